@@ -0,0 +1,710 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "action_stream.h"
+#include "backup_internal.h"
+#include "check.h"
+#include "mutex.h"
+#include "real_syscalls.h"
+#include "stream_format.h"
+
+#include <errno.h>
+#include <linux/falloc.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The protobuf encoding, as much of it as we need.  Each returns the
+// number of bytes it put at BUF.
+//
+static size_t put_varint(char *buf, uint64_t v) throw() {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (char)((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (char)v;
+    return n;
+}
+
+static size_t put_key(char *buf, int field, int wire_type) throw() {
+    return put_varint(buf, ((uint64_t)field << 3) | wire_type);
+}
+
+static size_t put_uint(char *buf, int field, uint64_t v) throw() {
+    size_t n = put_key(buf, field, STREAM_WIRE_VARINT);
+    return n + put_varint(buf + n, v);
+}
+
+static size_t put_string(char *buf, int field, const char *s) throw() {
+    const size_t len = strlen(s);
+    size_t n = put_key(buf, field, STREAM_WIRE_LENGTH);
+    n += put_varint(buf + n, len);
+    memcpy(buf + n, s, len);
+    return n + len;
+}
+
+// Room for a key and a varint.
+static const size_t max_uint_size = 20;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// And as much of the decoding as reading the acks needs.  Each returns
+// false if the message is malformed, or has no such field.
+//
+static bool get_varint(const char **p, const char *end, uint64_t *v) throw() {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        const unsigned char c = *(*p)++;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds FIELD in the message from P to END, which has the wire type WIRE_TYPE.
+static bool find_field(const char *p, const char *end, int field, int wire_type, uint64_t *v, const char **bytes) throw() {
+    while (p < end) {
+        uint64_t key, x;
+        if (!get_varint(&p, end, &key)) {
+            return false;
+        }
+        if ((key & 7) == STREAM_WIRE_VARINT) {
+            if (!get_varint(&p, end, &x)) {
+                return false;
+            }
+        } else if ((key & 7) == STREAM_WIRE_LENGTH) {
+            if (!get_varint(&p, end, &x) || x > (uint64_t)(end - p)) {
+                return false;
+            }
+            *bytes = p;
+            p += x;
+        } else {
+            return false;
+        }
+        if ((key >> 3) == (uint64_t)field && (int)(key & 7) == wire_type) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_uint_field(const char *p, const char *end, int field, uint64_t *v) throw() {
+    const char *bytes;
+    return find_field(p, end, field, STREAM_WIRE_VARINT, v, &bytes);
+}
+
+static bool get_bytes_field(const char *p, const char *end, int field, const char **bytes, const char **bytes_end) throw() {
+    uint64_t len;
+    if (!find_field(p, end, field, STREAM_WIRE_LENGTH, &len, bytes)) {
+        return false;
+    }
+    *bytes_end = *bytes + len;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+action_stream::action_stream(void) throw()
+    : m_fd(-1), m_is_socket(false), m_error(0), m_generation(0), m_next_id(0),
+      m_window(0), m_sent(0), m_acked(0), m_stopping(false), m_pump_running(false),
+      m_batch_len(0) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r == 0);
+    r = pthread_cond_init(&m_acked_cond, NULL);
+    check(r == 0);
+    m_batch_started.tv_sec = m_batch_started.tv_nsec = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+action_stream::~action_stream(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r == 0);
+    r = pthread_cond_destroy(&m_acked_cond);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// start() -
+//
+// Description:
+//
+//     Starts a backup's stream.  Acknowledgements have to come back on
+// the same descriptor, so only a socket gets a window.  If the pump
+// can't be started, nothing would read them, or send a batch that has
+// waited too long, so each action is sent as it comes, unacknowledged.
+//
+void action_stream::start(int fd, unsigned int window) throw() {
+    with_mutex_locked ml(&m_mutex);
+    struct stat sbuf;
+    m_fd = fd;
+    m_is_socket = (fstat(fd, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode));
+    m_error = 0;
+    m_generation++;
+    m_next_id = 1;
+    m_window = !m_is_socket ? 0 : (window < stream_max_window) ? window : stream_max_window;
+    m_sent = m_acked = 0;
+    m_batch_len = 0;
+    m_stopping = false;
+    m_pump_running = (pthread_create(&m_pump, NULL, pump, this) == 0);
+    if (!m_pump_running) {
+        m_window = 0;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::finish(bool succeeded) throw() {
+    {
+        with_mutex_locked ml(&m_mutex);
+        if (m_fd >= 0 && m_error == 0 && succeeded) {
+            // END is sent at once, and acknowledged if anything is.
+            ignore(this->send_locked(STREAM_END, 0, NULL, 0, NULL, 0)); // It is in m_error.
+            while (m_error == 0 && m_window > 0 && m_acked < m_sent) {
+                int r = pthread_cond_wait(&m_acked_cond, &m_mutex);
+                check(r == 0);
+            }
+        }
+        m_stopping = true;
+    }
+    if (m_pump_running) {
+        int r = pthread_join(m_pump, NULL);
+        check(r == 0);
+        m_pump_running = false;
+    }
+    with_mutex_locked ml(&m_mutex);
+    m_fd = -1;
+    m_batch_len = 0;
+    return m_error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void action_stream::set_error_locked(int error) throw() {
+    if (m_error == 0) {
+        m_error = error;
+    }
+    int r = pthread_cond_broadcast(&m_acked_cond);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// write_locked() -
+//
+// Description:
+//
+//     Writes all of IOV to the stream.  A socket is written with
+// MSG_NOSIGNAL, so that a receiver going away is an error for the
+// backup, rather than a SIGPIPE for the application.  (A pipe can't be
+// written that way, so the application has to handle SIGPIPE.)
+//
+int action_stream::write_locked(struct iovec *iov, int iovcnt) throw() {
+    while (iovcnt > 0) {
+        ssize_t wr;
+        if (m_is_socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            wr = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+        } else {
+            wr = call_real_writev(m_fd, iov, iovcnt);
+        }
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (wr == 0) {
+            return EIO;
+        }
+        while (iovcnt > 0 && (size_t)wr >= iov->iov_len) {
+            wr -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + wr;
+            iov->iov_len -= wr;
+        }
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool action_stream::window_is_open_locked(void) const throw() {
+    return m_window == 0 || m_sent - m_acked < m_window;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// wait_for_window_locked() -
+//
+// Description:
+//
+//     Waits (letting go of the mutex) until another batch may be sent.
+// This is where a receiver that has fallen behind holds us up.
+//
+int action_stream::wait_for_window_locked(void) throw() {
+    while (m_error == 0 && !this->window_is_open_locked()) {
+        int r = pthread_cond_wait(&m_acked_cond, &m_mutex);
+        check(r == 0);
+    }
+    return m_error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// send_batch_locked() -
+//
+// Description:
+//
+//     Sends a batch of the N_ENTRIES (at most max_batch_entries) buffers
+// at ENTRIES, which hold ENTRIES_LEN bytes of Batch.action fields, once
+// the window allows.
+//
+int action_stream::send_batch_locked(const struct iovec *entries, int n_entries, size_t entries_len) throw() {
+    check(n_entries <= max_batch_entries);
+    int r = this->wait_for_window_locked();
+    if (r != 0) {
+        return r;
+    }
+    char batch[2 * max_uint_size];
+    size_t batch_len = put_uint(batch, STREAM_BATCH_SEQ, m_sent + 1);
+    if (m_window > 0) {
+        batch_len += put_uint(batch + batch_len, STREAM_BATCH_WANT_ACK, 1);
+    }
+    char action[3 * max_uint_size];
+    size_t action_len = put_uint(action, STREAM_FIELD_ACTION, STREAM_BATCH);
+    action_len += put_key(action + action_len, STREAM_FIELD_BATCH, STREAM_WIRE_LENGTH);
+    action_len += put_varint(action + action_len, batch_len + entries_len);
+    char frame[max_uint_size];
+    const size_t frame_len = put_varint(frame, action_len + batch_len + entries_len);
+
+    struct iovec iov[3 + max_batch_entries];
+    iov[0].iov_base = frame;  iov[0].iov_len = frame_len;
+    iov[1].iov_base = action; iov[1].iov_len = action_len;
+    iov[2].iov_base = batch;  iov[2].iov_len = batch_len;
+    memcpy(&iov[3], entries, n_entries * sizeof(*entries));
+    r = this->write_locked(iov, 3 + n_entries);
+    if (r != 0) {
+        this->set_error_locked(r);
+        return r;
+    }
+    m_sent++;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// flush_locked() -
+//
+// Description:
+//
+//     Sends the batch being gathered, if there is one.  While we wait
+// for the window, other threads may add to it (they are sent with it),
+// or send it (so there is nothing left to do).
+//
+int action_stream::flush_locked(void) throw() {
+    if (m_batch_len == 0) {
+        return m_error;
+    }
+    int r = this->wait_for_window_locked();
+    if (r != 0 || m_batch_len == 0) {
+        return r;
+    }
+    struct iovec entry = {m_batch, m_batch_len};
+    r = this->send_batch_locked(&entry, 1, m_batch_len);
+    m_batch_len = 0;
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// send_locked() -
+//
+// Description:
+//
+//     Adds one action of type TYPE, whose message (in field FIELD, or
+// none if FIELD is zero) is BODY followed by DATA, to the batch being
+// gathered.  An action too big to gather goes in a batch of its own
+// (after the batch before it), with DATA sent from where it is, so a
+// large PWRITE's data isn't copied.
+//
+int action_stream::send_locked(int type, int field, const char *body, size_t body_len, const void *data, size_t data_len) throw() {
+    if (m_error != 0) {
+        return m_error;
+    }
+    char action[3 * max_uint_size];
+    size_t action_len = put_uint(action, STREAM_FIELD_ACTION, type);
+    if (field != 0) {
+        action_len += put_key(action + action_len, field, STREAM_WIRE_LENGTH);
+        action_len += put_varint(action + action_len, body_len + data_len);
+    }
+    char entry[2 * max_uint_size];
+    size_t entry_len = put_key(entry, STREAM_BATCH_ACTION, STREAM_WIRE_LENGTH);
+    entry_len += put_varint(entry + entry_len, action_len + body_len + data_len);
+    const size_t total = entry_len + action_len + body_len + data_len;
+
+    while (m_batch_len > 0 && m_batch_len + total > stream_batch_bytes) {
+        int r = this->flush_locked();
+        if (r != 0) {
+            return r;
+        }
+    }
+    if (total > stream_batch_bytes) {
+        struct iovec iov[max_batch_entries] = {{entry, entry_len}, {action, action_len}, {(void *)body, body_len}, {(void *)data, data_len}};
+        return this->send_batch_locked(iov, max_batch_entries, total);
+    }
+
+    if (m_batch_len == 0) {
+        int r = clock_gettime(CLOCK_MONOTONIC, &m_batch_started);
+        check(r == 0);
+    }
+    char *p = m_batch + m_batch_len;
+    memcpy(p, entry, entry_len);
+    p += entry_len;
+    memcpy(p, action, action_len);
+    p += action_len;
+    if (body_len > 0) {
+        memcpy(p, body, body_len);
+        p += body_len;
+    }
+    if (data_len > 0) {
+        memcpy(p, data, data_len);
+    }
+    m_batch_len += total;
+    if (type == STREAM_END || !m_pump_running) {
+        return this->flush_locked();
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// read_acks() -
+//
+// Description:
+//
+//     Reads what acknowledgements have arrived into BUF (which holds
+// *LEN bytes of a partial one), and takes note of them.  Returns false
+// if there will be no more (the receiver went away, or sent something
+// we can't make sense of).
+//
+bool action_stream::read_acks(char *buf, size_t *len) throw() {
+    static const size_t buf_size = 256;
+    ssize_t n = recv(m_fd, buf + *len, buf_size - *len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+    with_mutex_locked ml(&m_mutex);
+    if (n <= 0) {
+        // Once everything is acknowledged, the receiver may well hang up.
+        if (n < 0 || m_acked < m_sent) {
+            this->set_error_locked((n < 0) ? errno : EPIPE);
+        }
+        return false;
+    }
+    *len += n;
+    const char *p = buf;
+    const char *end = buf + *len;
+    while (p < end) {
+        const char *q = p;
+        uint64_t frame_len;
+        if (!get_varint(&q, end, &frame_len)) {
+            break; // Not all here yet.
+        }
+        if (frame_len > buf_size / 2) {
+            this->set_error_locked(EPROTO);
+            return false;
+        }
+        if ((size_t)(end - q) < frame_len) {
+            break;
+        }
+        uint64_t type = 0, seq = 0;
+        bool ok = get_uint_field(q, q + frame_len, STREAM_FIELD_ACTION, &type) && type == STREAM_ACK;
+        const char *ack, *ack_end;
+        ok = ok && get_bytes_field(q, q + frame_len, STREAM_FIELD_ACK, &ack, &ack_end);
+        ok = ok && get_uint_field(ack, ack_end, 1, &seq) && seq <= m_sent;
+        if (!ok) {
+            this->set_error_locked(EPROTO);
+            return false;
+        }
+        if (seq > m_acked) {
+            m_acked = seq;
+            int r = pthread_cond_broadcast(&m_acked_cond);
+            check(r == 0);
+        }
+        p = q + frame_len;
+    }
+    *len = end - p;
+    memmove(buf, p, *len);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pump() -
+//
+// Description:
+//
+//     Runs while the stream does: sends a batch that has waited long
+// enough (unless the window is shut, in which case the next ack will
+// let a sender do it), and reads the acks.
+//
+void *action_stream::pump(void *arg) throw() {
+    action_stream *s = (action_stream *)arg;
+    int fd;
+    bool reading;
+    {
+        with_mutex_locked ml(&s->m_mutex);
+        fd = s->m_fd;
+        reading = (s->m_window > 0);
+    }
+    char buf[256];
+    size_t len = 0;
+    while (true) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        const int n = poll(&pfd, reading ? 1 : 0, stream_flush_interval_ms);
+        if (n > 0) {
+            reading = s->read_acks(buf, &len);
+        }
+
+        with_mutex_locked ml(&s->m_mutex);
+        if (s->m_stopping) {
+            break;
+        }
+        if (s->m_batch_len > 0 && s->window_is_open_locked()) {
+            struct timespec now;
+            int r = clock_gettime(CLOCK_MONOTONIC, &now);
+            check(r == 0);
+            const int64_t waited_ms = (now.tv_sec - s->m_batch_started.tv_sec) * 1000
+                + (now.tv_nsec - s->m_batch_started.tv_nsec) / 1000000;
+            if (waited_ms >= (int64_t)stream_flush_interval_ms) {
+                ignore(s->flush_locked()); // It is in m_error.
+            }
+        }
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool action_stream::is_current_locked(const stream_file *file) const throw() {
+    return m_fd >= 0 && file->m_generation == m_generation;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::create_directory(const char *name) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_fd < 0) {
+        return 0;
+    }
+    char body[strlen(name) + 2 * max_uint_size];
+    size_t n = put_string(body, 1, name);
+    n += put_uint(body + n, 2, S_IFDIR | 0777);
+    return this->send_locked(STREAM_CREATE, STREAM_FIELD_CREATE, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::create_parent_directory(const char *name) throw() {
+    const char *slash = strrchr(name, '/');
+    if (slash == NULL || slash == name) {
+        return 0;
+    }
+    char parent[slash - name + 1];
+    memcpy(parent, name, slash - name);
+    parent[slash - name] = 0;
+    return this->create_directory(parent);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::open(const char *name, stream_file *file) throw() {
+    with_mutex_locked ml(&m_mutex);
+    file->m_generation = m_generation;
+    file->m_id = m_next_id++;
+    file->m_size = 0;
+    if (m_fd < 0) {
+        file->m_generation = 0; // Never current.
+        return 0;
+    }
+    char body[strlen(name) + 2 * max_uint_size];
+    size_t n = put_string(body, 1, name);
+    n += put_uint(body + n, 2, file->m_id);
+    return this->send_locked(STREAM_OPEN, STREAM_FIELD_OPEN, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::close(stream_file *file) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (!this->is_current_locked(file)) {
+        return 0;
+    }
+    char body[max_uint_size];
+    size_t n = put_uint(body, 1, file->m_id);
+    return this->send_locked(STREAM_CLOSE, STREAM_FIELD_CLOSE, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::pwrite(stream_file *file, const void *buf, size_t nbyte, uint64_t offset) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (!this->is_current_locked(file)) {
+        return 0;
+    }
+    int r = 0;
+    const char *data = (const char *)buf;
+    while (r == 0 && nbyte > 0) {
+        const size_t len = (nbyte < stream_max_data) ? nbyte : stream_max_data;
+        char body[4 * max_uint_size];
+        size_t n = put_uint(body, 1, file->m_id);
+        n += put_uint(body + n, 3, offset);
+        n += put_key(body + n, 2, STREAM_WIRE_LENGTH);
+        n += put_varint(body + n, len);
+        r = this->send_locked(STREAM_PWRITE, STREAM_FIELD_PWRITE, body, n, data, len);
+        data += len;
+        nbyte -= len;
+        offset += len;
+    }
+    if (r == 0 && offset > file->m_size) {
+        file->m_size = offset;
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::truncate(stream_file *file, uint64_t length) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (!this->is_current_locked(file)) {
+        return 0;
+    }
+    char body[2 * max_uint_size];
+    size_t n = put_uint(body, 1, file->m_id);
+    n += put_uint(body + n, 2, length);
+    int r = this->send_locked(STREAM_TRUNCATE, STREAM_FIELD_TRUNCATE, body, n, NULL, 0);
+    if (r == 0) {
+        file->m_size = length;
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::truncate(const char *name, uint64_t length) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_fd < 0) {
+        return 0;
+    }
+    char body[strlen(name) + 2 * max_uint_size];
+    size_t n = put_uint(body, 2, length);
+    n += put_string(body + n, 3, name);
+    return this->send_locked(STREAM_TRUNCATE, STREAM_FIELD_TRUNCATE, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description:
+//
+//     The receiver does the fallocate(2), falling back as
+// destination_file::fallocate() does, since only it knows how long the
+// file is.  We only know that the file is at least as long as an
+// extending call makes it.
+//
+int action_stream::fallocate(stream_file *file, int mode, uint64_t offset, uint64_t len) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (!this->is_current_locked(file)) {
+        return 0;
+    }
+    char body[4 * max_uint_size];
+    size_t n = put_uint(body, 1, file->m_id);
+    n += put_uint(body + n, 2, (uint64_t)(int64_t)mode);
+    n += put_uint(body + n, 3, offset);
+    n += put_uint(body + n, 4, len);
+    int r = this->send_locked(STREAM_FALLOCATE, STREAM_FIELD_FALLOCATE, body, n, NULL, 0);
+    if (r == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > file->m_size) {
+        file->m_size = offset + len;
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::rename(const char *old_name, const char *new_name) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_fd < 0) {
+        return 0;
+    }
+    char body[strlen(old_name) + strlen(new_name) + 2 * max_uint_size];
+    size_t n = put_string(body, 1, old_name);
+    n += put_string(body + n, 2, new_name);
+    return this->send_locked(STREAM_RENAME, STREAM_FIELD_RENAME, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int action_stream::unlink(const char *name) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (m_fd < 0) {
+        return 0;
+    }
+    char body[strlen(name) + max_uint_size];
+    size_t n = put_string(body, 1, name);
+    return this->send_locked(STREAM_UNLINK, STREAM_FIELD_UNLINK, body, n, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t action_stream::size(const stream_file *file) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return file->m_size;
+}
@@ -0,0 +1,146 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef ACTION_STREAM_H
+#define ACTION_STREAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "stream_format.h"
+
+// A file opened on the stream.  Its owner keeps it; the stream fills
+// it in and reads it under the stream's mutex.
+struct stream_file {
+    uint64_t m_generation; // The backup that opened it.
+    uint32_t m_id;         // The fd the stream gave it.
+    uint64_t m_size;       // Its length, as far as the writes through it tell.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// action_stream:
+//
+// Description:
+//
+//     Writes a streamed backup (see stream_format.h) to a file
+// descriptor the application gave us, typically a pipe or a socket.
+// Every change to the backup (a directory, a file opened, written,
+// truncated, renamed...) is one action.  Actions are added under a
+// mutex, so the stream is in the order of the changes.
+//
+//     Actions are gathered into batches, so that the many small writes
+// of a busy application go out as a few big ones.  A batch is sent
+// when the next action doesn't fit in it, when it has waited
+// stream_flush_interval_ms, or when the stream ends.  A pump thread
+// sends the batches that have waited long enough.
+//
+//     Given a window (and a socket), each batch asks the receiver to
+// acknowledge it, and the pump reads the acknowledgements.  Sending a
+// batch while the window's worth are unacknowledged waits for the
+// receiver to catch up.  So when the receiver falls behind, the
+// copier, and the captured writes (and, once the write-behind queue is
+// full, the application) are held back, while up to a window of
+// batches stays in flight, so nothing waits for a round trip per
+// write.  The END asks to be acknowledged too, so finish() doesn't
+// return until the receiver has applied everything.
+//
+//     The stream is started by each streamed backup, and stopped when
+// it finishes.  A file opened by an earlier backup (whose destination
+// outlived it) is ignored, as is everything once a write has failed,
+// since the rest of the stream can't be framed.
+//
+//     Each method returns 0 or an error number.  Nothing is reported.
+//
+class action_stream {
+  public:
+    action_stream(void) throw();
+    ~action_stream(void) throw();
+
+    void start(int fd, unsigned int window) throw();
+    // Effect: Start a backup's stream on FD (which we don't own).  If WINDOW is nonzero and FD is a socket,
+    //  wait for the receiver whenever WINDOW batches are unacknowledged.
+    int finish(bool succeeded) throw();
+    // Effect: End the stream (with END, if SUCCEEDED, and then wait for everything to be acknowledged).
+    //  Nothing more is written.
+
+    int create_directory(const char *name) throw();         // Make NAME, and any missing parents, a directory.
+    int create_parent_directory(const char *name) throw();  // Make the directory NAME is in.
+    int open(const char *name, stream_file *file) throw();  // Open NAME, creating it if need be.
+    int close(stream_file *file) throw();
+    int pwrite(stream_file *file, const void *buf, size_t nbyte, uint64_t offset) throw();
+    int truncate(stream_file *file, uint64_t length) throw();
+    int truncate(const char *name, uint64_t length) throw(); // Doesn't create NAME.
+    int fallocate(stream_file *file, int mode, uint64_t offset, uint64_t len) throw();
+    int rename(const char *old_name, const char *new_name) throw();
+    int unlink(const char *name) throw();
+    uint64_t size(const stream_file *file) throw();
+
+  private:
+    int send_locked(int type, int field, const char *body, size_t body_len, const void *data, size_t data_len) throw();
+    static const int max_batch_entries = 4; // The most buffers send_batch_locked() takes.
+    int send_batch_locked(const struct iovec *entries, int n_entries, size_t entries_len) throw();
+    int flush_locked(void) throw();
+    int wait_for_window_locked(void) throw();
+    bool window_is_open_locked(void) const throw();
+    int write_locked(struct iovec *iov, int iovcnt) throw();
+    bool is_current_locked(const stream_file *file) const throw();
+    void set_error_locked(int error) throw();
+    static void *pump(void *arg) throw();
+    bool read_acks(char *buf, size_t *len) throw();
+
+    pthread_mutex_t m_mutex;  // Protects everything below, and the stream.
+    pthread_cond_t m_acked_cond; // Signalled when m_acked or m_error changes.
+    int m_fd;                 // -1 when there is no stream.
+    bool m_is_socket;
+    int m_error;              // The first error.  Once there is one, nothing more is sent.
+    uint64_t m_generation;    // Counts the backups that have streamed.
+    uint32_t m_next_id;
+    unsigned int m_window;    // Zero if the receiver isn't asked to acknowledge.
+    uint64_t m_sent;          // The seq of the last batch sent.
+    uint64_t m_acked;         // The seq of the last batch acknowledged.
+    bool m_stopping;          // Tells the pump to stop.
+    bool m_pump_running;
+    pthread_t m_pump;
+    struct timespec m_batch_started; // When the first action went into m_batch.
+    size_t m_batch_len;
+    char m_batch[stream_batch_bytes]; // The actions waiting to be sent, each as a Batch.action field.
+};
+
+#endif // End of header guardian.
@@ -38,6 +38,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <fcntl.h> // open()
 #include <unistd.h> // close(), write(), read(), unlink(), truncate(), etc.
 #include <sys/stat.h> // mkdir()
+#include <sys/uio.h> // writev(), readv(), etc.
 #include <errno.h>
 #include <dlfcn.h>
 #include <stdarg.h>
@@ -209,6 +210,94 @@ extern "C" ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// writev() -
+//
+// Description: 
+//
+//     Writes a vector of buffers to the file associated with the given
+// file descriptor in both the source and backup directories.  The
+// backup gets the whole vector in one write.
+//
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    TRACE("writev() intercepted, fd = ", fd);
+    ssize_t r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.writev(fd, iov, iovcnt);
+    } else {
+        r = call_real_writev(fd, iov, iovcnt);
+    }
+
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwritev() -
+//
+// Description: 
+//
+//     Same as writev(), but at the given offset.
+//
+extern "C" ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    TRACE("pwritev() intercepted, fd = ", fd);
+    ssize_t r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.pwritev(fd, iov, iovcnt, offset);
+    } else {
+        r = call_real_pwritev(fd, iov, iovcnt, offset);
+    }
+
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwritev2() -
+//
+// Description: 
+//
+//     Same as pwritev(), with flags.  An offset of -1 means the file
+// descriptor's offset, as for writev().
+//
+extern "C" ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    TRACE("pwritev2() intercepted, fd = ", fd);
+    ssize_t r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.pwritev2(fd, iov, iovcnt, offset, flags);
+    } else {
+        r = call_real_pwritev2(fd, iov, iovcnt, offset, flags);
+    }
+
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// readv() -
+//
+// Description: 
+//
+//     Same as read(), for a vector of buffers.
+//
+// Note:
+//
+//     preadv() doesn't move the file offset, so like pread() it isn't
+// intercepted.
+//
+extern "C" ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    TRACE("readv() intercepted, fd = ", fd);
+    ssize_t r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.readv(fd, iov, iovcnt);
+    } else {
+        r = call_real_readv(fd, iov, iovcnt);
+    }
+
+    return r;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 off_t lseek(int fd, off_t offset, int whence) {
@@ -243,6 +332,48 @@ extern "C" int ftruncate(int fd, off_t length) {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description: 
+//
+//     Allocates (or deallocates, or zeros) a range of the file based
+// on the given file descriptor, in both the source and backup
+// directories.
+//
+extern "C" int fallocate(int fd, int mode, off_t offset, off_t len) {
+    TRACE("fallocate() intercepted, fd = ", fd);
+    int r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.fallocate(fd, mode, offset, len);
+    } else {
+        r = call_real_fallocate(fd, mode, offset, len);
+    }
+
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// posix_fallocate() -
+//
+// Description: 
+//
+//     Same as fallocate() with no mode.  The C library doesn't call
+// fallocate() for this, so it needs its own interposition.
+//
+extern "C" int posix_fallocate(int fd, off_t offset, off_t len) {
+    TRACE("posix_fallocate() intercepted, fd = ", fd);
+    int r = 0;
+    if (the_manager.is_alive()) {
+        r = the_manager.posix_fallocate(fd, offset, len);
+    } else {
+        r = call_real_posix_fallocate(fd, offset, len);
+    }
+
+    return r;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -352,9 +483,13 @@ extern "C" int tokubackup_create_backup(const char *source_dirs[],
         //if (r!=0) return r;
     }
 
+    // Read this once, so that the checks below and the backup agree.
+    const int stream_fd = the_manager.get_stream_fd();
+
     // Check to make sure that the source and destination directories are
-    // actually different.
-    {
+    // actually different.  (A streamed backup's destination isn't
+    // here to compare with.)
+    if (stream_fd < 0) {
         with_object_to_free<char*> full_source (call_real_realpath(source_dirs[0], NULL));
         if (full_source.value == NULL) {
             error_fun(ENOENT, "Could not resolve source directory path.", error_extra);
@@ -388,6 +523,7 @@ extern "C" int tokubackup_create_backup(const char *source_dirs[],
     // HUGE ASSUMPTION: - There is a 1:1 correspondence between source
     // and destination directories.
     directory_set dirs(dir_count, source_dirs, dest_dirs);
+    dirs.set_stream_fd(stream_fd);
 
     // TODO: Possibly change order IF you can't perform Validate() or
     // dirs that have been realpath()'d.  Or... Put the validate call
@@ -410,6 +546,54 @@ extern "C" void tokubackup_throttle_backup(unsigned long bytes_per_second) throw
     the_manager.set_throttle(bytes_per_second);
 }
 
+extern "C" void tokubackup_set_throttle_burst(unsigned long bytes) throw() {
+    the_manager.set_throttle_burst(bytes);
+}
+
+extern "C" void tokubackup_set_copy_threads(int n_threads) throw() {
+    the_manager.set_copy_threads(n_threads);
+}
+
+extern "C" void tokubackup_set_reflink(int enable) throw() {
+    the_manager.set_reflink(enable != 0);
+}
+
+extern "C" void tokubackup_set_copy_order(int order) throw() {
+    the_manager.set_copy_order(order);
+}
+
+extern "C" void tokubackup_set_manifest(int enable) throw() {
+    the_manager.set_write_manifest(enable != 0);
+}
+
+extern "C" int tokubackup_set_incremental_base(const char *base_dirs[], int dir_count) throw() {
+    return the_manager.set_incremental_base(base_dirs, dir_count);
+}
+
+extern "C" void tokubackup_set_compression(int enable) throw() {
+    the_manager.set_compression(enable != 0);
+}
+
+extern "C" int tokubackup_set_chunk_store(const char *dir) throw() {
+    return the_manager.set_chunk_store(dir);
+}
+
+extern "C" void tokubackup_set_stream_fd(int fd) throw() {
+    the_manager.set_stream_fd(fd);
+}
+
+extern "C" void tokubackup_set_stream_window(unsigned int batches) throw() {
+    the_manager.set_stream_window(batches);
+}
+
+extern "C" void tokubackup_set_io_queue_depth(unsigned int depth) throw() {
+    the_manager.set_io_queue_depth(depth);
+}
+
+extern "C" void tokubackup_set_capture_queue_size(unsigned long bytes) throw() {
+    the_manager.set_capture_queue_size(bytes);
+}
+
 unsigned long get_throttle(void) throw() {
     return the_manager.get_throttle();
 }
@@ -444,4 +628,7 @@ bool backup_done_copying(void) throw() {
 void backup_set_start_copying(bool b) throw() {
     the_manager.set_start_copying(b);
 }
+void backup_set_zero_copy(bool b) throw() {
+    the_manager.set_zero_copy(b);
+}
 #endif
@@ -123,6 +123,177 @@ void tokubackup_throttle_backup(unsigned long bytes_per_second) throw() __attrib
 //   the destination directory.  If the underlying data directory is being modified
 //   at a high rate, then the destination directory will receive those modifications
 //   at the same rate, plus receive the throttled read data from the source.
+//  The limit is for the whole process: all the copier threads share it, and it
+//   carries over from one file to the next.  A change takes effect within a few
+//   milliseconds, even in the middle of a file.
+
+void tokubackup_set_throttle_burst(unsigned long bytes) throw() __attribute__((visibility("default")));
+// Effect: Set how many bytes the backup may copy at full speed after it has been
+//   idle (or copying slower than the throttle), before the throttle holds it back.
+//  The default is 1MiB.  Bigger bursts make the copy less smooth, but let it catch up
+//   after a pause.
+//  This function can be called by any thread at any time.
+
+void tokubackup_set_copy_threads(int n_threads) throw() __attribute__((visibility("default")));
+// Effect: Set how many threads copy the source directories into the destination.
+//  The default is 1.  Values less than 1 are treated as 1.
+//  The copier threads share the work: each one expands the directories it copies
+//   onto its own list, and a thread that runs out of work takes some from the
+//   others.  More threads help when one reader can't keep the storage busy.
+//  This function can be called by any thread at any time.  It takes effect at
+//   the next backup.  The throttle set by tokubackup_throttle_backup() applies to
+//   all the copier threads together.
+
+void tokubackup_set_reflink(int enable) throw() __attribute__((visibility("default")));
+// Effect: If enable is nonzero, then when a source file and its backup are on the same
+//   filesystem, and that filesystem can share blocks between files (e.g., XFS or btrfs),
+//   the backup clones the file instead of copying its bytes.  The clone takes no space
+//   and almost no I/O until either copy is modified.
+//  Files that can't be cloned are copied as usual, so it is always safe to turn this on.
+//  It is off by default, since a cloned backup lives on the same disks as the data.
+//  This function can be called by any thread at any time.  It affects files that the
+//   backup has not started to copy yet.
+
+enum tokubackup_copy_order {
+    TOKUBACKUP_COPY_ORDER_TREE = 0,          // Walk the tree depth first, copying files as they are found (the default).
+    TOKUBACKUP_COPY_ORDER_LARGEST_FIRST = 1, // Copy the biggest files first.
+    TOKUBACKUP_COPY_ORDER_SMALLEST_FIRST = 2,// Copy the smallest files first.
+    TOKUBACKUP_COPY_ORDER_COLDEST_FIRST = 3  // Copy the files the application writes the least first.
+};
+
+void tokubackup_set_copy_order(int order) throw() __attribute__((visibility("default")));
+// Effect: Choose the order in which the backup copies files (one of the values above;
+//   anything else means TOKUBACKUP_COPY_ORDER_TREE).
+//  With any order but the default, the copier scans directories ahead of copying
+//   files, and copies the files it has found in the given order.
+//  Every write the application makes to a file that has been (or is being) copied is
+//   also made to the backup, until the backup finishes.  Copying the busiest files
+//   last, with TOKUBACKUP_COPY_ORDER_COLDEST_FIRST, cuts down on those extra writes.
+//   A file's heat is the number of bytes written to it while it has been open.  Files
+//   that are not open are the coldest.
+//  This function can be called by any thread at any time.  It takes effect at
+//   the next backup.
+
+void tokubackup_set_manifest(int enable) throw() __attribute__((visibility("default")));
+// Effect: If enable is nonzero, each backup writes a manifest into each of its
+//   destination directories (as .tokubackup_manifest).  The manifest records the
+//   size, mtime and inode number of every file copied, and a checksum of every
+//   1MiB block of its backup copy, so that a later backup can be incremental.
+//  A backup that writes a manifest has to read every byte it copies, so it doesn't
+//   use copy_file_range(2), splice(2) or io_uring.
+//  It is off by default.  This function can be called by any thread at any time.
+//   It takes effect at the next backup.
+
+int tokubackup_set_incremental_base(const char *base_dirs[], int dir_count) throw() __attribute__((visibility("default")));
+// Effect: Make the following backups incremental.  base_dirs[i] is an earlier
+//   backup (made with a manifest) of source_dirs[i], and must be on the same
+//   filesystem as dest_dirs[i].  Pass a dir_count of zero to go back to full backups.
+//  An incremental backup still makes a complete copy in its (empty) destination,
+//   and writes a manifest of its own, but:
+//   - A file whose size, mtime and inode match the base's manifest is hard linked
+//     to its copy in the base (or cloned, if tokubackup_set_reflink() is on, or if
+//     the application has it open).
+//   - Any other file that is in the base is cloned from the base, if the filesystem
+//     can share blocks, and then only the blocks whose checksums differ from the
+//     base's are written.
+//  Writes the application makes during the backup are captured as usual, and the
+//   new manifest forgets the checksums of the blocks they change.  If the application
+//   opens a hard-linked file, the link is broken (by copying the file) before any
+//   write reaches it, so the base is never modified.
+//  Returns 0, or EINVAL if dir_count is negative, or ENOMEM.  The backup fails with
+//   EINVAL if dir_count doesn't match its number of directories, or if a base has no
+//   manifest.
+//  This function can be called by any thread at any time.  It takes effect at
+//   the next backup.
+
+void tokubackup_set_compression(int enable) throw() __attribute__((visibility("default")));
+// Effect: If enable is nonzero, each backup writes its copy of every file in a
+//   compressed format: the file is split into 64KiB blocks, each compressed on its
+//   own, followed by an index of the blocks.  Writes the application makes during
+//   the backup rewrite only the blocks they touch.  Blocks of zeros take no space.
+//  The files can be read only after they are decompressed, with the tokubackup_restore
+//   tool (which copies any other file as it is).
+//  A compressed backup is read and written by the copier, so it doesn't use
+//   reflinks, copy_file_range(2), splice(2) or io_uring.  It writes no manifest, and
+//   is never incremental.
+//  It is off by default.  This function can be called by any thread at any time.
+//   It takes effect at the next backup.
+
+int tokubackup_set_chunk_store(const char *dir) throw() __attribute__((visibility("default")));
+// Effect: If dir isn't NULL, each backup stores the data of every file in the chunk
+//   store in dir (which is made if it doesn't exist), and writes a recipe in its
+//   place: the list of the file's chunks.  Files are cut into chunks (between 16KiB
+//   and 256KiB, 64KiB on average) where a rolling hash of the data says so, so that
+//   inserting or removing bytes moves only the nearby boundaries.  Each chunk is
+//   named by a 128-bit hash of its contents and stored only once, so a chunk that an
+//   earlier backup into the same store already has costs nothing but the recipe.
+//   Writes the application makes during the backup re-chunk only the region they
+//   touch.  Chunks of zeros aren't stored.
+//  The files can be read only after they are restored, with tokubackup_restore -c dir.
+//  A deduplicated backup is read and written by the copier, so it doesn't use
+//   reflinks, copy_file_range(2), splice(2) or io_uring.  It isn't compressed,
+//   writes no manifest, and is never incremental.  Streaming (see
+//   tokubackup_set_stream_fd()) takes precedence over it.  Nothing is ever removed
+//   from the store.
+//  Returns 0, or ENOMEM.  A NULL dir (the default) turns deduplication off.  This
+//   function can be called by any thread at any time.  It takes effect at the next
+//   backup.
+
+void tokubackup_set_stream_fd(int fd) throw() __attribute__((visibility("default")));
+// Effect: If fd is nonnegative, each backup is written to fd (a pipe or a connected
+//   socket) as a stream of actions, instead of into its destination directories.
+//   The tokubackup_receive tool (or the receiver it is built from) applies the
+//   stream under a directory of its own, so each destination directory passed to
+//   tokubackup_create_backup() must be a relative name without "..", and is
+//   created under that directory.  The stream ends with a marker only if the backup
+//   succeeds, so the receiver can tell a finished backup from one cut short.
+//  The stream uses the Action messages of remote/backup.proto, each preceded by
+//   its length.  A streamed backup is never compressed or incremental, and has no
+//   manifest.  The backup doesn't close fd.  Writes to a socket don't raise
+//   SIGPIPE, but writes to a pipe whose reader has gone do, so an application
+//   streaming to a pipe should ignore SIGPIPE.
+//  A negative fd (the default) turns streaming off.  This function can be called
+//   by any thread at any time.  It takes effect at the next backup.
+
+void tokubackup_set_stream_window(unsigned int batches) throw() __attribute__((visibility("default")));
+// Effect: Have the receiver of a streamed backup acknowledge what it has applied,
+//   and let at most batches batches of actions (each up to 256KiB, sent at least
+//   every 20ms) go unacknowledged.  When the receiver falls that far behind, the
+//   copier and the writes captured from the application wait for it (the
+//   application waits only once the capture queue is full, see
+//   tokubackup_set_capture_queue_size()), rather than the backup piling up data
+//   that hasn't been sent.  The backup finishes only once the receiver has
+//   applied everything.  With a window, a link with a long round trip stays busy,
+//   and no write waits for a round trip of its own.
+//  The acknowledgements come back on the stream's fd, so this applies only when it
+//   is a socket, and the receiver must answer on it (tokubackup_receive does, given
+//   a PORT).  The window is capped at 1024.  Zero (the default) asks for no
+//   acknowledgements.  This function can be called by any thread at any time.  It
+//   takes effect at the next backup.
+
+void tokubackup_set_io_queue_depth(unsigned int depth) throw() __attribute__((visibility("default")));
+// Effect: Set how many chunks each copier thread keeps in flight at once.
+//  With a depth of zero (the default), each copier thread reads a chunk and then
+//   writes it, one at a time.  With a nonzero depth, the copier uses io_uring(7) to
+//   keep up to depth reads and writes of the same file outstanding, which helps on
+//   storage that needs deep queues to reach its bandwidth (e.g., NVMe devices).
+//  Each slot uses a 1MiB buffer that is locked into memory, and the depth is capped
+//   at 64.  If io_uring isn't available (an old kernel, or too small a
+//   RLIMIT_MEMLOCK), the copier quietly copies one chunk at a time.
+//  This function can be called by any thread at any time.  It takes effect at
+//   the next backup.
+
+void tokubackup_set_capture_queue_size(unsigned long bytes) throw() __attribute__((visibility("default")));
+// Effect: Set how much of the application's written data the backup may hold in memory
+//   while it mirrors those writes into the backup in the background.
+//  During a backup, every write the application makes to a file that has been (or is
+//   being) copied is also made to the backup.  The application's write returns once its
+//   data is queued, and background threads write it to the backup, in order.  When the
+//   queue is full, the application's writes wait for it to drain.
+//  The default is 64MiB.  Zero makes each write to the backup happen before the
+//   application's write returns, as it did before.
+//  This function can be called by any thread at any time.  It takes effect at the
+//   next backup.
 
 const extern char *tokubackup_version_string  __attribute__((visibility("default")));
 
@@ -35,6 +35,8 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include "backup_callbacks.h"
+#include "check.h"
+#include "mutex.h"
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -61,12 +63,30 @@ m_bsc_fun(bsc_fun),
 m_bsc_extra(bsc_extra),
 m_asc_fun(asc_fun),
 m_asc_extra(asc_extra)
-{}
+{
+    pthread_mutexattr_t attr;
+    int r = pthread_mutexattr_init(&attr);
+    check(r==0);
+    r = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    check(r==0);
+    r = pthread_mutex_init(&m_mutex, &attr);
+    check(r==0);
+    r = pthread_mutexattr_destroy(&attr);
+    check(r==0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+backup_callbacks::~backup_callbacks(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
 int backup_callbacks::poll(float progress, const char *progress_string) throw() {
     int r = 0;
+    with_mutex_locked ml(&m_mutex);
     r = m_poll_function(progress, progress_string, m_poll_extra);
     return r;
 }
@@ -74,6 +94,7 @@ int backup_callbacks::poll(float progress, const char *progress_string) throw()
 //////////////////////////////////////////////////////////////////////////////
 //
 void backup_callbacks::report_error(int error_number, const char *error_str) throw() {
+    with_mutex_locked ml(&m_mutex);
     m_error_function(error_number, error_str, m_error_extra);
 }
 
@@ -85,6 +106,7 @@ unsigned long backup_callbacks::get_throttle(void) throw() {
 
 int backup_callbacks::exclude_copy(const char *source) throw() {
     int r = 0;
+    with_mutex_locked ml(&m_mutex);
     if (m_exclude_copy_function)
         r = m_exclude_copy_function(source, m_exclude_copy_extra);
     return r;
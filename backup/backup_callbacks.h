@@ -40,6 +40,8 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup_internal.h"
 
+#include <pthread.h>
+
 typedef unsigned long (*backup_throttle_fun_t)(void);
 
 //////////////////////////////////////////////////////////////////////////////
@@ -58,6 +60,9 @@ public:
                      void *bsc_extra,
                      backup_after_stop_capt_fun_t asc_fun,
                      void *asc_extra) throw();
+    ~backup_callbacks(void) throw();
+    // poll(), report_error() and exclude_copy() may be called from several copier threads.  They
+    // are serialized, so the user's functions never run concurrently with each other.
     int poll(float progress, const char *progress_string) throw();
     void report_error(int error_number, const char *error_description) throw();
     unsigned long get_throttle(void) throw();
@@ -83,6 +88,7 @@ private:
     void *m_bsc_extra;
     backup_after_stop_capt_fun_t m_asc_fun;
     void *m_asc_extra;
+    pthread_mutex_t m_mutex; // Recursive, since a user function may cause an error to be reported.
 };
 
 #endif // end of header guardian.
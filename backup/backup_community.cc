@@ -53,4 +53,37 @@ extern "C" void tokubackup_throttle_backup(unsigned long bytes_per_second __attr
     fprintf(stderr, "Sorry, backup is not implemented\n");
 }
 
+extern "C" void tokubackup_set_throttle_burst(unsigned long bytes __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_copy_threads(int n_threads __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_reflink(int enable __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_copy_order(int order __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_manifest(int enable __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" int tokubackup_set_incremental_base(const char *base_dirs[] __attribute__((unused)), int dir_count __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+    return ENOSYS;
+}
+
+extern "C" void tokubackup_set_io_queue_depth(unsigned int depth __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
+extern "C" void tokubackup_set_capture_queue_size(unsigned long bytes __attribute__((unused))) {
+    fprintf(stderr, "Sorry, backup is not implemented\n");
+}
+
 const char tokubackup_sql_suffix[] = "";
@@ -34,11 +34,14 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #ident "$Id$"
 
+#include "action_stream.h"
 #include "backup_directory.h"
 #include "description.h"
 #include "backup_debug.h"
 #include "raii-malloc.h"
 #include "real_syscalls.h"
+#include "manager.h"
+#include "source_file.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,13 +52,24 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 //////////////////////////////////////////////////////////////////////////////
 //
 backup_session::backup_session(directory_set *dirs, backup_callbacks *calls, file_hash_table * const file) throw()
-    : m_dirs(dirs), m_copier(calls, file)
+    : m_dirs(dirs), m_copier(calls, file), m_manifests(NULL), m_base_manifests(NULL), m_base_dirs(NULL)
 {
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //
 backup_session::~backup_session() throw() {
+    const int n = m_dirs->number_of_directories();
+    for (int i = 0; m_manifests != NULL && i < n; ++i) {
+        delete m_manifests[i];
+    }
+    delete[] m_manifests;
+    for (int i = 0; m_base_manifests != NULL && i < n; ++i) {
+        delete m_base_manifests[i];
+        free(m_base_dirs[i]);
+    }
+    delete[] m_base_manifests;
+    delete[] m_base_dirs;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -67,6 +81,9 @@ int backup_session::do_copy() throw() {
     for (int i = 0; i < m_dirs->number_of_directories(); ++i) {
         m_copier.set_directories(m_dirs->source_directory_at(i),
                                  m_dirs->destination_directory_at(i));
+        m_copier.set_manifests(m_base_manifests ? m_base_manifests[i] : NULL,
+                               m_base_dirs ? m_base_dirs[i] : NULL,
+                               m_manifests ? m_manifests[i] : NULL);
         r = m_copier.do_copy();
         if (r != 0) {
             break;
@@ -87,7 +104,7 @@ int backup_session::do_copy() throw() {
 //
 bool backup_session::is_prefix(const char *file) throw() {
     // mallocing this to make memcheck happy.  I don't like the extra malloc, but I'm more worried about testability than speed right now. -Bradley
-    with_object_to_free<char*> absfile(call_real_realpath(file, NULL));
+    with_object_to_free<char*> absfile(the_manager.resolve_path(file));
     if (absfile.value==NULL) return false;
     bool result = this->is_prefix_of_realpath(absfile.value);
     return result;
@@ -114,9 +131,14 @@ static int does_file_exist(const char*) throw();
 // Description:
 //
 //     Creates backup path for given file if it doesn't exist already.
-//     Any errors are reported, and an error number is returned.
+//     Any errors are reported, and an error number is returned.  A
+//     streamed backup can't look, so it always asks the receiver.
 //
 int open_path(const char *file_path) throw() {
+    action_stream *stream = the_manager.backup_stream();
+    if (stream != NULL) {
+        return stream->create_parent_directory(file_path);
+    }
     int r = 0;
     // See if the file exists in the backup copy already...
     int exists = does_file_exist(file_path);
@@ -204,8 +226,8 @@ out:
 //////////////////////////////////////////////////////////////////////////////
 // Effect: See backup_directory.h
 char* backup_session::translate_prefix(const char *file) throw() {
-    char *absfile = call_real_realpath(file, NULL);
-    // TODO: What if call_real_realpath() returns a NULL?  It would segfault.  See #6605.
+    char *absfile = the_manager.resolve_path(file);
+    // TODO: What if resolve_path() returns a NULL?  It would segfault.  See #6605.
     char *result = translate_prefix_of_realpath(absfile);
     free(absfile);
     return result;
@@ -303,3 +325,134 @@ void backup_session::cleanup(void) throw() {
 bool backup_session::file_is_excluded(const char *backup_file) throw() {
     return m_copier.file_should_be_excluded(backup_file);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// open_manifests() -
+//
+// Description:
+//
+//     An incremental backup always writes a manifest, so that the
+// next backup can be based on it.
+//
+int backup_session::open_manifests(bool write_manifest, char * const *base_dirs, int n_base_dirs) throw() {
+    const int n = m_dirs->number_of_directories();
+    if (n_base_dirs > 0 && n_base_dirs != n) {
+        the_manager.backup_error(EINVAL, "There are %d incremental base directories, but %d directories to back up", n_base_dirs, n);
+        return EINVAL;
+    }
+    if (!write_manifest && n_base_dirs == 0) {
+        return 0;
+    }
+
+    m_manifests = new manifest*[n];
+    for (int i = 0; i < n; ++i) {
+        m_manifests[i] = new manifest;
+    }
+    if (n_base_dirs == 0) {
+        return 0;
+    }
+
+    m_base_manifests = new manifest*[n];
+    m_base_dirs = new char*[n];
+    for (int i = 0; i < n; ++i) {
+        m_base_manifests[i] = new manifest;
+        m_base_dirs[i] = strdup(base_dirs[i]);
+        if (m_base_dirs[i] == NULL) {
+            int r = errno;
+            the_manager.backup_error(r, "Could not copy the incremental base directory name %s", base_dirs[i]);
+            return r;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        int r = m_base_manifests[i]->load(m_base_dirs[i]);
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not read the manifest of incremental base directory %s", m_base_dirs[i]);
+            return r;
+        }
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int backup_session::save_manifests(void) throw() {
+    for (int i = 0; m_manifests != NULL && i < m_dirs->number_of_directories(); ++i) {
+        int r = m_manifests[i]->save(m_dirs->destination_directory_at(i));
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not write the manifest in %s", m_dirs->destination_directory_at(i));
+            return r;
+        }
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// manifest_of_realpath() -
+//
+// Description:
+//
+//     Returns the manifest we are building for the directory that
+// holds absfile (or NULL), and sets *relative to absfile's path in that
+// directory.
+//
+manifest *backup_session::manifest_of_realpath(const char *absfile, const char **relative) throw() {
+    if (m_manifests == NULL) {
+        return NULL;
+    }
+    const int index = m_dirs->find_index_matching_prefix(absfile);
+    if (index == -1) {
+        return NULL;
+    }
+    const char *path = absfile + strlen(m_dirs->source_directory_at(index));
+    while (*path == '/') {
+        path++;
+    }
+    *relative = path;
+    return m_manifests[index];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_write(source_file *file, uint64_t offset, uint64_t length) throw() {
+    if (m_manifests == NULL) {
+        return;
+    }
+    with_source_file_name_read_lock sfl(file);
+    const char *relative;
+    manifest *m = this->manifest_of_realpath(file->name(), &relative);
+    if (m != NULL) {
+        m->note_write(relative, offset, length);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_truncate(source_file *file, uint64_t length) throw() {
+    if (m_manifests == NULL) {
+        return;
+    }
+    with_source_file_name_read_lock sfl(file);
+    this->capture_truncate(file->name(), length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_truncate(const char *absfile, uint64_t length) throw() {
+    const char *relative;
+    manifest *m = this->manifest_of_realpath(absfile, &relative);
+    if (m != NULL) {
+        m->note_truncate(relative, length);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void backup_session::capture_forget(const char *absfile, bool is_directory) throw() {
+    const char *relative;
+    manifest *m = this->manifest_of_realpath(absfile, &relative);
+    if (m != NULL) {
+        m->forget(relative, is_directory);
+    }
+}
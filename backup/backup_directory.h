@@ -43,6 +43,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "copier.h"
 #include "backup_callbacks.h"
 #include "directory_set.h"
+#include "manifest.h"
 
 #include <pthread.h>
 #include <vector>
@@ -72,9 +73,24 @@ public:
     void add_to_copy_todo_list(const char *file_path) throw();
     void cleanup(void) throw();
     bool file_is_excluded(const char *) throw();
+
+    // Manifests.
+    int open_manifests(bool write_manifest, char * const *base_dirs, int n_base_dirs) throw() __attribute__((warn_unused_result));
+    // Effect: Get ready to build a manifest for each directory, if WRITE_MANIFEST or if there are base directories, and
+    //   read the base directories' manifests.  If any errors occur, report them, and return the error code.
+    int save_manifests(void) throw() __attribute__((warn_unused_result)); // Write the manifests into the destinations.  Errors are reported.
+    void capture_write(source_file *file, uint64_t offset, uint64_t length) throw();
+    void capture_truncate(source_file *file, uint64_t length) throw();
+    void capture_truncate(const char *absfile, uint64_t length) throw();
+    void capture_forget(const char *absfile, bool is_directory) throw();
+    // Effect: Tell the manifests about a captured write, truncate, rename or unlink.  The caller holds the file's range lock, if any.
 private:
     const directory_set * const m_dirs;
     copier m_copier;
+    manifest **m_manifests;      // The manifests we are building, one per directory, or NULL.
+    manifest **m_base_manifests; // The manifests of the incremental base directories, or NULL.
+    char **m_base_dirs;
+    manifest *manifest_of_realpath(const char *absfile, const char **relative) throw();
 };
 
 #endif // End of header guardian.
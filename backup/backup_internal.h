@@ -60,6 +60,9 @@ void backup_pause_disable(bool b) throw();
 void backup_set_start_copying(bool b) throw(); // When the backup has started and is about to start copying, wait for this boolean to be true (true by default).
 bool backup_is_capturing(void) throw();        // Return true if the backup has started capturing.
 bool backup_done_copying(void) throw();          // Return true if the backup has finished copying.  This goes true sometime after is_capturing goes true. 
+void backup_set_zero_copy(bool b) throw();
+// Effect: Let the copier use copy_file_range(2) and splice(2) (true by default).  Tests that inject
+//  errors into the copier's read() or write() calls turn this off so that the copier makes those calls.
 void backup_set_keep_capturing(bool b) throw();
 // Effect:  By default, when a backup finishes, it disables capturing.  If before the backup finishes, someone calls backup_set_keep_capturing(true)
 //  then the capturing will keep running until someone calls backup_set_capturing(false).
@@ -88,6 +91,4 @@ void backup_set_keep_capturing(bool b) throw();
 
 static inline void ignore(int a __attribute__((unused))) throw() {}
 
-long long dirsum(const char*dname) throw();
-
 #endif // end of header guardian.
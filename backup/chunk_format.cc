@@ -0,0 +1,270 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "chunk_format.h"
+#include "instantiate_vector.h"
+#include "MurmurHash3.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// This file is also compiled into the restore tool, so it uses the
+// plain system calls, and reports errors only by returning them.  (In
+// the library, it opens chunks with openat(), which isn't captured.)
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The gear table of the rolling hash: a random 64-bit number for each
+// byte value, made by splitmix64, so that every backup (and the
+// restore tool) cuts the same data the same way.
+//
+static uint64_t gear[256];
+
+static struct gear_initializer {
+    gear_initializer(void) {
+        uint64_t x = 0;
+        for (int i = 0; i < 256; i++) {
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            gear[i] = z ^ (z >> 31);
+        }
+    }
+} the_gear_initializer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// find_chunk_boundary() -
+//
+// Description:
+//
+//     A gear hash: each byte shifts the hash left and adds the byte's
+// gear value, so the hash depends only on the last 64 bytes, and a
+// boundary follows any byte where the top chunk_average_bits bits of
+// it are zero.  Since only the last 64 bytes count, we can start
+// hashing 64 bytes before where we start looking.
+//
+size_t find_chunk_boundary(const char *buf, size_t n, size_t from) throw() {
+    const uint64_t mask = ~0ULL << (64 - chunk_average_bits);
+    const size_t end = (n < chunk_max_size) ? n : chunk_max_size;
+    size_t i = (from > chunk_min_size) ? from : chunk_min_size;
+    size_t j = (i > 64) ? i - 64 : 0;
+    uint64_t h = 0;
+    for (; j < i && j < end; j++) {
+        h = (h << 1) + gear[(unsigned char)buf[j]];
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + gear[(unsigned char)buf[i]];
+        if ((h & mask) == 0) {
+            return i + 1;
+        }
+    }
+    return (n >= chunk_max_size) ? chunk_max_size : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void make_chunk_ref(const char *buf, size_t n, chunk_ref *ref) throw() {
+    ref->m_length = n;
+    ref->m_kind = CHUNK_ZERO;
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i] != 0) {
+            ref->m_kind = CHUNK_DATA;
+            break;
+        }
+    }
+    if (ref->m_kind == CHUNK_ZERO) {
+        ref->m_hash[0] = ref->m_hash[1] = 0;
+    } else {
+        MurmurHash3_x64_128(buf, (int)n, 0, ref->m_hash);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The first byte of the hash picks a subdirectory, so that no
+// directory of the store gets too big.
+//
+void chunk_name(const chunk_ref &ref, char *name) throw() {
+    snprintf(name, chunk_name_size, "%02x/%016llx%016llx",
+             (unsigned int)(ref.m_hash[0] >> 56),
+             (unsigned long long)ref.m_hash[0], (unsigned long long)ref.m_hash[1]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reads exactly N bytes at OFFSET, returning 0 or an error number (EINVAL if the file is too short).
+static int pread_fully(int fd, void *buf, size_t n, off_t offset) throw() {
+    while (n > 0) {
+        ssize_t r = pread(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (r == 0) {
+            return EINVAL;
+        }
+        buf = (char *)buf + r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int pwrite_fully(int fd, const void *buf, size_t n, off_t offset) throw() {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (r == 0) {
+            return EIO;
+        }
+        buf = (const char *)buf + r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int read_chunk(int store_fd, const chunk_ref &ref, char *buf) throw() {
+    if (ref.m_kind == CHUNK_ZERO) {
+        memset(buf, 0, ref.m_length);
+        return 0;
+    }
+    char name[chunk_name_size];
+    chunk_name(ref, name);
+    int fd = openat(store_fd, name, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    int r = pread_fully(fd, buf, ref.m_length, 0);
+    close(fd);
+    if (r == 0) {
+        chunk_ref check;
+        make_chunk_ref(buf, ref.m_length, &check);
+        if (check.m_hash[0] != ref.m_hash[0] || check.m_hash[1] != ref.m_hash[1]) {
+            r = EINVAL;
+        }
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool is_chunk_recipe(int fd) throw() {
+    chunk_recipe_header header;
+    return (pread_fully(fd, &header, sizeof(header), 0) == 0 &&
+            memcmp(header.m_magic, chunk_recipe_magic, sizeof(chunk_recipe_magic)) == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int read_chunk_recipe(int fd, chunk_recipe_header *header, std::vector<chunk_ref> *chunks) throw() {
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        return errno;
+    }
+    int r = pread_fully(fd, header, sizeof(*header), 0);
+    if (r != 0) {
+        return r;
+    }
+    if (memcmp(header->m_magic, chunk_recipe_magic, sizeof(chunk_recipe_magic)) != 0 ||
+        header->m_n_chunks != ((uint64_t)sbuf.st_size - sizeof(*header)) / sizeof(chunk_ref)) {
+        return EINVAL;
+    }
+    chunks->resize(header->m_n_chunks);
+    if (header->m_n_chunks == 0) {
+        return header->m_size == 0 ? 0 : EINVAL;
+    }
+    r = pread_fully(fd, &(*chunks)[0], header->m_n_chunks * sizeof(chunk_ref), sizeof(*header));
+    if (r != 0) {
+        return r;
+    }
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < header->m_n_chunks; i++) {
+        if ((*chunks)[i].m_length == 0 || (*chunks)[i].m_length > chunk_max_size) {
+            return EINVAL;
+        }
+        size += (*chunks)[i].m_length;
+    }
+    return (size == header->m_size) ? 0 : EINVAL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int restore_chunked_file(int store_fd, int in_fd, int out_fd) throw() {
+    chunk_recipe_header header;
+    std::vector<chunk_ref> chunks;
+    int r = read_chunk_recipe(in_fd, &header, &chunks);
+    if (r != 0) {
+        return r;
+    }
+    char *buf = (char *)malloc(chunk_max_size);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    uint64_t offset = 0;
+    for (size_t i = 0; r == 0 && i < chunks.size(); i++) {
+        if (chunks[i].m_kind != CHUNK_ZERO) {
+            r = read_chunk(store_fd, chunks[i], buf);
+            if (r == 0) {
+                r = pwrite_fully(out_fd, buf, chunks[i].m_length, offset);
+            }
+        }
+        offset += chunks[i].m_length;
+    }
+    free(buf);
+    if (r == 0 && ftruncate(out_fd, header.m_size) != 0) {
+        r = errno;
+    }
+    return r;
+}
+
+// Instantiate the templates we need
+INSTANTIATE_VECTOR(chunk_ref)
@@ -0,0 +1,115 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef CHUNK_FORMAT_H
+#define CHUNK_FORMAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The deduplicated backup format.
+//
+//     A deduplicated backup keeps the data of its files in a chunk
+// store, a directory shared by every backup made with it.  The files
+// are cut into chunks where their contents say (see
+// find_chunk_boundary()), so that data that is the same in two files,
+// or in two backups of a file, is cut the same way even if it has
+// moved, and each chunk is stored once, named by its hash.  A chunk of
+// zeros isn't stored at all.
+//
+//     Each file in the backup is a recipe: a chunk_recipe_header,
+// followed by a chunk_ref for each chunk of the file, in order.
+// Numbers are in the byte order of the machine that made the backup.
+//
+//     A chunk is stored as it is, in the file chunk_name() gives,
+// under the store.  Chunks are never changed or removed.
+//
+static const char chunk_recipe_magic[8] = {'t', 'o', 'k', 'u', 'b', 'k', 'd', '1'};
+static const uint32_t chunk_min_size = 16 * 1024;
+static const uint32_t chunk_max_size = 256 * 1024;
+// A boundary is found after 1 byte in 2^chunk_average_bits (past the minimum).
+static const int chunk_average_bits = 16;
+
+struct chunk_recipe_header {
+    char m_magic[8];
+    uint64_t m_size;     // The length of the file.
+    uint64_t m_n_chunks; // How many chunk_refs follow.
+};
+
+enum chunk_kind {
+    CHUNK_DATA = 0, // In the store.
+    CHUNK_ZERO = 1  // All zeros, and not stored.
+};
+
+struct chunk_ref {
+    uint64_t m_hash[2]; // MurmurHash3_x64_128() of the chunk.
+    uint32_t m_length;
+    uint32_t m_kind;    // A chunk_kind.
+};
+
+// The longest name chunk_name() makes.
+static const size_t chunk_name_size = 40;
+
+size_t find_chunk_boundary(const char *buf, size_t n, size_t from) throw();
+// Effect: Return the length of the chunk that starts at BUF, which holds N bytes: the first boundary past
+//  chunk_min_size, or chunk_max_size if there isn't one before that.  If neither is in BUF, return 0.
+//  FROM says that there is no boundary in the first FROM bytes (they were looked at before), so that
+//  data arriving a little at a time needn't be looked at again.
+
+void make_chunk_ref(const char *buf, size_t n, chunk_ref *ref) throw();
+// Effect: Fill in REF for the chunk of N bytes at BUF.
+
+void chunk_name(const chunk_ref &ref, char *name) throw();
+// Effect: Put the name of REF's file, relative to the store, in NAME (which holds chunk_name_size bytes).
+
+int read_chunk(int store_fd, const chunk_ref &ref, char *buf) throw() __attribute__((warn_unused_result));
+// Effect: Read the chunk REF from the store open (as a directory) as STORE_FD into BUF, which holds
+//  REF.m_length bytes.  Returns 0, or an error number (EINVAL if the chunk isn't what REF says).
+
+bool is_chunk_recipe(int fd) throw();
+// Effect: Return true if the file open as FD starts with a chunk_recipe_header.
+
+int read_chunk_recipe(int fd, chunk_recipe_header *header, std::vector<chunk_ref> *chunks) throw() __attribute__((warn_unused_result));
+// Effect: Read the recipe open as FD.  Returns 0, or an error number (EINVAL if it is damaged).
+
+int restore_chunked_file(int store_fd, int in_fd, int out_fd) throw() __attribute__((warn_unused_result));
+// Effect: Write the contents of the file whose recipe is open as IN_FD, from the store open as STORE_FD, to
+//  the empty file open as OUT_FD.  Zero chunks are left as holes.  Returns 0, or an error number.
+
+#endif // End of header guardian.
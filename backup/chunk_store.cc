@@ -0,0 +1,161 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "chunk_store.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+chunk_store::chunk_store(void) throw()
+    : m_fd(-1), m_written(0), m_reused(0), m_next_temp(0) {
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+chunk_store::~chunk_store(void) throw() {
+    this->close();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int chunk_store::open(const char *dir) throw() {
+    this->close();
+    if (call_real_mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    m_fd = call_real_open(dir, O_RDONLY | O_DIRECTORY);
+    if (m_fd < 0) {
+        return errno;
+    }
+    m_written = m_reused = 0;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void chunk_store::close(void) throw() {
+    if (m_fd >= 0) {
+        ignore(call_real_close(m_fd)); // Nothing was written through it.
+        m_fd = -1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// put() -
+//
+// Description:
+//
+//     Stores a chunk.  The subdirectory the chunk goes in is made the
+// first time it's needed.  The store's files are reached with the *at()
+// calls, which aren't captured, so a store inside a directory being
+// backed up isn't backed up along with it.
+//
+int chunk_store::put(const char *buf, size_t n, chunk_ref *ref) throw() {
+    make_chunk_ref(buf, n, ref);
+    if (ref->m_kind == CHUNK_ZERO) {
+        return 0;
+    }
+    char name[chunk_name_size];
+    chunk_name(*ref, name);
+    struct stat sbuf;
+    if (fstatat(m_fd, name, &sbuf, 0) == 0 && sbuf.st_size == (off_t)n) {
+        __sync_fetch_and_add(&m_reused, 1);
+        return 0;
+    }
+
+    char subdir[3] = {name[0], name[1], 0};
+    if (mkdirat(m_fd, subdir, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    char temp[chunk_name_size + 40];
+    snprintf(temp, sizeof(temp), "%s/tmp.%d.%llu", subdir, (int)getpid(),
+             (unsigned long long)__sync_fetch_and_add(&m_next_temp, 1));
+    int fd = openat(m_fd, temp, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    if (fd < 0) {
+        return errno;
+    }
+    int r = 0;
+    for (size_t done = 0; r == 0 && done < n; ) {
+        ssize_t wr = call_real_pwrite(fd, buf + done, n - done, done);
+        if (wr < 0) {
+            r = errno;
+        } else if (wr == 0) {
+            r = EIO;
+        } else {
+            done += wr;
+        }
+    }
+    if (call_real_close(fd) != 0 && r == 0) {
+        r = errno;
+    }
+    if (r == 0 && renameat(m_fd, temp, m_fd, name) != 0) {
+        r = errno;
+    }
+    if (r != 0) {
+        unlinkat(m_fd, temp, 0);
+        return r;
+    }
+    __sync_fetch_and_add(&m_written, 1);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int chunk_store::get(const chunk_ref &ref, char *buf) throw() {
+    return read_chunk(m_fd, ref, buf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t chunk_store::chunks_written(void) const throw() {
+    return m_written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t chunk_store::chunks_reused(void) const throw() {
+    return m_reused;
+}
@@ -0,0 +1,83 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chunk_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// chunk_store:
+//
+// Description:
+//
+//     The chunk store of a deduplicated backup (see chunk_format.h).
+// Storing a chunk that is already there (from this backup or an
+// earlier one) costs a stat(), and nothing is written.  A new chunk is
+// written to a temporary file and renamed into place, so a chunk is
+// either all there or not at all, even if the backup dies, and two
+// threads storing the same chunk don't get in each other's way.
+//
+//     Errors are returned, not reported.
+//
+class chunk_store {
+  public:
+    chunk_store(void) throw();
+    ~chunk_store(void) throw();
+
+    int open(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Use the store in DIR, making DIR if it doesn't exist.  Returns 0, or an error number.
+    void close(void) throw();
+    int put(const char *buf, size_t n, chunk_ref *ref) throw() __attribute__((warn_unused_result));
+    // Effect: Store the chunk of N bytes at BUF, unless it's there already (or is zeros), and fill in REF.
+    //  This is thread-safe.
+    int get(const chunk_ref &ref, char *buf) throw() __attribute__((warn_unused_result));
+    // Effect: Read the chunk REF into BUF.  This is thread-safe.
+    uint64_t chunks_written(void) const throw(); // How many chunks this store has written since open().
+    uint64_t chunks_reused(void) const throw();  // How many chunks it found already there.
+
+  private:
+    int m_fd;                    // The store, open as a directory.  -1 if it isn't open.
+    volatile uint64_t m_written; // Changed with atomic operations.
+    volatile uint64_t m_reused;
+    volatile uint64_t m_next_temp;
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,450 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "chunk_store.h"
+#include "chunked_file.h"
+#include "instantiate_vector.h"
+#include "mutex.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+chunked_file::chunked_file(int fd, chunk_store *store) throw()
+    : m_fd(fd), m_store(store), m_chunked_end(0), m_tail(NULL), m_tail_len(0), m_tail_scanned(0),
+      m_work(NULL), m_work_capacity(0), m_dirty(false) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+chunked_file::~chunked_file(void) throw() {
+    free(m_tail);
+    free(m_work);
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// open() -
+//
+// Description:
+//
+//     Picks up the recipe the file already has (the backup copy was
+// closed and opened again), taking its last chunk back as the tail, so
+// that writes at the end carry on cutting it.  A new file is dirty, so
+// that even an empty one gets a recipe.
+//
+int chunked_file::open(void) throw() {
+    m_tail = (char *)malloc(tail_capacity);
+    if (m_tail == NULL) {
+        return ENOMEM;
+    }
+    struct stat sbuf;
+    if (fstat(m_fd, &sbuf) != 0) {
+        return errno;
+    }
+    if (sbuf.st_size == 0) {
+        m_dirty = true;
+        return 0;
+    }
+    chunk_recipe_header header;
+    std::vector<chunk_ref> refs;
+    int r = read_chunk_recipe(m_fd, &header, &refs);
+    if (r != 0) {
+        return r;
+    }
+    m_chunks.reserve(refs.size());
+    for (size_t i = 0; i < refs.size(); i++) {
+        chunk_state s;
+        s.m_ref = refs[i];
+        s.m_offset = m_chunked_end;
+        m_chunks.push_back(s);
+        m_chunked_end += refs[i].m_length;
+    }
+    if (!m_chunks.empty() && m_chunks.back().m_ref.m_length < chunk_max_size) {
+        const chunk_state &last = m_chunks.back();
+        r = m_store->get(last.m_ref, m_tail);
+        if (r != 0) {
+            return r;
+        }
+        m_tail_len = last.m_ref.m_length;
+        m_chunked_end = last.m_offset;
+        m_chunks.pop_back();
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// cut_tail() -
+//
+// Description:
+//
+//     Stores the chunks at the start of the tail, until there are no
+// more boundaries in it.  That leaves less than chunk_max_size there.
+//
+int chunked_file::cut_tail(void) throw() {
+    while (true) {
+        const size_t c = find_chunk_boundary(m_tail, m_tail_len, m_tail_scanned);
+        if (c == 0) {
+            m_tail_scanned = m_tail_len;
+            return 0;
+        }
+        chunk_state s;
+        int r = m_store->put(m_tail, c, &s.m_ref);
+        if (r != 0) {
+            return r;
+        }
+        s.m_offset = m_chunked_end;
+        m_chunks.push_back(s);
+        m_chunked_end += c;
+        m_tail_len -= c;
+        memmove(m_tail, m_tail + c, m_tail_len);
+        m_tail_scanned = 0;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Adds N bytes from BUF (or zeros, if BUF is NULL) to the end of the file.
+int chunked_file::append(const char *buf, size_t n) throw() {
+    while (n > 0) {
+        const size_t k = (n < tail_capacity - m_tail_len) ? n : tail_capacity - m_tail_len;
+        if (buf != NULL) {
+            memcpy(m_tail + m_tail_len, buf, k);
+            buf += k;
+        } else {
+            memset(m_tail + m_tail_len, 0, k);
+        }
+        m_tail_len += k;
+        n -= k;
+        int r = this->cut_tail();
+        if (r != 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Returns the index of the chunk that OFFSET (which is before m_chunked_end) is in.
+size_t chunked_file::chunk_at(uint64_t offset) const throw() {
+    size_t lo = 0, hi = m_chunks.size();
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (m_chunks[mid].m_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int chunked_file::grow_work(size_t n) throw() {
+    if (n <= m_work_capacity) {
+        return 0;
+    }
+    char *work = (char *)realloc(m_work, n);
+    if (work == NULL) {
+        return ENOMEM;
+    }
+    m_work = work;
+    m_work_capacity = n;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// rechunk() -
+//
+// Description:
+//
+//     Writes the N bytes at BUF at OFFSET, which is all in chunks that
+// have been cut.  The chunks from the one OFFSET is in are read into
+// m_work, patched, and cut again, until a new boundary (at or past the
+// end of the write) falls where an old one was.  The chunks from there
+// on are kept.  If we run out of chunks first, what is left over goes
+// back to the start of the tail.
+//
+int chunked_file::rechunk(const char *buf, size_t n, uint64_t offset) throw() {
+    const size_t first = this->chunk_at(offset);
+    const uint64_t start = m_chunks[first].m_offset;
+    size_t next = first; // The next old chunk to read.
+    size_t len = 0;      // How much of m_work is read.
+    int r = 0;
+    while (r == 0 && start + len < offset + n) {
+        const chunk_ref &ref = m_chunks[next].m_ref;
+        r = this->grow_work(len + ref.m_length);
+        if (r == 0) r = m_store->get(ref, m_work + len);
+        len += ref.m_length;
+        next++;
+    }
+    if (r != 0) {
+        return r;
+    }
+    memcpy(m_work + (offset - start), buf, n);
+
+    std::vector<chunk_state> cut;
+    size_t pos = 0;
+    size_t keep_from = 0; // The first old chunk kept after the new ones, if we resynchronize.
+    bool resynchronized = false;
+    while (!resynchronized) {
+        const size_t c = find_chunk_boundary(m_work + pos, len - pos, 0);
+        if (c == 0) {
+            if (next == m_chunks.size()) {
+                break;
+            }
+            const chunk_ref &ref = m_chunks[next].m_ref;
+            r = this->grow_work(len + ref.m_length);
+            if (r == 0) r = m_store->get(ref, m_work + len);
+            if (r != 0) {
+                return r;
+            }
+            len += ref.m_length;
+            next++;
+            continue;
+        }
+        chunk_state s;
+        r = m_store->put(m_work + pos, c, &s.m_ref);
+        if (r != 0) {
+            return r;
+        }
+        s.m_offset = start + pos;
+        cut.push_back(s);
+        pos += c;
+        if (start + pos >= offset + n) {
+            for (size_t j = first + 1; j <= next; j++) {
+                const uint64_t boundary = (j < m_chunks.size()) ? m_chunks[j].m_offset : m_chunked_end;
+                if (boundary == start + pos) {
+                    keep_from = j;
+                    resynchronized = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // The chunks before the cut ones, the cut ones, and the ones kept after them.
+    // (Assigned one by one: a range insert is a member template, which
+    // instantiating the vector doesn't instantiate.)
+    const size_t n_kept = resynchronized ? m_chunks.size() - keep_from : 0;
+    std::vector<chunk_state> chunks;
+    chunks.resize(first + cut.size() + n_kept);
+    size_t k = 0;
+    for (size_t j = 0; j < first; j++) {
+        chunks[k++] = m_chunks[j];
+    }
+    for (size_t j = 0; j < cut.size(); j++) {
+        chunks[k++] = cut[j];
+    }
+    for (size_t j = 0; j < n_kept; j++) {
+        chunks[k++] = m_chunks[keep_from + j];
+    }
+    if (resynchronized) {
+        m_chunks.swap(chunks);
+        return 0;
+    }
+    // Less than chunk_max_size is left over, and less than that is in the tail.
+    const size_t left = len - pos;
+    memmove(m_tail + left, m_tail, m_tail_len);
+    memcpy(m_tail, m_work + pos, left);
+    m_tail_len += left;
+    m_tail_scanned = 0;
+    m_chunked_end = start + pos;
+    m_chunks.swap(chunks);
+    return this->cut_tail();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwrite() -
+//
+// Description:
+//
+//     Writes past the end of the file fill the gap with zeros first.
+// The part of a write that lands in the tail is patched into it, and
+// the rest of it is appended.  The part before the tail is re-chunked
+// a piece at a time, so that m_work doesn't get too big.  Each step
+// looks again at where the tail starts, since re-chunking can move it.
+//
+int chunked_file::pwrite(const void *buf, size_t nbyte, off_t offset) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_dirty = true;
+    const char *data = (const char *)buf;
+    uint64_t at = offset;
+    int r = 0;
+    while (r == 0 && nbyte > 0) {
+        const uint64_t size = m_chunked_end + m_tail_len;
+        if (at > size) {
+            r = this->append(NULL, (at - size < tail_capacity) ? at - size : tail_capacity);
+        } else if (at >= m_chunked_end) {
+            const size_t rel = at - m_chunked_end;
+            const size_t in_tail = (nbyte < size - at) ? nbyte : size - at;
+            memcpy(m_tail + rel, data, in_tail);
+            if (rel < m_tail_scanned) {
+                m_tail_scanned = rel;
+            }
+            r = this->cut_tail();
+            if (r == 0) {
+                r = this->append(data + in_tail, nbyte - in_tail);
+            }
+            nbyte = 0;
+        } else {
+            size_t piece = (nbyte < max_rechunk) ? nbyte : max_rechunk;
+            if (piece > m_chunked_end - at) {
+                piece = m_chunked_end - at;
+            }
+            r = this->rechunk(data, piece, at);
+            data += piece;
+            at += piece;
+            nbyte -= piece;
+        }
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// truncate() -
+//
+// Description:
+//
+//     Cutting into the chunks drops the ones past LENGTH, and makes the
+// part of the one LENGTH is in the tail.
+//
+int chunked_file::truncate(off_t length) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_dirty = true;
+    const uint64_t new_size = length;
+    const uint64_t size = m_chunked_end + m_tail_len;
+    if (new_size >= size) {
+        return this->append(NULL, new_size - size);
+    }
+    if (new_size >= m_chunked_end) {
+        m_tail_len = new_size - m_chunked_end;
+        if (m_tail_scanned > m_tail_len) {
+            m_tail_scanned = m_tail_len;
+        }
+        return 0;
+    }
+    const size_t j = this->chunk_at(new_size);
+    const chunk_state last = m_chunks[j];
+    int r = m_store->get(last.m_ref, m_tail);
+    if (r != 0) {
+        return r;
+    }
+    m_tail_len = new_size - last.m_offset;
+    m_tail_scanned = 0;
+    m_chunked_end = last.m_offset;
+    m_chunks.erase(m_chunks.begin() + j, m_chunks.end());
+    return this->cut_tail();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t chunked_file::size(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return m_chunked_end + m_tail_len;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int chunked_file::flush(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    if (!m_dirty) {
+        return 0;
+    }
+    chunk_ref tail;
+    if (m_tail_len > 0) {
+        int r = m_store->put(m_tail, m_tail_len, &tail);
+        if (r != 0) {
+            return r;
+        }
+    }
+    const size_t n_chunks = m_chunks.size() + (m_tail_len > 0 ? 1 : 0);
+    const size_t len = sizeof(chunk_recipe_header) + n_chunks * sizeof(chunk_ref);
+    char *recipe = (char *)malloc(len);
+    if (recipe == NULL) {
+        return ENOMEM;
+    }
+    chunk_recipe_header *header = (chunk_recipe_header *)recipe;
+    memcpy(header->m_magic, chunk_recipe_magic, sizeof(chunk_recipe_magic));
+    header->m_size = m_chunked_end + m_tail_len;
+    header->m_n_chunks = n_chunks;
+    chunk_ref *refs = (chunk_ref *)(header + 1);
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        refs[i] = m_chunks[i].m_ref;
+    }
+    if (m_tail_len > 0) {
+        refs[m_chunks.size()] = tail;
+    }
+    int r = 0;
+    for (size_t done = 0; r == 0 && done < len; ) {
+        ssize_t wr = call_real_pwrite(m_fd, recipe + done, len - done, done);
+        if (wr < 0) {
+            r = errno;
+        } else if (wr == 0) {
+            r = EIO;
+        } else {
+            done += wr;
+        }
+    }
+    free(recipe);
+    if (r == 0 && call_real_ftruncate(m_fd, len) != 0) {
+        r = errno;
+    }
+    if (r == 0) {
+        m_dirty = false;
+    }
+    return r;
+}
+
+// Instantiate the templates we need
+INSTANTIATE_VECTOR(chunked_file::chunk_state)
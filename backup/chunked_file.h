@@ -0,0 +1,115 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef CHUNKED_FILE_H
+#define CHUNKED_FILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "chunk_format.h"
+
+class chunk_store;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// chunked_file:
+//
+// Description:
+//
+//     Writes a backup file as a recipe (see chunk_format.h), with its
+// data in a chunk store.  The data written at the end of the file (as
+// the copier does) collects in a tail, which is cut into chunks as
+// boundaries turn up in it.  What is left at the end is stored as a
+// last chunk when the recipe is written, but stays the tail.
+//
+//     A write into chunks already cut (as the application's writes
+// during a backup often are) reads back the chunks it touches, patches
+// them, and cuts them again, reading on into the chunks after them
+// until a new boundary falls on an old one.  Since boundaries depend
+// only on the data near them, that is usually within a chunk, and the
+// rest of the file keeps its chunks.
+//
+//     The chunk list is kept in memory, and the recipe is written out
+// by flush().  Everything is done under one mutex.
+//
+//     Errors are returned, not reported.
+//
+class chunked_file {
+  public:
+    chunked_file(int fd, chunk_store *store) throw();
+    ~chunked_file(void) throw();
+
+    int open(void) throw() __attribute__((warn_unused_result));
+    // Effect: Start a recipe in the empty file open as FD, or pick up the recipe already there.
+    //  Returns 0, or an error number (EINVAL if the file is something else).
+    int pwrite(const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    int truncate(off_t length) throw() __attribute__((warn_unused_result));
+    uint64_t size(void) throw();
+    int flush(void) throw() __attribute__((warn_unused_result));
+    // Effect: Store the tail, and write the recipe, if anything has changed.  Writing more after this is allowed,
+    //  and calls for another flush().
+
+  private:
+    struct chunk_state {
+        chunk_ref m_ref;
+        uint64_t m_offset; // Where the chunk starts in the file.
+    };
+    static const size_t tail_capacity = 2 * chunk_max_size;
+    static const size_t max_rechunk = 1<<20; // The most of a write re-chunked at once.
+
+    int cut_tail(void) throw();
+    int append(const char *buf, size_t n) throw();
+    int rechunk(const char *buf, size_t n, uint64_t offset) throw();
+    size_t chunk_at(uint64_t offset) const throw();
+    int grow_work(size_t n) throw();
+
+    const int m_fd;
+    chunk_store *const m_store;
+    pthread_mutex_t m_mutex;             // Protects everything below.
+    std::vector<chunk_state> m_chunks;   // The chunks cut so far, in order.
+    uint64_t m_chunked_end;              // Where the chunks end, and the tail starts.
+    char *m_tail;                        // Holds tail_capacity bytes.
+    size_t m_tail_len;
+    size_t m_tail_scanned;               // There's no boundary in this much of the tail.
+    char *m_work;                        // For re-chunking.
+    size_t m_work_capacity;
+    bool m_dirty;                        // Has anything changed since the recipe was written?
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,574 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "check.h"
+#include "compressed_file.h"
+#include "instantiate_vector.h"
+#include "lz_codec.h"
+#include "mutex.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const uint64_t block_size = compressed_block_size;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compression_pool::compression_pool(void) throw()
+    : m_batches(NULL), m_stopping(false), m_n_running(0) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r == 0);
+    r = pthread_cond_init(&m_work, NULL);
+    check(r == 0);
+    r = pthread_cond_init(&m_helped, NULL);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compression_pool::~compression_pool(void) throw() {
+    check(m_n_running == 0 && m_batches == NULL);
+    int r = pthread_cond_destroy(&m_helped);
+    check(r == 0);
+    r = pthread_cond_destroy(&m_work);
+    check(r == 0);
+    r = pthread_mutex_destroy(&m_mutex);
+    check(r == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void compression_pool::start(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_stopping = false;
+    while (m_n_running < n_helpers && pthread_create(&m_helpers[m_n_running], NULL, help_loop, this) == 0) {
+        m_n_running++;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// stop() -
+//
+// Description:
+//
+//     Nothing is posted once m_n_running is zero, and a helper that
+// leaves a batch early is harmless: its writer does what's left.
+//
+void compression_pool::stop(void) throw() {
+    int n_running;
+    {
+        with_mutex_locked ml(&m_mutex);
+        n_running = m_n_running;
+        m_n_running = 0;
+        m_stopping = true;
+        int r = pthread_cond_broadcast(&m_work);
+        check(r == 0);
+    }
+    for (int i = 0; i < n_running; i++) {
+        int r = pthread_join(m_helpers[i], NULL);
+        check(r == 0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void compression_pool::compress_job(job *j) throw() {
+    if (j->m_data[0] == 0 && memcmp(j->m_data, j->m_data + 1, block_size - 1) == 0) {
+        j->m_kind = COMPRESSED_ZERO;
+        j->m_length = 0;
+        return;
+    }
+    size_t n = lz_compress(j->m_data, block_size, j->m_out, lz_compress_bound(block_size));
+    if (n == 0) {
+        j->m_kind = COMPRESSED_RAW;
+        j->m_length = block_size;
+    } else {
+        j->m_kind = COMPRESSED_LZ;
+        j->m_length = n;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void compression_pool::compress_batch(batch *b) throw() {
+    while (true) {
+        int j = __sync_fetch_and_add(&b->m_next, 1);
+        if (j >= b->m_n_jobs) {
+            return;
+        }
+        compress_job(&b->m_jobs[j]);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compression_pool::batch *compression_pool::take_batch(void) throw() {
+    for (batch *b = m_batches; b != NULL; b = b->m_next_batch) {
+        if (__sync_fetch_and_add(&b->m_next, 0) < b->m_n_jobs) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void *compression_pool::help_loop(void *pool_v) throw() {
+    compression_pool *pool = (compression_pool *)pool_v;
+    pmutex_lock(&pool->m_mutex);
+    while (true) {
+        batch *b = pool->take_batch();
+        if (b == NULL) {
+            if (pool->m_stopping) {
+                break;
+            }
+            int r = pthread_cond_wait(&pool->m_work, &pool->m_mutex);
+            check(r == 0);
+            continue;
+        }
+        b->m_n_helping++;
+        pmutex_unlock(&pool->m_mutex);
+        compress_batch(b);
+        pmutex_lock(&pool->m_mutex);
+        b->m_n_helping--;
+        if (b->m_n_helping == 0) {
+            int r = pthread_cond_broadcast(&pool->m_helped);
+            check(r == 0);
+        }
+    }
+    pmutex_unlock(&pool->m_mutex);
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// compress() -
+//
+// Description:
+//
+//     Posts the batch, wakes enough helpers to take a block each, and
+// works on it alongside them.  Once there's nothing left to take, we
+// unpost it and wait for the helpers still compressing its blocks.
+//
+void compression_pool::compress(job *jobs, int n_jobs) throw() {
+    batch b = {jobs, n_jobs, 0, 0, NULL};
+    bool posted = false;
+    if (n_jobs > 1) {
+        with_mutex_locked ml(&m_mutex);
+        if (m_n_running > 0) {
+            b.m_next_batch = m_batches;
+            m_batches = &b;
+            posted = true;
+            for (int i = 1; i < n_jobs && i <= m_n_running; i++) {
+                int r = pthread_cond_signal(&m_work);
+                check(r == 0);
+            }
+        }
+    }
+    compress_batch(&b);
+    if (posted) {
+        with_mutex_locked ml(&m_mutex);
+        batch **p = &m_batches;
+        while (*p != &b) {
+            p = &(*p)->m_next_batch;
+        }
+        *p = b.m_next_batch;
+        while (b.m_n_helping > 0) {
+            int r = pthread_cond_wait(&m_helped, &m_mutex);
+            check(r == 0);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compressed_file::compressed_file(int fd, compression_pool *pool) throw()
+    : m_fd(fd), m_pool(pool), m_size(0), m_append(sizeof(compressed_header)) {
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r == 0);
+    for (int i = 0; i < n_stripes; i++) {
+        r = pthread_mutex_init(&m_stripes[i], NULL);
+        check(r == 0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compressed_file::~compressed_file(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r == 0);
+    for (int i = 0; i < n_stripes; i++) {
+        r = pthread_mutex_destroy(&m_stripes[i]);
+        check(r == 0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int compressed_file::write_data(const void *buf, size_t nbyte, uint64_t offset) throw() {
+    while (nbyte > 0) {
+        ssize_t wr = call_real_pwrite(m_fd, buf, nbyte, offset);
+        if (wr < 0) {
+            return errno;
+        }
+        if (wr == 0) {
+            return EIO;
+        }
+        buf = (const char *)buf + wr;
+        nbyte -= wr;
+        offset += wr;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int compressed_file::open(void) throw() {
+    struct stat sbuf;
+    if (fstat(m_fd, &sbuf) != 0) {
+        return errno;
+    }
+    if (sbuf.st_size == 0) {
+        compressed_header header;
+        memcpy(header.m_magic, compressed_magic, sizeof(header.m_magic));
+        header.m_block_size = compressed_block_size;
+        header.m_unused = 0;
+        return this->write_data(&header, sizeof(header), 0);
+    }
+    // The file was made earlier in this backup, and flushed when it was closed.
+    if (!is_compressed_file(m_fd)) {
+        return EINVAL;
+    }
+    compressed_trailer trailer;
+    std::vector<compressed_block> index;
+    int r = read_compressed_index(m_fd, &trailer, &index);
+    if (r != 0) {
+        return r;
+    }
+    with_mutex_locked ml(&m_mutex);
+    m_blocks.resize(index.size());
+    for (size_t b = 0; b < index.size(); b++) {
+        m_blocks[b].m_block = index[b];
+        m_blocks[b].m_capacity = index[b].m_length;
+    }
+    m_size = trailer.m_size;
+    m_append = trailer.m_index_offset; // New data can go over the old index.
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t compressed_file::stripe_mask(uint64_t first_block, uint64_t last_block) throw() {
+    if (last_block - first_block >= (uint64_t)n_stripes) {
+        return ~(uint64_t)0;
+    }
+    uint64_t mask = 0;
+    for (uint64_t b = first_block; b <= last_block; b++) {
+        mask |= (uint64_t)1 << (b % n_stripes);
+    }
+    return mask;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void compressed_file::lock_stripes(uint64_t mask) throw() {
+    // Always in the same order, so two writers can't deadlock.
+    for (int i = 0; i < n_stripes; i++) {
+        if (mask & ((uint64_t)1 << i)) {
+            pmutex_lock(&m_stripes[i]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void compressed_file::unlock_stripes(uint64_t mask) throw() {
+    for (int i = 0; i < n_stripes; i++) {
+        if (mask & ((uint64_t)1 << i)) {
+            pmutex_unlock(&m_stripes[i]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int compressed_file::read_block(uint64_t b, char *buf) throw() {
+    compressed_block block;
+    {
+        with_mutex_locked ml(&m_mutex);
+        if (b >= m_blocks.size()) {
+            memset(buf, 0, block_size);
+            return 0;
+        }
+        block = m_blocks[b].m_block;
+    }
+    return read_compressed_block(m_fd, block, buf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// store_block() -
+//
+// Description:
+//
+//     Puts a compressed block in the file, over its old data if there
+// is room, and otherwise at the end of the data.
+//
+int compressed_file::store_block(const block_job &job) throw() {
+    uint64_t offset = 0;
+    {
+        with_mutex_locked ml(&m_mutex);
+        if (job.m_block >= m_blocks.size()) {
+            block_state zero = {{0, 0, COMPRESSED_ZERO}, 0};
+            m_blocks.resize(job.m_block + 1, zero);
+        }
+        block_state &state = m_blocks[job.m_block];
+        if (job.m_length > state.m_capacity) {
+            state.m_block.m_offset = m_append;
+            state.m_capacity = job.m_length;
+            m_append += job.m_length;
+        }
+        offset = state.m_block.m_offset;
+        state.m_block.m_length = job.m_length;
+        state.m_block.m_kind = job.m_kind;
+    }
+    if (job.m_kind == COMPRESSED_ZERO) {
+        return 0;
+    }
+    const char *data = (job.m_kind == COMPRESSED_LZ) ? job.m_out : job.m_data;
+    return this->write_data(data, job.m_length, offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// rewrite_blocks() -
+//
+// Description:
+//
+//     Compresses the blocks, with the pool's help if we have one, and
+// stores them.
+//
+int compressed_file::rewrite_blocks(block_job *jobs, int n_jobs) throw() {
+    const size_t bound = lz_compress_bound(block_size);
+    char *out = (char *)malloc(n_jobs * bound);
+    if (out == NULL) {
+        return ENOMEM;
+    }
+    for (int j = 0; j < n_jobs; j++) {
+        jobs[j].m_out = out + j * bound;
+    }
+    if (m_pool != NULL) {
+        m_pool->compress(jobs, n_jobs);
+    } else {
+        for (int j = 0; j < n_jobs; j++) {
+            compression_pool::compress_job(&jobs[j]);
+        }
+    }
+    int r = 0;
+    for (int j = 0; r == 0 && j < n_jobs; j++) {
+        r = this->store_block(jobs[j]);
+    }
+    free(out);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwrite() -
+//
+// Description:
+//
+//     Rewrites the blocks that [offset, offset+nbyte) touches, a batch
+// at a time.  Only the first and last blocks can be partly covered, and
+// those we read back and patch.
+//
+int compressed_file::pwrite(const void *buf_v, size_t nbyte, off_t offset) throw() {
+    if (nbyte == 0) {
+        return 0;
+    }
+    const char *buf = (const char *)buf_v;
+    const uint64_t end = offset + nbyte;
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (end - 1) / block_size;
+    const uint64_t mask = stripe_mask(first, last);
+    char *patched[2] = {NULL, NULL}; // The first and last blocks, if they are partly covered.
+    int r = 0;
+    this->lock_stripes(mask);
+    for (uint64_t b = first; r == 0 && b <= last; ) {
+        block_job jobs[max_batch];
+        int n_jobs = 0;
+        for (; n_jobs < max_batch && b <= last; b++, n_jobs++) {
+            const uint64_t block_start = b * block_size;
+            const uint64_t lo = (block_start > (uint64_t)offset) ? block_start : offset;
+            const uint64_t hi = (block_start + block_size < end) ? block_start + block_size : end;
+            jobs[n_jobs].m_block = b;
+            if (lo == block_start && hi == block_start + block_size) {
+                jobs[n_jobs].m_data = buf + (block_start - offset);
+                continue;
+            }
+            char *&patch = patched[(b == first) ? 0 : 1];
+            patch = (char *)malloc(block_size);
+            if (patch == NULL) {
+                r = ENOMEM;
+                break;
+            }
+            r = this->read_block(b, patch);
+            if (r != 0) {
+                break;
+            }
+            memcpy(patch + (lo - block_start), buf + (lo - offset), hi - lo);
+            jobs[n_jobs].m_data = patch;
+        }
+        if (r == 0) {
+            r = this->rewrite_blocks(jobs, n_jobs);
+        }
+    }
+    if (r == 0) {
+        with_mutex_locked ml(&m_mutex);
+        if (end > m_size) {
+            m_size = end;
+        }
+    }
+    this->unlock_stripes(mask);
+    free(patched[0]);
+    free(patched[1]);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// truncate() -
+//
+// Description:
+//
+//     Bytes past the end of the file, in its last block, are always
+// zero, so that the file can grow again just by changing its length.
+// So when we shrink the file we zero the rest of the new last block,
+// and forget the blocks after it.
+//
+int compressed_file::truncate(off_t length) throw() {
+    const uint64_t new_size = length;
+    const uint64_t mask = ~(uint64_t)0;
+    int r = 0;
+    this->lock_stripes(mask);
+    uint64_t old_size;
+    {
+        with_mutex_locked ml(&m_mutex);
+        old_size = m_size;
+    }
+    if (new_size < old_size && new_size % block_size != 0) {
+        block_job job;
+        job.m_block = new_size / block_size;
+        char *patch = (char *)malloc(block_size);
+        if (patch == NULL) {
+            r = ENOMEM;
+        } else {
+            r = this->read_block(job.m_block, patch);
+            if (r == 0) {
+                memset(patch + new_size % block_size, 0, block_size - new_size % block_size);
+                job.m_data = patch;
+                r = this->rewrite_blocks(&job, 1);
+            }
+            free(patch);
+        }
+    }
+    if (r == 0) {
+        with_mutex_locked ml(&m_mutex);
+        const uint64_t n_blocks = (new_size + block_size - 1) / block_size;
+        if (m_blocks.size() > n_blocks) {
+            m_blocks.resize(n_blocks);
+        }
+        m_size = new_size;
+    }
+    this->unlock_stripes(mask);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint64_t compressed_file::size(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return m_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// flush() -
+//
+// Description:
+//
+//     Writes the index and trailer after the data, and cuts the file
+// off after them.  The index has an entry for every block up to the
+// end of the file, including the zero blocks we never stored.
+//
+int compressed_file::flush(void) throw() {
+    const uint64_t mask = ~(uint64_t)0;
+    this->lock_stripes(mask);
+    int r = 0;
+    {
+        with_mutex_locked ml(&m_mutex);
+        compressed_trailer trailer;
+        trailer.m_size = m_size;
+        trailer.m_index_offset = m_append;
+        trailer.m_n_blocks = (m_size + block_size - 1) / block_size;
+        memcpy(trailer.m_magic, compressed_magic, sizeof(trailer.m_magic));
+        compressed_block zero = {0, 0, COMPRESSED_ZERO};
+        std::vector<compressed_block> index(trailer.m_n_blocks, zero);
+        for (size_t b = 0; b < m_blocks.size() && b < index.size(); b++) {
+            index[b] = m_blocks[b].m_block;
+        }
+        const uint64_t index_bytes = trailer.m_n_blocks * sizeof(compressed_block);
+        if (index_bytes > 0) {
+            r = this->write_data(&index[0], index_bytes, m_append);
+        }
+        if (r == 0) {
+            r = this->write_data(&trailer, sizeof(trailer), m_append + index_bytes);
+        }
+        if (r == 0 && call_real_ftruncate(m_fd, m_append + index_bytes + sizeof(trailer)) != 0) {
+            r = errno;
+        }
+    }
+    this->unlock_stripes(mask);
+    return r;
+}
+
+// Instantiate the templates we need
+INSTANTIATE_VECTOR(compressed_file::block_state)
@@ -0,0 +1,167 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef COMPRESSED_FILE_H
+#define COMPRESSED_FILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "compressed_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// compression_pool:
+//
+// Description:
+//
+//     Threads that help compress the blocks of a write.  The pool is
+// started and stopped with the backup, so that a write doesn't pay to
+// start threads of its own.  A writer posts its blocks as a batch and
+// compresses them itself, while idle helpers take blocks from the same
+// batch.  The writer then waits only for the blocks a helper took.
+// When the pool isn't running, the writer compresses them all.
+//
+class compression_pool {
+  public:
+    static const int n_helpers = 3;
+
+    struct job {
+        uint64_t m_block;
+        const char *m_data;  // The block's new contents.
+        char *m_out;         // Room for the compressed data.
+        uint32_t m_length;   // Set by compress_job().
+        uint32_t m_kind;     // Set by compress_job().
+    };
+
+    compression_pool(void) throw();
+    ~compression_pool(void) throw(); // Requires that the helpers are stopped.
+
+    void start(void) throw();
+    // Effect: Start the helpers.  If a helper can't be started, the writers do its share.
+    void stop(void) throw();
+    // Effect: Stop the helpers.  Writes can go on while this runs, and after.
+    void compress(job *jobs, int n_jobs) throw();
+    // Effect: Compress the blocks of JOBS, with help if any is free.
+    static void compress_job(job *j) throw();
+    // Effect: Compress one block, in this thread.
+
+  private:
+    struct batch {
+        job *m_jobs;
+        int m_n_jobs;
+        int m_next;          // The next job to take.  Read and written with atomic operations.
+        int m_n_helping;     // How many helpers are working on the batch.
+        batch *m_next_batch;
+    };
+    static void compress_batch(batch *b) throw();
+    static void *help_loop(void *pool) throw();
+    batch *take_batch(void) throw(); // Returns a posted batch with jobs left, or NULL.  Requires m_mutex.
+
+    pthread_mutex_t m_mutex; // Protects everything below, and the m_n_helping and m_next_batch of posted batches.
+    pthread_cond_t m_work;   // Signalled when a batch is posted, or when it's time to stop.
+    pthread_cond_t m_helped; // Signalled when a helper is done with a batch.
+    batch *m_batches;        // The posted batches.
+    bool m_stopping;
+    int m_n_running;
+    pthread_t m_helpers[n_helpers];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// compressed_file:
+//
+// Description:
+//
+//     Writes a backup file in the compressed format (see
+// compressed_format.h).  A write rewrites just the blocks it touches:
+// a block it covers is compressed from the caller's buffer, and a block
+// it covers only part of is read back, patched and compressed again.
+// The blocks of one write are compressed in parallel, by the writer and
+// the pool's helpers, if it is given a pool.  A rewritten
+// block goes where it was if it fits, and otherwise after all the data.
+//
+//     Writes to the same block must not interleave, so each block is
+// locked (by one of a set of stripe locks) while it is rewritten.
+// Writes to other blocks go on at the same time.  The index is kept in
+// memory, and written out by flush().
+//
+//     Errors are returned, not reported.
+//
+class compressed_file {
+  public:
+    compressed_file(int fd, compression_pool *pool) throw(); // POOL may be NULL.
+    ~compressed_file(void) throw();
+
+    int open(void) throw() __attribute__((warn_unused_result));
+    // Effect: Start a compressed file in the empty file open as FD, or pick up the compressed file already there.
+    //  Returns 0, or an error number (EINVAL if the file is something else).
+    int pwrite(const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+    int truncate(off_t length) throw() __attribute__((warn_unused_result));
+    uint64_t size(void) throw(); // The length of the uncompressed file.
+    int flush(void) throw() __attribute__((warn_unused_result));
+    // Effect: Write the index and trailer, so that the file can be read.  Writing more after this is allowed, and calls for another flush().
+
+  private:
+    static const int n_stripes = 64;
+    static const int max_batch = 16;             // Blocks compressed at once.
+
+    struct block_state {
+        compressed_block m_block;
+        uint32_t m_capacity; // How much data fits at m_block.m_offset.
+    };
+    typedef compression_pool::job block_job;
+
+    static uint64_t stripe_mask(uint64_t first_block, uint64_t last_block) throw();
+    void lock_stripes(uint64_t mask) throw();
+    void unlock_stripes(uint64_t mask) throw();
+    int read_block(uint64_t b, char *buf) throw();       // Requires b's stripe lock.
+    int store_block(const block_job &job) throw();       // Requires the job's stripe lock.
+    int rewrite_blocks(block_job *jobs, int n_jobs) throw();
+    int write_data(const void *buf, size_t nbyte, uint64_t offset) throw();
+
+    const int m_fd;
+    compression_pool *const m_pool;
+    pthread_mutex_t m_mutex;            // Protects m_blocks, m_size and m_append.
+    std::vector<block_state> m_blocks;  // The blocks we know of.  The rest are zeros.
+    uint64_t m_size;
+    uint64_t m_append;                  // The end of the data.
+    pthread_mutex_t m_stripes[n_stripes]; // Block b is locked by m_stripes[b % n_stripes].
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,205 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "compressed_format.h"
+#include "instantiate_vector.h"
+#include "lz_codec.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// This file is also compiled into the restore tool, so it uses the
+// plain system calls, and reports errors only by returning them.
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reads exactly N bytes at OFFSET, returning 0 or an error number (EINVAL if the file is too short).
+static int pread_fully(int fd, void *buf, size_t n, off_t offset) throw() {
+    while (n > 0) {
+        ssize_t r = pread(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (r == 0) {
+            return EINVAL;
+        }
+        buf = (char *)buf + r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int pwrite_fully(int fd, const void *buf, size_t n, off_t offset) throw() {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (r == 0) {
+            return EIO;
+        }
+        buf = (const char *)buf + r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool is_compressed_file(int fd) throw() {
+    compressed_header header;
+    return (pread_fully(fd, &header, sizeof(header), 0) == 0 &&
+            memcmp(header.m_magic, compressed_magic, sizeof(compressed_magic)) == 0 &&
+            header.m_block_size == compressed_block_size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// read_compressed_index() -
+//
+// Description:
+//
+//     The trailer is the last thing in the file, and the index runs
+// from where the trailer says up to the trailer, so we check that they
+// agree with each other and with the file's length.
+//
+int read_compressed_index(int fd, compressed_trailer *trailer, std::vector<compressed_block> *index) throw() {
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        return errno;
+    }
+    const uint64_t file_size = sbuf.st_size;
+    if (file_size < sizeof(compressed_header) + sizeof(*trailer)) {
+        return EINVAL;
+    }
+    int r = pread_fully(fd, trailer, sizeof(*trailer), file_size - sizeof(*trailer));
+    if (r != 0) {
+        return r;
+    }
+    const uint64_t index_end = file_size - sizeof(*trailer);
+    if (memcmp(trailer->m_magic, compressed_magic, sizeof(compressed_magic)) != 0 ||
+        trailer->m_index_offset < sizeof(compressed_header) ||
+        trailer->m_index_offset > index_end ||
+        (index_end - trailer->m_index_offset) / sizeof(compressed_block) != trailer->m_n_blocks ||
+        (index_end - trailer->m_index_offset) % sizeof(compressed_block) != 0 ||
+        trailer->m_n_blocks != (trailer->m_size + compressed_block_size - 1) / compressed_block_size) {
+        return EINVAL;
+    }
+    index->resize(trailer->m_n_blocks);
+    if (trailer->m_n_blocks == 0) {
+        return 0;
+    }
+    return pread_fully(fd, &(*index)[0], trailer->m_n_blocks * sizeof(compressed_block), trailer->m_index_offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int read_compressed_block(int fd, const compressed_block &block, char *buf) throw() {
+    switch (block.m_kind) {
+    case COMPRESSED_ZERO:
+        memset(buf, 0, compressed_block_size);
+        return 0;
+    case COMPRESSED_RAW:
+        if (block.m_length != compressed_block_size) {
+            return EINVAL;
+        }
+        return pread_fully(fd, buf, compressed_block_size, block.m_offset);
+    case COMPRESSED_LZ: {
+        if (block.m_length >= compressed_block_size) {
+            return EINVAL;
+        }
+        char *data = (char *)malloc(block.m_length);
+        if (data == NULL) {
+            return ENOMEM;
+        }
+        int r = pread_fully(fd, data, block.m_length, block.m_offset);
+        if (r == 0) {
+            r = lz_decompress(data, block.m_length, buf, compressed_block_size);
+        }
+        free(data);
+        return r;
+    }
+    default:
+        return EINVAL;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int decompress_file(int in_fd, int out_fd) throw() {
+    if (!is_compressed_file(in_fd)) {
+        return EINVAL;
+    }
+    compressed_trailer trailer;
+    std::vector<compressed_block> index;
+    int r = read_compressed_index(in_fd, &trailer, &index);
+    if (r != 0) {
+        return r;
+    }
+    char *buf = (char *)malloc(compressed_block_size);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    for (uint64_t b = 0; r == 0 && b < trailer.m_n_blocks; b++) {
+        if (index[b].m_kind == COMPRESSED_ZERO) {
+            continue;
+        }
+        r = read_compressed_block(in_fd, index[b], buf);
+        if (r == 0) {
+            const uint64_t offset = b * compressed_block_size;
+            const uint64_t n = (trailer.m_size - offset < compressed_block_size) ? trailer.m_size - offset : compressed_block_size;
+            r = pwrite_fully(out_fd, buf, n, offset);
+        }
+    }
+    free(buf);
+    if (r == 0 && ftruncate(out_fd, trailer.m_size) != 0) {
+        r = errno;
+    }
+    return r;
+}
+
+// Instantiate the templates we need
+INSTANTIATE_VECTOR(compressed_block)
@@ -0,0 +1,106 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef COMPRESSED_FORMAT_H
+#define COMPRESSED_FORMAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The compressed backup file format.
+//
+//     A compressed backup file holds a file of the source directory
+// cut into blocks of compressed_block_size bytes.  Each block is
+// compressed by itself (see lz_codec.h), so it can be read or rewritten
+// without touching the others.  The file is:
+//
+//     a compressed_header,
+//     the blocks' data, in no particular order (a rewritten block may
+//         be written over its old data, if it fits, or somewhere new),
+//     the index: a compressed_block for each block of the file, in
+//         order, and
+//     a compressed_trailer, which ends the file.
+//
+// A block that is all zeros has no data.  A block that doesn't
+// compress is stored as it is.  The last block is padded with zeros.
+// Numbers are in the byte order of the machine that made the backup.
+//
+static const char compressed_magic[8] = {'t', 'o', 'k', 'u', 'b', 'k', 'z', '1'};
+static const uint32_t compressed_block_size = 64 * 1024;
+
+struct compressed_header {
+    char m_magic[8];
+    uint32_t m_block_size;
+    uint32_t m_unused;
+};
+
+enum compressed_block_kind {
+    COMPRESSED_ZERO = 0, // All zeros, with no data.
+    COMPRESSED_RAW  = 1, // The block as it is.
+    COMPRESSED_LZ   = 2  // Compressed with lz_compress().
+};
+
+struct compressed_block {
+    uint64_t m_offset; // Where the data is in the compressed file.
+    uint32_t m_length; // How long the data is.
+    uint32_t m_kind;   // A compressed_block_kind.
+};
+
+struct compressed_trailer {
+    uint64_t m_size;         // The length of the uncompressed file.
+    uint64_t m_index_offset; // Where the index starts.
+    uint64_t m_n_blocks;     // How many compressed_blocks are in the index.
+    char m_magic[8];
+};
+
+bool is_compressed_file(int fd) throw();
+// Effect: Return true if the file open as FD starts with a compressed_header.
+
+int read_compressed_index(int fd, compressed_trailer *trailer, std::vector<compressed_block> *index) throw() __attribute__((warn_unused_result));
+// Effect: Read the trailer and index of the compressed file open as FD.  Returns 0, or an error number (EINVAL if the file is damaged).
+
+int read_compressed_block(int fd, const compressed_block &block, char *buf) throw() __attribute__((warn_unused_result));
+// Effect: Read BLOCK of the compressed file open as FD, uncompressed, into BUF (which holds compressed_block_size bytes).
+//  Returns 0, or an error number (EINVAL if the block is damaged).
+
+int decompress_file(int in_fd, int out_fd) throw() __attribute__((warn_unused_result));
+// Effect: Write the uncompressed contents of the compressed file open as IN_FD to the empty file open as OUT_FD.
+//  Zero blocks are left as holes.  Returns 0, or an error number.
+
+#endif // End of header guardian.
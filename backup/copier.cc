@@ -34,15 +34,18 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #ident "$Id$"
 
+#include "action_stream.h"
 #include "backup_debug.h"
 #include "check.h"
 #include "copier.h"
 #include "file_hash_table.h"
 #include "manager.h"
+#include "manifest.h"
 #include "mutex.h"
 #include "raii-malloc.h"
 #include "real_syscalls.h"
 #include "source_file.h"
+#include "uring_engine.h"
 
 #include <dirent.h>
 #include <errno.h>
@@ -51,13 +54,17 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
 
-template class std::vector<char *>;
-
 #if DEBUG_HOTBACKUP
 #define WARN(string, arg) HotBackup::CopyWarn(string, arg)
 #define TRACE(string, arg) HotBackup::CopyTrace(string, arg)
@@ -74,6 +81,18 @@ template class std::vector<char *>;
 #define PAUSE(int)
 #endif
 
+static const size_t copy_buffer_size = 1024 * 1024; // We copy files this much at a time.
+static const double max_throttle_nap = 0.01;        // Seconds.  How long a throttled copier sleeps before looking at the throttle again.
+
+// What getdents64(2) returns.  The C library doesn't declare it.
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[1]; // Really d_reclen - offsetof(linux_dirent64, d_name) bytes.
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // is_dot() -
@@ -83,16 +102,14 @@ template class std::vector<char *>;
 //     Helper function that returns true if the given directory 
 // entry is either of the special cases: ".." or ".".
 //
-static bool is_dot(struct dirent const *entry)
+static bool is_dot(const char *name)
 {
-    if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+    if (strcmp(name, "..") == 0 || strcmp(name, ".") == 0) {
         return true;
     }
     return false;
 }
 
-pthread_mutex_t copier::m_todo_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // copier() - 
@@ -104,11 +121,28 @@ pthread_mutex_t copier::m_todo_mutex = PTHREAD_MUTEX_INITIALIZER;
 copier::copier(backup_callbacks *calls, file_hash_table * const table) throw()
     : m_source(NULL), 
       m_dest(NULL), 
+      m_queue(the_manager.get_copy_threads()),
       m_calls(calls), 
       m_table(table),
+      m_error(0),
+      m_engines(new uring_engine*[m_queue.worker_count()]),
       m_total_bytes_backed_up(0),
-      m_total_files_backed_up(0)
-{}
+      m_total_files_backed_up(0),
+      m_manifest(NULL),
+      m_base_manifest(NULL),
+      m_base(NULL)
+{
+    for (int i = 0; i < m_queue.worker_count(); ++i) {
+        m_engines[i] = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copier::~copier(void) throw() {
+    this->cleanup();
+    delete[] m_engines;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -124,6 +158,31 @@ void copier::set_directories(const char *source, const char *dest) throw() {
     m_dest = dest;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// set_manifests() -
+//
+// Description:
+//
+//     Sets the manifests for the directories given to
+// set_directories(): the one we build as we copy (NULL if we aren't
+// writing one), and the one from the incremental base directory (NULL
+// if this isn't an incremental backup).
+//
+void copier::set_manifests(manifest *base_manifest, const char *base, manifest *new_manifest) throw() {
+    m_base_manifest = base_manifest;
+    m_base = base;
+    m_manifest = new_manifest;
+}
+
+// What each copier worker thread gets to start with.
+struct copy_worker_info {
+    copier *m_copier;
+    int m_worker;
+    pthread_t m_thread;
+    bool m_started;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // start_copy() -
@@ -131,64 +190,122 @@ void copier::set_directories(const char *source, const char *dest) throw() {
 // Description: 
 //
 //     Loops through all files and subdirectories of the current 
-// directory that has been selected for backup.
+// directory that has been selected for backup.  The calling thread
+// is worker 0; the other workers get their own threads, which are
+// joined before we return.
 //
 int copier::do_copy(void) throw() {
-    m_total_bytes_to_back_up = dirsum(m_source);
-    int r = 0;
-    char *fname = 0;
-    size_t n_known = 0;
-    {
-        with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-        // Start with "."
-        m_todo.push_back(strdup("."));
-        n_known = m_todo.size();
+    // The total grows as the workers scan directories, so copying starts right away.
+    m_total_bytes_to_back_up = 0;
+    m_error = 0;
+    switch (the_manager.get_copy_order()) {
+    case TOKUBACKUP_COPY_ORDER_LARGEST_FIRST:
+        m_queue.set_priority_function(largest_first, this);
+        break;
+    case TOKUBACKUP_COPY_ORDER_SMALLEST_FIRST:
+        m_queue.set_priority_function(smallest_first, this);
+        break;
+    case TOKUBACKUP_COPY_ORDER_COLDEST_FIRST:
+        m_queue.set_priority_function(coldest_first, this);
+        break;
+    default:
+        m_queue.set_priority_function(NULL, NULL);
+        break;
+    }
+    // Start with "."
+    m_queue.push(0, ".");
+
+    const int n_workers = m_queue.worker_count();
+    copy_worker_info *workers = new copy_worker_info[n_workers];
+    for (int i = 1; i < n_workers; ++i) {
+        workers[i].m_copier = this;
+        workers[i].m_worker = i;
+        // If we can't get a thread, the remaining workers will steal
+        // its share of the work, so there is nothing to report.
+        workers[i].m_started = (pthread_create(&workers[i].m_thread, NULL, copy_worker, &workers[i]) == 0);
     }
-    while (n_known != 0) {
 
-        if (!the_manager.copy_is_enabled()) goto out;
-        
-        {
-            with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            fname = m_todo.back();
+    int r = this->copy_todo_items(0);
+    if (r != 0) {
+        ignore(__sync_bool_compare_and_swap(&m_error, 0, r));
+    }
+
+    for (int i = 1; i < n_workers; ++i) {
+        if (workers[i].m_started) {
+            int jr = pthread_join(workers[i].m_thread, NULL);
+            check(jr==0);
         }
+    }
+    delete[] workers;
+
+    this->cleanup();
+    return m_error;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void *copier::copy_worker(void *arg) throw() {
+    copy_worker_info *info = static_cast<copy_worker_info *>(arg);
+    copier *c = info->m_copier;
+    // Like the backup thread, a worker reports its errors directly.
+    thread_has_backup_calls = c->m_calls;
+    int r = c->copy_todo_items(info->m_worker);
+    if (r != 0) {
+        ignore(__sync_bool_compare_and_swap(&c->m_error, 0, r));
+    }
+    thread_has_backup_calls = NULL;
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_todo_items() -
+//
+// Description:
+//
+//     Pops names off the todo queue and copies them until there is
+// nothing left.  If anything goes wrong we abort the queue so the
+// other workers stop too.
+//
+int copier::copy_todo_items(int worker) throw() {
+    int r = 0;
+    char *fname = NULL;
+    todo_item item;
+    while (m_queue.pop(worker, &item)) {
+        fname = item.m_name;
+        if (!the_manager.copy_is_enabled()) goto abort_out;
+
         TRACE("Copying: ", fname);
         
-        char *msg = malloc_snprintf(strlen(fname)+100, "Backup progress %ld bytes, %ld files.  %ld more files known of. Copying file %s",  m_total_bytes_backed_up, m_total_files_backed_up, n_known, fname);
-        // Use n_done/n_files.   We need to do a better estimate involving n_bytes_copied/n_bytes_total
-        // This one is very wrongu
-        r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), msg);
-        free(msg);
+        {
+            char *msg = malloc_snprintf(strlen(fname)+100, "Backup progress %ld bytes, %ld files.  %ld more files known of. Copying file %s",  m_total_bytes_backed_up, m_total_files_backed_up, m_queue.pending(), fname);
+            // Use n_done/n_files.   We need to do a better estimate involving n_bytes_copied/n_bytes_total
+            // This one is very wrongu
+            r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), msg);
+            free(msg);
+        }
         if (r != 0) {
             fprintf(stderr, "%s:%d poll error r=%d\n", __FILE__, __LINE__, r);
-            goto out;
+            goto abort_out;
         }
 
-        {
-            with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            m_todo.pop_back();
-        }
-        
-        r = this->copy_stripped_file(fname);
+        r = this->copy_stripped_file(item, worker);
         if(r != 0) {
             fprintf(stderr, "%s:%d copy error fname=%s r=%d\n", __FILE__, __LINE__, fname, r);
-            free((void*)fname);
-            fname = NULL;
-            goto out;
+            goto abort_out;
         }
         free((void*)fname);
         fname = NULL;
 
-        m_total_files_backed_up++;
-        
-        {
-            with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-            n_known = m_todo.size();
-        }
+        __sync_fetch_and_add(&m_total_files_backed_up, 1);
+        m_queue.finish(worker);
     }
+    return 0;
 
-out:
-    this->cleanup();
+abort_out:
+    free((void*)fname);
+    m_queue.finish(worker);
+    m_queue.abort();
     return r;
 }
 
@@ -203,6 +320,43 @@ static void pathcat(char *dest, size_t destlen, const char *a, int alen, const c
     check(r<(int)destlen);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// largest_first(), smallest_first(), coldest_first() -
+//
+// Description:
+//
+//     The work_queue priority functions for the copy orders.  A file's
+// heat is how much the application has written to it, which is only
+// known if the file is open (and so has a source_file in the table).
+// Heat only goes up, so a file's priority only goes down, which is
+// what the work_queue requires.
+//
+int64_t copier::largest_first(const todo_item &item, void *extra __attribute__((unused))) throw() {
+    return item.m_size;
+}
+
+int64_t copier::smallest_first(const todo_item &item, void *extra __attribute__((unused))) throw() {
+    return -(int64_t)item.m_size;
+}
+
+int64_t copier::coldest_first(const todo_item &item, void *extra) throw() {
+    copier *c = static_cast<copier *>(extra);
+    int source_len = strlen(c->m_source);
+    int len = source_len + strlen(item.m_name) + 2;
+    char full_path[len];
+    pathcat(full_path, len, c->m_source, source_len, item.m_name);
+    uint64_t heat = 0;
+    {
+        with_file_hash_table_mutex mtl(c->m_table, full_path);
+        source_file *file = c->m_table->get(full_path);
+        if (file != NULL) {
+            heat = file->get_write_heat();
+        }
+    }
+    return -(int64_t)heat;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // copy_stripped_file() -
@@ -213,12 +367,13 @@ static void pathcat(char *dest, size_t destlen, const char *a, int alen, const c
 // destination directory members to determine the exact location
 // of the file in both the original and backup locations.
 //
-int copier::copy_stripped_file(const char *file) throw() {
+int copier::copy_stripped_file(const todo_item &item, int worker) throw() {
     int r = 0;
+    const char *file = item.m_name;
     bool is_dot = (strcmp(file, ".") == 0);
     if (is_dot) {
         // Just copy the root of the backup tree.
-        r = this->copy_full_path(m_source, m_dest, "");
+        r = this->copy_full_path(m_source, m_dest, "", worker, item.m_mode, item.m_size);
         if (r != 0) {
             goto out;
         }
@@ -235,7 +390,7 @@ int copier::copy_stripped_file(const char *file) throw() {
         char full_dest_file_path[dlen];
         pathcat(full_dest_file_path, dlen, m_dest, m_dest_len, file);
         
-        r = this->copy_full_path(full_source_file_path, full_dest_file_path, file);
+        r = this->copy_full_path(full_source_file_path, full_dest_file_path, file, worker, item.m_mode, item.m_size);
         if(r != 0) {
             goto out;
         }
@@ -246,6 +401,23 @@ out:
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// method_after_clone() -
+//
+// Description:
+//
+//     Returns the copy method to use when cloning isn't possible.  A
+// compressed, chunked or streamed backup has to see the data, so it
+// reads and writes.
+//
+static copy_method method_after_clone(void) throw() {
+    if (!the_manager.destinations_are_plain()) {
+        return COPY_WITH_READ_WRITE;
+    }
+    return the_manager.zero_copy_is_enabled() ? COPY_WITH_COPY_FILE_RANGE : COPY_WITH_READ_WRITE;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // copy_full_path() - 
@@ -255,33 +427,45 @@ out:
 //     Copies the given source file, or directory, to our backup
 // directory, using the given source and destination prefixes to
 // determine the relative location of the file in the directory
-// heirarchy.
+// heirarchy.  If mode is nonzero, the scanner has already stat'd the
+// file (when it read the parent directory), so we use the mode and size
+// it saw instead of calling stat() again.
 //
-int copier::copy_full_path(const char *source, const char* dest, const char *file) throw() {
+int copier::copy_full_path(const char *source, const char* dest, const char *file, int worker, mode_t mode, off_t size) throw() {
     if (m_calls->exclude_copy(source))
         return 0;
     int r = 0;
     struct stat sbuf;
-    int stat_r = stat(source, &sbuf);
-    if (stat_r != 0) {
-        stat_r = errno;
-        // Ignore errors about file not existing, 
-        // because we have not yet opened the file with open(), 
-        // which would prevent it from disappearing.
-        if (stat_r == ENOENT) {
+    if (mode != 0) {
+        sbuf.st_mode = mode;
+        sbuf.st_size = size;
+    } else {
+        int stat_r = stat(source, &sbuf);
+        if (stat_r != 0) {
+            stat_r = errno;
+            // Ignore errors about file not existing, 
+            // because we have not yet opened the file with open(), 
+            // which would prevent it from disappearing.
+            if (stat_r == ENOENT) {
+                goto out;
+            }
+
+            r = stat_r;
+            char *string = malloc_snprintf(strlen(dest)+100, "Could not stat(\"%s\"), errno=%d (%s) at %s:%d", dest, r, strerror(r), __FILE__, __LINE__);
+            m_calls->report_error(errno, string);
+            free(string);
             goto out;
         }
-
-        r = stat_r;
-        char *string = malloc_snprintf(strlen(dest)+100, "Could not stat(\"%s\"), errno=%d (%s) at %s:%d", dest, r, strerror(r), __FILE__, __LINE__);
-        m_calls->report_error(errno, string);
-        free(string);
-        goto out;
     }
     
     // See if the source path is a directory or a real file.
     if (S_ISREG(sbuf.st_mode)) {
-        source_info src_info = {-1, source, sbuf.st_size, NULL, O_RDONLY};
+        const copy_method method = (the_manager.reflink_is_enabled() && the_manager.destinations_are_plain()) ? COPY_WITH_CLONE : method_after_clone();
+        const char *name = source + strlen(m_source);
+        while (*name == '/') {
+            name++;
+        }
+        source_info src_info = {-1, source, sbuf.st_size, NULL, O_RDONLY, method, {-1, -1}, false, true, worker, name};
         r = this->copy_using_source_info(src_info, dest);
         if (r != 0) {
             // The error should already have been reported, so we simply return r.
@@ -289,39 +473,48 @@ int copier::copy_full_path(const char *source, const char* dest, const char *fil
         }
     } else if (S_ISDIR(sbuf.st_mode)) {
         // Open the directory to be copied (source directory, full path).
-        DIR *dir = opendir(source);
-        if(dir == NULL) {
+        int dirfd = call_real_open(source, O_RDONLY | O_DIRECTORY);
+        if (dirfd < 0) {
             r = errno;
             // If the directory was deleted from underneath us, just skip it.
-            if (r != ENOENT) {
-                the_manager.backup_error(r, "Could not opendir %s", source);
-                goto out;
+            if (r == ENOENT) {
+                r = 0;
+            } else {
+                the_manager.backup_error(r, "Could not open directory %s", source);
             }
+            goto out;
         }
 
         // Make the directory in the backup destination.
-        r = call_real_mkdir(dest, 0777);
-        if (r < 0) {
+        action_stream *stream = the_manager.backup_stream();
+        if (stream != NULL) {
+            r = stream->create_directory(dest);
+            if (r != 0) {
+                the_manager.backup_error(r, "Could not stream the creation of directory %s", dest);
+                ignore(call_real_close(dirfd));
+                goto out;
+            }
+        } else if (call_real_mkdir(dest, 0777) < 0) {
             int mkdir_errno = errno;
             if(mkdir_errno != EEXIST) {
                 char *string = malloc_snprintf(strlen(dest)+100, "error mkdir(\"%s\"), errno=%d (%s) at %s:%d", dest, mkdir_errno, strerror(mkdir_errno), __FILE__, __LINE__);
                 m_calls->report_error(mkdir_errno, string);
                 free(string);
                 r = mkdir_errno;
-                closedir(dir); // ignore errors from this.
+                ignore(call_real_close(dirfd));
                 goto out;
             }
             
             ERROR("Cannot create directory that already exists = ", dest);
         }
 
-        r = this->add_dir_entries_to_todo(dir, file);
+        r = this->add_dir_entries_to_todo(dirfd, source, file, worker);
         if (r != 0) {
-            closedir(dir); // ignore errors from this.
+            ignore(call_real_close(dirfd));
             goto out;
         }
 
-        r = closedir(dir);
+        r = call_real_close(dirfd);
         if (r!=0) {
             r = errno;
             the_manager.backup_error(r, "Cannot close dir %s during backup at %s:%d\n", source, __FILE__, __LINE__);
@@ -406,12 +599,28 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
         return r;
     }
 
+    // When building a manifest, we record what the file looked like
+    // before we copied it, and look it up in the base's manifest.
+    struct stat src_stat;
+    const manifest_entry *base_entry = NULL;
+    if (m_manifest != NULL) {
+        if (fstat(src_info.m_fd, &src_stat) != 0) {
+            int r = errno;
+            the_manager.backup_error(r, "Could not fstat %s at %s:%d", src_info.m_path, __FILE__, __LINE__);
+            return r;
+        }
+        if (m_base_manifest != NULL) {
+            base_entry = m_base_manifest->find(src_info.m_name);
+        }
+    }
+
     // Try to create the destination file, using the file hash table
     // lock to help serialize access.
     bool source_exists = true;
+    bool linked = false;
     int result = 0;
     {
-        with_file_hash_table_mutex mtl(m_table);
+        with_file_hash_table_mutex mtl(m_table, src_info.m_file);
 
         with_source_file_name_write_lock sfl(src_info.m_file);
 
@@ -422,7 +631,18 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
         TRACE("stat'ing file = ", src_info.m_path);
         int stat_r = lstat(src_info.m_path, &buf);
         if (stat_r == 0) {
-            result = src_info.m_file->try_to_create_destination_file(dest_path.value);
+            // An unchanged file that nobody has open can be a hard
+            // link to the base's copy.  Since we hold the table lock,
+            // nobody can open it until the link is there, and opening it
+            // for capture breaks the link.
+            if (base_entry != NULL && base_entry->matches(src_stat) &&
+                !the_manager.reflink_is_enabled() &&
+                src_info.m_file->get_destination() == NULL) {
+                linked = this->link_from_base(src_info, dest_path.value);
+            }
+            if (!linked) {
+                result = src_info.m_file->try_to_create_destination_file(dest_path.value);
+            }
         } else {
             source_exists = false;
         }
@@ -430,25 +650,39 @@ int copier::create_destination_and_copy(source_info src_info,  const char *path)
         // If the source file was unlinked since the respective
         // source_file object was created and since the stat
         // succeeded, we should not proceed.
-        if (src_info.m_file->get_destination() == NULL) {
+        if (!linked && src_info.m_file->get_destination() == NULL) {
             source_exists = false;
         }
     }
 
     if (result != 0) { return result; }
 
+    if (linked) {
+        manifest_entry *entry = m_manifest->add(src_info.m_name, src_stat);
+        m_manifest->copy_checksums(entry, base_entry);
+        __sync_fetch_and_add(&m_total_bytes_backed_up, src_stat.st_size);
+        return 0;
+    }
+
     if (source_exists) {
         // Actually perform the copy.
-        int r = this->copy_file_data(src_info);
+        src_info.m_file->begin_copy();
+        int r = (m_manifest != NULL) ? this->copy_file_data_with_manifest(src_info, src_stat, base_entry) : this->copy_file_data(src_info);
+        src_info.m_file->end_copy(r == 0 && the_manager.copy_is_enabled());
         if (r!=0) {
             return r;
         }
     }
 
-    // Try to destroy the destination file.
+    // Try to destroy the destination file.  Either way, the writes
+    // captured so far have to be in it before we call the file done.
     {
-        with_file_hash_table_mutex mtl(m_table);
+        with_file_hash_table_mutex mtl(m_table, src_info.m_file);
 
+        destination_file *dest = src_info.m_file->get_destination();
+        if (dest != NULL) {
+            the_manager.drain_captured_writes(dest);
+        }
         src_info.m_file->try_to_remove_destination();
     }
 
@@ -491,11 +725,11 @@ static double tdiff(struct timespec a, struct timespec b) throw()
 //     This section actually copies all the bytes from the source
 // file to our newly created backup copy.
 //
-int copier::copy_file_data(source_info src_info) throw() {
+int copier::copy_file_data(source_info &src_info) throw() {
     int r = 0;
     // For DirectIO: we need to allocate a mem-aligned buffer.
     const size_t align = 2<<12; // why 8K?
-    const size_t buf_size = 1024 * 1024;
+    const size_t buf_size = copy_buffer_size;
     char *buf_base = new char[buf_size + align];
     char *buf = (char *)(((size_t)buf_base + align) & ~(align-1));
 
@@ -506,43 +740,109 @@ int copier::copy_file_data(source_info src_info) throw() {
     ssize_t n_wrote_now = 0;
     size_t poll_string_size = 2000;
     char *poll_string = new char [poll_string_size];
-    m_total_written_this_file = 0;
-    struct timespec starttime;
+    uint64_t total_written_this_file = 0;
 
-    r = gettime_reporting_error(&starttime, m_calls);
-    if (r!=0) goto out;
+    this->preallocate_destination(src_info);
+
+    if (src_info.m_copy_method != COPY_WITH_CLONE) {
+        uring_engine *engine = this->get_engine(src_info.m_worker);
+        if (engine != NULL) {
+            bool done = false;
+            r = this->copy_file_data_with_engine(engine, src_info, total_written_this_file, buf_size, align, poll_string, poll_string_size, &done);
+            if (r != 0 || done) goto out;
+            // Otherwise the O_DIRECT flag changed: finish synchronously, which reopens the source.
+        }
+    }
+
+    // From here on we read everything from total_written_this_file
+    // up, so captured writes there needn't be mirrored.  Those that
+    // are still queued must reach the backup first, or they could land
+    // on top of newer data that we copy.
+    file->lock_range(total_written_this_file, LLONG_MAX);
+    the_manager.drain_captured_writes(dest);
+    file->set_copy_frontier(total_written_this_file);
+    r = file->unlock_range(total_written_this_file, LLONG_MAX);
+    if (r != 0) goto out;
 
     while (1) {
         if (!the_manager.copy_is_enabled()) goto out;
 
         PAUSE(HotBackup::COPIER_BEFORE_READ);
-        const ssize_t lock_start = m_total_written_this_file;
-        const ssize_t lock_end   = m_total_written_this_file + buf_size;
+        size_t chunk_size = buf_size;
+        bool at_end = false;
+        if (src_info.m_skip_holes) {
+            // Lock everything above us while we look for the data, so
+            // a write into the hole we skip lands after the frontier
+            // has moved past it, and is mirrored.
+            const uint64_t hole_start = total_written_this_file;
+            file->lock_range(hole_start, LLONG_MAX);
+            this->skip_hole(src_info, total_written_this_file, buf_size, align, &chunk_size, &at_end);
+            file->set_copy_frontier(at_end ? source_file::no_copy_frontier : total_written_this_file);
+            r = file->unlock_range(hole_start, LLONG_MAX);
+            if (r != 0) goto out;
+        }
+        if (at_end) {
+            // Only a hole (if anything) is left.
+            r = this->extend_destination(src_info, total_written_this_file);
+            goto out;
+        }
+
+        const ssize_t lock_start = total_written_this_file;
+        const ssize_t lock_end   = total_written_this_file + chunk_size;
         file->lock_range(lock_start, lock_end);
         
         copy_result result;
-        result = open_and_lock_file_then_copy_range(src_info, buf, buf_size, poll_string, poll_string_size);
+        result = open_and_lock_file_then_copy_range(src_info, total_written_this_file, buf, chunk_size, poll_string, poll_string_size);
         n_wrote_now = result.m_n_wrote_now;
+        if (result.m_result == 0) {
+            file->set_copy_frontier(total_written_this_file);
+        }
 
         r = file->unlock_range(lock_start, lock_end); 
         if (r!=0) goto out;
 
-        // If we hit an error, or have no more bytes to write, 
-        // we are finished and need to return immediately.
-        if (result.m_result != 0 || n_wrote_now == 0)
+        // If we hit an error we are finished and need to return immediately.
+        if (result.m_result != 0)
         {
             r = result.m_result;
             goto out;
         }
 
+        if (n_wrote_now == 0) {
+            if (src_info.m_fd < 0) {
+                goto out; // The file is gone.
+            }
+            // Writes after the end of the file weren't mirrored, so
+            // make sure there aren't any before we stop.
+            bool grew = false;
+            r = this->finish_destination(src_info, total_written_this_file, &grew);
+            if (r != 0 || !grew) goto out;
+            continue;
+        }
+
         PAUSE(HotBackup::COPIER_AFTER_WRITE);
-        r = possibly_sleep_or_abort(src_info, m_total_written_this_file, dest, starttime);
+        // Holes we skipped don't count against the throttle, since we never read them.
+        r = possibly_sleep_or_abort(src_info, total_written_this_file - lock_start, total_written_this_file, dest);
         if (r != 0) {
             goto out;
         }
     }
 
 out:
+    {
+        // If we stopped partway, go back to mirroring every write.
+        const uint64_t frontier = file->get_copy_frontier();
+        if (frontier != source_file::no_copy_frontier) {
+            file->lock_range(frontier, LLONG_MAX);
+            file->set_copy_frontier(source_file::no_copy_frontier);
+            ignore(file->unlock_range(frontier, LLONG_MAX));
+        }
+    }
+    if (src_info.m_pipe[0] >= 0) {
+        ignore(call_real_close(src_info.m_pipe[0]));
+        ignore(call_real_close(src_info.m_pipe[1]));
+        src_info.m_pipe[0] = src_info.m_pipe[1] = -1;
+    }
     delete[] buf_base;
     delete[] poll_string;
     return r;
@@ -550,23 +850,568 @@ out:
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-copy_result copier::open_and_lock_file_then_copy_range(source_info src_info, 
-                                                       char *buf, 
-                                                       size_t buf_size, 
-                                                       char *poll_string, 
-                                                       size_t poll_string_size) throw()
+// preallocate_destination() -
+//
+// Description:
+//
+//     Allocates the destination's space for the whole source file
+// before we copy, so that our writes fill in allocated extents instead
+// of growing the file a chunk at a time.  We keep the destination's
+// size, since the copier and the captured writes compare it with the
+// source's.  A sparse source isn't preallocated, since that would fill
+// in the holes we skip, and neither is a clone, which shares the
+// source's blocks, nor a compressed, chunked or streamed file.  This is only an
+// optimization, so errors are ignored: the writes will run into any
+// real problem.
+//
+void copier::preallocate_destination(const source_info &src_info) throw() {
+    if (src_info.m_copy_method == COPY_WITH_CLONE || !src_info.m_file->get_destination()->has_plain_fd()) {
+        return;
+    }
+    struct stat sbuf;
+    if (fstat(src_info.m_fd, &sbuf) != 0 || sbuf.st_size == 0) {
+        return;
+    }
+    if ((uint64_t)sbuf.st_blocks * 512 < (uint64_t)sbuf.st_size) {
+        return;
+    }
+    destination_file *dest = src_info.m_file->get_destination();
+    ignore(call_real_fallocate(dest->get_fd(), FALLOC_FL_KEEP_SIZE, 0, sbuf.st_size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// link_from_base() -
+//
+// Description:
+//
+//     Hard links the incremental base's copy of the file to dest.
+// Returns false if that can't be done (the base's copy is gone, or is
+// on another filesystem, or dest already exists because the
+// application had the file open earlier), in which case the caller
+// copies the file instead.
+//
+bool copier::link_from_base(const source_info &src_info, const char *dest) throw() {
+    with_object_to_free<char*> base_path(malloc_snprintf(strlen(m_base) + strlen(src_info.m_name) + 2, "%s/%s", m_base, src_info.m_name));
+    if (link(base_path.value, dest) != 0) {
+        TRACE("Could not link to the incremental base, copying instead ", src_info.m_path);
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// clone_from_base() -
+//
+// Description:
+//
+//     Makes the destination a clone of the incremental base's copy of
+// the file, and sets *have_base if that worked.  We lock the whole file,
+// so no captured write can land in the destination and then be
+// overwritten by the clone.  If the file turns out to be unchanged
+// since the base was made, the clone is the backup: we set *unchanged
+// and fill in the new manifest entry (while we still hold the lock, so
+// a captured write can't slip in before it).
+//
+int copier::clone_from_base(source_info &src_info, manifest_entry *entry, const manifest_entry *base_entry, bool *have_base, bool *unchanged) throw() {
+    source_file * file = src_info.m_file;
+    destination_file * dest = file->get_destination();
+    with_object_to_free<char*> base_path(malloc_snprintf(strlen(m_base) + strlen(src_info.m_name) + 2, "%s/%s", m_base, src_info.m_name));
+    file->lock_range(0, LLONG_MAX);
+    int base_fd = call_real_open(base_path.value, O_RDONLY);
+    if (base_fd >= 0) {
+        if (ioctl(dest->get_fd(), FICLONE, base_fd) == 0) {
+            *have_base = true;
+            struct stat sbuf;
+            if (fstat(src_info.m_fd, &sbuf) == 0 && base_entry->matches(sbuf)) {
+                *unchanged = true;
+                m_manifest->copy_checksums(entry, base_entry);
+            }
+        } else {
+            TRACE("Could not clone from the incremental base, copying the whole file ", src_info.m_path);
+        }
+        ignore(call_real_close(base_fd));
+    }
+    return file->unlock_range(0, LLONG_MAX);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// finish_destination() -
+//
+// Description:
+//
+//     We have copied up to END, where a read found the end of the
+// source file.  Lock everything from there up, and either find that
+// the file has grown since (so we set *grew, and the caller goes on
+// copying), or make the destination the same length as the source.
+// It may be longer, if it was cloned from a longer base.  In the
+// latter case we are done with the file, so from now on every captured
+// write to it is mirrored.
+//
+int copier::finish_destination(const source_info &src_info, uint64_t end, bool *grew) throw() {
+    int r = 0;
+    source_file * file = src_info.m_file;
+    destination_file * dest = file->get_destination();
+    file->lock_range(end, LLONG_MAX);
+    struct stat src_stat;
+    off_t dest_size;
+    if (fstat(src_info.m_fd, &src_stat) != 0 || dest->get_size(&dest_size) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not fstat %s or %s at %s:%d", src_info.m_path, dest->get_path(), __FILE__, __LINE__);
+    } else if ((uint64_t)src_stat.st_size > end) {
+        *grew = true;
+    } else if (dest_size != src_stat.st_size) {
+        r = dest->truncate(src_stat.st_size); // It reports any error.
+    }
+    if (r == 0 && !*grew) {
+        file->set_copy_frontier(source_file::no_copy_frontier);
+    }
+    int ur = file->unlock_range(end, LLONG_MAX);
+    return (r != 0) ? r : ur;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_file_data_with_manifest() -
+//
+// Description:
+//
+//     Copies the file a manifest block at a time, recording each
+// block's checksum in the manifest.  To see the data we have to read it
+// ourselves, so none of the zero-copy methods apply.
+//
+//     If the file is in the incremental base, we first make the
+// destination a clone of the base's copy, and then write only the
+// blocks whose checksums differ from the base's.  If the filesystem
+// can't clone, every block is written.
+//
+//     Each block is read and written under its range lock, so a
+// captured write to the block either comes first (and we read it) or
+// comes after we set the checksum (and forgets it).
+//
+int copier::copy_file_data_with_manifest(source_info &src_info, const struct stat &src_stat, const manifest_entry *base_entry) throw() {
+    int r = 0;
+    source_file * file = src_info.m_file;
+    destination_file * dest = file->get_destination();
+    manifest_entry *entry = m_manifest->add(src_info.m_name, src_stat);
+    bool have_base = false;
+    if (base_entry != NULL) {
+        bool unchanged = false;
+        r = this->clone_from_base(src_info, entry, base_entry, &have_base, &unchanged);
+        if (r != 0 || unchanged) {
+            if (unchanged) {
+                __sync_fetch_and_add(&m_total_bytes_backed_up, src_stat.st_size);
+            }
+            return r;
+        }
+    }
+
+    // For DirectIO: we need to allocate a mem-aligned buffer.
+    const size_t align = 2<<12;
+    const size_t block_size = manifest::block_size;
+    char *buf_base = new char[block_size + align];
+    char *buf = (char *)(((size_t)buf_base + align) & ~(align-1));
+    size_t poll_string_size = 2000;
+    char *poll_string = new char [poll_string_size];
+
+    uint64_t block = 0;
+    while (the_manager.copy_is_enabled()) {
+        const uint64_t offset = block * block_size;
+        r = this->poll_copy_progress(src_info, offset, poll_string, poll_string_size);
+        if (r != 0) {
+            break;
+        }
+
+        PAUSE(HotBackup::COPIER_BEFORE_READ);
+        file->lock_range(offset, offset + block_size);
+        size_t n_read = 0;
+        bool gone = false;
+        {
+            with_source_file_fd_lock fdl(file);
+            r = this->reopen_source_if_needed(src_info, offset, &gone);
+            while (r == 0 && !gone && n_read < block_size) {
+                ssize_t n = pread(src_info.m_fd, buf + n_read, block_size - n_read, offset + n_read);
+                if (n < 0) {
+                    r = errno;
+                    the_manager.backup_error(r, "Could not read from %s at %s:%d", src_info.m_path, __FILE__, __LINE__);
+                } else if (n == 0) {
+                    break;
+                } else {
+                    n_read += n;
+                }
+            }
+        }
+        if (r == 0 && n_read > 0) {
+            const uint64_t checksum = manifest::checksum(buf, n_read);
+            if (!have_base || m_base_manifest->get_checksum(base_entry, block) != checksum) {
+                PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+                r = dest->pwrite(buf, n_read, offset); // It reports any error.
+            }
+            if (r == 0) {
+                m_manifest->set_checksum(entry, block, checksum);
+            }
+        }
+        int ur = file->unlock_range(offset, offset + block_size);
+        if (r == 0) {
+            r = ur;
+        }
+        if (r != 0 || gone) {
+            break;
+        }
+        __sync_fetch_and_add(&m_total_bytes_backed_up, n_read);
+
+        if (n_read == block_size) {
+            block++;
+        } else {
+            bool grew = false;
+            r = this->finish_destination(src_info, offset + n_read, &grew);
+            if (r != 0 || !grew) {
+                break;
+            }
+            // Read the last block again, now that there is more of it.
+        }
+
+        PAUSE(HotBackup::COPIER_AFTER_WRITE);
+        r = this->possibly_sleep_or_abort(src_info, n_read, offset + n_read, dest);
+        if (r != 0) {
+            break;
+        }
+    }
+
+    delete[] buf_base;
+    delete[] poll_string;
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// get_engine() -
+//
+// Description:
+//
+//     Returns the given worker's io_uring engine, setting it up the
+// first time, or NULL if the io queue depth is zero or io_uring can't
+// be used.  A failed setup is remembered (as an engine with a zero
+// queue depth), so we don't retry it for every file.  The engine writes
+// the destination's fd directly, so a compressed, chunked or streamed
+// backup can't use it.
+//
+uring_engine *copier::get_engine(int worker) throw() {
+    const unsigned int depth = the_manager.get_io_queue_depth();
+    if (depth == 0 || !the_manager.destinations_are_plain()) {
+        return NULL;
+    }
+    if (m_engines[worker] == NULL) {
+        m_engines[worker] = new uring_engine;
+        int r = m_engines[worker]->init(depth, copy_buffer_size);
+        if (r != 0) {
+            WARN("Could not set up io_uring, so copying synchronously.", "");
+        }
+    }
+    return (m_engines[worker]->queue_depth() > 0) ? m_engines[worker] : NULL;
+}
+
+// The state of one of an engine's slots, while copying a file.
+struct uring_slot {
+    enum { SLOT_FREE, SLOT_READING, SLOT_WRITING } m_state;
+    uint64_t m_offset; // Where the chunk starts (in both files).
+    size_t m_length;   // The size of the range lock we hold, and of the read.
+    size_t m_n_read;
+    size_t m_n_written;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_file_data_with_engine() -
+//
+// Description:
+//
+//     Copies the source file the same way the loop in copy_file_data()
+// does, but keeps up to the engine's queue depth of chunks in flight.
+// Each chunk is read into its own registered buffer and then written
+// to the same offset in the destination.  We hold a chunk's range lock
+// from just before its read is queued until its write completes, so a
+// captured write to that range waits for the copy of it, exactly as it
+// does when we copy synchronously; writes to the rest of the file are
+// not held up.
+//
+//     Sets *done unless the source's O_DIRECT flag changed, in which
+// case total_written_this_file is where the caller should carry on
+// synchronously (it reopens the source).  We never return with I/O in
+// flight.
+//
+int copier::copy_file_data_with_engine(uring_engine *engine,
+                                       source_info &src_info,
+                                       uint64_t &total_written_this_file,
+                                       size_t buf_size,
+                                       size_t align,
+                                       char *poll_string,
+                                       size_t poll_string_size,
+                                       bool *done) throw()
 {
-    copy_result result;
-    with_source_file_fd_lock fdl(src_info.m_file);
-    // We may have to re-open the source file because the Direct I/O
-    // flags may have changed since we last copied a range.
+    int r = 0;
+    source_file * file = src_info.m_file;
+    destination_file * dest = file->get_destination();
+    const unsigned int depth = engine->queue_depth();
+    uring_slot *slots = new uring_slot[depth];
+    for (unsigned int i = 0; i < depth; ++i) {
+        slots[i].m_state = uring_slot::SLOT_FREE;
+    }
+    unsigned int n_in_flight = 0;
+    uint64_t next_offset = total_written_this_file; // Where the next chunk starts.
+    bool reading = true;     // False once we know we don't want any more chunks.
+    bool at_end = false;     // True if only a hole (if anything) is left after next_offset.
+    *done = true;
+
+    while (reading || n_in_flight > 0) {
+        // Keep the queue full.
+        while (reading && n_in_flight < depth) {
+            if (!the_manager.copy_is_enabled()) {
+                reading = false;
+                break;
+            }
+            if (file->locked_direct_io_flag_is_set() != ((src_info.m_flags & O_DIRECT) != 0)) {
+                *done = false;
+                reading = false;
+                break;
+            }
+            if (the_manager.charge_throttle(0, m_calls->get_throttle()) > 0) {
+                // Let what is in flight finish (or sleep, below, if nothing is).
+                break;
+            }
+
+            PAUSE(HotBackup::COPIER_BEFORE_READ);
+            size_t chunk_size = buf_size;
+            this->skip_hole(src_info, next_offset, buf_size, align, &chunk_size, &at_end);
+            if (at_end) {
+                reading = false;
+                break;
+            }
+            r = this->poll_copy_progress(src_info, next_offset, poll_string, poll_string_size);
+            if (r != 0) {
+                reading = false;
+                break;
+            }
+
+            unsigned int slot = 0;
+            while (slots[slot].m_state != uring_slot::SLOT_FREE) {
+                slot++;
+            }
+            file->lock_range(next_offset, next_offset + chunk_size);
+            slots[slot].m_state = uring_slot::SLOT_READING;
+            slots[slot].m_offset = next_offset;
+            slots[slot].m_length = chunk_size;
+            slots[slot].m_n_read = 0;
+            slots[slot].m_n_written = 0;
+            the_manager.charge_throttle(chunk_size, m_calls->get_throttle()); // We'll wait for it before the next chunk.
+            engine->prepare_read(slot, src_info.m_fd, chunk_size, next_offset);
+            next_offset += chunk_size;
+            n_in_flight++;
+        }
+
+        if (n_in_flight == 0) {
+            if (!reading) {
+                break;
+            }
+            // The throttle's bucket is in debt and nothing is in flight: sleep it off.
+            r = possibly_sleep_or_abort(src_info, 0, next_offset, dest);
+            if (r != 0) {
+                reading = false;
+            }
+            continue;
+        }
+
+        unsigned int slot = 0;
+        int result = 0;
+        int wr = engine->wait(&slot, &result);
+        if (wr != 0) {
+            // The ring itself is broken, so nothing in flight will complete.
+            snprintf(poll_string, poll_string_size, "io_uring failed while copying %s, errno=%d (%s) at %s:%d", src_info.m_path, wr, strerror(wr), __FILE__, __LINE__);
+            m_calls->report_error(wr, poll_string);
+            for (unsigned int i = 0; i < depth; ++i) {
+                if (slots[i].m_state != uring_slot::SLOT_FREE) {
+                    ignore(file->unlock_range(slots[i].m_offset, slots[i].m_offset + slots[i].m_length));
+                }
+            }
+            r = wr;
+            goto out;
+        }
+        uring_slot *s = &slots[slot];
+
+        if (s->m_state == uring_slot::SLOT_READING) {
+            if (result < 0) {
+                if (r == 0) {
+                    r = -result;
+                    snprintf(poll_string, poll_string_size, "Could not read from %s, errno=%d (%s) fd=%d at %s:%d", src_info.m_path, r, strerror(r), src_info.m_fd, __FILE__, __LINE__);
+                    m_calls->report_error(r, poll_string);
+                }
+                reading = false;
+                result = 0;
+            } else if ((size_t)result < s->m_length) {
+                // We found the end of the file.  Anything written past it
+                // from now on is captured, since the destination exists.
+                reading = false;
+            }
+            s->m_n_read = result;
+            if (s->m_n_read > 0 && r == 0) {
+                PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+                s->m_state = uring_slot::SLOT_WRITING;
+                engine->prepare_write(slot, dest->get_fd(), 0, s->m_n_read, s->m_offset);
+                continue;
+            }
+        } else {
+            if (result < 0) {
+                if (r == 0) {
+                    r = -result;
+                    snprintf(poll_string, poll_string_size, "error write to %s, errno=%d (%s) at %s:%d", dest->get_path(), r, strerror(r), __FILE__, __LINE__);
+                    m_calls->report_error(r, poll_string);
+                }
+                reading = false;
+            } else {
+                s->m_n_written += result;
+                __sync_fetch_and_add(&m_total_bytes_backed_up, result);
+                if (result > 0 && s->m_n_written < s->m_n_read) {
+                    engine->prepare_write(slot, dest->get_fd(), s->m_n_written, s->m_n_read - s->m_n_written, s->m_offset + s->m_n_written);
+                    continue;
+                }
+            }
+        }
+
+        // The chunk is finished (or failed).
+        s->m_state = uring_slot::SLOT_FREE;
+        n_in_flight--;
+        int ur = file->unlock_range(s->m_offset, s->m_offset + s->m_length);
+        if (ur != 0 && r == 0) {
+            r = ur;
+            reading = false;
+        }
+        PAUSE(HotBackup::COPIER_AFTER_WRITE);
+    }
+
+    if (r == 0 && !*done) {
+        // Every chunk before next_offset has been copied.
+        total_written_this_file = next_offset;
+    } else if (r == 0 && at_end) {
+        r = this->extend_destination(src_info, next_offset);
+    }
+
+out:
+    delete[] slots;
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// skip_hole() -
+//
+// Description:
+//
+//     Moves total_written_this_file past any hole that starts there,
+// and shortens the next chunk so that it stops where the data does (we
+// round up to the O_DIRECT alignment, so a little of the next hole may
+// be copied as zeros).  Sets *at_end if there is no more data in the
+// file.  Returns the number of bytes skipped.
+//
+// Notes:
+//
+//     If the file has a copy frontier, the caller holds the range lock
+// from total_written_this_file up while we skip, and moves the
+// frontier before releasing it, so a write into a hole after we have
+// looked is mirrored.  Otherwise every write is mirrored anyway, and
+// no lock is needed.
+//
+uint64_t copier::skip_hole(source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, size_t align, size_t *chunk_size, bool *at_end) throw() {
+    *chunk_size = buf_size;
+    *at_end = false;
+    if (!src_info.m_skip_holes) {
+        return 0;
+    }
+
+    // These lseeks move the fd's offset, so the read path must reposition it.
+    src_info.m_source_offset_is_set = false;
+    off_t data = call_real_lseek(src_info.m_fd, total_written_this_file, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO) {
+            *at_end = true;
+        } else {
+            // The filesystem can't find holes for us, so copy everything.
+            src_info.m_skip_holes = false;
+        }
+        return 0;
+    }
+    off_t hole = call_real_lseek(src_info.m_fd, data, SEEK_HOLE);
+    if (hole < 0) {
+        // The file was truncated under us, or something stranger.  Copy
+        // a whole chunk, and the copy will find out which.
+        hole = data + buf_size;
+    }
+
+    const uint64_t n_skipped = data - total_written_this_file;
+    total_written_this_file = data;
+    // The skipped bytes are in the total we are making progress toward.
+    __sync_fetch_and_add(&m_total_bytes_backed_up, n_skipped);
+
+    const uint64_t n_data = hole - data;
+    if (n_data < buf_size) {
+        *chunk_size = (n_data + align - 1) & ~(align - 1);
+        if (*chunk_size > buf_size) {
+            *chunk_size = buf_size;
+        }
+    }
+    return n_skipped;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// extend_destination() -
+//
+// Description:
+//
+//     When the source file ends with a hole we never write the hole, so
+// make the destination as long as the source.  We lock everything from
+// total_written_this_file up, so that a captured write or truncate
+// can't change the sizes while we look at them: we must never shrink
+// the destination.
+//
+int copier::extend_destination(const source_info &src_info, uint64_t total_written_this_file) throw() {
+    int r = 0;
+    source_file * file = src_info.m_file;
+    destination_file * dest = file->get_destination();
+    file->lock_range(total_written_this_file, LLONG_MAX);
+    struct stat src_stat;
+    off_t dest_size;
+    if (fstat(src_info.m_fd, &src_stat) != 0 || dest->get_size(&dest_size) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not fstat %s or %s at %s:%d", src_info.m_path, dest->get_path(), __FILE__, __LINE__);
+    } else if (dest_size < src_stat.st_size) {
+        r = dest->truncate(src_stat.st_size); // It reports any error.
+    }
+    int ur = file->unlock_range(total_written_this_file, LLONG_MAX);
+    return (r != 0) ? r : ur;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// reopen_source_if_needed() -
+//
+// Description:
+//
+//     We may have to re-open the source file because the Direct I/O
+// flags may have changed since we last copied a range.  Sets *gone if
+// the file has been unlinked.  The caller holds the source file's fd
+// lock.
+//
+int copier::reopen_source_if_needed(source_info &src_info, uint64_t offset, bool *gone) throw() {
+    int result = 0;
     if (src_info.m_file->given_flags_are_different(src_info.m_flags)) {
         // Close the old fd.
         int r = call_real_close(src_info.m_fd);
         if (r != 0) {
             int close_errno = errno;
             the_manager.backup_error(close_errno, "Could not close %s at %s:%d", src_info.m_path, __FILE__, __LINE__);
-            result.m_result = close_errno;
+            result = close_errno;
         }
 
         // Open the new fd.
@@ -576,31 +1421,52 @@ copy_result copier::open_and_lock_file_then_copy_range(source_info src_info,
         }
 
         src_info.m_fd = call_real_open(src_info.m_path, flags);
+        src_info.m_flags = flags;
         if (src_info.m_fd < 0) {
             int open_errno = errno;
             if (open_errno == ENOENT) {
+                *gone = true;
                 return result;
             } else {
                 the_manager.backup_error(open_errno, "Could not open source file: %s", src_info.m_path);
-                result.m_result = open_errno;
-                return result;
+                return open_errno;
             }
         }
 
         // We have to do a seek because we close and re-open the file
         // between each range copy.  For host files opened with the
-        // O_DIRECT flag, m_total_written_this_file should line up
-        // with the correct offsets and should not return an error.
-        off_t offset = call_real_lseek(src_info.m_fd, m_total_written_this_file, SEEK_SET);
-        if (offset < 0) {
+        // O_DIRECT flag, the offset should line up with the correct
+        // offsets and should not return an error.
+        off_t new_offset = call_real_lseek(src_info.m_fd, offset, SEEK_SET);
+        if (new_offset < 0) {
             int lseek_errno = errno;
             the_manager.backup_error(lseek_errno, "Could not lseek file: %s", src_info.m_path);
-            result.m_result = lseek_errno;
-            return result;
+            return lseek_errno;
         }
+        src_info.m_source_offset_is_set = true;
+    }
+    return 0; // A close error has been reported, but we carry on with the new fd.
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_result copier::open_and_lock_file_then_copy_range(source_info &src_info, 
+                                                       uint64_t &total_written_this_file,
+                                                       char *buf, 
+                                                       size_t buf_size, 
+                                                       char *poll_string, 
+                                                       size_t poll_string_size) throw()
+{
+    copy_result result;
+    with_source_file_fd_lock fdl(src_info.m_file);
+    bool gone = false;
+    result.m_result = this->reopen_source_if_needed(src_info, total_written_this_file, &gone);
+    if (result.m_result != 0 || gone) {
+        return result;
     }
 
     result = copy_file_range(src_info,
+                             total_written_this_file,
                              buf, 
                              buf_size, 
                              poll_string, 
@@ -612,16 +1478,302 @@ copy_result copier::open_and_lock_file_then_copy_range(source_info src_info,
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-copy_result copier::copy_file_range(source_info src_info,
+// copy_file_range() -
+//
+// Description:
+//
+//     Copies up to buf_size bytes of the source file, starting at
+// total_written_this_file, into the destination file.  The caller holds
+// the range lock for that region.  We use the cheapest method that
+// works for this file: cloning (only if reflinks were asked for), then
+// copy_file_range(2), then splice(2) through a pipe, then
+// read(2)/write(2) through buf.  If a method turns out not to
+// be supported (on these particular files) we step down to the next
+// one, remembering the choice in src_info for the rest of the file.
+// Returns m_n_wrote_now==0 when the end of the file is reached.
+//
+copy_result copier::copy_file_range(source_info &src_info,
+                                    uint64_t &total_written_this_file,
                                     char * buf, 
                                     size_t buf_size, 
                                     char *poll_string, 
                                     size_t poll_string_size) throw()
+{
+    copy_result result;
+    if (src_info.m_copy_method == COPY_WITH_CLONE) {
+        result = copy_range_with_clone(src_info, total_written_this_file, buf_size, poll_string, poll_string_size);
+        if (src_info.m_copy_method == COPY_WITH_CLONE || result.m_n_wrote_now > 0) {
+            return result;
+        }
+    }
+    if (src_info.m_copy_method == COPY_WITH_COPY_FILE_RANGE) {
+        result = copy_range_with_copy_file_range(src_info, total_written_this_file, buf_size, poll_string, poll_string_size);
+        if (src_info.m_copy_method == COPY_WITH_COPY_FILE_RANGE || result.m_n_wrote_now > 0) {
+            return result;
+        }
+    }
+    if (src_info.m_copy_method == COPY_WITH_SPLICE) {
+        result = copy_range_with_splice(src_info, total_written_this_file, buf_size, poll_string, poll_string_size);
+        if (src_info.m_copy_method == COPY_WITH_SPLICE || result.m_n_wrote_now > 0) {
+            return result;
+        }
+    }
+    return copy_range_with_read_write(src_info, total_written_this_file, buf, buf_size, poll_string, poll_string_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// zero_copy_is_unsupported() -
+//
+// Description:
+//
+//     Returns true if the errno from copy_file_range(2) or splice(2)
+// means that the call can't be used on these files (as opposed to a
+// real I/O error), so that we should fall back to another method.
+//
+static bool zero_copy_is_unsupported(int error) throw() {
+    return (error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int copier::poll_copy_progress(const source_info &src_info, uint64_t total_written_this_file, char *poll_string, size_t poll_string_size) throw() {
+    destination_file * dest = src_info.m_file->get_destination();
+    snprintf(poll_string, 
+             poll_string_size, 
+             "Backup progress %ld bytes, %ld files.  Copying file: %ld/%ld bytes done of %s to %s.",
+             m_total_bytes_backed_up, 
+             m_total_files_backed_up, 
+             total_written_this_file, 
+             src_info.m_size,
+             src_info.m_path,
+             dest->get_path());
+    int r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), poll_string);
+    if (r!=0) {
+        m_calls->report_error(r, "User aborted backup");
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// copy_range_with_clone() -
+//
+// Description:
+//
+//     Makes the destination share the source's blocks for this chunk
+// with FICLONERANGE.  The filesystem requires the range to be block
+// aligned, except that it may end at the end of the source file, so we
+// clone whole chunks and then a last piece that runs exactly to the
+// current end of the file.  If the files are on different filesystems,
+// or the filesystem can't clone, or the file grew under us so the last
+// piece is no longer at the end, we step down to the next method.
+//
+copy_result copier::copy_range_with_clone(source_info &src_info,
+                                          uint64_t &total_written_this_file,
+                                          size_t buf_size,
+                                          char *poll_string,
+                                          size_t poll_string_size) throw()
+{
+    copy_result result;
+    destination_file * dest = src_info.m_file->get_destination();
+    struct stat src_stat, dest_stat;
+    if (fstat(src_info.m_fd, &src_stat) != 0 || fstat(dest->get_fd(), &dest_stat) != 0) {
+        int stat_errno = errno;
+        snprintf(poll_string, poll_string_size, "Could not fstat %s or %s, errno=%d (%s) at %s:%d", src_info.m_path, dest->get_path(), stat_errno, strerror(stat_errno), __FILE__, __LINE__);
+        m_calls->report_error(stat_errno, poll_string);
+        result.m_result = stat_errno;
+        return result;
+    }
+    if (src_stat.st_dev != dest_stat.st_dev) {
+        TRACE("Source and destination are on different filesystems, not cloning ", src_info.m_path);
+        src_info.m_copy_method = method_after_clone();
+        return result;
+    }
+    if ((uint64_t)src_stat.st_size <= total_written_this_file) {
+        // The end of the file.
+        return result;
+    }
+
+    result.m_result = this->poll_copy_progress(src_info, total_written_this_file, poll_string, poll_string_size);
+    if (result.m_result != 0) {
+        return result;
+    }
+
+    uint64_t length = src_stat.st_size - total_written_this_file;
+    if (length > buf_size) {
+        length = buf_size;
+    }
+    struct file_clone_range range;
+    range.src_fd = src_info.m_fd;
+    range.src_offset = total_written_this_file;
+    range.src_length = length;
+    range.dest_offset = total_written_this_file;
+    PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+    if (ioctl(dest->get_fd(), FICLONERANGE, &range) != 0) {
+        int clone_errno = errno;
+        if (zero_copy_is_unsupported(clone_errno) || clone_errno == ENOTTY) {
+            TRACE("Cannot clone, copying instead ", src_info.m_path);
+            src_info.m_copy_method = method_after_clone();
+            return result;
+        }
+        snprintf(poll_string, poll_string_size, "Could not clone %s to %s, errno=%d (%s) at %s:%d", src_info.m_path, dest->get_path(), clone_errno, strerror(clone_errno), __FILE__, __LINE__);
+        m_calls->report_error(clone_errno, poll_string);
+        result.m_result = clone_errno;
+        return result;
+    }
+
+    result.m_n_wrote_now     = length;
+    total_written_this_file += length;
+    __sync_fetch_and_add(&m_total_bytes_backed_up, length);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_result copier::copy_range_with_copy_file_range(source_info &src_info,
+                                                    uint64_t &total_written_this_file,
+                                                    size_t buf_size,
+                                                    char *poll_string,
+                                                    size_t poll_string_size) throw()
+{
+    copy_result result;
+    destination_file * dest = src_info.m_file->get_destination();
+    result.m_result = this->poll_copy_progress(src_info, total_written_this_file, poll_string, poll_string_size);
+    if (result.m_result != 0) {
+        return result;
+    }
+
+    // The read and the write are one call here, so this is where a
+    // test can pause us while we hold the range lock.
+    PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+    while ((size_t)result.m_n_wrote_now < buf_size) {
+        // Pass the offsets explicitly, so neither fd's file offset moves.
+        loff_t in_offset = total_written_this_file;
+        loff_t out_offset = total_written_this_file;
+        ssize_t n_copied = call_real_copy_file_range(src_info.m_fd, &in_offset,
+                                                     dest->get_fd(), &out_offset,
+                                                     buf_size - result.m_n_wrote_now, 0);
+        if (n_copied == 0) {
+            // The end of the file.
+            break;
+        } else if (n_copied < 0) {
+            int copy_errno = errno;
+            if (zero_copy_is_unsupported(copy_errno)) {
+                TRACE("copy_file_range() is not supported, trying splice() for ", src_info.m_path);
+                src_info.m_copy_method = COPY_WITH_SPLICE;
+                return result;
+            }
+            snprintf(poll_string, poll_string_size, "Could not copy_file_range from %s to %s, errno=%d (%s) at %s:%d", src_info.m_path, dest->get_path(), copy_errno, strerror(copy_errno), __FILE__, __LINE__);
+            m_calls->report_error(copy_errno, poll_string);
+            result.m_result = copy_errno;
+            return result;
+        }
+
+        result.m_n_wrote_now    += n_copied;
+        total_written_this_file += n_copied;
+        __sync_fetch_and_add(&m_total_bytes_backed_up, n_copied);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_result copier::copy_range_with_splice(source_info &src_info,
+                                           uint64_t &total_written_this_file,
+                                           size_t buf_size,
+                                           char *poll_string,
+                                           size_t poll_string_size) throw()
+{
+    copy_result result;
+    destination_file * dest = src_info.m_file->get_destination();
+    if (src_info.m_pipe[0] < 0) {
+        if (pipe(src_info.m_pipe) != 0) {
+            TRACE("Could not make a pipe for splice(), using read() and write() for ", src_info.m_path);
+            src_info.m_copy_method = COPY_WITH_READ_WRITE;
+            return result;
+        }
+        // A bigger pipe means fewer trips through it.  If we can't get one, the default will do.
+        ignore(fcntl(src_info.m_pipe[1], F_SETPIPE_SZ, (int)buf_size));
+    }
+
+    result.m_result = this->poll_copy_progress(src_info, total_written_this_file, poll_string, poll_string_size);
+    if (result.m_result != 0) {
+        return result;
+    }
+
+    while ((size_t)result.m_n_wrote_now < buf_size) {
+        loff_t in_offset = total_written_this_file;
+        ssize_t n_in = call_real_splice(src_info.m_fd, &in_offset, src_info.m_pipe[1], NULL,
+                                        buf_size - result.m_n_wrote_now, SPLICE_F_MOVE);
+        if (n_in == 0) {
+            // The end of the file.
+            break;
+        } else if (n_in < 0) {
+            int splice_errno = errno;
+            if (zero_copy_is_unsupported(splice_errno)) {
+                TRACE("splice() is not supported, using read() and write() for ", src_info.m_path);
+                src_info.m_copy_method = COPY_WITH_READ_WRITE;
+                return result;
+            }
+            snprintf(poll_string, poll_string_size, "Could not splice from %s, errno=%d (%s) at %s:%d", src_info.m_path, splice_errno, strerror(splice_errno), __FILE__, __LINE__);
+            m_calls->report_error(splice_errno, poll_string);
+            result.m_result = splice_errno;
+            return result;
+        }
+
+        PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+        // Now empty the pipe into the destination.  The data is
+        // already out of the source, so there's no falling back now.
+        ssize_t n_out_total = 0;
+        while (n_out_total < n_in) {
+            loff_t out_offset = total_written_this_file + n_out_total;
+            ssize_t n_out = call_real_splice(src_info.m_pipe[0], NULL, dest->get_fd(), &out_offset,
+                                             n_in - n_out_total, SPLICE_F_MOVE);
+            if (n_out <= 0) {
+                int splice_errno = (n_out < 0) ? errno : EIO;
+                snprintf(poll_string, poll_string_size, "Could not splice to %s, errno=%d (%s) at %s:%d", dest->get_path(), splice_errno, strerror(splice_errno), __FILE__, __LINE__);
+                m_calls->report_error(splice_errno, poll_string);
+                result.m_result = splice_errno;
+                return result;
+            }
+            n_out_total += n_out;
+        }
+
+        result.m_n_wrote_now    += n_in;
+        total_written_this_file += n_in;
+        __sync_fetch_and_add(&m_total_bytes_backed_up, n_in);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+copy_result copier::copy_range_with_read_write(source_info &src_info,
+                                               uint64_t &total_written_this_file,
+                                               char * buf, 
+                                               size_t buf_size, 
+                                               char *poll_string, 
+                                               size_t poll_string_size) throw()
 {
     copy_result result;
     result.m_result = 0;
     result.m_n_wrote_now = 0;
     destination_file * dest = src_info.m_file->get_destination();
+    if (!src_info.m_source_offset_is_set) {
+        // The other methods pass offsets explicitly, so the source fd
+        // may not be where we left off.
+        if (call_real_lseek(src_info.m_fd, total_written_this_file, SEEK_SET) < 0) {
+            int lseek_errno = errno;
+            snprintf(poll_string, poll_string_size, "Could not lseek %s, errno=%d (%s) at %s:%d", src_info.m_path, lseek_errno, strerror(lseek_errno), __FILE__, __LINE__);
+            m_calls->report_error(lseek_errno, poll_string);
+            result.m_result = lseek_errno;
+            return result;
+        }
+        src_info.m_source_offset_is_set = true;
+    }
         ssize_t n_read = call_real_read(src_info.m_fd, buf, buf_size);
         if (n_read == 0) {
             // SUCCESS! We are done copying the file.
@@ -637,20 +1789,32 @@ copy_result copier::copy_file_range(source_info src_info,
         }
 
         PAUSE(HotBackup::COPIER_AFTER_READ_BEFORE_WRITE);
+        if (!dest->has_plain_fd()) {
+            int r = dest->pwrite(buf, n_read, total_written_this_file); // It reports any error.
+            if (r != 0) {
+                result.m_result = r;
+                return result;
+            }
+            result.m_n_wrote_now = n_read;
+            total_written_this_file += n_read;
+            __sync_fetch_and_add(&m_total_bytes_backed_up, n_read);
+            return result;
+        }
+        // Another worker may have copied this file through the same
+        // destination fd (e.g., after a rename put the new name in the
+        // todo list), so position the fd ourselves.  We hold the source
+        // file's fd lock, so nobody else moves it while we write.
+        if (call_real_lseek(dest->get_fd(), total_written_this_file, SEEK_SET) < 0) {
+            int lseek_errno = errno;
+            snprintf(poll_string, poll_string_size, "Could not lseek %s, errno=%d (%s) at %s:%d", dest->get_path(), lseek_errno, strerror(lseek_errno), __FILE__, __LINE__);
+            m_calls->report_error(lseek_errno, poll_string);
+            result.m_result = lseek_errno;
+            return result;
+        }
         ssize_t n_wrote_this_buf = 0;
         while (n_wrote_this_buf < n_read) {
-            snprintf(poll_string, 
-                     poll_string_size, 
-                     "Backup progress %ld bytes, %ld files.  Copying file: %ld/%ld bytes done of %s to %s.",
-                     m_total_bytes_backed_up, 
-                     m_total_files_backed_up, 
-                     m_total_written_this_file, 
-                     src_info.m_size,
-                     src_info.m_path,
-                     dest->get_path());
-            int r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), poll_string);
+            int r = this->poll_copy_progress(src_info, total_written_this_file, poll_string, poll_string_size);
             if (r!=0) {
-                m_calls->report_error(r, "User aborted backup");
                 result.m_result = r;
                 return result;
             }
@@ -667,56 +1831,64 @@ copy_result copier::copy_file_range(source_info src_info,
             }
 
             n_wrote_this_buf          += result.m_n_wrote_now;
-            m_total_written_this_file += result.m_n_wrote_now;
-            m_total_bytes_backed_up   += result.m_n_wrote_now;
+            total_written_this_file   += result.m_n_wrote_now;
+            __sync_fetch_and_add(&m_total_bytes_backed_up, result.m_n_wrote_now);
         }
 
     return result;
 }
 
 
-int copier::possibly_sleep_or_abort(source_info src_info, ssize_t total_written_this_file, destination_file * dest, struct timespec starttime) throw()
+////////////////////////////////////////////////////////////////////////////////
+//
+// possibly_sleep_or_abort() -
+//
+// Description:
+//
+//     Charges the n_bytes we just copied to the process-wide throttle,
+// and sleeps until the throttle's bucket is out of debt.  We sleep in
+// short naps (so that a change to the throttle takes effect right
+// away, and a throttle of zero pauses the copy until it is raised),
+// and keep polling once per second while we wait.
+//
+int copier::possibly_sleep_or_abort(const source_info &src_info, uint64_t n_bytes, uint64_t total_written_this_file, destination_file * dest) throw()
 {
     int r = 0;
-        while (1) {
-            if (!the_manager.copy_is_enabled()) goto out;
-
-            // Sleep until we've used up enough time.  Be sure to keep polling once per second.
-            struct timespec endtime;
-            r = gettime_reporting_error(&endtime, m_calls);
-            if (r!=0) goto out;
-            double actual_time = tdiff(endtime, starttime);
-            unsigned long throttle = m_calls->get_throttle();
-            double budgeted_time = total_written_this_file / (double)throttle;
-            if (budgeted_time <= actual_time) break;
-            double sleep_time = budgeted_time - actual_time;  // if we were supposed to copy 10MB at 2MB/s, then our budget was 5s.  If we took 1s, then sleep 4s.
-            {
-                char string[1000];
-                snprintf(string, 
-                         sizeof(string),
-                         "Backup progress %ld bytes, %ld files.  Throttled: copied %ld/%ld bytes of %s to %s. Sleeping %.2fs for throttling.",
-                         m_total_bytes_backed_up,
-                         m_total_files_backed_up,
-                         total_written_this_file, 
-                         src_info.m_size, 
-                         src_info.m_path, 
-                         dest->get_path(), 
-                         sleep_time);
-                r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), string);
-            }
+    double sleep_time = the_manager.charge_throttle(n_bytes, m_calls->get_throttle());
+    bool have_polled = false;
+    struct timespec last_poll;
+    while (sleep_time > 0) {
+        if (!the_manager.copy_is_enabled()) goto out;
+
+        struct timespec now;
+        r = gettime_reporting_error(&now, m_calls);
+        if (r!=0) goto out;
+        if (!have_polled || tdiff(now, last_poll) >= 1) {
+            char string[1000];
+            snprintf(string, 
+                     sizeof(string),
+                     "Backup progress %ld bytes, %ld files.  Throttled: copied %ld/%ld bytes of %s to %s. Sleeping %.2fs for throttling.",
+                     m_total_bytes_backed_up,
+                     m_total_files_backed_up,
+                     total_written_this_file, 
+                     src_info.m_size, 
+                     src_info.m_path, 
+                     dest->get_path(), 
+                     sleep_time);
+            r = m_calls->poll((double)(m_total_bytes_backed_up+1)/(double)(m_total_bytes_to_back_up+1), string);
             if (r!=0) {
                 m_calls->report_error(r, "User aborted backup");
                 goto out;
             }
-            if (sleep_time>1) {
-                usleep(1000000);
-            } else {
-                usleep((long)(sleep_time*1e6));
-            }
-
-            if (!the_manager.copy_is_enabled()) goto out;
-
+            have_polled = true;
+            last_poll = now;
         }
+        if (sleep_time > max_throttle_nap) {
+            sleep_time = max_throttle_nap;
+        }
+        usleep((long)(sleep_time*1e6));
+        sleep_time = the_manager.charge_throttle(0, m_calls->get_throttle());
+    }
 out:
     return r;
 }
@@ -728,34 +1900,75 @@ out:
 // Description: 
 //
 //     Loop through each entry, adding directories and regular
-// files to our copy 'todo' list.
+// files to our copy 'todo' list.  This is the only walk of the source
+// tree: we read the directory in big batches with getdents64(2) and
+// stat each entry relative to the directory's fd, recording its mode
+// and size in the todo item (so the copier doesn't stat it again) and
+// adding the size of each regular file to the progress total.  Since
+// each worker scans the directories it pops, the workers scan
+// different parts of the tree in parallel, and they copy files while
+// the rest of the tree is still being scanned.
 //
-int copier::add_dir_entries_to_todo(DIR *dir, const char *file) throw() {
+int copier::add_dir_entries_to_todo(int dirfd, const char *source, const char *file, int worker) throw() {
     TRACE("--Adding all entries in this directory to todo list: ", file);
     int error = 0;
-    with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-    struct dirent const *e = NULL;
-    while((e = readdir(dir)) != NULL) {
-        if (!the_manager.copy_is_enabled()) break;
-        if(is_dot(e)) {
-            TRACE("skipping: ", e->d_name);
-        } else {
-            TRACE("-> prepending :", e->d_name);
+    const size_t buf_size = 64 * 1024;
+    with_object_to_free<char*> buf((char*)malloc(buf_size));
+    if (buf.value == NULL) {
+        error = ENOMEM;
+        the_manager.backup_error(error, "Could not read directory %s", source);
+        goto out;
+    }
+    while (the_manager.copy_is_enabled()) {
+        long n_read = syscall(SYS_getdents64, dirfd, buf.value, buf_size);
+        if (n_read == 0) {
+            break;
+        } else if (n_read < 0) {
+            error = errno;
+            the_manager.backup_error(error, "Could not read directory %s", source);
+            goto out;
+        }
+        for (long pos = 0; pos < n_read; ) {
+            const linux_dirent64 *e = (const linux_dirent64 *)(buf.value + pos);
+            const char *d_name = buf.value + pos + offsetof(linux_dirent64, d_name);
+            pos += e->d_reclen;
+            if (is_dot(d_name)) {
+                TRACE("skipping: ", d_name);
+                continue;
+            }
+            TRACE("-> prepending :", d_name);
             TRACE("-> with :", file);
-            
+
             // Concatenate the stripped dir name with this dir entry.
-            int length = strlen(file) + strlen(e->d_name) + 2;
+            int length = strlen(file) + strlen(d_name) + 2;
             char new_name[length + 1];
             int printed = 0;
-            printed = snprintf(new_name, length + 1, "%s/%s", file, e->d_name);
+            printed = snprintf(new_name, length + 1, "%s/%s", file, d_name);
             if(printed + 1 != length) {
                 // snprintf had an error.  We must abort the copy.
                 error = errno;
                 goto out;
             }
-            
-            // Add it to our todo list.
-            m_todo.push_back(strdup(new_name));
+
+            // Like the copier, follow symlinks.  If the stat fails (the
+            // entry went away, say), leave it for the copier to look at.
+            mode_t mode = 0;
+            off_t size = 0;
+            if (e->d_type == DT_DIR) {
+                mode = S_IFDIR;
+            } else {
+                struct stat sbuf;
+                if (fstatat(dirfd, d_name, &sbuf, 0) == 0) {
+                    mode = sbuf.st_mode;
+                    size = sbuf.st_size;
+                    if (S_ISREG(mode)) {
+                        __sync_fetch_and_add(&m_total_bytes_to_back_up, size);
+                    }
+                }
+            }
+
+            // Add it to our own deque, where we will find it first.
+            m_queue.push(worker, new_name, mode, size);
             TRACE("~~~Added this file to todo list:", new_name);
         }
     }
@@ -767,8 +1980,7 @@ out:
 ////////////////////////////////////////////////////////////////////////////////
 //
 void copier::add_file_to_todo(const char *file) throw() {
-    with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-    m_todo.push_back(strdup(file));
+    m_queue.push(0, file);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -777,22 +1989,18 @@ void copier::add_file_to_todo(const char *file) throw() {
 //
 // Description:
 //
-//     Frees any strings that are still allocated in our todo list.
+//     Frees any strings that are still in our todo queue, and the
+// workers' io_uring engines.
 //
 // Notes:
 //
 //     This should only be called if there is no future copy work.
 //
 void copier::cleanup(void) throw() {
-    with_mutex_locked tm(&m_todo_mutex, BACKTRACE(NULL));
-    for(std::vector<char *>::size_type i = 0; i < m_todo.size(); ++i) {
-        char *file = m_todo[i];
-        if (file == NULL) {
-            continue;
-        }
-
-        free((void*)file);
-        m_todo[i] = NULL;
+    m_queue.clear();
+    for (int i = 0; i < m_queue.worker_count(); ++i) {
+        delete m_engines[i];
+        m_engines[i] = NULL;
     }
 }
 
@@ -40,8 +40,10 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "backup.h"
 #include "backup_callbacks.h"
+#include "work_queue.h"
 
 #include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <vector>
 #include <dirent.h>
@@ -50,6 +52,9 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 class file_hash_table;
 class source_file;
 class destination_file;
+class uring_engine;
+class manifest;
+struct manifest_entry;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -61,12 +66,25 @@ class destination_file;
 //     and destination information through the copier class' copy
 //     paths.
 //
+enum copy_method {
+    COPY_WITH_CLONE,           // FICLONERANGE: share the source's blocks (reflink), when both files are on the same CoW filesystem.
+    COPY_WITH_COPY_FILE_RANGE, // copy_file_range(2): the kernel copies the data, which never enters user space.
+    COPY_WITH_SPLICE,          // splice(2) the data through a pipe, which also stays in the kernel.
+    COPY_WITH_READ_WRITE       // read(2) the data into our buffer and write(2) it out.
+};
+
 struct source_info {
     int m_fd;
     const char *m_path;
     off_t m_size;
     source_file * m_file;
     int m_flags;
+    copy_method m_copy_method;    // The cheapest method that has worked so far for this file.
+    int m_pipe[2];                // The pipe used by COPY_WITH_SPLICE, or -1s if we haven't made it.
+    bool m_source_offset_is_set;  // True if m_fd's file offset is where COPY_WITH_READ_WRITE should read next.
+    bool m_skip_holes;            // True unless the filesystem can't find holes with SEEK_DATA/SEEK_HOLE.
+    int m_worker;                 // The copier worker copying this file.
+    const char *m_name;           // The path relative to the source directory, which is what the manifests use.
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -89,36 +107,70 @@ struct copy_result {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
+// copier:
+//
+// Description:
+//
+//     Copies the source directories into the destination directories.
+// The copy is done by a pool of workers (the calling thread is worker
+// 0) that share a work_queue of todo_items, which serves as the
+// manifest of the backup.  Copying a directory scans it, pushing its
+// entries (with their sizes) onto the copying worker's own deque.
+// Idle workers steal from the others.
+//
 class copier {
   private:
     const char *m_source;
     const char *m_dest;
-    std::vector<char *> m_todo;
+    work_queue m_queue;
     backup_callbacks *m_calls;
     file_hash_table * const m_table;
-    size_t m_total_written_this_file;
-public:
-    static pthread_mutex_t m_todo_mutex; // make this public so that we can grab the mutex when creating a copier.
-private:
-    uint64_t m_total_bytes_backed_up;
-    uint64_t m_total_files_backed_up;
-    uint64_t m_total_bytes_to_back_up; // the number of files that we will need to back up. This is used for the polling callback.
+    volatile int m_error; // The first error seen by any worker (0 if none).
+    uring_engine **m_engines; // One per worker, made when the worker first copies with a nonzero io queue depth.
+    // The progress counters are updated with atomic adds, since every worker bumps them.
+    volatile uint64_t m_total_bytes_backed_up;
+    volatile uint64_t m_total_files_backed_up;
+    volatile uint64_t m_total_bytes_to_back_up; // the number of bytes that we will need to back up (so far as the scan has found). This is used for the polling callback.
+    manifest *m_manifest;      // The manifest we are building for this directory, or NULL if we aren't.
+    manifest *m_base_manifest; // The manifest of the incremental base of this directory, or NULL.
+    const char *m_base;        // The incremental base directory.
     int copy_regular_file(source_info src_info, const char *dest) throw()  __attribute__((warn_unused_result));
     int copy_using_source_info(source_info src_info, const char *dest) throw();
     int create_destination_and_copy(source_info src_info, const char *dest) throw();
-    int add_dir_entries_to_todo(DIR *dir, const char *file) throw() __attribute__((warn_unused_result));
-    int possibly_sleep_or_abort(source_info src_info, ssize_t total_written_this_file, destination_file * dest, struct timespec starttime) throw() __attribute__((warn_unused_result));
-    ssize_t copy_file_range(source_info src_info, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size, size_t & total_written_this_file) throw() __attribute__((warn_unused_result));
-    copy_result open_and_lock_file_then_copy_range(source_info src_info, char *buf, size_t buf_size,char *poll_string,size_t poll_string_size) throw() __attribute__((warn_unused_result));
-    copy_result copy_file_range(source_info src_info, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    int add_dir_entries_to_todo(int dirfd, const char *source, const char *file, int worker) throw() __attribute__((warn_unused_result));
+    uint64_t skip_hole(source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, size_t align, size_t *chunk_size, bool *at_end) throw();
+    int extend_destination(const source_info &src_info, uint64_t total_written_this_file) throw() __attribute__((warn_unused_result));
+    void preallocate_destination(const source_info &src_info) throw();
+    int possibly_sleep_or_abort(const source_info &src_info, uint64_t n_bytes, uint64_t total_written_this_file, destination_file * dest) throw() __attribute__((warn_unused_result));
+    copy_result open_and_lock_file_then_copy_range(source_info &src_info, uint64_t &total_written_this_file, char *buf, size_t buf_size,char *poll_string,size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    copy_result copy_file_range(source_info &src_info, uint64_t &total_written_this_file, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    copy_result copy_range_with_clone(source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    copy_result copy_range_with_copy_file_range(source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    copy_result copy_range_with_splice(source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    copy_result copy_range_with_read_write(source_info &src_info, uint64_t &total_written_this_file, char * buf, size_t buf_size, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    uring_engine *get_engine(int worker) throw();
+    int copy_file_data_with_engine(uring_engine *engine, source_info &src_info, uint64_t &total_written_this_file, size_t buf_size, size_t align, char *poll_string, size_t poll_string_size, bool *done) throw() __attribute__((warn_unused_result));
+    bool link_from_base(const source_info &src_info, const char *dest) throw();
+    int copy_file_data_with_manifest(source_info &src_info, const struct stat &src_stat, const manifest_entry *base_entry) throw() __attribute__((warn_unused_result));
+    int clone_from_base(source_info &src_info, manifest_entry *entry, const manifest_entry *base_entry, bool *have_base, bool *unchanged) throw() __attribute__((warn_unused_result));
+    int finish_destination(const source_info &src_info, uint64_t end, bool *grew) throw() __attribute__((warn_unused_result));
+    int reopen_source_if_needed(source_info &src_info, uint64_t offset, bool *gone) throw() __attribute__((warn_unused_result));
+    int poll_copy_progress(const source_info &src_info, uint64_t total_written_this_file, char *poll_string, size_t poll_string_size) throw() __attribute__((warn_unused_result));
+    int copy_todo_items(int worker) throw() __attribute__((warn_unused_result)); // The body of each worker: copy items until the queue runs dry.
+    static void *copy_worker(void *arg) throw();
+    static int64_t largest_first(const todo_item &item, void *extra) throw();
+    static int64_t smallest_first(const todo_item &item, void *extra) throw();
+    static int64_t coldest_first(const todo_item &item, void *extra) throw();
 public:
     copier(backup_callbacks *calls, file_hash_table * const table) throw();
+    ~copier(void) throw();
     void set_directories(const char *source, const char *dest) throw();
+    void set_manifests(manifest *base_manifest, const char *base, manifest *new_manifest) throw();
     void set_error(int error) throw();
     int do_copy(void) throw() __attribute__((warn_unused_result)) __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_stripped_file(const char *file) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_full_path(const char *source, const char* dest, const char *file) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
-    int copy_file_data(source_info src_info) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_stripped_file(const todo_item &item, int worker) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_full_path(const char *source, const char* dest, const char *file, int worker, mode_t mode, off_t size) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
+    int copy_file_data(source_info &src_info) throw() __attribute__((warn_unused_result)); // Returns the error code (not in errno)
     void add_file_to_todo(const char *file) throw();
     int open_both_files(const char *source, const char *dest, int *srcfd, int *destfd) throw();
     void cleanup(void) throw();
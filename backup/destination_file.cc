@@ -36,10 +36,15 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "action_stream.h"
+#include "chunked_file.h"
+#include "compressed_file.h"
 #include "destination_file.h"
 #include "glassbox.h"
 #include "manager.h"
@@ -48,7 +53,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 ///////////////////////////////////////////////////////////////////////////////
 //
 destination_file::destination_file(const int opened_fd, const char * full_path) throw()
-        : m_fd(opened_fd), m_path(strdup(full_path))
+        : m_fd(opened_fd), m_path(strdup(full_path)), m_compressed(NULL), m_chunked(NULL), m_stream(NULL), m_stream_file(NULL), m_n_queued(0), m_n_written(0)
 {};
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -57,6 +62,44 @@ destination_file::~destination_file() throw() {
     if (m_path != NULL) {
         free((void*)m_path);
     }
+    delete m_compressed;
+    delete m_chunked;
+    delete m_stream_file;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int destination_file::init(compression_pool *compress, chunk_store *store) throw() {
+    if (store != NULL) {
+        m_chunked = new chunked_file(m_fd, store);
+        int r = m_chunked->open();
+        if (r != 0) {
+            delete m_chunked;
+            m_chunked = NULL;
+        }
+        return r;
+    }
+    if (compress == NULL) {
+        return 0;
+    }
+    m_compressed = new compressed_file(m_fd, compress);
+    int r = m_compressed->open();
+    if (r != 0) {
+        delete m_compressed;
+        m_compressed = NULL;
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int destination_file::stream_to(action_stream *stream) throw() {
+    m_stream_file = new stream_file;
+    int r = stream->open(m_path, m_stream_file);
+    if (r == 0) {
+        m_stream = stream;
+    }
+    return r;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -66,10 +109,20 @@ int destination_file::close(void) const throw() {
     // the file.  Otherwise, if there are any references left, 
     // we can only decrement the refcount; other file descriptors
     // are still open in the main application.
+    if (m_stream != NULL) {
+        int r = m_stream->close(m_stream_file);
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not stream the close of backup file %s", m_path);
+        }
+        return r;
+    }
+    int flush_r = this->flush(); // It reports any error.
     int r = call_real_close(m_fd);
     if (r == -1) {
         r = errno;
         the_manager.backup_error(r, "Trying to close a backup file (fd=%d)", m_fd);
+    } else {
+        r = flush_r;
     }
 
     return r;
@@ -78,6 +131,27 @@ int destination_file::close(void) const throw() {
 ///////////////////////////////////////////////////////////////////////////////
 //
 int destination_file::pwrite(const void *buf, size_t nbyte, off_t offset) const throw() {
+    if (m_compressed != NULL) {
+        int r = m_compressed->pwrite(buf, nbyte, offset);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to pwrite compressed backup file at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
+    if (m_chunked != NULL) {
+        int r = m_chunked->pwrite(buf, nbyte, offset);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to pwrite chunked backup file at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
+    if (m_stream != NULL) {
+        int r = m_stream->pwrite(m_stream_file, buf, nbyte, offset);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to stream a pwrite of backup file at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
     // Get the data written out, or do 
     while (nbyte > 0) {
         ssize_t wr = call_real_pwrite(m_fd, buf, nbyte, offset);
@@ -101,10 +175,107 @@ int destination_file::pwrite(const void *buf, size_t nbyte, off_t offset) const
     return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwritev() -
+//
+// Description:
+//
+//     Like pwrite(), but gathers the data from IOV.  A short write
+// leaves us partway through some iovec, so copy the rest of the array
+// and pick up from there.  A compressed, chunked or streamed file
+// takes the data in one piece.
+//
+int destination_file::pwritev(const struct iovec *iov, int iovcnt, off_t offset) const throw() {
+    if (!this->has_plain_fd()) {
+        size_t nbyte = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            nbyte += iov[i].iov_len;
+        }
+        char *buf = (char *)malloc(nbyte);
+        if (buf == NULL && nbyte > 0) {
+            int r = errno;
+            the_manager.backup_error(r, "Could not allocate memory at %s:%d", __FILE__, __LINE__);
+            return r;
+        }
+        size_t at = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(buf + at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
+        }
+        int r = this->pwrite(buf, nbyte, offset); // It reports any error.
+        free(buf);
+        return r;
+    }
+    struct iovec *rest = (struct iovec *)malloc(iovcnt * sizeof(rest[0]));
+    if (rest == NULL && iovcnt > 0) {
+        int r = errno;
+        the_manager.backup_error(r, "Could not allocate memory at %s:%d", __FILE__, __LINE__);
+        return r;
+    }
+    memcpy(rest, iov, iovcnt * sizeof(rest[0]));
+    struct iovec *next = rest;
+    int r = 0;
+    while (true) {
+        while (iovcnt > 0 && next->iov_len == 0) {
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) break;
+        ssize_t wr = call_real_pwritev(m_fd, next, iovcnt, offset);
+        if (wr == -1) {
+            r = errno;
+            the_manager.backup_error(r, "Failed to pwritev backup file at %s:%d", __FILE__, __LINE__);
+            break;
+        }
+
+        if (wr == 0) {
+            r = -1; // Unknown error
+            the_manager.backup_error(-1, "pwritev inexplicably returned zero at %s:%d", __FILE__, __LINE__);
+            break;
+        }
+
+        offset += wr;
+        while ((size_t)wr >= next->iov_len) {
+            wr -= next->iov_len;
+            next++;
+            iovcnt--;
+            if (iovcnt == 0) break;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *)next->iov_base + wr;
+            next->iov_len -= wr;
+        }
+    }
+    free(rest);
+    return r;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 int destination_file::truncate(off_t length) const throw() {
     int r = 0;
+    if (m_compressed != NULL) {
+        r = m_compressed->truncate(length);
+        if (r != 0) {
+            the_manager.backup_error(r, "Truncating compressed backup file failed at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
+    if (m_chunked != NULL) {
+        r = m_chunked->truncate(length);
+        if (r != 0) {
+            the_manager.backup_error(r, "Truncating chunked backup file failed at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
+    if (m_stream != NULL) {
+        r = m_stream->truncate(m_stream_file, length);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to stream a truncate of backup file at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
     r = call_real_ftruncate(m_fd, length);
     if (r != 0) {
         r = errno;
@@ -114,9 +285,74 @@ int destination_file::truncate(off_t length) const throw() {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description:
+//
+//     Does the application's fallocate(2) on the backup file.  If the
+// backup's filesystem can't do that MODE, we get the same contents by
+// writing zeros, or extending the file: only the allocation differs.
+// Collapsing or inserting a range can't be done that way, so that is
+// an error.  A compressed or chunked file always takes the fallback,
+// since its blocks aren't where the application's are.  A streamed file leaves it
+// all to the receiver, which knows how long the file is.
+//
+int destination_file::fallocate(int mode, off_t offset, off_t len) const throw() {
+    if (m_stream != NULL) {
+        int r = m_stream->fallocate(m_stream_file, mode, offset, len);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to stream a fallocate of backup file at %s:%d", __FILE__, __LINE__);
+        }
+        return r;
+    }
+    int r = EOPNOTSUPP;
+    if (m_compressed == NULL && m_chunked == NULL) {
+        if (call_real_fallocate(m_fd, mode, offset, len) == 0) {
+            return 0;
+        }
+        r = errno;
+    }
+    if ((r != EOPNOTSUPP && r != ENOSYS) ||
+        (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) != 0) {
+        the_manager.backup_error(r, "Failed to fallocate backup file at %s:%d", __FILE__, __LINE__);
+        return r;
+    }
+
+    off_t size;
+    if (this->get_size(&size) != 0) {
+        r = errno;
+        the_manager.backup_error(r, "Could not fstat backup file at %s:%d", __FILE__, __LINE__);
+        return r;
+    }
+    off_t end = offset + len;
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        if ((mode & FALLOC_FL_KEEP_SIZE) && end > size) {
+            end = size;
+        }
+        static const char zeros[1<<16] = {0};
+        for (r = 0; r == 0 && offset < end; offset += sizeof(zeros)) {
+            r = this->pwrite(zeros, (end - offset < (off_t)sizeof(zeros)) ? end - offset : sizeof(zeros), offset); // It reports any error.
+        }
+        return r;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > size) {
+        return this->truncate(end); // It reports any error.
+    }
+    return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 int destination_file::unlink(void) const throw() {
+    if (m_stream != NULL) {
+        int r = m_stream->unlink(m_path);
+        if (r != 0) {
+            the_manager.backup_error(r, "Failed to stream the unlink of backup file %s", m_path);
+        }
+        return r;
+    }
     int r = call_real_unlink(m_path);
     if (r != 0) {
         r = errno;
@@ -136,8 +372,14 @@ int destination_file::rename(const char *new_path) throw() {
         return r;
     }
 
-    r = call_real_rename(m_path, new_destination_path);
-    if (r != 0) {
+    if (m_stream != NULL) {
+        r = m_stream->rename(m_path, new_destination_path);
+        if (r != 0) {
+            free((void*) new_destination_path);
+            the_manager.backup_error(r, "Could not stream the rename of a backup file.");
+            return r;
+        }
+    } else if (call_real_rename(m_path, new_destination_path) != 0) {
         r = errno;
         // Ignore the error where the copier hasn't yet copied the
         // original file.
@@ -153,6 +395,63 @@ int destination_file::rename(const char *new_path) throw() {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// get_size() -
+//
+// Description:
+//
+//     The length of the file as the application sees it, which for a
+// compressed or chunked file isn't the length of the file on disk.  For a streamed
+// file, it's the length our writes and truncates have given it.
+//
+int destination_file::get_size(off_t *size) const throw() {
+    if (m_stream != NULL) {
+        *size = m_stream->size(m_stream_file);
+        return 0;
+    }
+    if (m_compressed != NULL) {
+        *size = m_compressed->size();
+        return 0;
+    }
+    if (m_chunked != NULL) {
+        *size = m_chunked->size();
+        return 0;
+    }
+    struct stat sbuf;
+    if (fstat(m_fd, &sbuf) != 0) {
+        return -1;
+    }
+    *size = sbuf.st_size;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool destination_file::has_plain_fd(void) const throw() {
+    return m_compressed == NULL && m_chunked == NULL && m_stream == NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int destination_file::flush(void) const throw() {
+    if (m_chunked != NULL) {
+        int r = m_chunked->flush();
+        if (r != 0) {
+            the_manager.backup_error(r, "Could not write the recipe of chunked backup file %s", m_path);
+        }
+        return r;
+    }
+    if (m_compressed == NULL) {
+        return 0;
+    }
+    int r = m_compressed->flush();
+    if (r != 0) {
+        the_manager.backup_error(r, "Could not write the index of compressed backup file %s", m_path);
+    }
+    return r;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 int destination_file::get_fd(void) const throw() {
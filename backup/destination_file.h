@@ -37,22 +37,52 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ifndef DESTINATION_FILE_H
 #define DESTINATION_FILE_H
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+class action_stream;
+class chunk_store;
+class chunked_file;
+class compressed_file;
+class compression_pool;
+struct stream_file;
 
 class destination_file {
 public:
     destination_file(const int opened_fd, const char * full_path) throw();
     ~destination_file() throw();
+    int init(compression_pool *compress, chunk_store *store) throw() __attribute__((warn_unused_result));
+    // Effect: If STORE isn't NULL, write the file as a recipe of chunks in STORE (see chunked_file.h).  Otherwise,
+    //  if COMPRESS isn't NULL, write the file in the compressed format (see compressed_file.h), with COMPRESS's help.
+    //  Returns 0, or an error number, which it doesn't report.
+    int stream_to(action_stream *stream) throw() __attribute__((warn_unused_result));
+    // Effect: Open the file on STREAM, and write it there instead (the fd is -1).
+    //  Returns 0, or an error number, which it doesn't report.
     int close(void) const throw();
     int pwrite(const void *buf, size_t nbyte, off_t offset) const throw();
+    int pwritev(const struct iovec *iov, int iovcnt, off_t offset) const throw(); // Writes all of IOV, which must have at most IOV_MAX entries.
     int truncate(off_t length) const throw();
+    int fallocate(int mode, off_t offset, off_t len) const throw(); // Falls back to writing zeros (or extending the file) if the filesystem can't do MODE.
     int unlink(void) const throw();
     int rename(const char *new_path) throw();
+    int get_size(off_t *size) const throw(); // Like fstat(2): returns 0, or -1 and sets errno.
+    bool has_plain_fd(void) const throw(); // Do writes to the file go straight to get_fd()?  Not if it's compressed, chunked or streamed.
+    int flush(void) const throw(); // Makes a compressed or chunked file readable.  A no-op otherwise.
     int get_fd(void) const throw();
     const char * get_path(void) const throw();
 private:
     const int m_fd;
     const char * m_path;
+    compressed_file *m_compressed; // NULL unless the file is compressed.
+    chunked_file *m_chunked;       // NULL unless the file is chunked.
+    action_stream *m_stream;       // NULL unless the file is streamed.
+    stream_file *m_stream_file;
+    // How many captured writes have been queued for this file, and how
+    // many of them have been done.  Protected by the write_behind.
+    uint64_t m_n_queued;
+    uint64_t m_n_written;
+    friend class write_behind;
 };
 
 #endif // End of header guardian.
@@ -49,7 +49,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 directory_set::directory_set(const int count,
                              const char **sources,
                              const char **destinations)
-:m_count(count), m_real_path_successful(false)
+:m_count(count), m_real_path_successful(false), m_stream_fd(-1)
 {
     m_sources = new const char *[m_count];
     m_destinations = new const char *[m_count];
@@ -98,10 +98,21 @@ int directory_set::update_to_full_path(void)
 //   #6542)
 // 6) The dir cannot be closedir()'d (who knows...)
 //
+// A streamed backup's destinations are only checked to be names the
+// receiver will accept.
+//
 int directory_set::validate(void) const {
     int r = 0;
     struct stat sbuf;
     for (int i = 0; i < m_count; ++i) {
+        if (m_stream_fd >= 0) {
+            r = this->validate_streamed_destination(i);
+            if (r != 0) {
+                break;
+            }
+            continue;
+        }
+
         r = stat(m_destinations[i], &sbuf);
         if (r != 0) {
             r = errno;
@@ -204,6 +215,14 @@ int directory_set::number_of_directories() const {
     return m_count;
 }
 
+void directory_set::set_stream_fd(int fd) {
+    m_stream_fd = (fd < 0) ? -1 : fd;
+}
+
+int directory_set::stream_fd(void) const {
+    return m_stream_fd;
+}
+
 //////////////////////
 // private methods: //
 //////////////////////
@@ -240,6 +259,35 @@ int directory_set::verify_destination_is_empty(const int index,
     return r;
 }
 
+//------------------------------------------------------------------
+// A streamed destination must be a non-empty relative name with no
+// ".." component, since the receiver refuses anything that could
+// land outside the directory it was given.
+//
+int directory_set::validate_streamed_destination(const int index) const {
+    const char *dest = m_destinations[index];
+    bool ok = (dest[0] != '\0' && dest[0] != '/');
+    for (const char *p = dest; ok && *p != '\0'; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            ok = false;
+        }
+        p += len;
+        if (*p == '/') {
+            p++;
+        }
+    }
+
+    if (!ok) {
+        the_manager.backup_error(EINVAL,
+                                 "Streamed backup destination %s must be a relative name without \"..\"",
+                                 dest);
+        return EINVAL;
+    }
+
+    return 0;
+}
+
 //------------------------------------------------------------------
 // This method frees any previous successful and allocated
 // realpath() result strings in the case of a realpath failure.
@@ -276,7 +324,9 @@ int directory_set::update_to_real_path_on_index(const int i) {
         goto out;
     }
 
-    dest = call_real_realpath(m_destinations[i], NULL);
+    // A streamed destination names a directory on the receiver, so
+    // there is nothing here to resolve.
+    dest = (m_stream_fd >= 0) ? strdup(m_destinations[i]) : call_real_realpath(m_destinations[i], NULL);
     if (dest == NULL) {
         with_object_to_free<char*> str(malloc_snprintf(strlen(m_destinations[i]) + 100, "This backup destination directory does not exist: %s", m_destinations[i]));
         //TODO: calls->report_error(ENOENT, str.value); 
@@ -72,16 +72,26 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
         const char *destination_directory_at(const int index) const;
         int number_of_directories() const;
 
+        //----------------------------------------------------------
+        // The descriptor a streamed backup is written to, or -1.  A
+        // streamed backup's destinations are names relative to
+        // wherever the receiver puts them, so they are not checked
+        // or resolved here.
+        void set_stream_fd(int fd);
+        int stream_fd(void) const;
+
     private:
         const char **m_sources;
         const char **m_destinations;
         const int m_count;
         bool m_real_path_successful;
+        int m_stream_fd;
         directory_set();
         int verify_destination_is_empty(const int index, DIR *dir) const;
         void handle_realpath_results(const int r, const int allocated_pairs);
         int update_to_real_path_on_index(const int i);
         int verify_no_two_directories_are_the_same(void);
+        int validate_streamed_destination(const int index) const;
     };
 
 #endif // End of header guardian.
@@ -0,0 +1,177 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "check.h"
+#include "epoch_rwlock.h"
+#include "mutex.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+// Writers take the writer mutex for as long as they hold the lock.
+// Readers that back out for a writer wait on the wait mutex and
+// condition variable for it to finish.  A writer that is still waiting
+// for readers to leave after spinning waits on the wait mutex and the
+// drain condition variable.
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wait_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+
+// How many times a writer yields to a reader before it sleeps.
+static const int n_spins = 100;
+
+// What this thread holds for reading.
+static __thread const epoch_rwlock *reader_lock;
+static __thread int reader_depth;
+static __thread int reader_counter;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// rdlock() -
+//
+// Description:
+//
+//     Counts this thread as a reader, unless a writer has announced
+// itself.  The count and the writer's announcement are both
+// sequentially consistent, so either the writer sees our count and
+// waits for it, or we see the writer and back out.
+//
+void epoch_rwlock::rdlock(void) throw() {
+    if (reader_depth > 0) {
+        check(reader_lock == this);
+        reader_depth++;
+        return;
+    }
+    while (true) {
+        const int cpu = sched_getcpu();
+        const int c = (cpu < 0) ? 0 : cpu % n_counters;
+        __atomic_add_fetch(&m_counters[c].m_n, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_writer, __ATOMIC_SEQ_CST) == 0) {
+            reader_lock = this;
+            reader_depth = 1;
+            reader_counter = c; // The thread may move to another CPU, but it takes itself out of this counter.
+            return;
+        }
+        this->leave_counter(c);
+        this->wait_for_writer();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void epoch_rwlock::rdunlock(void) throw() {
+    check(reader_depth > 0 && reader_lock == this);
+    if (--reader_depth > 0) {
+        return;
+    }
+    reader_lock = NULL;
+    this->leave_counter(reader_counter);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// leave_counter() -
+//
+// Description:
+//
+//     Takes a reader out of counter C.  If that empties the counter
+// while a writer waits, the writer may be asleep, so we wake it.  The
+// writer announced itself before it looked at the counter, so if it
+// saw our count, we see its announcement.
+//
+void epoch_rwlock::leave_counter(int c) throw() {
+    if (__atomic_sub_fetch(&m_counters[c].m_n, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&m_writer, __ATOMIC_SEQ_CST) != 0) {
+        with_mutex_locked ml(&wait_mutex);
+        int r = pthread_cond_broadcast(&drain_cond);
+        check(r == 0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void epoch_rwlock::wait_for_writer(void) throw() {
+    with_mutex_locked ml(&wait_mutex);
+    while (__atomic_load_n(&m_writer, __ATOMIC_SEQ_CST) != 0) {
+        int r = pthread_cond_wait(&wait_cond, &wait_mutex);
+        check(r == 0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// wrlock() -
+//
+// Description:
+//
+//     Announces the writer, and waits for the grace period: for the
+// readers that got in before the announcement to leave.  Most readers
+// are in for the length of one I/O call, so we yield to them for a
+// while.  But a reader may stay in much longer: it may wait for a
+// range lock, for room in the write-behind queue, or for the backup
+// stream's window.  So if a counter still isn't empty, we sleep until
+// its last reader leaves and wakes us.
+//
+void epoch_rwlock::wrlock(void) throw() {
+    pmutex_lock(&writer_mutex);
+    __atomic_store_n(&m_writer, 1, __ATOMIC_SEQ_CST);
+    for (int c = 0; c < n_counters; c++) {
+        for (int i = 0; i < n_spins && __atomic_load_n(&m_counters[c].m_n, __ATOMIC_SEQ_CST) != 0; i++) {
+            sched_yield();
+        }
+        if (__atomic_load_n(&m_counters[c].m_n, __ATOMIC_SEQ_CST) != 0) {
+            with_mutex_locked ml(&wait_mutex);
+            while (__atomic_load_n(&m_counters[c].m_n, __ATOMIC_SEQ_CST) != 0) {
+                int r = pthread_cond_wait(&drain_cond, &wait_mutex);
+                check(r == 0);
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void epoch_rwlock::wrunlock(void) throw() {
+    {
+        with_mutex_locked ml(&wait_mutex);
+        __atomic_store_n(&m_writer, 0, __ATOMIC_SEQ_CST);
+        int r = pthread_cond_broadcast(&wait_cond);
+        check(r == 0);
+    }
+    pmutex_unlock(&writer_mutex);
+}
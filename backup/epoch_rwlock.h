@@ -0,0 +1,110 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef EPOCH_RWLOCK_H
+#define EPOCH_RWLOCK_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// epoch_rwlock:
+//
+// Description:
+//
+//     A reader-writer lock for data that is read on every I/O call and
+// written only when a backup starts or stops (the backup session).
+// A pthread rwlock makes every reader write the same cache line, which
+// then bounces between the cores.  Here a reader counts itself in one
+// of a set of counters, chosen by the CPU it is running on, so readers
+// on different CPUs touch different cache lines.  A writer announces
+// itself, and then waits for a grace period: until every counter is
+// zero.  A reader that sees a writer backs out and waits for it.  The
+// last reader to leave a counter while a writer waits wakes it.
+//
+//     A thread may take the read lock again while it holds it (which
+// never waits), but it may hold only one epoch_rwlock for reading at a
+// time.  Writers wait for each other, on a mutex that every
+// epoch_rwlock shares.
+//
+//     The lock needs no constructor: a zeroed epoch_rwlock (such as
+// one with static storage) is unlocked.  So it can be used by
+// interposed calls that come before the static constructors have run.
+//
+class epoch_rwlock {
+  public:
+    void rdlock(void) throw();
+    void rdunlock(void) throw();
+    void wrlock(void) throw();
+    void wrunlock(void) throw();
+
+  private:
+    static const int n_counters = 64;
+    static const int cache_line_size = 64;
+    struct counter {
+        long m_n; // The readers that counted themselves here.  Read and written with atomic operations.
+        char m_pad[cache_line_size - sizeof(long)];
+    };
+    void wait_for_writer(void) throw();
+    void leave_counter(int c) throw();
+
+    counter m_counters[n_counters] __attribute__((aligned(cache_line_size)));
+    int m_writer; // Nonzero while a writer holds the lock or waits for it.  Read and written with atomic operations.
+};
+
+class with_epoch_rdlocked {
+  private:
+    epoch_rwlock *m_lock;
+  public:
+    with_epoch_rdlocked(epoch_rwlock *lock): m_lock(lock) {
+        m_lock->rdlock();
+    }
+    ~with_epoch_rdlocked(void) {
+        m_lock->rdunlock();
+    }
+};
+
+class with_epoch_wrlocked {
+  private:
+    epoch_rwlock *m_lock;
+  public:
+    with_epoch_wrlocked(epoch_rwlock *lock): m_lock(lock) {
+        m_lock->wrlock();
+    }
+    ~with_epoch_wrlocked(void) {
+        m_lock->wrunlock();
+    }
+};
+
+#endif // End of header guardian.
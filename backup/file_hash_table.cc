@@ -45,48 +45,54 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "manager.h"
 #include "mutex.h"
 #include "MurmurHash3.h"
+#include "check.h"
 
 ////////////////////////////////////////////////////////
 //
-pthread_mutex_t file_hash_table::m_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-////////////////////////////////////////////////////////
-//
-file_hash_table::file_hash_table() throw() : m_count(0),
-                                             m_array(new source_file*[1]),
-                                             m_size(1)
+file_hash_table::file_hash_table() throw()
 {
-    m_array[0] = NULL;
+    for (int i = 0; i < n_segments; i++) {
+        segment *seg = &m_segments[i];
+        int r = pthread_mutex_init(&seg->m_mutex, NULL);
+        check(r==0);
+        seg->m_count = 0;
+        seg->m_array = new source_file*[1];
+        seg->m_array[0] = NULL;
+        seg->m_size = 1;
+    }
 }
 
 ////////////////////////////////////////////////////////
 //
 file_hash_table::~file_hash_table() throw() {
-    for (size_t i=0; i < m_size; i++) {
-        while (source_file *head = m_array[i]) {
-            m_array[i] = head->next();
-            delete head;
+    for (int s = 0; s < n_segments; s++) {
+        segment *seg = &m_segments[s];
+        for (size_t i=0; i < seg->m_size; i++) {
+            while (source_file *head = seg->m_array[i]) {
+                seg->m_array[i] = head->next();
+                delete head;
+            }
         }
+        delete[] seg->m_array;
+        int r = pthread_mutex_destroy(&seg->m_mutex);
+        check(r==0);
     }
-    delete[] m_array;
 }
 
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::get_or_create_locked(const char * const file_name, source_file **file, const int flags) throw() {
-    this->lock();
+    with_file_hash_table_mutex mtl(this, file_name);
     source_file * source = this->get_or_create(file_name);
     source->set_flags(flags);
-    this->unlock();
     *file = source;
 }
 
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::get_or_create_locked(const char * const file_name, source_file **file) throw() {
-    this->lock();
+    with_file_hash_table_mutex mtl(this, file_name);
     source_file * source = this->get_or_create(file_name);
-    this->unlock();
     *file = source;
 }
 
@@ -107,8 +113,9 @@ source_file * file_hash_table::get_or_create(const char * const file_name) {
 //
 source_file* file_hash_table::get(const char * const full_file_path) const throw()
 {
-    int hash_index = this->hash(full_file_path);
-    source_file *file_found = m_array[hash_index];
+    const uint64_t the_hash = this->hash(full_file_path);
+    const segment *seg = &m_segments[segment_of(the_hash)];
+    source_file *file_found = seg->m_array[(the_hash / n_segments) % seg->m_size];
     while (file_found != NULL) {
         int result = strcmp(full_file_path, file_found->name());
         if (result == 0) {
@@ -124,54 +131,73 @@ source_file* file_hash_table::get(const char * const full_file_path) const throw
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::put(source_file * const file) throw() {
-    int hash_index = this->hash(file->name());
-    this->insert(file, hash_index);
+    this->insert(file, this->hash(file->name()));
 }
 
 ////////////////////////////////////////////////////////
 //
-int file_hash_table::hash(const char * const file) const  throw() {
-    assert(m_size);
+uint64_t file_hash_table::hash(const char * const file) throw() {
     int length = strlen(file);
     uint64_t the_hash[2];
     MurmurHash3_x64_128(file, length, 0, the_hash);
-    return (the_hash[0]+the_hash[1])%m_size;
+    return the_hash[0]+the_hash[1];
+}
+
+////////////////////////////////////////////////////////
+//
+int file_hash_table::segment_of(uint64_t the_hash) throw() {
+    return the_hash % n_segments;
 }
 
 ////////////////////////////////////////////////////////
 //
-void file_hash_table::insert(source_file * const file, int hash_index)  throw()
+size_t file_hash_table::size(void) const throw() {
+    size_t count = 0;
+    for (int i = 0; i < n_segments; i++) {
+        count += m_segments[i].m_count;
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////
+//
+void file_hash_table::insert(source_file * const file, uint64_t the_hash)  throw()
         // It's OK to insert the same file repeatedly (in which case the table is not modified)
 {
-    source_file *current = m_array[hash_index];
+    segment *seg = &m_segments[segment_of(the_hash)];
+    const size_t hash_index = (the_hash / n_segments) % seg->m_size;
+    source_file *current = seg->m_array[hash_index];
     while (current) {
         if (current == file) return;
         current = current->next();
     }
-    file->set_next(m_array[hash_index]);
-    m_array[hash_index] = file;
-    m_count++;
-    maybe_resize();
+    file->set_next(seg->m_array[hash_index]);
+    seg->m_array[hash_index] = file;
+    // lock_file() reads this without the segment mutex, to find out
+    // which mutex to take.
+    __atomic_store_n(&file->m_table_segment, segment_of(the_hash), __ATOMIC_RELEASE);
+    seg->m_count++;
+    maybe_resize(seg);
 }
 
-void file_hash_table::maybe_resize(void) throw() {
-    if (m_size < m_count) {
-        source_file **old_array = m_array;
-        size_t old_size = m_size;
-        m_size = m_size + m_count;
-        assert(m_size);
-        m_array = new source_file*[m_size];
-        for (size_t i=0; i<m_size; i++) {
-            m_array[i] = NULL;
+void file_hash_table::maybe_resize(segment *seg) throw() {
+    if (seg->m_size < seg->m_count) {
+        source_file **old_array = seg->m_array;
+        size_t old_size = seg->m_size;
+        seg->m_size = seg->m_size + seg->m_count;
+        assert(seg->m_size);
+        seg->m_array = new source_file*[seg->m_size];
+        for (size_t i=0; i<seg->m_size; i++) {
+            seg->m_array[i] = NULL;
         }
         for (size_t i=0; i<old_size; i++) {
             while (1) {
                 source_file *head = old_array[i];
                 if (head==NULL) break;
                 old_array[i] = head->next();
-                int hash_index = this->hash(head->name());
-                head->set_next(m_array[hash_index]);
-                m_array[hash_index] = head;
+                size_t hash_index = (this->hash(head->name()) / n_segments) % seg->m_size;
+                head->set_next(seg->m_array[hash_index]);
+                seg->m_array[hash_index] = head;
             }
         }
         delete[] old_array;
@@ -181,8 +207,10 @@ void file_hash_table::maybe_resize(void) throw() {
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::remove(source_file * const file) throw() {
-    int hash_index = this->hash(file->name());
-    source_file *current = m_array[hash_index];
+    const uint64_t the_hash = this->hash(file->name());
+    segment *seg = &m_segments[segment_of(the_hash)];
+    const size_t hash_index = (the_hash / n_segments) % seg->m_size;
+    source_file *current = seg->m_array[hash_index];
     source_file *previous = NULL;
     while (current != NULL) {
         int result = strcmp(current->name(), file->name());
@@ -192,10 +220,10 @@ void file_hash_table::remove(source_file * const file) throw() {
             if (previous != NULL) {
                 previous->set_next(next);                
             } else {
-                m_array[hash_index] = next;
+                seg->m_array[hash_index] = next;
             }
-            assert(m_count);
-            m_count--;
+            assert(seg->m_count);
+            seg->m_count--;
             break;
         }
         
@@ -207,9 +235,8 @@ void file_hash_table::remove(source_file * const file) throw() {
 ////////////////////////////////////////////////////////
 //
 void file_hash_table::try_to_remove_locked(source_file * const file) throw() {
-    this->lock();
+    with_file_hash_table_mutex mtl(this, file);
     this->try_to_remove(file);
-    this->unlock();
 }
 
 ////////////////////////////////////////////////////////
@@ -227,7 +254,8 @@ void file_hash_table::try_to_remove(source_file * const file) throw() {
 //
 int file_hash_table::rename_locked(const char * const old_path, const char *new_path, const char *old_dest, const char *dest_path) throw() {
     int r = 0;
-    with_file_hash_table_mutex ht(this);
+    int old_segment, new_segment;
+    this->lock_two_names(old_path, new_path, &old_segment, &new_segment);
     source_file * target = this->get_or_create(old_path);
 
     // This path should only be called during an active backup
@@ -239,6 +267,10 @@ int file_hash_table::rename_locked(const char * const old_path, const char *new_
         this->try_to_remove(target);
     }
 
+    this->unlock(old_segment);
+    if (new_segment != old_segment) {
+        this->unlock(new_segment);
+    }
     return r;
 }
 
@@ -275,14 +307,57 @@ int file_hash_table::rename(source_file * target, const char *new_source_name, c
 
 ////////////////////////////////////////////////////////
 // Description: See file_hash_table.h.
-void file_hash_table::lock(void) throw() {
-    pmutex_lock(&m_mutex);
+int file_hash_table::lock_name(const char * const file_name) throw() {
+    const int s = segment_of(this->hash(file_name));
+    pmutex_lock(&m_segments[s].m_mutex);
+    return s;
 }
 
 ////////////////////////////////////////////////////////
-// Description: See file_hash_table.h.
-void file_hash_table::unlock(void) throw() {
-    pmutex_unlock(&m_mutex);
+//
+// lock_file() -
+//
+// Description:
+//
+//     Lock the segment that the file is in.  Only a rename, holding
+// the segment mutex, moves a file to another segment, so once we hold
+// the mutex of the segment that the file says it's in, it stays there.
+//
+int file_hash_table::lock_file(source_file * const file) throw() {
+    while (1) {
+        const int s = __atomic_load_n(&file->m_table_segment, __ATOMIC_ACQUIRE);
+        pmutex_lock(&m_segments[s].m_mutex);
+        if (__atomic_load_n(&file->m_table_segment, __ATOMIC_ACQUIRE) == s) {
+            return s;
+        }
+        pmutex_unlock(&m_segments[s].m_mutex);
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+// lock_two_names() -
+//
+// Description:
+//
+//     Lock the segments for both names, in segment order so that two
+// renames can't deadlock.  If both names are in the same segment, it's
+// locked once.
+//
+void file_hash_table::lock_two_names(const char *name0, const char *name1, int *segment0, int *segment1) throw() {
+    const int s0 = segment_of(this->hash(name0));
+    const int s1 = segment_of(this->hash(name1));
+    pmutex_lock(&m_segments[s0 < s1 ? s0 : s1].m_mutex);
+    if (s0 != s1) {
+        pmutex_lock(&m_segments[s0 < s1 ? s1 : s0].m_mutex);
+    }
+    *segment0 = s0;
+    *segment1 = s1;
 }
 
+////////////////////////////////////////////////////////
+// Description: See file_hash_table.h.
+void file_hash_table::unlock(int s) throw() {
+    pmutex_unlock(&m_segments[s].m_mutex);
+}
 
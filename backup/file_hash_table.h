@@ -38,10 +38,31 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <pthread.h>
-#include <vector>
+#include <stddef.h>
+#include <stdint.h>
 
 class source_file;
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// file_hash_table:
+//
+// Description:
+//
+//     The source_file objects of the files that the application has
+// open (or that the copier is copying), by full path.
+//
+//     The table is split into segments by hash, and each segment has
+// its own mutex, its own buckets and its own count, so that opening,
+// closing, unlinking and copying different files don't serialize on one
+// lock.  A segment grows (by doubling) while holding only its own
+// mutex, so growing never stops the rest of the table.
+//
+//     The segment mutex of a file is also what the manager and the
+// copier use to serialize creating, removing and renaming the file's
+// destination.  Use with_file_hash_table_mutex to hold it: by name
+// for a lookup, or by source_file for a file you already have.
+//
 class file_hash_table {
 public:
     file_hash_table() throw();
@@ -67,14 +88,16 @@ public:
     //
     void get_or_create_locked(const char * const file_name, source_file **file, const int flags) throw();
     void get_or_create_locked(const char * const file_name, source_file **file) throw();
+
+    // The methods without _locked require that the caller holds the
+    // segment mutex for the file (or name) they're given.
     source_file * get_or_create(const char * const file_name);
     source_file* get(const char *full_file_path) const throw();
-    void put(source_file * const file) throw();
-    int hash(const char * const file) const throw();
-    void insert(source_file * const file, int hash_index) throw(); // you may insert the same file more than once.
+    void put(source_file * const file) throw(); // you may put the same file more than once.
     void remove(source_file * const file) throw();
     void try_to_remove_locked(source_file * const file) throw();
     void try_to_remove(source_file * const file) throw();
+    size_t size(void) const throw(); // The number of files in the table.  Only meaningful when nothing else is changing it.
 
     // These methods rename at least the source_file object and
     // reinsert it into our hash table.  If there is a
@@ -83,32 +106,44 @@ public:
     // Does *not* take ownership of the paths.
     // Return values and errors:: On success return 0, otherwise return error number (not in errno), having reported the error to the manager.
 
+    static uint64_t hash(const char * const file) throw();
+
   private:
     // The rename method (without a lock) is private to the file_hash_table.
     int rename(source_file * const target, const char *new_name, const char *dest) throw(); // On success return 0, otherwise return error number (not in errno).
 
   private:
-    void lock(void) throw(); // no return results since we assume that mutexes work.
-    void unlock(void) throw();
+    static const int n_segments = 64;
+    static int segment_of(uint64_t hash) throw();
+    int lock_name(const char * const file_name) throw();    // Locks, and returns, the segment for the name.
+    int lock_file(source_file * const file) throw();         // Locks, and returns, the segment that the file is in.
+    void lock_two_names(const char *name0, const char *name1, int *segment0, int *segment1) throw();
+    void unlock(int s) throw();
     
     friend class with_file_hash_table_mutex;
 private:
-    size_t m_count;
-    source_file **m_array;
-    size_t m_size;
-    static pthread_mutex_t m_mutex;
-    void maybe_resize(void) throw();
+    struct segment {
+        pthread_mutex_t m_mutex;
+        size_t m_count;
+        source_file **m_array;
+        size_t m_size;
+    };
+    segment m_segments[n_segments];
+    void insert(source_file * const file, uint64_t hash) throw();
+    void maybe_resize(segment *seg) throw(); // Requires that seg's mutex is held.
 };
 
 class with_file_hash_table_mutex {
   private:
     file_hash_table *ht;
+    const int m_segment;
   public:
-    with_file_hash_table_mutex(file_hash_table *h): ht(h) {
-        ht->lock();
+    with_file_hash_table_mutex(file_hash_table *h, const char *file_name): ht(h), m_segment(h->lock_name(file_name)) {
+    }
+    with_file_hash_table_mutex(file_hash_table *h, source_file *file): ht(h), m_segment(h->lock_file(file)) {
     }
     ~with_file_hash_table_mutex(void) {
-        ht->unlock();
+        ht->unlock(m_segment);
     }
 };
 
@@ -35,6 +35,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include "backup_debug.h"
+#include "check.h"
 #include "fmap.h"
 #include "glassbox.h"
 #include "manager.h"
@@ -45,14 +46,14 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
-#include <vector>
-
-class file_description;
-template class std::vector<file_description *>;
 
 // This mutx protects the file descriptor map
 static pthread_mutex_t get_put_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Stands in for the description of every untracked fd.  It is never used as a description.
+static description untracked_description;
+description *const fmap::untracked = &untracked_description;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // fmap():
@@ -61,7 +62,11 @@ static pthread_mutex_t get_put_mutex = PTHREAD_MUTEX_INITIALIZER;
 //
 //     Constructor.
 //
-fmap::fmap() throw() {}
+fmap::fmap() throw() : m_size(0) {
+    for (int i = 0; i < n_segments; ++i) {
+        m_segments[i] = NULL;
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -72,46 +77,70 @@ fmap::fmap() throw() {}
 //     Destructor.
 //
 fmap::~fmap() throw() {
-    for(std::vector<file_description *>::size_type i = 0; i < m_map.size(); ++i)
-    {
-        description *file = m_map[i];
-        if (file == NULL) {
+    for (int fd = 0; fd < m_size; ++fd) {
+        description **p = this->slot(fd);
+        if (p == NULL || *p == NULL || *p == untracked) {
             continue;
         }
         
-        delete file;
-        m_map[i] = NULL;
+        delete *p;
+        *p = NULL;
+    }
+    for (int i = 0; i < n_segments; ++i) {
+        free(m_segments[i]);
+        m_segments[i] = NULL;
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Description:  See fmap.h.
-void fmap::get(int fd, description** resultp, const backtrace bt) throw() {
+void fmap::get(int fd, description** resultp, const backtrace bt __attribute__((unused))) throw() {
     if (HotBackup::MAP_DBG) { 
         printf("get() called with fd = %d \n", fd);
     }
-    with_fmap_locked ml(BACKTRACE(&bt));
-    description *result = this->get_unlocked(fd);
-    *resultp = result;
+    *resultp = this->get_unlocked(fd);
 }
 
 description* fmap::get_unlocked(int fd) throw() {
-    if (fd < 0) return NULL;
-    description *result;
-    if ((size_t)fd >= m_map.size()) {
-        result = NULL;
-    } else {
-        result = m_map[fd];
+    description **p = this->slot(fd);
+    if (p == NULL) {
+        return NULL;
     }
-    return result;
+    // The acquire pairs with the release in put(), so that we see
+    // the description fully constructed.
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 void fmap::put(int fd, description *file) throw() {
     with_fmap_locked ml(BACKTRACE(NULL));
     this->grow_array(fd);
-    glass_assert(m_map[fd] == NULL);
-    m_map[fd] = file;
+    description **p = this->slot(fd);
+    glass_assert(p != NULL && (*p == NULL || *p == untracked)); // A description may replace the untracked marker.
+    __atomic_store_n(p, file, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// put_untracked():
+//
+// Description:
+//
+//     Marks fd untracked.  Most fds already have a slot, and then we
+// needn't serialize with the other put()s and erase()s: the walkers
+// that hold the lock skip untracked slots, and track_untracked_fds()
+// holds the session lock for writing, so it can't run while we do.
+// Only making a new segment needs the lock.
+//
+void fmap::put_untracked(int fd) throw() {
+    description **p = this->slot(fd);
+    if (p == NULL) {
+        this->put(fd, untracked);
+        return;
+    }
+    glass_assert(*p == NULL || *p == untracked);
+    __atomic_store_n(p, untracked, __ATOMIC_RELEASE);
+    this->raise_size(fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -124,25 +153,24 @@ void fmap::put(int fd, description *file) throw() {
 // that index's file descriptor pointer to zero.
 //
 // Requires: the fd is something currently mapped.
+//
+// Notes: A get() that races with the erase() of the same fd may still
+// return the description.  That was so when get() took the lock, too:
+// only the application's close() of an fd erases it, and an application
+// that uses an fd while closing it has a race of its own.
 
 int fmap::erase(int fd, const backtrace bt) throw() {
     with_fmap_locked ml(BACKTRACE(&bt));
-    if ((size_t)fd  >= m_map.size()) {
+    description **p = this->slot(fd);
+    if (p == NULL) {
         return 0;
     } else {
-        description *description = m_map[fd];
-        m_map[fd] = NULL;
-        {
-            if (description) {
-                // Do this after releasing the lock
-                //                source_file * src_file = description->get_source_file();
-                //if (src_file != NULL) {
-                //  src_file->remove_reference();
-                //}
-                delete description;
-            }
-            return 0;
+        description *description = *p;
+        __atomic_store_n(p, (struct description *)NULL, __ATOMIC_RELEASE);
+        if (description && description != untracked) {
+            delete description;
         }
+        return 0;
     }
 }
 
@@ -150,33 +178,106 @@ int fmap::erase(int fd, const backtrace bt) throw() {
 //
 // size():
 //
+// Description:
+//
+//     Returns one more than the largest fd that has ever been put.
+// Every fd below that can be passed to get_unlocked().
+//
 int fmap::size(void) throw() {
-    return  m_map.size();
+    return __atomic_load_n(&m_size, __ATOMIC_ACQUIRE);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// grow_fds_array():
+// segment_of():
 //
 // Description:
 //
-//     Expands the array of file descriptions to include the given file
-// descriptor (fd) index.  This will fill each new spot between the current
-// end of the array and the new index with NULL pointers.  These missing 
-// file descriptors may be used by the parent process, but not part of our
-// backup directory.
+//     Segment s holds the first_segment_size << s fds that start at
+// first_segment_size * (2^s - 1), so fd's segment is the log of
+// fd / first_segment_size + 1.
+//
+// Requires: fd >= 0.
+int fmap::segment_of(int fd, int *index) throw() {
+    const unsigned int q = (unsigned int)fd / first_segment_size + 1;
+    const int s = 31 - __builtin_clz(q);
+    *index = fd - first_segment_size * ((1 << s) - 1);
+    return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// slot():
+//
+// Description:
+//
+//     Returns the address of fd's slot, or NULL if fd is negative or
+// its segment hasn't been made yet.  Takes no lock.
+//
+description** fmap::slot(int fd) throw() {
+    if (fd < 0) return NULL;
+    int index;
+    const int s = segment_of(fd, &index);
+    description **segment = __atomic_load_n(&m_segments[s], __ATOMIC_ACQUIRE);
+    if (segment == NULL) {
+        return NULL;
+    }
+    return &segment[index];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// grow_array():
+//
+// Description:
+//
+//     Makes sure that the given file descriptor (fd) has a slot,
+// making every segment up to and including its own.  The new slots are
+// NULL.  These missing file descriptors may be used by the parent
+// process, but not part of our backup directory.
+//
+//     The segments are zeroed before they are published, and they are
+// never moved, so readers that don't hold the lock are safe.
 // 
 // Requires: the get_put_mutex is held
 void fmap::grow_array(int fd) throw() {
     if (fd>=0) {
-        while(m_map.size() <= (size_t)fd) {
-            m_map.push_back(NULL);
+        int index;
+        const int last = segment_of(fd, &index);
+        for (int s = 0; s <= last; ++s) {
+            if (m_segments[s] != NULL) {
+                continue;
+            }
+            const size_t n = (size_t)first_segment_size << s;
+            description **segment = (description **)calloc(n, sizeof(description *));
+            // put() can't fail, and without the slot we would lose
+            // track of the fd.
+            check(segment != NULL);
+            __atomic_store_n(&m_segments[s], segment, __ATOMIC_RELEASE);
         }
+        this->raise_size(fd);
     } else {
         // Don't bother complaining if someone manages to pass a negative fd.
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// raise_size():
+//
+// Description:
+//
+//     put_untracked() can raise m_size without the lock, so we never
+// just store it.
+//
+void fmap::raise_size(int fd) throw() {
+    int size = __atomic_load_n(&m_size, __ATOMIC_ACQUIRE);
+    while (fd >= size &&
+           !__atomic_compare_exchange_n(&m_size, &size, fd + 1, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        // size now holds the current value, so look again.
+    }
+}
+
 void fmap::lock_fmap(const backtrace bt) throw() {
     pmutex_lock(&get_put_mutex, BACKTRACE(&bt));
 }
@@ -184,6 +285,3 @@ void fmap::lock_fmap(const backtrace bt) throw() {
 void fmap::unlock_fmap(const backtrace bt) throw() {
     pmutex_unlock(&get_put_mutex, BACKTRACE(&bt));
 }
-
-// Instantiate the templates we need
-template class std::vector<description*>;
@@ -37,18 +37,38 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
 #ident "$Id$"
 
-
-#include <vector>
 #include "description.h"
 #include "backup_directory.h"
 #include "backtrace.h"
 
 class backup_directory;
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// fmap:
+//
+// Description:
+//
+//     Maps file descriptors to their descriptions.  Every interposed
+// call looks up its fd here, whether or not a backup is running, so
+// get() takes no lock: it does two atomic loads.
+//
+//     The slots live in segments that double in size (the first holds
+// first_segment_size fds, the next twice that, and so on), reached
+// through a fixed array of segment pointers.  A segment is made the
+// first time an fd in it is put, and is never moved or freed until the
+// fmap is destroyed, so a reader never sees memory go away under it.
+// put() and erase() still serialize on the fmap lock, which the backup
+// manager also holds while it walks the map.  Marking an fd untracked
+// usually doesn't need it.
+//
 class fmap
 {
 private:
-    std::vector<description *> m_map;
+    static const int first_segment_size = 1024;
+    static const int n_segments = 22; // Enough for every non-negative int.
+    description **m_segments[n_segments]; // Read and written with atomic operations.
+    int m_size;                           // One more than the largest fd ever put.
 public:
     fmap() throw();
     ~fmap() throw();
@@ -57,16 +77,27 @@ public:
     // Effect:   Returns pointer (in *result) to the file description object that matches the
     //   given file descriptor.  This will return NULL if the given file
     //   descriptor has not been added to this map.
-    // No errors can occur.
+    // No errors can occur, and no locks are taken.
 
     void put(int fd, description *file) throw();
     // Effect: adds given description pointer to array (acquires a lock)
 
-    description* get_unlocked(int fd) throw(); // use this one instead of get() when you already have the lock.
+    static description *const untracked;
+    // The description put for an fd whose file we've chosen not to track.  It
+    //  may later be replaced by a real description.  Don't use it as a description.
+
+    void put_untracked(int fd) throw();
+    // Effect: The same as put(fd, untracked), but takes no lock if FD's slot has already been made.
+    // Requires: the caller holds the manager's session lock for reading.
+
+    description* get_unlocked(int fd) throw(); // The same as get().  It's here for callers that already have the lock.
     int erase(int fd, const backtrace bt) throw() __attribute__((warn_unused_result)); // returns 0 or an error number.
     int size(void) throw();
 private:
+    static int segment_of(int fd, int *index) throw(); // Returns fd's segment, and sets *index to its slot in the segment.
+    description **slot(int fd) throw();               // Returns NULL if fd's segment hasn't been made.
     void grow_array(int fd) throw();
+    void raise_size(int fd) throw(); // Makes m_size at least fd + 1.
     
     // Global locks used when the file descriptor map is updated.   Sometimes the backup system needs to hold the lock for several operations.
     // No errors are countenanced.
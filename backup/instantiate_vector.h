@@ -31,47 +31,27 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
     You should have received a copy of the GNU Affero General Public License
     along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
 ======= */
-
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
 #ident "$Id$"
 
-// Walk a directory and return the total size.
-
-#include <sys/stat.h>
-#include <dirent.h>
-#include <string.h>
-#include <stdio.h>
-
-#include "raii-malloc.h"
-#include "backup_internal.h"
-#include "check.h"
-
-long long dirsum(const char *dname) throw() {
-    DIR *dir = opendir(dname);
-    if (dir==0) return 0;
-    long long sum = 0;
-    while (1) {
-        struct dirent *dent = readdir(dir);
-        if (dent==0) break;
-        if (!strcmp(dent->d_name, "." )) continue;
-        if (!strcmp(dent->d_name, "..")) continue;
-        int len = strlen(dname) + 1 + strlen(dent->d_name) + 1; // one for the slash, one for the NUL.
-        with_object_to_free<char *> str((char*)malloc(len));
-        {
-            int r = snprintf(str.value, len, "%s/%s", dname, dent->d_name);
-            check(r==len-1);
-        }
-	struct stat st;
-        int r = lstat(str.value, &st);
-        if (r == -1) continue;
-        if (S_ISLNK(st.st_mode)) continue;
-        if (S_ISDIR(st.st_mode)) {
-            long long sub_dirsum = dirsum(str.value);
-            sum += sub_dirsum;
-            continue;
-        }
-        sum += st.st_size;
-    }
-    closedir(dir);
-    return sum;
-}
-
+#ifndef INSTANTIATE_VECTOR_H
+#define INSTANTIATE_VECTOR_H
+
+#include <vector>
+
+// We build with -fno-implicit-templates, so each .cc file instantiates
+// the vectors it uses.  Instantiating std::vector<T> doesn't
+// instantiate the std::__niter_base() overloads that libstdc++'s vector
+// members call, so INSTANTIATE_VECTOR(T) instantiates those too.
+// Use it at namespace scope, without a trailing semicolon.
+#if defined(__GLIBCXX__)
+#define INSTANTIATE_VECTOR(T)                                           \
+    template class std::vector<T>;                                      \
+    template T *std::__niter_base(std::vector<T>::iterator);            \
+    template T const *std::__niter_base(std::vector<T>::const_iterator);
+#else
+#define INSTANTIATE_VECTOR(T)                                           \
+    template class std::vector<T>;
+#endif
+
+#endif // End of header guardian.
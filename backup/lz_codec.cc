@@ -0,0 +1,215 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "lz_codec.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+static const size_t min_match = 4;
+static const size_t max_offset = 65535;
+static const int hash_bits = 12;
+// The compressor leaves this many bytes at the end as literals, so its
+// four byte loads never run off the end.
+static const size_t end_literals = 8;
+
+static inline uint32_t load32(const uint8_t *p) throw() {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) throw() {
+    return (v * 2654435761U) >> (32 - hash_bits);
+}
+
+// Appends the extra bytes of a length that didn't fit in its four bits.
+static inline uint8_t *put_length(uint8_t *op, size_t length) throw() {
+    for (length -= 15; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Appends a sequence of N_LITERALS literals, followed by a match of
+// MATCH_LENGTH at OFFSET unless MATCH_LENGTH is zero.  Returns NULL if
+// it wouldn't fit before OEND.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t n_literals, size_t offset, size_t match_length) throw() {
+    // The worst case: the token, both lengths, the literals and the offset.
+    if ((size_t)(oend - op) < 1 + (n_literals / 255 + 1) + n_literals + 2 + (match_length / 255 + 1)) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)(((n_literals < 15) ? n_literals : 15) << 4);
+    if (n_literals >= 15) {
+        op = put_length(op, n_literals);
+    }
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+    if (match_length == 0) {
+        return op;
+    }
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    const size_t extra = match_length - min_match;
+    *token |= (uint8_t)((extra < 15) ? extra : 15);
+    if (extra >= 15) {
+        op = put_length(op, extra);
+    }
+    return op;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+size_t lz_compress_bound(size_t n) throw() {
+    return n + n / 255 + 16;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// lz_compress() -
+//
+// Description:
+//
+//     Greedy matching: we remember where we last saw each hashed four
+// bytes, and take the match there if it is real and near enough.
+//
+size_t lz_compress(const void *src_v, size_t n, void *dst_v, size_t dst_capacity) throw() {
+    const uint8_t *const src = (const uint8_t *)src_v;
+    const uint8_t *const end = src + n;
+    uint8_t *const dst = (uint8_t *)dst_v;
+    uint8_t *const oend = dst + dst_capacity;
+    uint8_t *op = dst;
+    const uint8_t *anchor = src; // The first literal not yet written.
+    if (n > end_literals + min_match) {
+        uint32_t table[1 << hash_bits];
+        memset(table, 0, sizeof(table));
+        const uint8_t *const match_limit = end - end_literals;
+        const uint8_t *ip = src + 1;
+        while (ip < match_limit) {
+            const uint32_t seq = load32(ip);
+            const uint32_t h = hash32(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref < ip && (size_t)(ip - ref) <= max_offset && load32(ref) == seq) {
+                const uint8_t *mp = ip + min_match;
+                const uint8_t *rp = ref + min_match;
+                while (mp < match_limit && *mp == *rp) {
+                    mp++;
+                    rp++;
+                }
+                op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+                if (op == NULL) {
+                    return 0;
+                }
+                ip = mp;
+                anchor = ip;
+            } else {
+                ip++;
+            }
+        }
+    }
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (op == NULL || (size_t)(op - dst) >= n) {
+        return 0;
+    }
+    return op - dst;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// lz_decompress() -
+//
+// Description:
+//
+//     Every length and offset is checked against the buffers, so
+// corrupt data gives EINVAL rather than a wild write.
+//
+int lz_decompress(const void *src_v, size_t n, void *dst_v, size_t dst_n) throw() {
+    const uint8_t *ip = (const uint8_t *)src_v;
+    const uint8_t *const iend = ip + n;
+    uint8_t *const dst = (uint8_t *)dst_v;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + dst_n;
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+        size_t n_literals = token >> 4;
+        if (n_literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return EINVAL;
+                b = *ip++;
+                n_literals += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < n_literals || (size_t)(oend - op) < n_literals) {
+            return EINVAL;
+        }
+        memcpy(op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+        if (ip == iend) {
+            break; // The last sequence.
+        }
+        if (iend - ip < 2) {
+            return EINVAL;
+        }
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_length = (token & 15) + min_match;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return EINVAL;
+                b = *ip++;
+                match_length += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < match_length) {
+            return EINVAL;
+        }
+        // The match may overlap what it produces, so copy a byte at a time.
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_length; i++) {
+            op[i] = ref[i];
+        }
+        op += match_length;
+    }
+    return (op == oend) ? 0 : EINVAL;
+}
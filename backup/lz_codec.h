@@ -0,0 +1,65 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// A small, fast LZ77 codec for the compressed backup format.  The
+// compressed data is a series of sequences.  Each is a token byte (the
+// high four bits count literals, the low four bits count match bytes
+// beyond the minimum of four), any further literal count (bytes of 255
+// and then the rest), the literals, a two byte little-endian offset
+// back to the match, and any further match count.  The last sequence
+// has only literals, and ends the data.  Nothing is recorded about the
+// uncompressed length, which the caller must know.
+//
+
+size_t lz_compress_bound(size_t n) throw();
+// Effect: Return the most that lz_compress() can need for N bytes.
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t dst_capacity) throw();
+// Effect: Compress the N (less than 4GiB) bytes at SRC into DST, and return the compressed length.
+//  Returns 0 if the compressed data would not fit in DST_CAPACITY bytes, or would be no shorter than N.
+
+int lz_decompress(const void *src, size_t n, void *dst, size_t dst_n) throw() __attribute__((warn_unused_result));
+// Effect: Decompress the N bytes at SRC, which must come to exactly DST_N bytes, into DST.
+//  Returns 0, or EINVAL if the data is corrupt.
+
+#endif // End of header guardian.
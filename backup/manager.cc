@@ -41,12 +41,12 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "mutex.h"
 #include "raii-malloc.h"
 #include "real_syscalls.h"
-#include "rwlock.h"
 #include "source_file.h"
 #include "directory_set.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -56,6 +56,10 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include <unistd.h>
 #include "backup_helgrind.h"
 
+static const unsigned int max_io_queue_depth = 64;
+static const unsigned long default_throttle_burst = 1024 * 1024; // One copier chunk.
+static const size_t default_capture_queue_size = 64 * 1024 * 1024;
+
 #if DEBUG_HOTBACKUP
 #define WARN(string, arg) HotBackup::CaptureWarn(string, arg)
 #define TRACE(string, arg) HotBackup::CaptureTrace(string, arg)
@@ -83,9 +87,11 @@ static void print_time(const char *toku_string) throw() {
 }
 
 pthread_mutex_t manager::m_mutex         = PTHREAD_MUTEX_INITIALIZER;
-pthread_rwlock_t manager::m_session_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+epoch_rwlock manager::m_session_lock; // Zeroed, and so unlocked, before anything runs.
 pthread_mutex_t manager::m_error_mutex   = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t manager::m_atomic_file_op_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t manager::m_incremental_base_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t manager::m_chunk_store_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -107,6 +113,23 @@ manager::manager(void) throw()
       m_backup_is_running(false),
       m_session(NULL),
       m_throttle(ULONG_MAX),
+      m_throttle_bucket(default_throttle_burst),
+      m_write_behind(default_capture_queue_size),
+      m_copy_threads(1),
+      m_zero_copy(true),
+      m_reflink(false),
+      m_io_queue_depth(0),
+      m_copy_order(TOKUBACKUP_COPY_ORDER_TREE),
+      m_write_manifest(false),
+      m_compress(false),
+      m_compress_this_backup(false),
+      m_stream_fd(-1),
+      m_stream_window(0),
+      m_stream_this_backup(false),
+      m_incremental_base(NULL),
+      m_incremental_base_count(0),
+      m_chunk_store_dir(NULL),
+      m_chunk_this_backup(false),
       m_an_error_happened(false),
       m_errnum(BACKUP_SUCCESS),
       m_errstring(NULL)
@@ -123,6 +146,8 @@ manager::manager(void) throw()
 
 manager::~manager(void) throw() {
     if (m_errstring) free(m_errstring);
+    ignore(this->set_incremental_base(NULL, 0));
+    free(m_chunk_store_dir);
 }
 
 // This is a per-thread variable that indicates if we are the thread that can do the backup calls directly (and if so, here they are).
@@ -144,6 +169,7 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
     thread_has_backup_calls = calls;
 
     int r = 0;
+    backup_session *session = NULL;
     if (this->is_dead()) {
         r = EINVAL;
         backup_error(r, "Backup system is dead");
@@ -172,12 +198,54 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
         goto unlock_out;
     }
 
+    // A compressed backup's files can't be linked or cloned into a
+    // plain one (or the other way round), so it is never incremental,
+    // and has no manifest that would let it be a base.  Nor is a
+    // streamed one, which has no files here at all (and can't be
+    // compressed).  A deduplicated backup's files are recipes, so it
+    // is the same, and isn't compressed either: the store does better.
+    // Streaming takes precedence over both.
+    if (dirs->stream_fd() < 0) {
+        with_mutex_locked ml(&m_chunk_store_mutex);
+        if (m_chunk_store_dir != NULL) {
+            r = m_chunk_store.open(m_chunk_store_dir);
+            if (r != 0) {
+                backup_error(r, "Could not open the chunk store %s", m_chunk_store_dir);
+                goto unlock_out;
+            }
+            m_chunk_this_backup = true;
+        }
+    }
+    m_compress_this_backup = m_compress && dirs->stream_fd() < 0 && !m_chunk_this_backup;
+
+    // Reading the base manifests can take a while, so do it before we hold up the application with the session lock.
+    session = new backup_session(dirs, calls, &m_table);
+    if (m_compress_this_backup || m_chunk_this_backup || dirs->stream_fd() >= 0) {
+        r = session->open_manifests(false, NULL, 0);
+    } else {
+        with_mutex_locked ml(&m_incremental_base_mutex);
+        r = session->open_manifests(m_write_manifest, m_incremental_base, m_incremental_base_count);
+    }
+    if (r != 0) {
+        delete session;
+        if (m_chunk_this_backup) {
+            m_chunk_store.close();
+            m_chunk_this_backup = false;
+        }
+        goto unlock_out;
+    }
+
     {
-        with_rwlock_wrlocked ms(&m_session_rwlock, BACKTRACE(NULL));
+        with_epoch_wrlocked ms(&m_session_lock);
 
-        {
-            with_mutex_locked mt(&copier::m_todo_mutex, BACKTRACE(NULL));
-            m_session = new backup_session(dirs, calls, &m_table);
+        m_session = session;
+        m_paths.clear(); // Start each backup with nothing remembered from before it.
+        m_stream_this_backup = (dirs->stream_fd() >= 0);
+        if (m_stream_this_backup) {
+            m_stream.start(dirs->stream_fd(), m_stream_window);
+        }
+        for (int i = 0; i < dirs->number_of_directories(); ++i) {
+            m_tracked_dirs.add(dirs->source_directory_at(i));
         }
         print_time("Toku Hot Backup: Started:");    
 
@@ -187,6 +255,10 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
             goto disable_out;
         }
 
+        if (m_compress_this_backup) {
+            m_compression_pool.start();
+        }
+        m_write_behind.start();
         this->enable_capture();
         this->enable_copy();
     }
@@ -197,6 +269,8 @@ int manager::do_backup(directory_set *dirs, backup_callbacks *calls) throw() {
                 while (!m_start_copying) sched_yield();
             }) );
 
+    // A backup has to earn its first burst, rather than starting at full speed.
+    m_throttle_bucket.empty();
     r = m_session->do_copy();
     if (r != 0) {
         this->backup_error(r, "COPY phase returned an error: %d", r);
@@ -214,21 +288,42 @@ disable_out: // preserves r if r!=0
 
     calls->before_stop_capt_call();
     {
-        with_rwlock_wrlocked ms(&m_session_rwlock, BACKTRACE(NULL));
+        with_epoch_wrlocked ms(&m_session_lock);
 
         m_backup_is_running = false;
         this->disable_capture();
+        // Nothing more can be queued, so get what has been queued into the backup before we call it done.
+        m_write_behind.stop();
+        m_compression_pool.stop();
         this->disable_descriptions();
+        if (m_stream_this_backup) {
+            // The receiver takes the backup as done only if the stream ends properly.
+            int sr = m_stream.finish(r == 0 && !m_an_error_happened);
+            if (sr != 0 && r == 0) {
+                r = sr;
+                this->backup_error(r, "Could not finish the backup stream");
+            }
+            m_stream_this_backup = false;
+        }
+        if (m_chunk_this_backup) {
+            m_chunk_store.close();
+            m_chunk_this_backup = false;
+        }
         WHEN_GLASSBOX(m_is_capturing = false);
         print_time("Toku Hot Backup: Finished:");
         // We need to remove any extra renamed files that may have made it
         // to the backup session just after copy finished.
         m_session->cleanup();
-        delete m_session;
         m_session = NULL;
     }
     calls->after_stop_capt_call();
 
+    // Once capture has stopped, the manifests can't change.  Saving them can take a while, so do it without the session lock.
+    if (r == 0 && !m_an_error_happened) {
+        r = session->save_manifests();
+    }
+    delete session;
+
 unlock_out: // preserves r if r!0
 
     pmutex_unlock(&m_mutex, BACKTRACE(NULL));
@@ -247,18 +342,21 @@ error_out:
 ///////////////////////////////////////////////////////////////////////////////
 //
 int manager::prepare_directories_for_backup(backup_session *session, backtrace bt) throw() {
-    int r = 0;
+    int r = this->track_untracked_fds(session);
+    if (r != 0) {
+        return r;
+    }
     // Loop through all the current file descriptions and prepare them
     // for backup.
     with_fmap_locked fm(BACKTRACE(&bt)); // TODO: #6532 This lock is much too coarse.  Need to refine it.  This lock deals with a race between file->create() and a close() call from the application.  We aren't using the m_refcount in file_description (which we should be) and we even if we did, the following loop would be racy since m_map.size could change while we are running, and file descriptors could come and go in the meanwhile.  So this really must be fixed properly to refine this lock.
     for (int i = 0; i < m_map.size(); ++i) {
         description *file = m_map.get_unlocked(i);
-        if (file == NULL) {
+        if (file == NULL || file == fmap::untracked) {
             continue;
         }
         
         source_file * source = file->get_source_file();
-        with_file_hash_table_mutex mtl(&m_table); // We think this fixes #34.  Also this must before the source_file_name_read_lock.
+        with_file_hash_table_mutex mtl(&m_table, source); // We think this fixes #34.  Also this must before the source_file_name_read_lock.
         with_source_file_name_read_lock sfl(source);
 
         if (!session->is_prefix_of_realpath(source->name())) {
@@ -304,12 +402,18 @@ void manager::disable_descriptions(void) throw() {
                     }
                 }) );
         description *file = m_map.get_unlocked(i);
-        if (file == NULL) {
+        if (file == NULL || file == fmap::untracked) {
             continue;
         }
 
         source_file * source = file->get_source_file();
         if (source != NULL) {
+            // A destination that other descriptions still share isn't
+            // closed here, so a compressed one has to be made readable now.
+            destination_file *dest = source->get_destination();
+            if (dest != NULL) {
+                ignore(dest->flush()); // It reports any error.
+            }
             source->try_to_remove_destination();
         }
     }
@@ -341,6 +445,20 @@ int manager::open(int fd, const char *file, int flags) throw() {
         return 0;
     }
 
+    // Don't track a file that no backup so far could have covered.
+    // If a backup comes to cover it, track_untracked_fds() will start
+    // tracking it then.
+    {
+        with_epoch_rdlocked ms(&m_session_lock);
+        if (m_tracked_dirs.is_active()) {
+            char full_path[PATH_MAX];
+            if (m_paths.realpath(file, full_path) != NULL && !m_tracked_dirs.may_contain(full_path)) {
+                m_map.put_untracked(fd);
+                return 0;
+            }
+        }
+    }
+
     // Create the description and source file objects.  This happens
     // whether we a backup session is in progress or not.
     int result = this->setup_description_and_source_file(fd, file, flags);
@@ -404,6 +522,15 @@ void manager::close(int fd) {
     TRACE("entering close() with fd = ", fd);
     description * file = NULL;
     m_map.get(fd, &file, BACKTRACE(NULL));
+    if (file == fmap::untracked) {
+        // Don't let a backup start tracking the fd as we close it.
+        with_epoch_rdlocked ms(&m_session_lock);
+        m_map.get(fd, &file, BACKTRACE(NULL));
+        if (file == fmap::untracked) {
+            int ignore __attribute__((unused)) = m_map.erase(fd, BACKTRACE(NULL)); // Any errors have been reported.
+            return;
+        }
+    }
     
     if (file == NULL) {
         return;
@@ -413,7 +540,7 @@ void manager::close(int fd) {
     {
         with_manager_enter_session_and_lock msl(this);
         if (msl.entered) {
-            with_file_hash_table_mutex mtl(&m_table);
+            with_file_hash_table_mutex mtl(&m_table, source);
             source->try_to_remove_destination();
         }
     }
@@ -429,6 +556,62 @@ void manager::close(int fd) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// iovec_length() -
+//
+// Description:
+//
+//     Returns the total length of the buffers in IOV[0..iovcnt).
+//
+static size_t iovec_length(const struct iovec *iov, int iovcnt) throw() {
+    size_t nbyte = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        nbyte += iov[i].iov_len;
+    }
+    return nbyte;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// call_real_write_vector() -
+//
+// Description:
+//
+//     Does the application's write, at OFFSET if POSITIONAL or else at
+// the fd's offset, with the system call the application asked for, so
+// that a single buffer still goes through write(2) or pwrite(2).
+//
+static ssize_t call_real_write_vector(int fd, const struct iovec *iov, int iovcnt, bool positional, off_t offset, int flags) throw() {
+    if (flags != 0) {
+        return call_real_pwritev2(fd, iov, iovcnt, positional ? offset : -1, flags);
+    }
+    if (iovcnt == 1) {
+        return positional ? call_real_pwrite(fd, iov[0].iov_base, iov[0].iov_len, offset) : call_real_write(fd, iov[0].iov_base, iov[0].iov_len);
+    }
+    return positional ? call_real_pwritev(fd, iov, iovcnt, offset) : call_real_writev(fd, iov, iovcnt);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// append_offset() -
+//
+// Description:
+//
+//     Returns where a write with RWF_APPEND lands: the end of the file.
+// The caller holds the lock on the whole file, so nobody else can
+// move the end.  Returns -1 (having reported the error) if we can't
+// tell.
+//
+static off_t append_offset(int fd) throw() {
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        the_manager.backup_error(errno, "Could not fstat fd %d at %s:%d", fd, __FILE__, __LINE__);
+        return -1;
+    }
+    return sbuf.st_size;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // write() -
@@ -440,37 +623,79 @@ void manager::close(int fd) {
 //     Also does the write itself (the write is in here so that a lock can be obtained to protect the file offset)
 //
 ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
+    struct iovec iov = { const_cast<void *>(buf), nbyte };
+    return this->write_at_fd_offset(fd, &iov, 1, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+ssize_t manager::writev(int fd, const struct iovec *iov, int iovcnt) throw() {
+    return this->write_at_fd_offset(fd, iov, iovcnt, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// write_at_fd_offset() -
+//
+// Description:
+//
+//     Does a write, writev or pwritev2 at the fd's offset, and mirrors
+// it into the backup.  The whole vector is written under one range lock
+// and mirrored with one write.
+//
+ssize_t manager::write_at_fd_offset(int fd, const struct iovec *iov, int iovcnt, int flags) throw() {
     TRACE("entering write() with fd = ", fd);
     bool ok = true;
-    description *description;
-    if (ok) {
-        m_map.get(fd, &description, BACKTRACE(NULL));
-        if (description == NULL) ok = false;
-    }
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description == NULL) ok = false;
     bool have_description_lock = false;
     if (ok && description) {
         description->lock(BACKTRACE(NULL));
         have_description_lock = true;
     }
+    const bool append = (flags & RWF_APPEND) != 0;
     source_file *file = NULL;
     bool have_range_lock = false;
+    bool block_locked = false;
     uint64_t lock_start=0, lock_end=0;
+    uint64_t write_start=0;
     if (ok && description) {
         file = description->get_source_file();
         // We need the range lock before calling real lock so that the write into the source and backup are atomic wrt other writes.
         TRACE("Grabbing file range lock() with fd = ", fd);
-        lock_start = description->get_offset();
-        lock_end   = lock_start + nbyte;
+        if (append) {
+            // We don't know where the end is until nobody else can move it.
+            lock_start = 0;
+            lock_end   = LLONG_MAX;
+        } else {
+            lock_start = description->get_offset();
+            lock_end   = lock_start + iovec_length(iov, iovcnt);
+        }
 
         // We want to release the description->lock ASAP, since it's limiting other writes.
         // We cannot release it before the real write since the real write determines the new m_offset.
-        file->lock_range(lock_start, lock_end);
+        block_locked = file->lock_for_write(lock_start, lock_end);
         have_range_lock = true;
+        write_start = lock_start;
+        if (append) {
+            off_t end = append_offset(fd);
+            if (end < 0) {
+                ok = false;
+            } else {
+                write_start = end;
+            }
+        }
     }
-    ssize_t n_wrote = call_real_write(fd, buf, nbyte);
+    ssize_t n_wrote = call_real_write_vector(fd, iov, iovcnt, false, -1, flags);
     if (n_wrote>0 && description) { // Don't need OK, just need description
         // actually wrote something.
-        description->increment_offset(n_wrote);
+        if (append && ok) {
+            description->lseek(write_start + n_wrote);
+        } else {
+            description->increment_offset(n_wrote);
+        }
+        description->get_source_file()->add_write_heat(n_wrote);
     }
     // Now we can release the description lock, since the offset is calculated.  Release it even if not OK.
     if (have_description_lock) {
@@ -478,24 +703,29 @@ ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
     }
 
     // We still have the lock range, with which we do the pwrite.
-    if (ok) {
+    if (ok && n_wrote > 0) {
         with_manager_enter_session_and_lock msl(this);
         if (msl.entered) {
             TRACE("write() captured with fd = ", fd);
             destination_file * dest_file = file->get_destination();
             if (dest_file != NULL) {
-                int r = dest_file->pwrite(buf, nbyte, lock_start);
-                if (r!=0) {
-                    // The error has been reported.
-                    ok = false;
+                // The copier will read whatever lies beyond its frontier.
+                const size_t n_mirror = file->n_bytes_to_mirror(write_start, n_wrote);
+                if (n_mirror > 0) {
+                    int r = this->mirror_writev(dest_file, iov, iovcnt, n_mirror, write_start);
+                    if (r!=0) {
+                        // The error has been reported.
+                        ok = false;
+                    }
                 }
+                m_session->capture_write(file, write_start, n_wrote);
             }
         }
     }
 
     if (have_range_lock) { // Release the range lock if if not OK.
         TRACE("Releasing file range lock() with fd = ", fd);
-        int r = file->unlock_range(lock_start, lock_end);
+        int r = file->unlock_for_write(lock_start, lock_end, block_locked);
         // The error has been reported.
         if (r!=0) ok = false;
     }
@@ -513,8 +743,8 @@ ssize_t manager::write(int fd, const void *buf, size_t nbyte) throw() {
 ssize_t manager::read(int fd, void *buf, size_t nbyte) throw() {
     TRACE("entering write() with fd = ", fd);
     ssize_t r = 0;
-    description *description;
-    m_map.get(fd, &description, BACKTRACE(NULL));
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
     if (description == NULL) {
         r = call_real_read(fd, buf, nbyte);
     } else {
@@ -529,6 +759,33 @@ ssize_t manager::read(int fd, void *buf, size_t nbyte) throw() {
     return r;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// readv() -
+//
+// Description:
+//
+//     Same as read(), for a vector of buffers.
+//
+ssize_t manager::readv(int fd, const struct iovec *iov, int iovcnt) throw() {
+    TRACE("entering readv() with fd = ", fd);
+    ssize_t r = 0;
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description == NULL) {
+        r = call_real_readv(fd, iov, iovcnt);
+    } else {
+        description->lock(BACKTRACE(NULL));
+        r = call_real_readv(fd, iov, iovcnt);
+        if (r>0) {
+            description->increment_offset(r); //moves the offset
+        }
+        description->unlock(BACKTRACE(NULL));
+    }
+
+    return r;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // pwrite() -
@@ -538,38 +795,87 @@ ssize_t manager::read(int fd, void *buf, size_t nbyte) throw() {
 //     Same as regular write, but uses additional offset argument
 // to write to a particular position in the backup file.
 //
-ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) throw()
+ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) throw() {
+    struct iovec iov = { const_cast<void *>(buf), nbyte };
+    return this->write_at(fd, &iov, 1, offset, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+ssize_t manager::pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) throw() {
+    return this->write_at(fd, iov, iovcnt, offset, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// pwritev2() -
+//
+// Description:
+//
+//     An offset of -1 means the fd's offset, as for writev().
+//
+ssize_t manager::pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw() {
+    if (offset == -1) {
+        return this->write_at_fd_offset(fd, iov, iovcnt, flags);
+    }
+    return this->write_at(fd, iov, iovcnt, offset, flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// write_at() -
+//
+// Description:
+//
+//     Does a pwrite, pwritev or pwritev2 at OFFSET, and mirrors it
+// into the backup.  The whole vector is written under one range lock
+// and mirrored with one write.
+//
+ssize_t manager::write_at(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw()
 // Do the write, returning the number of bytes written.
 // Note: If the backup destination gets a short write, that's an error.
 {
     TRACE("entering pwrite() with fd = ", fd);
-    description *description;
-    {
-        m_map.get(fd, &description, BACKTRACE(NULL));
-        if (description == NULL) {
-            int res = call_real_pwrite(fd, buf, nbyte, offset);
-            return res;
-        }
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description == NULL) {
+        return call_real_write_vector(fd, iov, iovcnt, true, offset, flags);
     }
 
     source_file * file = description->get_source_file();
 
-    file->lock_range(offset, offset+nbyte);
-    ssize_t nbytes_written = call_real_pwrite(fd, buf, nbyte, offset);
+    // With RWF_APPEND the offset is ignored, and we don't know where
+    // the end is until nobody else can move it.
+    const bool append = (flags & RWF_APPEND) != 0;
+    const uint64_t lock_start = append ? 0 : offset;
+    const uint64_t lock_end = append ? LLONG_MAX : offset + iovec_length(iov, iovcnt);
+    const bool block_locked = file->lock_for_write(lock_start, lock_end);
+    bool ok = true;
+    if (append) {
+        offset = append_offset(fd);
+        ok = (offset >= 0);
+    }
+    ssize_t nbytes_written = call_real_write_vector(fd, iov, iovcnt, true, offset, flags);
     int e = 0;
     if (nbytes_written>0) {
+        file->add_write_heat(nbytes_written);
         with_manager_enter_session_and_lock msl(this);
-        if (msl.entered) {
+        if (ok && msl.entered) {
             destination_file * dest_file = file->get_destination();
             if (dest_file != NULL) {
-                ignore(dest_file->pwrite(buf, nbyte, offset)); // nothing more to do.  It's been reported.
+                // The copier will read whatever lies beyond its frontier.
+                const size_t n_mirror = file->n_bytes_to_mirror(offset, nbytes_written);
+                if (n_mirror > 0) {
+                    ignore(this->mirror_writev(dest_file, iov, iovcnt, n_mirror, offset)); // nothing more to do.  It's been reported.
+                }
+                m_session->capture_write(file, offset, nbytes_written);
             }
         }
     } else if (nbytes_written<0) {
         e = errno; // save the errno
     }
 
-    ignore(file->unlock_range(offset, offset+nbyte)); // nothing more to do.  It's been reported.
+    ignore(file->unlock_for_write(lock_start, lock_end, block_locked)); // nothing more to do.  It's been reported.
     if (nbytes_written<0) {
         errno = e; // restore errno
     }
@@ -577,7 +883,6 @@ ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) thr
     return nbytes_written;
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // seek() -
@@ -589,12 +894,10 @@ ssize_t manager::pwrite(int fd, const void *buf, size_t nbyte, off_t offset) thr
 //
 off_t manager::lseek(int fd, size_t nbyte, int whence) throw() {
     TRACE("entering seek() with fd = ", fd);
-    description *description;
     bool ok = true;
-    {
-        m_map.get(fd, &description, BACKTRACE(NULL));
-        if (description==NULL) ok = false;
-    }
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description==NULL) ok = false;
     if (ok) {
         description->lock(BACKTRACE(NULL));
     }
@@ -617,7 +920,8 @@ off_t manager::lseek(int fd, size_t nbyte, int whence) throw() {
 int manager::rename(const char *oldpath, const char *newpath) throw() {
     TRACE("entering rename() with oldpath = ", oldpath);
     int user_error = 0;
-    const char * full_old_path = call_real_realpath(oldpath, NULL);
+    bool maybe_directory;
+    const char * full_old_path = this->resolve_path(oldpath, &maybe_directory);
     if (full_old_path == NULL) {
         int error = errno;
         if (error == ENOMEM) {
@@ -631,9 +935,13 @@ int manager::rename(const char *oldpath, const char *newpath) throw() {
     // So just call it now, regardless of CAPTURE state.
     user_error = call_real_rename(oldpath, newpath);
     if (user_error == 0) {
+        // The directories under a renamed directory have new realpaths.
+        if (maybe_directory) {
+            m_paths.forget_tree(full_old_path);
+        }
         with_manager_enter_session_and_lock msl(this);
         if (msl.entered) {
-            this->capture_rename(full_old_path, newpath); // takes ownership of the full_old_path, so tough to make RAII.
+            this->capture_rename(full_old_path, newpath, maybe_directory); // takes ownership of the full_old_path, so tough to make RAII.
         }
     }
 
@@ -644,7 +952,7 @@ int manager::rename(const char *oldpath, const char *newpath) throw() {
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-void manager::capture_rename(const char * full_old_path, const char * newpath)
+void manager::capture_rename(const char * full_old_path, const char * newpath, bool maybe_directory)
 {
     int error = 0;
     int r = 0;
@@ -653,12 +961,25 @@ void manager::capture_rename(const char * full_old_path, const char * newpath)
     // We could not call this earlier, since the new file path
     // did not exist till AFTER we called the real rename on 
     // the original source file.
-    with_object_to_free<char*> full_new_path(call_real_realpath(newpath, NULL));
+    with_object_to_free<char*> full_new_path(this->resolve_path(newpath));
     if (full_new_path.value != NULL) {
         TRACE("renaming backup copy", full_new_path.value);
         bool original_present = m_session->is_prefix_of_realpath(full_old_path);
         bool new_present = m_session->is_prefix_of_realpath(full_new_path.value);
 
+        // Neither name's manifest entry (if any) describes what is in the backup under that name any more.
+        // rename() lstat()ed the old path, so we only stat() the new one if it might be a directory.
+        if (original_present || new_present) {
+            struct stat sbuf;
+            const bool is_directory = (maybe_directory && stat(full_new_path.value, &sbuf) == 0 && S_ISDIR(sbuf.st_mode));
+            if (original_present) {
+                m_session->capture_forget(full_old_path, is_directory);
+            }
+            if (new_present) {
+                m_session->capture_forget(full_new_path.value, is_directory);
+            }
+        }
+
         // Four cases:
         if ((original_present == false) && (new_present == false)) { 
             // 1. If neither file is in the directory we just bail.
@@ -728,7 +1049,7 @@ int manager::unlink(const char *path) throw() {
     int r = 0;
     int user_error = 0;
     source_file * source = NULL;
-    with_object_to_free<char*> full_path(call_real_realpath(path, NULL));
+    with_object_to_free<char*> full_path(this->resolve_path(path));
     if (full_path.value == NULL) {
         int error = errno;
         if (error == ENOMEM) {
@@ -749,8 +1070,8 @@ int manager::unlink(const char *path) throw() {
     m_table.get_or_create_locked(full_path.value, &source);
 
     {
-        with_rwlock_rdlocked ms(&m_session_rwlock);
-        with_file_hash_table_mutex mtl(&m_table);
+        with_epoch_rdlocked ms(&m_session_lock);
+        with_file_hash_table_mutex mtl(&m_table, source);
 
         if (this->should_capture_unlink_of_file(full_path.value)) {
             // 1. Find source file, unlink it.
@@ -772,6 +1093,7 @@ int manager::unlink(const char *path) throw() {
             }
 
             // 3. Unlink the destination file.
+            m_session->capture_forget(full_path.value, false);
             r = dest->unlink();
             if (r != 0) {
                 int error = errno;
@@ -811,18 +1133,16 @@ int manager::ftruncate(int fd, off_t length) throw() {
     TRACE("entering ftruncate with fd = ", fd);
     // TODO: Remove the logic for null descriptions, since we will
     // always have a description and a source_file.
-    description *description;
-    {
-        m_map.get(fd, &description, BACKTRACE(NULL));
-        if (description == NULL) {
-            int res = call_real_ftruncate(fd, length);
-            return res;
-        }
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description == NULL) {
+        int res = call_real_ftruncate(fd, length);
+        return res;
     }
 
     source_file * file = description->get_source_file();
 
-    file->lock_range(length, LLONG_MAX);
+    const bool block_locked = file->lock_for_write(length, LLONG_MAX);
     int user_result = call_real_ftruncate(fd, length);
     int e = 0;
     if (user_result==0) {
@@ -833,19 +1153,88 @@ int manager::ftruncate(int fd, off_t length) throw() {
                  // the error from truncate been reported, so there's
                  // nothing we can do about that error except to try
                  // to unlock the range.
+                this->drain_captured_writes(dest_file);
                 ignore(dest_file->truncate(length));
+                m_session->capture_truncate(file, length);
             }
         }
     } else {
         e = errno; // save errno
     }
-    ignore(file->unlock_range(length, LLONG_MAX)); // it's been reported, so there's not much more to do
+    ignore(file->unlock_for_write(length, LLONG_MAX, block_locked)); // it's been reported, so there's not much more to do
     if (user_result!=0) {
         errno = e; // restore errno
     }
     return user_result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// fallocate() -
+//
+// Description:
+//
+//     Does the application's fallocate(2), and does the same to the
+// backup file, so that the backup is preallocated (or has its holes
+// punched, or ranges zeroed) just like the source.
+//
+int manager::fallocate(int fd, int mode, off_t offset, off_t len) throw() {
+    return this->allocate(fd, mode, offset, len, false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// posix_fallocate() -
+//
+// Description:
+//
+//     Same as fallocate() with a mode of zero, except that it returns
+// an error number instead of setting errno.
+//
+int manager::posix_fallocate(int fd, off_t offset, off_t len) throw() {
+    return this->allocate(fd, 0, offset, len, true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::allocate(int fd, int mode, off_t offset, off_t len, bool posix) throw() {
+    TRACE("entering fallocate with fd = ", fd);
+    with_fd_description fdd(this, fd);
+    description *description = fdd.value;
+    if (description == NULL) {
+        return posix ? call_real_posix_fallocate(fd, offset, len) : call_real_fallocate(fd, mode, offset, len);
+    }
+
+    source_file * file = description->get_source_file();
+
+    // Collapsing or inserting a range moves everything after it.
+    const bool shifts = (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) != 0;
+    const uint64_t lock_start = offset;
+    const uint64_t lock_end = shifts ? LLONG_MAX : offset + len;
+    const bool block_locked = file->lock_for_write(lock_start, lock_end);
+    int user_result = posix ? call_real_posix_fallocate(fd, offset, len) : call_real_fallocate(fd, mode, offset, len);
+    int e = errno; // save errno
+    if (user_result==0) {
+        with_manager_enter_session_and_lock msl(this);
+        if (msl.entered) {
+            destination_file * dest_file = file->get_destination();
+            if (dest_file != NULL) {
+                // The captured writes to this range have to land first.
+                this->drain_captured_writes(dest_file);
+                ignore(dest_file->fallocate(mode, offset, len)); // It's been reported.
+                if (shifts) {
+                    m_session->capture_truncate(file, offset);
+                } else {
+                    m_session->capture_write(file, offset, len);
+                }
+            }
+        }
+    }
+    ignore(file->unlock_for_write(lock_start, lock_end, block_locked)); // it's been reported, so there's not much more to do
+    errno = e; // restore errno
+    return user_result;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // truncate() -
@@ -858,41 +1247,62 @@ int manager::truncate(const char *path, off_t length) throw() {
     int r;
     int user_error = 0;
     int error = 0;
-    with_object_to_free<char*> full_path(call_real_realpath(path, NULL));
+    with_object_to_free<char*> full_path(this->resolve_path(path));
     if (full_path.value == NULL) {
         error = errno;
         the_manager.backup_error(error, "Failed to truncate backup file.");
         return call_real_truncate(path, length);
     }
 
-    with_rwlock_rdlocked ms(&m_session_rwlock);
+    with_epoch_rdlocked ms(&m_session_lock);
     
     if (m_session != NULL && m_session->is_prefix_of_realpath(full_path.value)) {
         with_object_to_free<char *> destination_file(m_session->translate_prefix_of_realpath(full_path.value));
-        // Find and lock the associated source file.
+        // Find (or make) and lock the associated source file.  The
+        // table is keyed by source name, and the file needn't be open.
         source_file *file;
-        {
-            with_file_hash_table_mutex mtl(&m_table);
-
-            file = m_table.get(destination_file.value);
-            file->add_reference();
-        }
+        m_table.get_or_create_locked(full_path.value, &file);
         
-        file->lock_range(length, LLONG_MAX);
+        const bool block_locked = file->lock_for_write(length, LLONG_MAX);
         
         user_error = call_real_truncate(full_path.value, length);
         if (user_error == 0 && this->capture_is_enabled()) {
-            r = call_real_truncate(destination_file.value, length);
-            if (r != 0) {
+            if (file->get_destination() != NULL) {
+                this->drain_captured_writes(file->get_destination());
+            }
+            if (m_stream_this_backup) {
+                r = m_stream.truncate(destination_file.value, length);
+                if (r != 0) {
+                    the_manager.backup_error(r, "Could not stream the truncate of a backup file.");
+                }
+            } else if (!this->destinations_are_plain()) {
+                // A compressed or chunked backup file's length isn't its
+                // length on disk, so it has to be truncated through its
+                // destination_file, which we open if nothing has.
+                with_file_hash_table_mutex mtl(&m_table, file);
+                if (file->get_destination() == NULL) {
+                    r = file->try_to_create_destination_file(destination_file.value);
+                    if (r != 0 && r != ENOENT) {
+                        the_manager.backup_error(r, "Could not open backup file %s", destination_file.value);
+                    }
+                }
+                if (file->get_destination() != NULL) {
+                    ignore(file->get_destination()->truncate(length)); // It's been reported.
+                }
+            } else if (call_real_truncate(destination_file.value, length) != 0) {
                 error = errno;
                 if (error != ENOENT) {
                     the_manager.backup_error(error, "Could not truncate backup file.");
                 }
             }
+            m_session->capture_truncate(full_path.value, length);
         }
 
-        r = file->unlock_range(length, LLONG_MAX);
-        file->remove_reference();
+        r = file->unlock_for_write(length, LLONG_MAX, block_locked);
+        {
+            with_file_hash_table_mutex mtl(&m_table, file);
+            m_table.try_to_remove(file);
+        }
         if (r != 0) {
             user_error = call_real_truncate(path, length);
             // More RAII-fixed problems (the session rwlock wasn't freed, and the destination_file wasn't freed.
@@ -921,7 +1331,7 @@ free_out:
 //     TBD...
 //
 void manager::mkdir(const char *pathname) throw() {
-    with_rwlock_rdlocked ml(&m_session_rwlock);
+    with_epoch_rdlocked ml(&m_session_lock);
 
     if(m_session != NULL) {
         int r = m_session->capture_mkdir(pathname);
@@ -946,6 +1356,273 @@ unsigned long manager::get_throttle(void) const throw() {
     return m_throttle;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_throttle_burst(unsigned long bytes) throw() {
+    m_throttle_bucket.set_burst(bytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned long manager::get_throttle_burst(void) const throw() {
+    return m_throttle_bucket.get_burst();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+double manager::charge_throttle(uint64_t n_bytes, unsigned long rate) throw() {
+    return m_throttle_bucket.take(n_bytes, rate);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_copy_threads(int n_threads) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_copy_threads, sizeof(m_copy_threads));
+    m_copy_threads = (n_threads < 1) ? 1 : n_threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::get_copy_threads(void) const throw() {
+    return m_copy_threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_zero_copy(bool zero_copy) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_zero_copy, sizeof(m_zero_copy));
+    m_zero_copy = zero_copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::zero_copy_is_enabled(void) const throw() {
+    return m_zero_copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_reflink(bool reflink) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_reflink, sizeof(m_reflink));
+    m_reflink = reflink;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::reflink_is_enabled(void) const throw() {
+    return m_reflink;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_io_queue_depth(unsigned int depth) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_io_queue_depth, sizeof(m_io_queue_depth));
+    // Each slot pins a copy buffer, so don't let a typo lock down gigabytes.
+    m_io_queue_depth = (depth > max_io_queue_depth) ? max_io_queue_depth : depth;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+unsigned int manager::get_io_queue_depth(void) const throw() {
+    return m_io_queue_depth;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_copy_order(int order) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_copy_order, sizeof(m_copy_order));
+    switch (order) {
+    case TOKUBACKUP_COPY_ORDER_LARGEST_FIRST:
+    case TOKUBACKUP_COPY_ORDER_SMALLEST_FIRST:
+    case TOKUBACKUP_COPY_ORDER_COLDEST_FIRST:
+        m_copy_order = order;
+        break;
+    default:
+        m_copy_order = TOKUBACKUP_COPY_ORDER_TREE;
+        break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::get_copy_order(void) const throw() {
+    return m_copy_order;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_compression(bool compress) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_compress, sizeof(m_compress));
+    m_compress = compress;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::compress_this_backup(void) const throw() {
+    return m_compress_this_backup;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_stream_fd(int fd) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_stream_fd, sizeof(m_stream_fd));
+    m_stream_fd = (fd < 0) ? -1 : fd;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::get_stream_fd(void) const throw() {
+    return m_stream_fd;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_stream_window(unsigned int batches) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_stream_window, sizeof(m_stream_window));
+    m_stream_window = batches;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+action_stream *manager::backup_stream(void) throw() {
+    return m_stream_this_backup ? &m_stream : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int manager::set_chunk_store(const char *dir) throw() {
+    char *copy = NULL;
+    if (dir != NULL) {
+        copy = strdup(dir);
+        if (copy == NULL) {
+            return ENOMEM;
+        }
+    }
+    with_mutex_locked ml(&m_chunk_store_mutex);
+    free(m_chunk_store_dir);
+    m_chunk_store_dir = copy;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+chunk_store *manager::backup_chunk_store(void) throw() {
+    return m_chunk_this_backup ? &m_chunk_store : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+compression_pool *manager::backup_compression_pool(void) throw() {
+    return m_compress_this_backup ? &m_compression_pool : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool manager::destinations_are_plain(void) const throw() {
+    return !m_compress_this_backup && !m_chunk_this_backup && !m_stream_this_backup;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_write_manifest(bool write_manifest) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_write_manifest, sizeof(m_write_manifest));
+    m_write_manifest = write_manifest;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// set_incremental_base() -
+//
+// Description:
+//
+//     Replaces our copies of the incremental base directories.  A
+// running backup has already read the old ones.
+//
+int manager::set_incremental_base(const char *base_dirs[], int dir_count) throw() {
+    if (dir_count < 0) {
+        return EINVAL;
+    }
+    char **copies = NULL;
+    if (dir_count > 0) {
+        copies = new char*[dir_count];
+        for (int i = 0; i < dir_count; ++i) {
+            copies[i] = strdup(base_dirs[i]);
+            if (copies[i] == NULL) {
+                while (i > 0) {
+                    free(copies[--i]);
+                }
+                delete[] copies;
+                return ENOMEM;
+            }
+        }
+    }
+
+    with_mutex_locked ml(&m_incremental_base_mutex);
+    for (int i = 0; i < m_incremental_base_count; ++i) {
+        free(m_incremental_base[i]);
+    }
+    delete[] m_incremental_base;
+    m_incremental_base = copies;
+    m_incremental_base_count = dir_count;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::set_capture_queue_size(unsigned long bytes) throw() {
+    m_write_behind.set_capacity(bytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+char *manager::resolve_path(const char *path, bool *maybe_directory) throw() {
+    return m_paths.realpath(path, maybe_directory);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void manager::drain_captured_writes(destination_file *dest) throw() {
+    m_write_behind.drain(dest);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// mirror_writev() -
+//
+// Description:
+//
+//     Make a captured write to the backup: queue it for the flusher,
+// or do it now if they aren't running.  Only the first NBYTE bytes of
+// IOV are written, since the application's write may have been short,
+// or reached past the copier's frontier.  The caller holds the source's
+// range lock, so writes to any one offset are queued in order.
+//
+int manager::mirror_writev(destination_file *dest, const struct iovec *iov, int iovcnt, size_t nbyte, off_t offset) throw() {
+    // Trim the vector to NBYTE.
+    struct iovec *trimmed = (struct iovec *)malloc(iovcnt * sizeof(trimmed[0]));
+    if (trimmed == NULL && iovcnt > 0) {
+        int r = errno;
+        this->backup_error(r, "Could not allocate memory at %s:%d", __FILE__, __LINE__);
+        return r;
+    }
+    int n_trimmed = 0;
+    for (size_t left = nbyte; n_trimmed < iovcnt && left > 0; n_trimmed++) {
+        trimmed[n_trimmed] = iov[n_trimmed];
+        if (trimmed[n_trimmed].iov_len > left) {
+            trimmed[n_trimmed].iov_len = left;
+        }
+        left -= trimmed[n_trimmed].iov_len;
+    }
+    int r = 0;
+    if (m_write_behind.is_running()) {
+        m_write_behind.enqueue(dest, trimmed, n_trimmed, nbyte, offset);
+    } else {
+        r = dest->pwritev(trimmed, n_trimmed, offset);
+    }
+    free(trimmed);
+    return r;
+}
+
 void manager::backup_error_ap(int errnum, const char *format_string, va_list ap) throw() {
     this->disable_capture();
     this->disable_copy();
@@ -1000,10 +1677,10 @@ void manager::set_error_internal(int errnum, const char *format_string, va_list
 ///////////////////////////////////////////////////////////////////////////////
 //
 bool manager::try_to_enter_session_and_lock(void) throw() {
-    prwlock_rdlock(&m_session_rwlock);
+    m_session_lock.rdlock();
 
     if (m_session == NULL) {
-        prwlock_unlock(&m_session_rwlock);
+        m_session_lock.rdunlock();
         return false;
     }
 
@@ -1013,7 +1690,7 @@ bool manager::try_to_enter_session_and_lock(void) throw() {
 ///////////////////////////////////////////////////////////////////////////////
 //
 void manager::exit_session_and_unlock_or_die(void) throw() {
-    prwlock_unlock(&m_session_rwlock);
+    m_session_lock.rdunlock();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1026,7 +1703,7 @@ int manager::setup_description_and_source_file(int fd, const char *file, const i
     // Resolve the given, possibly relative, file path to
     // the full path. 
     {
-        with_object_to_free<char*> full_source_file_path(call_real_realpath(file, NULL));
+        with_object_to_free<char*> full_source_file_path(this->resolve_path(file));
         if (full_source_file_path.value == NULL) {
             error = errno;
             // This error is not recoverable, because we can't guarantee 
@@ -1050,6 +1727,85 @@ int manager::setup_description_and_source_file(int fd, const char *file, const i
     return error;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// track_untracked_fds() -
+//
+// Description:
+//
+//     Starts tracking the untracked fds whose files SESSION covers, so
+// that their writes are captured.  Called with the session lock held
+// for writing, so nothing is using those fds through us.  We find each
+// file's current name in /proc.  The new description starts at the
+// fd's current offset.
+//
+int manager::track_untracked_fds(backup_session *session) throw() {
+    const int size = m_map.size();
+    for (int fd = 0; fd < size; ++fd) {
+        if (m_map.get_unlocked(fd) != fmap::untracked) {
+            continue;
+        }
+        char proc_path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        char path[PATH_MAX];
+        ssize_t n = readlink(proc_path, path, sizeof(path) - 1);
+        if (n < 0) {
+            int r = errno;
+            this->backup_error(r, "Could not find the file open as fd %d", fd);
+            return r;
+        }
+        path[n] = '\0';
+        struct stat sbuf;
+        if (fstat(fd, &sbuf) != 0 || sbuf.st_nlink == 0) {
+            continue; // The file has been unlinked, so it isn't in the backup.
+        }
+        if (!session->is_prefix_of_realpath(path)) {
+            continue;
+        }
+        const int flags = fcntl(fd, F_GETFL);
+        const off_t offset = call_real_lseek(fd, 0, SEEK_CUR);
+        if (flags < 0 || offset < 0) {
+            int r = errno;
+            this->backup_error(r, "Could not start tracking %s", path);
+            return r;
+        }
+        int r = this->setup_description_and_source_file(fd, path, flags);
+        if (r != 0) {
+            return r; // The error has been reported.
+        }
+        description *file = m_map.get_unlocked(fd);
+        file->lseek(offset);
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+with_fd_description::with_fd_description(manager *m, int fd) throw()
+  : m_manager(m), m_session_locked(false), value(NULL) {
+    m_manager->m_map.get(fd, &value, BACKTRACE(NULL));
+    if (value == fmap::untracked) {
+        // Look again with the session lock held, in case a backup has just started tracking the fd.
+        m_manager->m_session_lock.rdlock();
+        m_session_locked = true;
+        m_manager->m_map.get(fd, &value, BACKTRACE(NULL));
+        if (value == fmap::untracked) {
+            value = NULL;
+        } else {
+            m_manager->m_session_lock.rdunlock();
+            m_session_locked = false;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+with_fd_description::~with_fd_description(void) throw() {
+    if (m_session_locked) {
+        m_manager->m_session_lock.rdunlock();
+    }
+}
+
 void manager::lock_file_op(void)
 {
     pmutex_lock(&m_atomic_file_op_mutex);
@@ -38,12 +38,20 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
 #ident "$Id$"
 
+#include "action_stream.h"
 #include "backup.h"
 #include "backup_directory.h"
+#include "chunk_store.h"
+#include "compressed_file.h"
 #include "description.h"
 #include "file_hash_table.h"
 #include "manager_state.h"
 #include "directory_set.h"
+#include "epoch_rwlock.h"
+#include "path_cache.h"
+#include "prefix_filter.h"
+#include "token_bucket.h"
+#include "write_behind.h"
 
 #include <pthread.h>
 #include <stdarg.h>
@@ -67,15 +75,39 @@ private:
 
     fmap m_map;
     file_hash_table m_table;
+    path_cache m_paths;              // Remembers the realpaths of the directories that captured files are in.
     static pthread_mutex_t m_mutex; // Used to serialize multiple backup operations.
 
     //static pthread_rwlock_t m_capture_rwlock; // Used to serialize access of CAPTURE boolean flag.
     //bool m_capture_enabled;
 
     backup_session *m_session;
-    static pthread_rwlock_t m_session_rwlock;
+    static epoch_rwlock m_session_lock; // Protects m_session.  Every captured call takes it for reading.
+    prefix_filter m_tracked_dirs; // The source directories of every backup so far.  Files opened outside them aren't tracked.  Protected by m_session_lock.
 
     volatile unsigned long m_throttle;
+    token_bucket m_throttle_bucket; // Shared by every copier thread.
+    write_behind m_write_behind;    // Mirrors captured writes into the backup, when it's running.
+    volatile int m_copy_threads;
+    volatile bool m_zero_copy;
+    volatile bool m_reflink;
+    volatile unsigned int m_io_queue_depth;
+    volatile int m_copy_order;
+    volatile bool m_write_manifest;
+    volatile bool m_compress;
+    bool m_compress_this_backup;     // m_compress, as it was when this backup started.
+    compression_pool m_compression_pool; // Helps compress the backup's writes, when it's running.
+    volatile int m_stream_fd;        // -1 unless backups are streamed.
+    volatile unsigned int m_stream_window; // How many batches the stream leaves unacknowledged, or 0.
+    action_stream m_stream;
+    bool m_stream_this_backup;       // Is m_stream in use?  Changed only with the session lock held for writing.
+    char **m_incremental_base;       // Copies of the base directories given to tokubackup_set_incremental_base().
+    int m_incremental_base_count;    // Zero for full backups.
+    static pthread_mutex_t m_incremental_base_mutex; // Protects m_incremental_base and m_incremental_base_count.
+    char *m_chunk_store_dir;         // A copy of the directory given to tokubackup_set_chunk_store(), or NULL.
+    static pthread_mutex_t m_chunk_store_mutex; // Protects m_chunk_store_dir.
+    chunk_store m_chunk_store;
+    bool m_chunk_this_backup;        // Is m_chunk_store in use?  Set before the session starts, and cleared with the session lock held for writing.
 
     // Error handling.
     static pthread_mutex_t m_error_mutex;     // When testing errors grab this mutex. 
@@ -95,16 +127,56 @@ public:
     void close(int fd); // It has reported the error to the backup manager, and the application doesn't care.
     ssize_t write(int fd, const void *buf, size_t nbyte) throw(); // Actually performs the write on fd (so that a lock can be obtained).
     ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset) throw(); // Actually performs the write on fd (so that a lock can be obtained).
+    ssize_t writev(int fd, const struct iovec *iov, int iovcnt) throw();                // Like write(), mirroring the whole vector with one write.
+    ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) throw(); // Like pwrite(), mirroring the whole vector with one write.
+    ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw();
     ssize_t read(int fd, void *buf, size_t nbyte) throw();        // Actually performs the read (so a lock can be obtained).  Returns the number read.
+    ssize_t readv(int fd, const struct iovec *iov, int iovcnt) throw(); // Like read().
     off_t   lseek(int fd, size_t nbyte, int whence) throw();      // Actually performs the seek (so a lock can be obtained).
     int rename(const char *oldpath, const char *newpath) throw();
     int unlink(const char *path) throw();
     int ftruncate(int fd, off_t length) throw();                  // Actually performs the trunate (so a lock can be obtained).
+    int fallocate(int fd, int mode, off_t offset, off_t len) throw(); // Actually performs the fallocate (so a lock can be obtained).
+    int posix_fallocate(int fd, off_t offset, off_t len) throw();     // Returns an error number, as posix_fallocate() does.
     int truncate(const char *path, off_t length) throw();
     void mkdir(const char *pathname) throw();
     
     void set_throttle(unsigned long bytes_per_second) throw(); // This is thread-safe.
     unsigned long get_throttle(void) const throw();                 // This is thread-safe.
+    void set_throttle_burst(unsigned long bytes) throw();         // This is thread-safe.
+    unsigned long get_throttle_burst(void) const throw();           // This is thread-safe.
+    double charge_throttle(uint64_t n_bytes, unsigned long rate) throw();
+    // Effect: Charge n_bytes of copying to the process-wide token bucket, which fills at rate bytes per second.
+    //  Returns how many seconds the caller should wait before copying more (see token_bucket::take()).  This is thread-safe.
+    void set_copy_threads(int n_threads) throw();  // This is thread-safe.  Takes effect at the next backup.
+    int get_copy_threads(void) const throw();      // This is thread-safe.
+    void set_zero_copy(bool zero_copy) throw();    // Let the copier use copy_file_range(2) and splice(2) (the default).  This is thread-safe.
+    bool zero_copy_is_enabled(void) const throw(); // This is thread-safe.
+    void set_reflink(bool reflink) throw();        // Let the copier clone files instead of copying them.  This is thread-safe.
+    bool reflink_is_enabled(void) const throw();   // This is thread-safe.
+    void set_io_queue_depth(unsigned int depth) throw(); // Zero copies synchronously (the default).  This is thread-safe.
+    unsigned int get_io_queue_depth(void) const throw(); // This is thread-safe.
+    void set_copy_order(int order) throw();        // One of the TOKUBACKUP_COPY_ORDER_ values.  This is thread-safe.
+    int get_copy_order(void) const throw();        // This is thread-safe.
+    void set_write_manifest(bool write_manifest) throw(); // Write a manifest into each destination.  This is thread-safe.
+    void set_compression(bool compress) throw();   // Write the backup in the compressed format.  This is thread-safe.  Takes effect at the next backup.
+    bool compress_this_backup(void) const throw(); // Is the running backup compressed?
+    compression_pool *backup_compression_pool(void) throw(); // The running backup's compression pool, or NULL if it isn't compressed.  Call this only within the session.
+    void set_stream_fd(int fd) throw();            // Stream backups to FD, or write them to their directories if FD is negative.  This is thread-safe.  Takes effect at the next backup.
+    int get_stream_fd(void) const throw();         // This is thread-safe.
+    void set_stream_window(unsigned int batches) throw(); // Have the receiver acknowledge the stream, with BATCHES in flight (0 for none).  This is thread-safe.  Takes effect at the next backup.
+    action_stream *backup_stream(void) throw();    // The running backup's stream, or NULL if it isn't streamed.  Call this only within the session.
+    int set_chunk_store(const char *dir) throw();  // Deduplicate backups into the chunk store in DIR, or don't if DIR is NULL.  Returns 0 or ENOMEM.  This is thread-safe.  Takes effect at the next backup.
+    chunk_store *backup_chunk_store(void) throw(); // The running backup's chunk store, or NULL if it isn't deduplicated.  Call this only within the session.
+    bool destinations_are_plain(void) const throw(); // Are the running backup's files written as they are, into its directories?  (Not if it is compressed, chunked or streamed.)
+    int set_incremental_base(const char *base_dirs[], int dir_count) throw(); // Returns 0, EINVAL or ENOMEM.  This is thread-safe.
+    void set_capture_queue_size(unsigned long bytes) throw(); // Zero mirrors captured writes synchronously.  This is thread-safe.  Takes effect at the next backup.
+    char *resolve_path(const char *path, bool *maybe_directory = NULL) throw() __attribute__((warn_unused_result));
+    // Effect: Like call_real_realpath(path, NULL), but remembers the realpaths of directories.  This is thread-safe.
+    //  If MAYBE_DIRECTORY isn't NULL, sets it to false if PATH is known not to name a directory.
+    void drain_captured_writes(destination_file *dest) throw();
+    // Effect: Wait until the captured writes queued for DEST have been written to it.
+    //  Call this before changing DEST in any other way (truncating it, closing it, or calling it done).
 
     void fatal_error(int errnum, const char *format, ...) throw() __attribute__((format(printf,3,4)));
     void backup_error(int errnum, const char *format, ...) throw() __attribute__((format(printf,3,4)));
@@ -132,19 +204,28 @@ public:
 
 private:
     // Backup session control methods.
-    void capture_rename(const char *, const char *);
+    void capture_rename(const char *full_old_path, const char *newpath, bool maybe_directory);
     bool try_to_enter_session_and_lock(void) throw();
     void exit_session_and_unlock_or_die(void) throw();
     int prepare_directories_for_backup(backup_session *session, const backtrace bt) throw();
     void disable_descriptions(void) throw();
     void set_error_internal(int errnum, const char *format, va_list ap) throw();
     int setup_description_and_source_file(int fd, const char *file, const int flags) throw();
+    int track_untracked_fds(backup_session *session) throw();
     bool should_capture_unlink_of_file(const char *file) throw();
+    ssize_t write_at_fd_offset(int fd, const struct iovec *iov, int iovcnt, int flags) throw();
+    ssize_t write_at(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw();
+    int allocate(int fd, int mode, off_t offset, off_t len, bool posix) throw();
+    int mirror_writev(destination_file *dest, const struct iovec *iov, int iovcnt, size_t nbyte, off_t offset) throw(); // Mirrors the first NBYTE bytes of IOV.  Returns 0 or an error number, which has been reported.
     friend class with_manager_enter_session_and_lock;
+    friend class with_fd_description;
 };
 
 extern manager the_manager;
 
+// Set on the threads that may call the backup callbacks directly (the backup thread and the copier workers).
+extern __thread backup_callbacks *thread_has_backup_calls;
+
 class with_manager_enter_session_and_lock {
   private:
     manager *m_manager;
@@ -159,4 +240,17 @@ class with_manager_enter_session_and_lock {
     }
 };
 
+// Looks up the description of an fd.  If the fd is untracked, VALUE is
+// NULL, and the fd stays untracked (because we hold the session lock,
+// which a backup needs to start tracking it) until this is destroyed.
+class with_fd_description {
+  private:
+    manager *m_manager;
+    bool m_session_locked;
+  public:
+    description *value;
+    with_fd_description(manager *m, int fd) throw();
+    ~with_fd_description(void) throw();
+};
+
 #endif // End of header guardian.
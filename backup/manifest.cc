@@ -0,0 +1,522 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "manifest.h"
+#include "MurmurHash3.h"
+#include "mutex.h"
+#include "raii-malloc.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const char * const manifest::file_name = ".tokubackup_manifest";
+
+// The first line of a manifest file.  The block size is part of it, since checksums of different sized blocks can't be compared.
+static const char manifest_header[] = "tokubackup manifest 1";
+
+static const uint64_t initial_n_buckets = 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool manifest_entry::matches(const struct stat &sbuf) const throw() {
+    return (m_size       == (uint64_t)sbuf.st_size &&
+            m_mtime_sec  == (int64_t)sbuf.st_mtim.tv_sec &&
+            m_mtime_nsec == (int64_t)sbuf.st_mtim.tv_nsec &&
+            m_ino        == (uint64_t)sbuf.st_ino);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void free_entry(manifest_entry *entry) throw() {
+    free(entry->m_path);
+    free(entry->m_checksums);
+    delete entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest::manifest(void) throw()
+    : m_buckets(new manifest_entry*[initial_n_buckets]),
+      m_n_buckets(initial_n_buckets),
+      m_n_entries(0)
+{
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+    for (uint64_t i = 0; i < m_n_buckets; ++i) {
+        m_buckets[i] = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest::~manifest(void) throw() {
+    for (uint64_t i = 0; i < m_n_buckets; ++i) {
+        while (m_buckets[i] != NULL) {
+            manifest_entry *entry = m_buckets[i];
+            m_buckets[i] = entry->m_next;
+            free_entry(entry);
+        }
+    }
+    delete[] m_buckets;
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//
+//     Returns the head of the bucket that PATH hashes to.  Requires m_mutex.
+//
+manifest_entry **manifest::bucket(const char *path) throw() {
+    uint64_t the_hash[2];
+    MurmurHash3_x64_128(path, strlen(path), 0, the_hash);
+    return &m_buckets[the_hash[0] & (m_n_buckets - 1)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_entry *manifest::find_locked(const char *path) throw() {
+    for (manifest_entry *entry = *this->bucket(path); entry != NULL; entry = entry->m_next) {
+        if (strcmp(entry->m_path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_entry *manifest::find(const char *path) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return this->find_locked(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::remove_locked(manifest_entry **prev) throw() {
+    manifest_entry *entry = *prev;
+    *prev = entry->m_next;
+    free_entry(entry);
+    m_n_entries--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// grow_locked() -
+//
+// Description:
+//
+//     Doubles the number of buckets once there are more entries than
+// buckets, so the chains stay short.
+//
+void manifest::grow_locked(void) throw() {
+    manifest_entry **old_buckets = m_buckets;
+    const uint64_t old_n_buckets = m_n_buckets;
+    m_n_buckets *= 2;
+    m_buckets = new manifest_entry*[m_n_buckets];
+    for (uint64_t i = 0; i < m_n_buckets; ++i) {
+        m_buckets[i] = NULL;
+    }
+    for (uint64_t i = 0; i < old_n_buckets; ++i) {
+        while (old_buckets[i] != NULL) {
+            manifest_entry *entry = old_buckets[i];
+            old_buckets[i] = entry->m_next;
+            manifest_entry **head = this->bucket(entry->m_path);
+            entry->m_next = *head;
+            *head = entry;
+        }
+    }
+    delete[] old_buckets;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+manifest_entry *manifest::add(const char *path, const struct stat &sbuf) throw() {
+    manifest_entry *entry = new manifest_entry;
+    entry->m_path = strdup(path);
+    check(entry->m_path != NULL);
+    entry->m_size = sbuf.st_size;
+    entry->m_mtime_sec = sbuf.st_mtim.tv_sec;
+    entry->m_mtime_nsec = sbuf.st_mtim.tv_nsec;
+    entry->m_ino = sbuf.st_ino;
+    entry->m_n_blocks = 0;
+    entry->m_checksums = NULL;
+
+    with_mutex_locked ml(&m_mutex);
+    for (manifest_entry **prev = this->bucket(path); *prev != NULL; prev = &(*prev)->m_next) {
+        if (strcmp((*prev)->m_path, path) == 0) {
+            this->remove_locked(prev);
+            break;
+        }
+    }
+    if (m_n_entries >= m_n_buckets) {
+        this->grow_locked();
+    }
+    manifest_entry **head = this->bucket(path);
+    entry->m_next = *head;
+    *head = entry;
+    m_n_entries++;
+    return entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::set_checksum_locked(manifest_entry *entry, uint64_t block, uint64_t checksum) throw() {
+    if (block >= entry->m_n_blocks) {
+        if (checksum == 0) {
+            // Blocks past the end are already unknown.
+            return;
+        }
+        uint64_t *checksums = (uint64_t *)realloc(entry->m_checksums, (block + 1) * sizeof(uint64_t));
+        check(checksums != NULL);
+        for (uint64_t i = entry->m_n_blocks; i < block; ++i) {
+            checksums[i] = 0;
+        }
+        entry->m_checksums = checksums;
+        entry->m_n_blocks = block + 1;
+    }
+    entry->m_checksums[block] = checksum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::set_checksum(manifest_entry *entry, uint64_t block, uint64_t checksum) throw() {
+    with_mutex_locked ml(&m_mutex);
+    this->set_checksum_locked(entry, block, checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t manifest::get_checksum(const manifest_entry *entry, uint64_t block) throw() {
+    with_mutex_locked ml(&m_mutex);
+    return (block < entry->m_n_blocks) ? entry->m_checksums[block] : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::copy_checksums(manifest_entry *entry, const manifest_entry *from) throw() {
+    with_mutex_locked ml(&m_mutex);
+    for (uint64_t i = 0; i < from->m_n_blocks; ++i) {
+        this->set_checksum_locked(entry, i, from->m_checksums[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::note_write(const char *path, uint64_t offset, uint64_t length) throw() {
+    if (length == 0) {
+        return;
+    }
+    with_mutex_locked ml(&m_mutex);
+    manifest_entry *entry = this->find_locked(path);
+    if (entry == NULL) {
+        return;
+    }
+    for (uint64_t i = offset / block_size; i <= (offset + length - 1) / block_size && i < entry->m_n_blocks; ++i) {
+        entry->m_checksums[i] = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void manifest::note_truncate(const char *path, uint64_t length) throw() {
+    with_mutex_locked ml(&m_mutex);
+    manifest_entry *entry = this->find_locked(path);
+    if (entry == NULL) {
+        return;
+    }
+    for (uint64_t i = length / block_size; i < entry->m_n_blocks; ++i) {
+        entry->m_checksums[i] = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// forget() -
+//
+// Description:
+//
+//     Drops PATH's entry.  If PATH is a directory, that means dropping
+// every entry under it, which takes a walk over the whole table, so
+// the caller tells us whether to bother.
+//
+void manifest::forget(const char *path, bool is_directory) throw() {
+    with_mutex_locked ml(&m_mutex);
+    for (manifest_entry **prev = this->bucket(path); *prev != NULL; prev = &(*prev)->m_next) {
+        if (strcmp((*prev)->m_path, path) == 0) {
+            this->remove_locked(prev);
+            break;
+        }
+    }
+    if (!is_directory) {
+        return;
+    }
+    const size_t path_length = strlen(path);
+    for (uint64_t i = 0; i < m_n_buckets; ++i) {
+        manifest_entry **prev = &m_buckets[i];
+        while (*prev != NULL) {
+            const char *entry_path = (*prev)->m_path;
+            if ((path_length == 0 || (strncmp(entry_path, path, path_length) == 0 && entry_path[path_length] == '/'))) {
+                this->remove_locked(prev);
+            } else {
+                prev = &(*prev)->m_next;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// checksum() -
+//
+// Description:
+//
+//     The length is the hash's seed, so blocks of different lengths
+// (the last block of a file that grew, say) don't match.
+//
+uint64_t manifest::checksum(const void *buf, size_t length) throw() {
+    uint64_t the_hash[2];
+    MurmurHash3_x64_128(buf, length, length, the_hash);
+    uint64_t result = the_hash[0] ^ the_hash[1];
+    return (result == 0) ? 1 : result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// read_path() -
+//
+// Description:
+//
+//     Reads the rest of a manifest line, which is a path with its
+// backslashes and newlines escaped.  Returns a malloc'd string, or
+// NULL if the line is garbled.
+//
+static char *read_path(FILE *f) throw() {
+    size_t length = 0;
+    size_t size = 64;
+    char *path = (char *)malloc(size);
+    check(path != NULL);
+    while (1) {
+        int c = getc(f);
+        if (c == EOF) {
+            free(path);
+            return NULL;
+        } else if (c == '\n') {
+            break;
+        } else if (c == '\\') {
+            c = getc(f);
+            if (c == 'n') {
+                c = '\n';
+            } else if (c != '\\') {
+                free(path);
+                return NULL;
+            }
+        }
+        if (length + 1 >= size) {
+            size *= 2;
+            path = (char *)realloc(path, size);
+            check(path != NULL);
+        }
+        path[length++] = c;
+    }
+    path[length] = 0;
+    return path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// load() -
+//
+// Description:
+//
+//     Reads DIR's manifest.  The file has a header line, then a line
+// per file:
+//
+//     size mtime_sec mtime_nsec inode n_blocks checksum... path
+//
+// with the checksums in hex.  The path comes last, since it may
+// contain spaces.
+//
+int manifest::load(const char *dir) throw() {
+    with_object_to_free<char*> path(malloc_snprintf(strlen(dir) + strlen(file_name) + 2, "%s/%s", dir, file_name));
+    int fd = call_real_open(path.value, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    FILE *f = fdopen(fd, "r");
+    if (f == NULL) {
+        int r = errno;
+        ignore(call_real_close(fd));
+        return r;
+    }
+
+    int r = 0;
+    char header[sizeof(manifest_header)];
+    uint64_t file_block_size;
+    if (fread(header, 1, sizeof(manifest_header) - 1, f) != sizeof(manifest_header) - 1 ||
+        memcmp(header, manifest_header, sizeof(manifest_header) - 1) != 0 ||
+        fscanf(f, " %" SCNu64 "\n", &file_block_size) != 1 ||
+        file_block_size != block_size) {
+        r = EINVAL;
+        goto out;
+    }
+    while (1) {
+        struct stat sbuf;
+        uint64_t size, ino, n_blocks;
+        int64_t mtime_sec, mtime_nsec;
+        int n = fscanf(f, "%" SCNu64 " %" SCNd64 " %" SCNd64 " %" SCNu64 " %" SCNu64,
+                       &size, &mtime_sec, &mtime_nsec, &ino, &n_blocks);
+        if (n == EOF) {
+            break;
+        } else if (n != 5) {
+            r = EINVAL;
+            goto out;
+        }
+        uint64_t *checksums = (uint64_t *)malloc((n_blocks > 0 ? n_blocks : 1) * sizeof(uint64_t));
+        if (checksums == NULL) {
+            r = ENOMEM;
+            goto out;
+        }
+        for (uint64_t i = 0; i < n_blocks; ++i) {
+            if (fscanf(f, " %" SCNx64, &checksums[i]) != 1) {
+                free(checksums);
+                r = EINVAL;
+                goto out;
+            }
+        }
+        char *file = (getc(f) == ' ') ? read_path(f) : NULL;
+        if (file == NULL) {
+            free(checksums);
+            r = EINVAL;
+            goto out;
+        }
+        memset(&sbuf, 0, sizeof(sbuf));
+        sbuf.st_size = size;
+        sbuf.st_mtim.tv_sec = mtime_sec;
+        sbuf.st_mtim.tv_nsec = mtime_nsec;
+        sbuf.st_ino = ino;
+        manifest_entry *entry = this->add(file, sbuf);
+        free(file);
+        free(entry->m_checksums);
+        entry->m_checksums = checksums;
+        entry->m_n_blocks = n_blocks;
+    }
+
+out:
+    if (fclose(f) != 0 && r == 0) {
+        r = errno;
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+static void write_path(FILE *f, const char *path) throw() {
+    for (const char *p = path; *p; ++p) {
+        if (*p == '\\') {
+            fputs("\\\\", f);
+        } else if (*p == '\n') {
+            fputs("\\n", f);
+        } else {
+            putc(*p, f);
+        }
+    }
+    putc('\n', f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// save() -
+//
+// Description:
+//
+//     Writes the manifest to a temporary file, syncs it, and renames
+// it into place, so that DIR never has a partial manifest.
+//
+int manifest::save(const char *dir) throw() {
+    with_object_to_free<char*> path(malloc_snprintf(strlen(dir) + strlen(file_name) + 2, "%s/%s", dir, file_name));
+    with_object_to_free<char*> tmp_path(malloc_snprintf(strlen(path.value) + 5, "%s.tmp", path.value));
+    int fd = call_real_open(tmp_path.value, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        int r = errno;
+        ignore(call_real_close(fd));
+        return r;
+    }
+
+    int r = 0;
+    {
+        with_mutex_locked ml(&m_mutex);
+        fprintf(f, "%s %" PRIu64 "\n", manifest_header, (uint64_t)block_size);
+        for (uint64_t i = 0; i < m_n_buckets; ++i) {
+            for (const manifest_entry *entry = m_buckets[i]; entry != NULL; entry = entry->m_next) {
+                fprintf(f, "%" PRIu64 " %" PRId64 " %" PRId64 " %" PRIu64 " %" PRIu64,
+                        entry->m_size, entry->m_mtime_sec, entry->m_mtime_nsec, entry->m_ino, entry->m_n_blocks);
+                for (uint64_t j = 0; j < entry->m_n_blocks; ++j) {
+                    fprintf(f, " %" PRIx64, entry->m_checksums[j]);
+                }
+                putc(' ', f);
+                write_path(f, entry->m_path);
+            }
+        }
+    }
+    if (fflush(f) != 0 || fsync(fd) != 0) {
+        r = errno;
+    }
+    if (fclose(f) != 0 && r == 0) {
+        r = errno;
+    }
+    if (r == 0 && call_real_rename(tmp_path.value, path.value) != 0) {
+        r = errno;
+    }
+    if (r != 0) {
+        ignore(call_real_unlink(tmp_path.value));
+    }
+    return r;
+}
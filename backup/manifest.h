@@ -0,0 +1,131 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// manifest_entry:
+//
+// Description:
+//
+//     What a manifest knows about one backed-up file: the source
+// file's size, mtime and inode number when the copier opened it, and a
+// checksum of each block of the backup copy.  A checksum of zero means
+// "unknown", which is what a block gets when a captured write changes
+// it after the copier checksummed it.
+//
+struct manifest_entry {
+    char *m_path;          // Relative to the backed-up directory, without a leading slash.
+    uint64_t m_size;
+    int64_t m_mtime_sec;
+    int64_t m_mtime_nsec;
+    uint64_t m_ino;
+    uint64_t m_n_blocks;
+    uint64_t *m_checksums; // m_n_blocks of them.
+    manifest_entry *m_next; // The next entry in the same hash bucket.
+    bool matches(const struct stat &sbuf) const throw(); // True if the file looks unchanged since this entry was made.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// manifest:
+//
+// Description:
+//
+//     The table of manifest_entries for one backup destination, keyed
+// by relative path.  A backup that is asked to write a manifest builds
+// one as it copies, and saves it in the destination when the backup is
+// done.  An incremental backup loads the manifest of the backup it is
+// based on, and uses it to find files (and blocks) that haven't
+// changed.
+//
+//     The manifest is shared by the copier workers and by the threads
+// whose writes are captured, so every method takes m_mutex.  The
+// pointer returned by find() and add() stays good until the entry is
+// forgotten, which happens only when the file is renamed or unlinked.
+//
+class manifest {
+  public:
+    static const size_t block_size = 1<<20;
+    static const char * const file_name; // The name of the manifest in a backup destination.
+
+    manifest(void) throw();
+    ~manifest(void) throw();
+
+    int load(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Read the manifest saved in DIR.  Returns 0, or an error number (ENOENT if there is none, EINVAL if it is garbled).
+    int save(const char *dir) throw() __attribute__((warn_unused_result));
+    // Effect: Write this manifest into DIR, replacing it atomically.  Returns 0 or an error number.
+
+    manifest_entry *find(const char *path) throw();
+    manifest_entry *add(const char *path, const struct stat &sbuf) throw();
+    // Effect: Start a new entry for PATH, replacing any old one, with no known blocks.
+
+    void copy_checksums(manifest_entry *entry, const manifest_entry *from) throw();
+    void set_checksum(manifest_entry *entry, uint64_t block, uint64_t checksum) throw();
+    uint64_t get_checksum(const manifest_entry *entry, uint64_t block) throw(); // Returns 0 if the block isn't known.
+
+    void note_write(const char *path, uint64_t offset, uint64_t length) throw();
+    // Effect: Forget the checksums of the blocks that a captured write changed.
+    void note_truncate(const char *path, uint64_t length) throw();
+    // Effect: Forget the checksums of the blocks at and after LENGTH.
+    void forget(const char *path, bool is_directory) throw();
+    // Effect: Drop the entry for PATH, and if it is a directory, the entries for everything under it.
+
+    static uint64_t checksum(const void *buf, size_t length) throw();
+    // Effect: Returns the (nonzero) checksum of a block.
+
+  private:
+    pthread_mutex_t m_mutex;
+    manifest_entry **m_buckets;
+    uint64_t m_n_buckets; // A power of two.
+    uint64_t m_n_entries;
+    manifest_entry **bucket(const char *path) throw();
+    manifest_entry *find_locked(const char *path) throw();
+    void remove_locked(manifest_entry **prev) throw();
+    void grow_locked(void) throw();
+    void set_checksum_locked(manifest_entry *entry, uint64_t block, uint64_t checksum) throw();
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,261 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "mutex.h"
+#include "path_cache.h"
+#include "real_syscalls.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+path_cache::path_cache(void) throw() {
+    for (int i = 0; i < n_slots; i++) {
+        m_slots[i].m_dev = 0;
+        m_slots[i].m_ino = 0;
+        m_slots[i].m_ctime.tv_sec = 0;
+        m_slots[i].m_ctime.tv_nsec = 0;
+        m_slots[i].m_path = NULL;
+    }
+    for (int i = 0; i < n_mutexes; i++) {
+        int r = pthread_mutex_init(&m_mutexes[i], NULL);
+        check(r==0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+path_cache::~path_cache(void) throw() {
+    this->clear();
+    for (int i = 0; i < n_mutexes; i++) {
+        int r = pthread_mutex_destroy(&m_mutexes[i]);
+        check(r==0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int path_cache::slot_of(dev_t dev, ino_t ino) throw() {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL + (uint64_t)dev;
+    return (h >> 32) % n_slots;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+pthread_mutex_t *path_cache::mutex_of(int s) throw() {
+    return &m_mutexes[s % n_mutexes];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool path_cache::matches(const slot &sl, const struct stat &dir_stat) throw() {
+    return (sl.m_path != NULL &&
+            sl.m_dev == dir_stat.st_dev &&
+            sl.m_ino == dir_stat.st_ino &&
+            sl.m_ctime.tv_sec == dir_stat.st_ctim.tv_sec &&
+            sl.m_ctime.tv_nsec == dir_stat.st_ctim.tv_nsec);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// lookup() -
+//
+// Description:
+//
+//     Copies the remembered realpath of the directory described by
+// DIR_STAT into RESOLVED (which has PATH_MAX bytes), and returns true,
+// or returns false if we don't have it.  The caller just stat()ed the
+// directory, so if the slot's inode and ctime match, the directory
+// hasn't been renamed since we remembered it.
+//
+bool path_cache::lookup(const struct stat &dir_stat, char *resolved) throw() {
+    const int s = slot_of(dir_stat.st_dev, dir_stat.st_ino);
+    with_mutex_locked ml(mutex_of(s));
+    const slot &sl = m_slots[s];
+    if (!matches(sl, dir_stat)) {
+        return false;
+    }
+    strcpy(resolved, sl.m_path); // It came from realpath(), so it fits.
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void path_cache::insert(const struct stat &dir_stat, const char *dir_path) throw() {
+    char *copy = strdup(dir_path);
+    if (copy == NULL) {
+        return; // We just don't remember it.
+    }
+    const int s = slot_of(dir_stat.st_dev, dir_stat.st_ino);
+    char *old = NULL;
+    {
+        with_mutex_locked ml(mutex_of(s));
+        slot &sl = m_slots[s];
+        old = sl.m_path;
+        sl.m_dev = dir_stat.st_dev;
+        sl.m_ino = dir_stat.st_ino;
+        sl.m_ctime = dir_stat.st_ctim;
+        sl.m_path = copy;
+    }
+    free(old);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// realpath() -
+//
+// Description:
+//
+//     Resolves PATH's directory through the cache, and appends the last
+// component.  Paths whose last component can't simply be appended
+// (because it is empty, "." or "..", or a symlink) go to the real
+// realpath().  The lstat() of the last component tells the caller
+// whether PATH was a directory for free.
+//
+char *path_cache::realpath(const char *path, bool *maybe_directory) throw() {
+    char resolved[PATH_MAX];
+    if (this->realpath(path, resolved, maybe_directory) == NULL) {
+        return NULL;
+    }
+    char *result = strdup(resolved);
+    if (result == NULL) {
+        errno = ENOMEM;
+    }
+    return result;
+}
+
+char *path_cache::realpath(const char *path, char *resolved, bool *maybe_directory) throw() {
+    if (maybe_directory != NULL) {
+        *maybe_directory = true;
+    }
+    const char *slash = strrchr(path, '/');
+    const char *base = (slash != NULL) ? slash + 1 : path;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        return call_real_realpath(path, resolved);
+    }
+    struct stat sbuf;
+    if (lstat(path, &sbuf) != 0) {
+        return NULL; // realpath() would fail the same way.
+    }
+    if (maybe_directory != NULL) {
+        *maybe_directory = S_ISDIR(sbuf.st_mode) || S_ISLNK(sbuf.st_mode);
+    }
+    if (S_ISLNK(sbuf.st_mode)) {
+        return call_real_realpath(path, resolved);
+    }
+
+    // The directory is everything up to the last slash.
+    const size_t dir_len = (slash == NULL) ? 1 : (slash == path) ? 1 : slash - path;
+    char dir[dir_len + 1];
+    if (slash == NULL) {
+        dir[0] = '.';
+    } else if (slash == path) {
+        dir[0] = '/';
+    } else {
+        memcpy(dir, path, dir_len);
+    }
+    dir[dir_len] = '\0';
+    struct stat dir_stat;
+    if (stat(dir, &dir_stat) != 0) {
+        return call_real_realpath(path, resolved);
+    }
+
+    if (!this->lookup(dir_stat, resolved)) {
+        if (call_real_realpath(dir, resolved) == NULL) {
+            return NULL;
+        }
+        this->insert(dir_stat, resolved);
+    }
+
+    const size_t len = strlen(resolved);
+    const bool need_slash = (len == 0 || resolved[len - 1] != '/');
+    if (len + need_slash + strlen(base) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (need_slash) {
+        resolved[len] = '/';
+    }
+    strcpy(resolved + len + need_slash, base);
+    return resolved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// forget_tree() -
+//
+// Description:
+//
+//     The directories under FULL_PATH have new realpaths now.  We don't
+// know their inodes, so we look at every slot.  Renaming a directory
+// is rare enough for that.
+//
+void path_cache::forget_tree(const char *full_path) throw() {
+    const size_t len = strlen(full_path);
+    for (int s = 0; s < n_slots; s++) {
+        char *old = NULL;
+        {
+            with_mutex_locked ml(mutex_of(s));
+            slot &sl = m_slots[s];
+            if (sl.m_path != NULL && strncmp(sl.m_path, full_path, len) == 0 &&
+                (sl.m_path[len] == '\0' || sl.m_path[len] == '/')) {
+                old = sl.m_path;
+                sl.m_path = NULL;
+            }
+        }
+        free(old);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void path_cache::clear(void) throw() {
+    for (int s = 0; s < n_slots; s++) {
+        char *old = NULL;
+        {
+            with_mutex_locked ml(mutex_of(s));
+            old = m_slots[s].m_path;
+            m_slots[s].m_path = NULL;
+        }
+        free(old);
+    }
+}
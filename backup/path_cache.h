@@ -0,0 +1,101 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// path_cache:
+//
+// Description:
+//
+//     Resolves the paths that the application passes to open(),
+// rename(), unlink() and truncate() to their realpaths, without walking
+// every component of the path each time.  We remember the realpath of
+// each directory we resolve, keyed by its device and inode number, along
+// with its ctime.  Resolving a file then takes an lstat() of the file
+// (to see that it isn't a symlink) and a stat() of its directory, which
+// gives the key.  A directory that was renamed, or an inode that was
+// reused by a new directory, has a new ctime, so its slot doesn't match.
+// Renaming a directory doesn't change the ctimes of the directories
+// under it, so rename() tells us about those (forget_tree()).
+//
+//     The cache is direct mapped, so a directory whose slot is wanted by
+// another just loses it.  Each slot is protected by one of a set of
+// mutexes.
+//
+class path_cache {
+  public:
+    path_cache(void) throw();
+    ~path_cache(void) throw();
+
+    char *realpath(const char *path, bool *maybe_directory = NULL) throw() __attribute__((warn_unused_result));
+    // Effect: Like call_real_realpath(path, NULL): returns the malloc'd realpath of PATH, or NULL (setting errno).
+    //  If MAYBE_DIRECTORY isn't NULL, sets it to false if PATH is known not to name a directory, or a symlink that might lead to one.
+
+    char *realpath(const char *path, char *resolved, bool *maybe_directory = NULL) throw() __attribute__((warn_unused_result));
+    // Effect: Like call_real_realpath(path, RESOLVED), where RESOLVED has PATH_MAX bytes: puts the realpath of PATH there and
+    //  returns RESOLVED, or returns NULL (setting errno).  It only allocates to remember a new directory.  MAYBE_DIRECTORY is as above.
+
+    void forget_tree(const char *full_path) throw();
+    // Effect: Forget the directory whose realpath was FULL_PATH, which has just been renamed, and every directory under it.
+    void clear(void) throw();
+
+  private:
+    static const int n_slots = 1024;
+    static const int n_mutexes = 64;
+    struct slot {
+        dev_t m_dev;
+        ino_t m_ino;
+        struct timespec m_ctime;
+        char *m_path; // The directory's realpath, or NULL if the slot is empty.
+    };
+    static int slot_of(dev_t dev, ino_t ino) throw();
+    pthread_mutex_t *mutex_of(int s) throw();
+    bool lookup(const struct stat &dir_stat, char *resolved) throw();
+    void insert(const struct stat &dir_stat, const char *dir_path) throw();
+    static bool matches(const slot &sl, const struct stat &dir_stat) throw();
+
+    slot m_slots[n_slots];
+    pthread_mutex_t m_mutexes[n_mutexes];
+};
+
+#endif // End of header guardian.
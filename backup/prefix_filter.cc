@@ -0,0 +1,108 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "instantiate_vector.h"
+#include "prefix_filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+prefix_filter::prefix_filter(void) throw()
+  : m_pass_everything(false) {
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+prefix_filter::~prefix_filter(void) throw() {
+    for (size_t i = 0; i < m_dirs.size(); i++) {
+        free(m_dirs[i]);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// add() -
+//
+// Description:
+//
+//     Remembers DIR, unless a directory we already have covers it.
+// Most backups cover the same directories as the last one, so the
+// filter stays as short as the list of directories ever backed up.
+//
+void prefix_filter::add(const char *dir) throw() {
+    if (m_pass_everything) {
+        return;
+    }
+    for (size_t i = 0; i < m_dirs.size(); i++) {
+        if (strncmp(m_dirs[i], dir, m_lengths[i]) == 0) {
+            return;
+        }
+    }
+    char *copy = strdup(dir);
+    if (copy == NULL) {
+        m_pass_everything = true;
+        return;
+    }
+    m_dirs.push_back(copy);
+    m_lengths.push_back(strlen(copy));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool prefix_filter::may_contain(const char *file) const throw() {
+    if (!this->is_active()) {
+        return true;
+    }
+    for (size_t i = 0; i < m_dirs.size(); i++) {
+        if (strncmp(m_dirs[i], file, m_lengths[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool prefix_filter::is_active(void) const throw() {
+    return !m_pass_everything && !m_dirs.empty();
+}
+
+// Instantiate the templates we need
+INSTANTIATE_VECTOR(char *)
+INSTANTIATE_VECTOR(size_t)
@@ -0,0 +1,77 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef PREFIX_FILTER_H
+#define PREFIX_FILTER_H
+
+#include <stddef.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prefix_filter:
+//
+// Description:
+//
+//     Tells whether a file might ever be backed up, from its realpath.
+// The filter holds the realpath of every source directory a backup has
+// been asked to cover.  Until the first directory is added, every file
+// might be backed up.  A file is matched against a directory the same
+// way backup_session::is_prefix_of_realpath() matches it (the
+// directory's path is a prefix of the file's), so a file the filter
+// turns away could never be in any of those backups.
+//
+//     The filter does no locking of its own.
+//
+class prefix_filter {
+  public:
+    prefix_filter(void) throw();
+    ~prefix_filter(void) throw();
+
+    void add(const char *dir) throw();
+    // Effect: Let the files under DIR (a realpath) through.  If we run out of memory, let everything through from now on.
+    bool may_contain(const char *file) const throw();
+    // Effect: Return false if FILE (a realpath) isn't under any of the directories.
+    bool is_active(void) const throw();
+    // Effect: Return true if the filter turns any file away.
+
+  private:
+    std::vector<char *> m_dirs;
+    std::vector<size_t> m_lengths; // m_lengths[i] is strlen(m_dirs[i]).
+    bool m_pass_everything;        // Set if we couldn't remember a directory.
+};
+
+#endif // End of header guardian.
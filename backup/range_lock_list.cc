@@ -0,0 +1,206 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "check.h"
+#include "range_lock_list.h"
+
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock_list::range_lock_list(void) throw()
+  : m_height(1), m_free_nodes(NULL), m_random(2463534242U) {
+    m_head.m_lo = m_head.m_hi = 0;
+    m_head.m_waiters = NULL;
+    m_head.m_height = locked_range::max_height;
+    for (int i = 0; i < locked_range::max_height; i++) {
+        m_head.m_next[i] = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+range_lock_list::~range_lock_list(void) throw() {
+    for (locked_range *node = m_head.m_next[0]; node != NULL; ) {
+        locked_range *next = node->m_next[0];
+        free(node);
+        node = next;
+    }
+    while (m_free_nodes != NULL) {
+        locked_range *next = m_free_nodes->m_next[0];
+        free(m_free_nodes);
+        m_free_nodes = next;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// find_conflict() -
+//
+// Description:
+//
+//     Find the last locked range that starts before hi.  It's the only
+// candidate, since every range before it ends before it starts.
+//
+locked_range *range_lock_list::find_conflict(uint64_t lo, uint64_t hi) const throw() {
+    if (lo >= hi) return NULL; // An empty range conflicts with nothing.
+    const locked_range *node = &m_head;
+    for (int level = m_height - 1; level >= 0; level--) {
+        while (node->m_next[level] != NULL && node->m_next[level]->m_lo < hi) {
+            node = node->m_next[level];
+        }
+    }
+    if (node == &m_head || node->m_hi <= lo) {
+        return NULL;
+    }
+    return const_cast<locked_range *>(node);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// find_predecessors() -
+//
+// Description:
+//
+//     Fill in preds[level] with the last node at each level that starts
+// before lo, and return the node after preds[0] (which is the first
+// range that starts at or after lo).
+//
+locked_range *range_lock_list::find_predecessors(uint64_t lo, locked_range **preds) throw() {
+    locked_range *node = &m_head;
+    for (int level = locked_range::max_height - 1; level >= 0; level--) {
+        while (node->m_next[level] != NULL && node->m_next[level]->m_lo < lo) {
+            node = node->m_next[level];
+        }
+        preds[level] = node;
+    }
+    return node->m_next[0];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// random_height() -
+//
+// Description:
+//
+//     Each level has a quarter of the nodes of the one below it.
+//
+int range_lock_list::random_height(void) throw() {
+    // xorshift32
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    int height = 1;
+    uint32_t bits = m_random;
+    while (height < locked_range::max_height && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void range_lock_list::insert(uint64_t lo, uint64_t hi) throw() {
+    locked_range *preds[locked_range::max_height];
+    find_predecessors(lo, preds);
+    locked_range *node = m_free_nodes;
+    if (node != NULL) {
+        m_free_nodes = node->m_next[0];
+    } else {
+        node = (locked_range *)malloc(sizeof(locked_range));
+        check(node != NULL);
+    }
+    node->m_lo = lo;
+    node->m_hi = hi;
+    node->m_waiters = NULL;
+    node->m_height = random_height();
+    if (node->m_height > m_height) {
+        m_height = node->m_height;
+    }
+    for (int level = 0; level < node->m_height; level++) {
+        node->m_next[level] = preds[level]->m_next[level];
+        preds[level]->m_next[level] = node;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool range_lock_list::remove(uint64_t lo, uint64_t hi) throw() {
+    locked_range *preds[locked_range::max_height];
+    locked_range *node = find_predecessors(lo, preds);
+    if (node == NULL || node->m_lo != lo || node->m_hi != hi) {
+        return false;
+    }
+    for (int level = 0; level < node->m_height; level++) {
+        preds[level]->m_next[level] = node->m_next[level];
+    }
+    while (m_height > 1 && m_head.m_next[m_height - 1] == NULL) {
+        m_height--;
+    }
+    // The waiters recheck for conflicts when they get the mutex back,
+    // so it's fine to wake them before we're done.
+    for (range_waiter *w = node->m_waiters; w != NULL; w = w->m_next) {
+        w->m_woken = true;
+        int r = pthread_cond_signal(&w->m_cond);
+        check(r==0);
+    }
+    node->m_waiters = NULL;
+    node->m_next[0] = m_free_nodes;
+    m_free_nodes = node;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void range_lock_list::wait(locked_range *range, pthread_mutex_t *mutex) throw() {
+    range_waiter waiter;
+    {
+        int r = pthread_cond_init(&waiter.m_cond, NULL);
+        check(r==0);
+    }
+    waiter.m_woken = false;
+    waiter.m_next = range->m_waiters;
+    range->m_waiters = &waiter;
+    while (!waiter.m_woken) {
+        int r = pthread_cond_wait(&waiter.m_cond, mutex);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_destroy(&waiter.m_cond);
+        check(r==0);
+    }
+}
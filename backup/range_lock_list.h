@@ -0,0 +1,112 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef RANGE_LOCK_LIST_H
+#define RANGE_LOCK_LIST_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A thread waiting to lock a range.  It lives on the waiting thread's
+// stack, queued on the locked range that it conflicts with.
+struct range_waiter {
+    pthread_cond_t m_cond;
+    bool m_woken;
+    range_waiter *m_next;
+};
+
+// A locked range, [lo,hi).
+struct locked_range {
+    static const int max_height = 8;
+    uint64_t m_lo, m_hi;
+    range_waiter *m_waiters; // The threads waiting for this range to be unlocked.
+    int m_height;
+    locked_range *m_next[max_height];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// range_lock_list:
+//
+// Description:
+//
+//     The nonempty ranges that are locked in one source file, as a skip
+// list ordered by lo.  The locked ranges never overlap, so they are
+// ordered by hi as well, and the only range that can intersect [lo,hi)
+// is the last one that starts before hi.  That makes finding a
+// conflict, locking and unlocking O(log n) in the number of locked
+// ranges, instead of O(n).
+//
+//     A thread that has to wait queues itself on the range it
+// conflicts with, so that unlocking a range wakes only the threads that
+// were waiting for that range.
+//
+//     This class does no locking of its own: the source_file's mutex
+// protects it.  Unlocked nodes are kept for reuse, so that locking a
+// range usually doesn't call malloc().
+//
+class range_lock_list {
+  public:
+    range_lock_list(void) throw();
+    ~range_lock_list(void) throw();
+
+    locked_range *find_conflict(uint64_t lo, uint64_t hi) const throw();
+    // Effect: Return the locked range that intersects [lo,hi), or NULL if there is none.
+
+    void insert(uint64_t lo, uint64_t hi) throw();
+    // Effect: Record that [lo,hi) is locked.
+    //  Requires that [lo,hi) is nonempty and find_conflict(lo, hi) returns NULL.
+
+    bool remove(uint64_t lo, uint64_t hi) throw() __attribute__((warn_unused_result));
+    // Effect: Forget the locked range [lo,hi), and wake the threads waiting for it.
+    //  Return false (and change nothing) if [lo,hi) isn't a locked range.
+
+    static void wait(locked_range *range, pthread_mutex_t *mutex) throw();
+    // Effect: Queue the calling thread on RANGE, and wait on MUTEX (which protects the list) until RANGE is unlocked.
+    //  Requires that RANGE is in the list.
+
+  private:
+    locked_range *find_predecessors(uint64_t lo, locked_range **preds) throw();
+    int random_height(void) throw();
+
+    locked_range m_head;        // A sentinel: only its m_next pointers are used.
+    int m_height;               // The height of the tallest node in the list.
+    locked_range *m_free_nodes; // Unlocked nodes, chained through m_next[0].
+    uint32_t m_random;          // State for random_height().
+};
+
+#endif // End of header guardian.
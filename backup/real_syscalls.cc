@@ -35,6 +35,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -164,6 +165,58 @@ pwrite_fun_t register_pwrite(pwrite_fun_t f) throw() {
     return r;
 }
 
+static pwritev_fun_t real_pwritev = NULL;
+
+ssize_t call_real_pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset) throw() {
+    dlsym_set(&real_pwritev, "pwritev");
+    return real_pwritev(fildes, iov, iovcnt, offset);
+}
+pwritev_fun_t register_pwritev(pwritev_fun_t f) throw() {
+    dlsym_set(&real_pwritev, "pwritev");
+    pwritev_fun_t r = real_pwritev;
+    real_pwritev = f;
+    return r;
+}
+
+static pwritev2_fun_t real_pwritev2 = NULL;
+
+ssize_t call_real_pwritev2(int fildes, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw() {
+    dlsym_set(&real_pwritev2, "pwritev2");
+    return real_pwritev2(fildes, iov, iovcnt, offset, flags);
+}
+pwritev2_fun_t register_pwritev2(pwritev2_fun_t f) throw() {
+    dlsym_set(&real_pwritev2, "pwritev2");
+    pwritev2_fun_t r = real_pwritev2;
+    real_pwritev2 = f;
+    return r;
+}
+
+static writev_fun_t real_writev = NULL;
+
+ssize_t call_real_writev(int fildes, const struct iovec *iov, int iovcnt) throw() {
+    dlsym_set(&real_writev, "writev");
+    return real_writev(fildes, iov, iovcnt);
+}
+writev_fun_t register_writev(writev_fun_t f) throw() {
+    dlsym_set(&real_writev, "writev");
+    writev_fun_t r = real_writev;
+    real_writev = f;
+    return r;
+}
+
+static readv_fun_t real_readv = NULL;
+
+ssize_t call_real_readv(int fildes, const struct iovec *iov, int iovcnt) throw() {
+    dlsym_set(&real_readv, "readv");
+    return real_readv(fildes, iov, iovcnt);
+}
+readv_fun_t register_readv(readv_fun_t f) throw() {
+    dlsym_set(&real_readv, "readv");
+    readv_fun_t r = real_readv;
+    real_readv = f;
+    return r;
+}
+
 static off_t (*real_lseek)(int, off_t, int) = NULL;
 off_t call_real_lseek(int fd, off_t offset, int whence) throw() {
     dlsym_set(&real_lseek, "lseek");
@@ -190,6 +243,32 @@ ftruncate_fun_t register_ftruncate(ftruncate_fun_t f) throw() {
     return r;
 }
 
+static fallocate_fun_t real_fallocate = NULL;
+int call_real_fallocate(int fildes, int mode, off_t offset, off_t len) throw() {
+    dlsym_set(&real_fallocate, "fallocate");
+    return real_fallocate(fildes, mode, offset, len);
+}
+
+fallocate_fun_t register_fallocate(fallocate_fun_t f) throw() {
+    dlsym_set(&real_fallocate, "fallocate");
+    fallocate_fun_t r = real_fallocate;
+    real_fallocate = f;
+    return r;
+}
+
+static posix_fallocate_fun_t real_posix_fallocate = NULL;
+int call_real_posix_fallocate(int fildes, off_t offset, off_t len) throw() {
+    dlsym_set(&real_posix_fallocate, "posix_fallocate");
+    return real_posix_fallocate(fildes, offset, len);
+}
+
+posix_fallocate_fun_t register_posix_fallocate(posix_fallocate_fun_t f) throw() {
+    dlsym_set(&real_posix_fallocate, "posix_fallocate");
+    posix_fallocate_fun_t r = real_posix_fallocate;
+    real_posix_fallocate = f;
+    return r;
+}
+
 int call_real_truncate(const char *path, off_t length) throw() {
     static int (*real_truncate)(const char *path, off_t length) = NULL;
     dlsym_set(&real_truncate, "truncate");
@@ -248,3 +327,34 @@ char *call_real_realpath(const char *pathname, char *result) throw() {
     dlvsym_set(&real_realpath, "realpath", "GLIBC_2.3");
     return real_realpath(pathname, result);
 }
+
+static copy_file_range_fun_t real_copy_file_range = NULL;
+ssize_t call_real_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) throw() {
+    dlsym_set(&real_copy_file_range, "copy_file_range");
+    if (real_copy_file_range == NULL) {
+        // Older C libraries don't have it.  The copier falls back to splice().
+        errno = ENOSYS;
+        return -1;
+    }
+    return real_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+copy_file_range_fun_t register_copy_file_range(copy_file_range_fun_t f) throw() {
+    dlsym_set(&real_copy_file_range, "copy_file_range");
+    copy_file_range_fun_t r = real_copy_file_range;
+    real_copy_file_range = f;
+    return r;
+}
+
+static splice_fun_t real_splice = NULL;
+ssize_t call_real_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) throw() {
+    dlsym_set(&real_splice, "splice");
+    return real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+splice_fun_t register_splice(splice_fun_t f) throw() {
+    dlsym_set(&real_splice, "splice");
+    splice_fun_t r = real_splice;
+    real_splice = f;
+    return r;
+}
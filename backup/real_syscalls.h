@@ -39,6 +39,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 extern pthread_mutex_t backup_manager_mutex;
 
@@ -47,13 +48,21 @@ int call_real_close(int fd) throw()  __attribute__((warn_unused_result));
 ssize_t call_real_write(int fd, const void *buf, size_t nbyte) throw() __attribute__((warn_unused_result));
 ssize_t call_real_read(int fildes, const void *buf, size_t nbyte) throw() __attribute__((warn_unused_result));
 ssize_t call_real_pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) throw() __attribute__((warn_unused_result));
+ssize_t call_real_pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset) throw() __attribute__((warn_unused_result));
+ssize_t call_real_pwritev2(int fildes, const struct iovec *iov, int iovcnt, off_t offset, int flags) throw() __attribute__((warn_unused_result));
+ssize_t call_real_writev(int fildes, const struct iovec *iov, int iovcnt) throw() __attribute__((warn_unused_result));
+ssize_t call_real_readv(int fildes, const struct iovec *iov, int iovcnt) throw() __attribute__((warn_unused_result));
 off_t call_real_lseek(int fd, off_t offset, int whence) throw() __attribute__((warn_unused_result));
 int call_real_ftruncate(int fildes, off_t length) throw() __attribute__((warn_unused_result));
+int call_real_fallocate(int fildes, int mode, off_t offset, off_t len) throw() __attribute__((warn_unused_result));
+int call_real_posix_fallocate(int fildes, off_t offset, off_t len) throw() __attribute__((warn_unused_result)); // Returns an error number, like posix_fallocate().
 int call_real_truncate(const char *path, off_t length) throw() __attribute__((__nonnull__ (1)))  __attribute__((warn_unused_result));
 int call_real_unlink(const char *path) throw() __attribute__((__nonnull__ (1)))  __attribute__((warn_unused_result));
 int call_real_rename(const char* oldpath, const char* newpath) throw() __attribute__((warn_unused_result));
 int call_real_mkdir(const char *pathname, mode_t mode) throw() __attribute__((__nonnull__ (1))) __attribute__((warn_unused_result));
 char *call_real_realpath(const char *file_name, char *resolved_name) throw() __attribute__((__nonnull__ (1))) __attribute__((warn_unused_result));
+ssize_t call_real_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) throw() __attribute__((warn_unused_result)); // Fails with ENOSYS if the C library doesn't have copy_file_range().
+ssize_t call_real_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) throw() __attribute__((warn_unused_result));
 
 typedef int (*open_fun_t)(const char *, int, ...);
 open_fun_t register_open(open_fun_t new_open) throw();
@@ -61,6 +70,18 @@ open_fun_t register_open(open_fun_t new_open) throw();
 typedef ssize_t (*pwrite_fun_t)(int, const void *, size_t, off_t);
 pwrite_fun_t register_pwrite(pwrite_fun_t new_pwrite) throw(); // Effect: The system will call new_pwrite in the future.  The function it would have called is returned (so that the new_pwrite function can use it, if it wants)
 
+typedef ssize_t (*pwritev_fun_t)(int, const struct iovec *, int, off_t);
+pwritev_fun_t register_pwritev(pwritev_fun_t new_pwritev) throw();
+
+typedef ssize_t (*pwritev2_fun_t)(int, const struct iovec *, int, off_t, int);
+pwritev2_fun_t register_pwritev2(pwritev2_fun_t new_pwritev2) throw();
+
+typedef ssize_t (*writev_fun_t)(int, const struct iovec *, int);
+writev_fun_t register_writev(writev_fun_t new_writev) throw();
+
+typedef ssize_t (*readv_fun_t)(int, const struct iovec *, int);
+readv_fun_t register_readv(readv_fun_t new_readv) throw();
+
 typedef ssize_t (*write_fun_t)(int, const void *, size_t);
 write_fun_t register_write(write_fun_t new_write) throw();
 
@@ -73,6 +94,12 @@ lseek_fun_t register_lseek(lseek_fun_t new_lseek) throw();
 typedef int (*ftruncate_fun_t)(int, off_t);
 ftruncate_fun_t register_ftruncate(ftruncate_fun_t new_ftruncate) throw();
 
+typedef int (*fallocate_fun_t)(int, int, off_t, off_t);
+fallocate_fun_t register_fallocate(fallocate_fun_t new_fallocate) throw();
+
+typedef int (*posix_fallocate_fun_t)(int, off_t, off_t);
+posix_fallocate_fun_t register_posix_fallocate(posix_fallocate_fun_t new_posix_fallocate) throw();
+
 typedef int (*unlink_fun_t)(const char *);
 unlink_fun_t register_unlink(unlink_fun_t new_unlink) throw();
 
@@ -88,4 +115,10 @@ close_fun_t register_close(close_fun_t new_close) throw();
 typedef char* (*realpath_fun_t)(const char *, char *);
 realpath_fun_t register_realpath(realpath_fun_t new_realpath) throw();
 
+typedef ssize_t (*copy_file_range_fun_t)(int, loff_t *, int, loff_t *, size_t, unsigned int);
+copy_file_range_fun_t register_copy_file_range(copy_file_range_fun_t new_copy_file_range) throw();
+
+typedef ssize_t (*splice_fun_t)(int, loff_t *, int, loff_t *, size_t, unsigned int);
+splice_fun_t register_splice(splice_fun_t new_splice) throw();
+
 #endif // end of header guardian.
@@ -35,16 +35,24 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #ident "$Id$"
 
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
+#include "action_stream.h"
 #include "backup_debug.h"
+#include "backup_internal.h"
 #include "check.h"
+#include "instantiate_vector.h"
 #include "manager.h"
 #include "mutex.h"
+#include "raii-malloc.h"
 #include "real_syscalls.h"
 #include "rwlock.h"
 #include "source_file.h"
@@ -55,6 +63,8 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #define PAUSE(number)
 #endif
 
+const uint64_t source_file::no_copy_frontier;
+
 ////////////////////////////////////////////////////////
 //
 source_file::source_file(const char *path) throw()
@@ -63,16 +73,16 @@ source_file::source_file(const char *path) throw()
    m_reference_count(0),
    m_unlinked(false),
    m_destination_file(NULL),
-   m_flags(0)
+   m_flags(0),
+   m_write_heat(0),
+   m_copy_frontier(no_copy_frontier),
+   m_copy_state(NOT_COPIED),
+   m_table_segment(0)
 {
     {
         int r = pthread_mutex_init(&m_mutex, NULL);
         check(r==0);
     }
-    {
-        int r = pthread_cond_init(&m_cond, NULL);
-        check(r==0);
-    }
     {
         int r = pthread_rwlock_init(&m_name_rwlock, NULL);
         check(r==0);
@@ -81,6 +91,10 @@ source_file::source_file(const char *path) throw()
         int r = pthread_mutex_init(&m_fd_mutex, NULL);
         check(r==0);
     }
+    for (int i = 0; i < n_block_locks; i++) {
+        int r = pthread_mutex_init(&m_block_mutexes[i], NULL);
+        check(r==0);
+    }
 }
 
 source_file::~source_file(void) throw() {
@@ -91,10 +105,6 @@ source_file::~source_file(void) throw() {
             int r = pthread_mutex_destroy(&m_mutex);
             check(r==0);
         }
-        {
-            int r = pthread_cond_destroy(&m_cond);
-            check(r==0);
-        }
         {
             int r = pthread_rwlock_destroy(&m_name_rwlock);
             check(r==0);
@@ -103,6 +113,10 @@ source_file::~source_file(void) throw() {
             int r = pthread_mutex_destroy(&m_fd_mutex);
             check(r==0);
         }
+        for (int i = 0; i < n_block_locks; i++) {
+            int r = pthread_mutex_destroy(&m_block_mutexes[i]);
+            check(r==0);
+        }
     }
 }
 
@@ -124,39 +138,28 @@ void source_file::set_next(source_file *next_source) throw() {
     m_next = next_source;
 }
 
-static bool ranges_intersect (uint64_t lo0, uint64_t hi0,
-                              uint64_t lo1, uint64_t hi1) throw()
-// Effect: Return true iff [lo0,hi0)  (the half-open interval from lo0 inclusive to hi0 exclusive) intersects [lo1, hi1).
-{
-    if (lo0 >= hi0) return false; // range0 is empty
-    if (lo1 >= hi1) return false; // range1 is empty
-    if (hi0 <= lo1) return false; // range0 is before range1
-    if (hi1 <= lo0) return false; // range1 is before range0
-    return true;
-}
-
 bool source_file::lock_range_would_block_unlocked(uint64_t lo, uint64_t hi) const throw() {
-    size_t size = m_locked_ranges.size();    
-    for (size_t i = 0; i<size; i++) {
-        if (ranges_intersect(m_locked_ranges[i].lo, m_locked_ranges[i].hi,
-                             lo, hi)) {
-            return true;
-        }
-    }
-    return false;
+    return m_locked_ranges.find_conflict(lo, hi) != NULL;
 }
 
 ////////////////////////////////////////////////////////
 //
 void source_file::lock_range(uint64_t lo, uint64_t hi) throw() {
     with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
-    while (this->lock_range_would_block_unlocked(lo, hi)) {
-        int r = pthread_cond_wait(&m_cond, &m_mutex);
-        check(r==0);
+    if (lo >= hi) {
+        struct range new_range = {lo,hi};
+        m_empty_ranges.push_back((struct range)new_range);
+        return;
+    }
+    while (true) {
+        locked_range *conflict = m_locked_ranges.find_conflict(lo, hi);
+        if (conflict == NULL) break;
+        // Sleep until that range is unlocked, and then look again,
+        // since some other range may be in the way by then.
+        range_lock_list::wait(conflict, &m_mutex);
     }
     // Got here, we don't intersect any of the ranges.
-    struct range new_range = {lo,hi};
-    m_locked_ranges.push_back((struct range)new_range);
+    m_locked_ranges.insert(lo, hi);
 }
 
 
@@ -164,24 +167,137 @@ void source_file::lock_range(uint64_t lo, uint64_t hi) throw() {
 //
 int source_file::unlock_range(uint64_t lo, uint64_t hi) throw() {
     with_mutex_locked ml(&m_mutex, BACKTRACE(NULL));
-    size_t size = m_locked_ranges.size();
-    for (size_t i=0; i<size; i++) {
-        if (m_locked_ranges[i].lo == lo &&
-            m_locked_ranges[i].hi == hi) {
-            m_locked_ranges[i] = m_locked_ranges[size-1];
-            m_locked_ranges.pop_back();
-            {
-                int r = pthread_cond_broadcast(&m_cond);
-                check(r==0);
-            }
+    if (lo < hi) {
+        if (m_locked_ranges.remove(lo, hi)) {
             return 0;
         }
+    } else {
+        size_t size = m_empty_ranges.size();
+        for (size_t i=0; i<size; i++) {
+            if (m_empty_ranges[i].lo == lo &&
+                m_empty_ranges[i].hi == hi) {
+                m_empty_ranges[i] = m_empty_ranges[size-1];
+                m_empty_ranges.pop_back();
+                return 0;
+            }
+        }
     }
     // No such range.
     the_manager.fatal_error(EINVAL, "Range doesn't exist at %s:%d", __FILE__, __LINE__);
     return EINVAL;
 }
 
+////////////////////////////////////////////////////////
+//
+// block_lock_mask() -
+//
+// Description:
+//
+//     Returns the set of block locks that cover [lo,hi), as a bit mask.
+// An empty range still takes the lock for the block at LO, so that
+// begin_copy() waits for it like any other write.
+//
+unsigned int source_file::block_lock_mask(uint64_t lo, uint64_t hi) const throw() {
+    const uint64_t first = lo >> block_lock_shift;
+    const uint64_t last = (hi > lo) ? (hi - 1) >> block_lock_shift : first;
+    if (last - first >= (uint64_t)n_block_locks) {
+        return (1u << n_block_locks) - 1;
+    }
+    unsigned int mask = 0;
+    for (uint64_t b = first; b <= last; b++) {
+        mask |= 1u << (b % n_block_locks);
+    }
+    return mask;
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::lock_blocks(unsigned int mask) throw() {
+    // Always in the same order, so two writers can't deadlock.
+    for (int i = 0; i < n_block_locks; i++) {
+        if (mask & (1u << i)) {
+            pmutex_lock(&m_block_mutexes[i]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::unlock_blocks(unsigned int mask) throw() {
+    for (int i = 0; i < n_block_locks; i++) {
+        if (mask & (1u << i)) {
+            pmutex_unlock(&m_block_mutexes[i]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+source_file::copy_state source_file::get_copy_state(void) const throw() {
+    return (copy_state)__atomic_load_n(&m_copy_state, __ATOMIC_SEQ_CST);
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::begin_copy(void) throw() {
+    __atomic_store_n(&m_copy_state, COPYING, __ATOMIC_SEQ_CST);
+    // A writer that took its block locks before the store may not
+    // have seen it.  Once we have had every block lock, any such
+    // writer is done, and the rest will see the store and take the
+    // range lock.
+    const unsigned int all = (1u << n_block_locks) - 1;
+    this->lock_blocks(all);
+    this->unlock_blocks(all);
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::end_copy(bool copied) throw() {
+    if (!copied) {
+        __atomic_store_n(&m_copy_state, NOT_COPIED, __ATOMIC_SEQ_CST);
+        return;
+    }
+    // Wait for the writes that hold range locks, so that none of them
+    // overlaps a write that takes block locks.  Those that get their
+    // range lock after us will see the store and switch.
+    this->lock_range(0, LLONG_MAX);
+    __atomic_store_n(&m_copy_state, COPIED, __ATOMIC_SEQ_CST);
+    ignore(this->unlock_range(0, LLONG_MAX)); // We just locked it.
+}
+
+////////////////////////////////////////////////////////
+//
+bool source_file::lock_for_write(uint64_t lo, uint64_t hi) throw() {
+    while (true) {
+        // Each branch checks the state again once it has the lock,
+        // since the copier may have changed it while we waited.
+        if (this->get_copy_state() == COPIED) {
+            const unsigned int mask = this->block_lock_mask(lo, hi);
+            this->lock_blocks(mask);
+            if (this->get_copy_state() == COPIED) {
+                return true;
+            }
+            this->unlock_blocks(mask);
+        } else {
+            this->lock_range(lo, hi);
+            if (this->get_copy_state() != COPIED) {
+                return false;
+            }
+            ignore(this->unlock_range(lo, hi)); // We just locked it.
+        }
+    }
+}
+
+////////////////////////////////////////////////////////
+//
+int source_file::unlock_for_write(uint64_t lo, uint64_t hi, bool block_locked) throw() {
+    if (block_locked) {
+        this->unlock_blocks(this->block_lock_mask(lo, hi));
+        return 0;
+    }
+    return this->unlock_range(lo, hi);
+}
+
 ////////////////////////////////////////////////////////
 //
 void source_file::name_write_lock(void) throw() {
@@ -265,11 +381,66 @@ void source_file::try_to_remove_destination(void) throw() {
         return;
     }
 
+    the_manager.drain_captured_writes(m_destination_file);
     ignore(m_destination_file->close());
     delete m_destination_file;
     m_destination_file = NULL;
 }
 
+////////////////////////////////////////////////////////
+//
+// break_hard_link() -
+//
+// Description:
+//
+//     Replaces the file at PATH, which is open as *FD, with a copy of
+// itself (a clone, if the filesystem can), and sets *FD to the copy.
+// The other links keep the original.
+//
+static int break_hard_link(const char *path, int *fd) throw() {
+    with_object_to_free<char*> tmp_path(malloc_snprintf(strlen(path) + 20, "%s.tokubackup_link", path));
+    int tmp_fd = call_real_open(tmp_path.value, O_RDWR | O_CREAT | O_TRUNC, 0777);
+    if (tmp_fd < 0) {
+        return errno;
+    }
+    int r = 0;
+    if (ioctl(tmp_fd, FICLONE, *fd) != 0) {
+        const size_t buf_size = 1<<20;
+        with_object_to_free<char*> buf((char *)malloc(buf_size));
+        if (buf.value == NULL) {
+            r = ENOMEM;
+        }
+        for (off_t offset = 0; r == 0; ) {
+            ssize_t n_read = pread(*fd, buf.value, buf_size, offset);
+            if (n_read < 0) {
+                r = errno;
+            } else if (n_read == 0) {
+                break;
+            }
+            for (ssize_t n_wrote = 0; r == 0 && n_wrote < n_read; ) {
+                ssize_t n = call_real_pwrite(tmp_fd, buf.value + n_wrote, n_read - n_wrote, offset + n_wrote);
+                if (n < 0) {
+                    r = errno;
+                } else {
+                    n_wrote += n;
+                }
+            }
+            offset += n_read;
+        }
+    }
+    if (r == 0 && call_real_rename(tmp_path.value, path) != 0) {
+        r = errno;
+    }
+    if (r != 0) {
+        ignore(call_real_close(tmp_fd));
+        ignore(call_real_unlink(tmp_path.value));
+        return r;
+    }
+    ignore(call_real_close(*fd));
+    *fd = tmp_fd;
+    return 0;
+}
+
 ////////////////////////////////////////////////////////
 //
 int source_file::try_to_create_destination_file(const char *full_path) throw() {
@@ -283,6 +454,19 @@ int source_file::try_to_create_destination_file(const char *full_path) throw() {
 
     PAUSE(HotBackup::OPEN_DESTINATION_FILE);
 
+    // A streamed backup has no file on disk: the receiver makes it.
+    action_stream *stream = the_manager.backup_stream();
+    if (stream != NULL) {
+        destination_file *dest = new destination_file(-1, full_path);
+        int r = dest->stream_to(stream);
+        if (r != 0) {
+            delete dest;
+            return r;
+        }
+        m_destination_file = dest;
+        return 0;
+    }
+
     // Create the file on disk using the given path, though it may
     // already exist.
     int fd = call_real_open(full_path, O_RDWR | O_CREAT, 0777);
@@ -290,7 +474,25 @@ int source_file::try_to_create_destination_file(const char *full_path) throw() {
         return errno;
     }
 
-    m_destination_file = new destination_file(fd, full_path);
+    // An incremental backup may have hard linked the file to its copy
+    // in an earlier backup, which a captured write must not modify.
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == 0 && sbuf.st_nlink > 1) {
+        int r = break_hard_link(full_path, &fd);
+        if (r != 0) {
+            ignore(call_real_close(fd));
+            return r;
+        }
+    }
+
+    destination_file *dest = new destination_file(fd, full_path);
+    int r = dest->init(the_manager.backup_compression_pool(), the_manager.backup_chunk_store());
+    if (r != 0) {
+        ignore(call_real_close(fd));
+        delete dest;
+        return r;
+    }
+    m_destination_file = dest;
     return 0;
 }
 
@@ -328,6 +530,57 @@ bool source_file::given_flags_are_different(const int flags)
     return true;
 }
 
+////////////////////////////////////////////////////////
+//
+void source_file::add_write_heat(uint64_t n_bytes) throw()
+{
+    __sync_fetch_and_add(&m_write_heat, n_bytes);
+}
+
+////////////////////////////////////////////////////////
+//
+uint64_t source_file::get_write_heat(void) const throw()
+{
+    return m_write_heat;
+}
+
+////////////////////////////////////////////////////////
+//
+void source_file::set_copy_frontier(uint64_t offset) throw()
+{
+    __atomic_store_n(&m_copy_frontier, offset, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////
+//
+uint64_t source_file::get_copy_frontier(void) const throw()
+{
+    return __atomic_load_n(&m_copy_frontier, __ATOMIC_ACQUIRE);
+}
+
+////////////////////////////////////////////////////////
+//
+// n_bytes_to_mirror() -
+//
+// Description:
+//
+//     Returns how many bytes of a write of NBYTE bytes at OFFSET must
+// be mirrored into the backup: the ones below the copy frontier.  The
+// caller holds the range lock for the write, so the copier can't move
+// the frontier across it until we are done.
+//
+size_t source_file::n_bytes_to_mirror(uint64_t offset, size_t nbyte) const throw()
+{
+    const uint64_t frontier = this->get_copy_frontier();
+    if (offset >= frontier) {
+        return 0;
+    }
+    if (frontier - offset < nbyte) {
+        return frontier - offset;
+    }
+    return nbyte;
+}
+
 ////////////////////////////////////////////////////////
 //
 void source_file::fd_lock(void) throw()
@@ -343,4 +596,4 @@ void source_file::fd_unlock(void) throw()
 }
 
 // Instantiate the templates we need
-template class std::vector<range>;
+INSTANTIATE_VECTOR(range)
@@ -41,6 +41,7 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "destination_file.h"
 #include "description.h"
+#include "range_lock_list.h"
 
 struct range {
     uint64_t lo, hi;
@@ -64,6 +65,24 @@ public:
     // Effect: Return true if lock_range() would block because [lo,hi) intersects some locked range.
     //  This function does not acquire any locks.  We expose it for testing purposes (it should not be used by production code).x
 
+    // Once the copier has copied the file, nothing but the application's
+    // own writes and truncates takes its range locks.  Those take a block
+    // lock for each (1MiB) block they touch instead, which is cheaper and
+    // lets writes to different blocks go on at once.  Overlapping writes
+    // share a block lock, so they still reach the backup in the order
+    // they reached the source.
+    enum copy_state { NOT_COPIED, COPYING, COPIED };
+    void begin_copy(void) throw();
+    // Effect: Mark the file as being copied, and wait for the writes that saw it copied to finish, so that the copier's range locks exclude every write from here on.
+    void end_copy(bool copied) throw();
+    // Effect: Mark the file as copied (if COPIED) or not, when the copier is done with it.
+    copy_state get_copy_state(void) const throw();
+
+    bool lock_for_write(uint64_t lo, uint64_t hi) throw();
+    // Effect: Lock [lo,hi) for an application write or truncate: the block locks if the file has been copied, otherwise the range lock.  Returns true if it took the block locks.
+    int unlock_for_write(uint64_t lo, uint64_t hi, bool block_locked) throw() __attribute__((warn_unused_result));
+    // Effect: Undo lock_for_write(), which returned BLOCK_LOCKED.  Return 0 or an error number.
+
     // Name locking and associated rename call.
   private: // use the RAII-style with_source_file_name_write_lock to grab the lock.
     void name_write_lock(void) throw();
@@ -96,6 +115,32 @@ public:
     bool locked_direct_io_flag_is_set(void);
     bool given_flags_are_different(const int flags);
 
+    // How many bytes the application has written to the file while it
+    // has been open (so far as we know).  The copier can use this to
+    // copy the busiest files last.  These are thread-safe.
+    void add_write_heat(uint64_t n_bytes) throw();
+    uint64_t get_write_heat(void) const throw();
+
+    // How far the copier has got through the file.  The copier will
+    // still read everything from the frontier up, so a captured write
+    // there needn't be mirrored into the backup.  The frontier is
+    // no_copy_frontier (everything is mirrored) unless a copier is
+    // partway through the file.  Whoever moves the frontier must hold
+    // the range lock from the lower of the old and new frontiers to the
+    // higher, and a writer must hold the range lock for its write while
+    // it asks how much of the write to mirror.
+    static const uint64_t no_copy_frontier = UINT64_MAX;
+    void set_copy_frontier(uint64_t offset) throw();
+    uint64_t get_copy_frontier(void) const throw();
+    size_t n_bytes_to_mirror(uint64_t offset, size_t nbyte) const throw();
+
+private:
+    static const int n_block_locks = 16;
+    static const int block_lock_shift = 20;
+    unsigned int block_lock_mask(uint64_t lo, uint64_t hi) const throw();
+    void lock_blocks(unsigned int mask) throw();
+    void unlock_blocks(unsigned int mask) throw();
+
 private: // Fd locking using RAII-style object with_source_file_fd_lock to grab the lock.
     void fd_lock(void) throw();
     void fd_unlock(void) throw();
@@ -106,9 +151,9 @@ private:
     pthread_rwlock_t m_name_rwlock;
     unsigned int m_reference_count;
 
-    pthread_mutex_t  m_mutex;
-    pthread_cond_t   m_cond;
-    std::vector<struct range> m_locked_ranges;
+    pthread_mutex_t  m_mutex;           // Protects m_locked_ranges and m_empty_ranges.
+    range_lock_list  m_locked_ranges;   // The nonempty locked ranges.
+    std::vector<struct range> m_empty_ranges; // Empty ranges never conflict, but unlock_range() still has to find them.
 
     bool m_unlinked;
     destination_file * m_destination_file;
@@ -116,6 +161,14 @@ private:
     pthread_mutex_t  m_fd_mutex;
     int m_flags;
 
+    volatile uint64_t m_write_heat;
+    uint64_t m_copy_frontier; // Read and written with atomics.
+    int m_copy_state; // A copy_state, read and written with atomics.
+    pthread_mutex_t m_block_mutexes[n_block_locks]; // Block b is locked by m_block_mutexes[b % n_block_locks].
+
+    int m_table_segment; // The file_hash_table segment that the file is in.  Set by the table, with atomic stores.
+
+    friend class file_hash_table;
     friend class with_source_file_name_write_lock;
     friend class with_source_file_name_read_lock;
     friend class with_source_file_fd_lock;
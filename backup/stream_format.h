@@ -0,0 +1,106 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef STREAM_FORMAT_H
+#define STREAM_FORMAT_H
+
+// The wire format of a streamed backup: the Action messages of
+// remote/backup.proto, in protobuf's encoding, each preceded by its
+// length as a varint.  We write and read them by hand, so that neither
+// the library nor the receiver needs protobuf.  The library sends every
+// action inside a BATCH; the receiver takes bare actions too.
+
+// Action.ActionType
+enum stream_action_type {
+    STREAM_CREATE = 0,
+    STREAM_RENAME = 1,
+    STREAM_UNLINK = 2,
+    STREAM_LINK = 3,
+    STREAM_OPEN = 4,
+    STREAM_CLOSE = 5,
+    STREAM_PWRITE = 6,
+    STREAM_TRUNCATE = 7,
+    STREAM_FALLOCATE = 8,
+    STREAM_END = 9,
+    STREAM_BATCH = 10,
+    STREAM_ACK = 11
+};
+
+// The field numbers of Action.  Each message's own fields are numbered
+// from 1 in the order backup.proto lists them.
+enum stream_action_field {
+    STREAM_FIELD_ACTION = 1,
+    STREAM_FIELD_CREATE = 2,
+    STREAM_FIELD_RENAME = 3,
+    STREAM_FIELD_UNLINK = 4,
+    STREAM_FIELD_LINK = 5,
+    STREAM_FIELD_OPEN = 6,
+    STREAM_FIELD_CLOSE = 7,
+    STREAM_FIELD_PWRITE = 8,
+    STREAM_FIELD_TRUNCATE = 9,
+    STREAM_FIELD_FALLOCATE = 10,
+    STREAM_FIELD_BATCH = 11,
+    STREAM_FIELD_ACK = 12
+};
+
+// The fields of Batch.
+enum stream_batch_field {
+    STREAM_BATCH_SEQ = 1,
+    STREAM_BATCH_ACTION = 2,
+    STREAM_BATCH_WANT_ACK = 3
+};
+
+// Protobuf wire types.
+enum stream_wire_type {
+    STREAM_WIRE_VARINT = 0,
+    STREAM_WIRE_LENGTH = 2
+};
+
+// A PWRITE carries at most this much data, so that the receiver can
+// read each action into a bounded buffer.
+static const unsigned int stream_max_data = 1<<20;
+// And no action (with its framing) is longer than this.
+static const unsigned int stream_max_action = stream_max_data + 4096;
+
+// A batch gathers actions until they come to this many bytes.  A
+// bigger action (a large PWRITE) goes in a batch of its own.
+static const unsigned int stream_batch_bytes = 1<<18;
+// A batch that isn't full is sent once it is this old.
+static const unsigned int stream_flush_interval_ms = 20;
+// The most batches the sender leaves unanswered.
+static const unsigned int stream_max_window = 1024;
+
+#endif // End of header guardian.
@@ -0,0 +1,593 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "stream_format.h"
+#include "stream_receiver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// This file is also compiled into the receiver tool, so it uses the
+// plain system calls, and reports errors only by returning them.
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reads the stream through a buffer, since most actions are tiny.
+//
+// It also answers the batches that ask to be acknowledged, on
+// m_ack_fd: all at once, but always before it waits for more of the
+// stream, since the sender may be waiting for them.
+//
+struct stream_reader {
+    int m_fd;
+    int m_ack_fd;       // -1 if nothing is acknowledged.
+    uint64_t m_ack_seq; // The last batch applied that asked to be acknowledged, if it hasn't been.
+    char m_buf[1<<16];
+    size_t m_begin, m_end;
+};
+
+// Returns 0 or an error number.
+static int send_ack(stream_reader *in) throw() {
+    if (in->m_ack_seq == 0 || in->m_ack_fd < 0) {
+        return 0;
+    }
+    char ack[32];
+    size_t n = 0;
+    ack[n++] = 0; // The frame's length, filled in below.
+    ack[n++] = (STREAM_FIELD_ACTION << 3) | STREAM_WIRE_VARINT;
+    ack[n++] = STREAM_ACK;
+    ack[n++] = (STREAM_FIELD_ACK << 3) | STREAM_WIRE_LENGTH;
+    ack[n++] = 0; // The Ack's length.
+    const size_t ack_begin = n;
+    ack[n++] = (1 << 3) | STREAM_WIRE_VARINT;
+    for (uint64_t v = in->m_ack_seq; ; v >>= 7) {
+        ack[n++] = (char)((v & 0x7f) | ((v >= 0x80) ? 0x80 : 0));
+        if (v < 0x80) break;
+    }
+    ack[ack_begin - 1] = n - ack_begin;
+    ack[0] = n - 1;
+    for (size_t done = 0; done < n; ) {
+        // A sender that has gone away is an error, not a SIGPIPE.
+        ssize_t r = send(in->m_ack_fd, ack + done, n - done, MSG_NOSIGNAL);
+        if (r < 0 && errno == ENOTSOCK) {
+            r = write(in->m_ack_fd, ack + done, n - done);
+        }
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        done += r;
+    }
+    in->m_ack_seq = 0;
+    return 0;
+}
+
+// Returns 0, EPIPE at the end of the stream, or an error number.
+static int read_bytes(stream_reader *in, char *out, size_t n) throw() {
+    while (n > 0) {
+        if (in->m_begin == in->m_end) {
+            int r = send_ack(in);
+            if (r != 0) {
+                return r;
+            }
+            r = read(in->m_fd, in->m_buf, sizeof(in->m_buf));
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            if (r == 0) {
+                return EPIPE;
+            }
+            in->m_begin = 0;
+            in->m_end = r;
+        }
+        size_t len = in->m_end - in->m_begin;
+        if (len > n) {
+            len = n;
+        }
+        memcpy(out, in->m_buf + in->m_begin, len);
+        in->m_begin += len;
+        out += len;
+        n -= len;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int read_frame_length(stream_reader *in, uint64_t *length) throw() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char c;
+        int r = read_bytes(in, &c, 1);
+        if (r != 0) {
+            return r;
+        }
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            *length = v;
+            return 0;
+        }
+    }
+    return EPROTO;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Decoding a message in memory.  get_varint() and parse_message() return
+// false if the message is malformed.
+//
+static bool get_varint(const char **p, const char *end, uint64_t *v) throw() {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        const unsigned char c = *(*p)++;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The fields of a message we care about, which are all numbered below max_fields.
+static const int max_fields = STREAM_FIELD_ACK + 1;
+struct stream_message {
+    bool m_has[max_fields];
+    uint64_t m_uint[max_fields];
+    const char *m_bytes[max_fields];
+    size_t m_length[max_fields];
+};
+
+static bool parse_message(const char *p, const char *end, stream_message *m) throw() {
+    memset(m, 0, sizeof(*m));
+    while (p < end) {
+        uint64_t key, v;
+        if (!get_varint(&p, end, &key)) {
+            return false;
+        }
+        const uint64_t field = key >> 3;
+        if ((key & 7) == STREAM_WIRE_VARINT) {
+            if (!get_varint(&p, end, &v)) {
+                return false;
+            }
+            if (field < (uint64_t)max_fields) {
+                m->m_has[field] = true;
+                m->m_uint[field] = v;
+            }
+        } else if ((key & 7) == STREAM_WIRE_LENGTH) {
+            if (!get_varint(&p, end, &v) || v > (uint64_t)(end - p)) {
+                return false;
+            }
+            if (field < (uint64_t)max_fields) {
+                m->m_has[field] = true;
+                m->m_bytes[field] = p;
+                m->m_length[field] = v;
+            }
+            p += v;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The state of a stream being applied.
+//
+struct stream_target {
+    int m_dir_fd;
+    int *m_fds;      // Indexed by the stream's fds.  -1 if not open.
+    uint32_t m_n_fds;
+    uint64_t m_last_seq; // Of the last batch applied.
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copies string field F of M to a malloc'd string, if it is a safe
+// name: not empty, not absolute, and never going up a directory.
+//
+static int get_name(const stream_message &m, int f, char **name) throw() {
+    if (!m.m_has[f] || m.m_length[f] == 0 || m.m_bytes[f][0] == '/' || memchr(m.m_bytes[f], 0, m.m_length[f]) != NULL) {
+        return EPROTO;
+    }
+    char *s = (char *)malloc(m.m_length[f] + 1);
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    memcpy(s, m.m_bytes[f], m.m_length[f]);
+    s[m.m_length[f]] = 0;
+    for (const char *c = s; c != NULL; c = strchr(c, '/')) {
+        if (*c == '/') c++;
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == 0)) {
+            free(s);
+            return EPROTO;
+        }
+    }
+    *name = s;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int get_fd(const stream_target *t, const stream_message &m, int *fd) throw() {
+    if (!m.m_has[1] || m.m_uint[1] >= t->m_n_fds || t->m_fds[m.m_uint[1]] < 0) {
+        return EPROTO;
+    }
+    *fd = t->m_fds[m.m_uint[1]];
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int pwrite_fully(int fd, const char *buf, size_t n, uint64_t offset) throw() {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (r == 0) {
+            return EIO;
+        }
+        buf += r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Makes NAME, and any missing parents, a directory.
+//
+static int make_directories(int dir_fd, char *name) throw() {
+    for (char *slash = strchr(name, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) {
+            *slash = 0;
+        }
+        int r = (mkdirat(dir_fd, name, 0777) == 0 || errno == EEXIST) ? 0 : errno;
+        if (slash != NULL) {
+            *slash = '/';
+        }
+        if (r != 0 || slash == NULL) {
+            return r;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The fallback of destination_file::fallocate(), for filesystems that
+// can't do MODE.
+//
+static int fallocate_or_fake_it(int fd, int mode, uint64_t offset, uint64_t len) throw() {
+    if (fallocate(fd, mode, offset, len) == 0) {
+        return 0;
+    }
+    int r = errno;
+    if ((r != EOPNOTSUPP && r != ENOSYS) || (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) != 0) {
+        return r;
+    }
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        return errno;
+    }
+    uint64_t end = offset + len;
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        if ((mode & FALLOC_FL_KEEP_SIZE) && end > (uint64_t)sbuf.st_size) {
+            end = sbuf.st_size;
+        }
+        static const char zeros[1<<16] = {0};
+        for (r = 0; r == 0 && offset < end; offset += sizeof(zeros)) {
+            r = pwrite_fully(fd, zeros, (end - offset < sizeof(zeros)) ? end - offset : sizeof(zeros), offset);
+        }
+        return r;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > (uint64_t)sbuf.st_size) {
+        return (ftruncate(fd, end) == 0) ? 0 : errno;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int apply_open(stream_target *t, const stream_message &m) throw() {
+    char *name;
+    int r = get_name(m, 1, &name);
+    if (r != 0) {
+        return r;
+    }
+    if (!m.m_has[2] || m.m_uint[2] > UINT32_MAX - 1) {
+        free(name);
+        return EPROTO;
+    }
+    const uint32_t id = m.m_uint[2];
+    if (id >= t->m_n_fds) {
+        uint32_t n = (t->m_n_fds == 0) ? 64 : t->m_n_fds;
+        while (n <= id) n *= 2;
+        int *fds = (int *)realloc(t->m_fds, n * sizeof(int));
+        if (fds == NULL) {
+            free(name);
+            return ENOMEM;
+        }
+        for (uint32_t i = t->m_n_fds; i < n; i++) {
+            fds[i] = -1;
+        }
+        t->m_fds = fds;
+        t->m_n_fds = n;
+    }
+    if (t->m_fds[id] >= 0) {
+        close(t->m_fds[id]);
+    }
+    t->m_fds[id] = openat(t->m_dir_fd, name, O_RDWR | O_CREAT, 0666);
+    r = (t->m_fds[id] < 0) ? errno : 0;
+    free(name);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// apply_action() -
+//
+// Description:
+//
+//     Applies one action, and sets *done if it was the END.  A BATCH
+// applies each of its actions (which are given a NULL IN, since they
+// can't be batches).  Renaming, unlinking or truncating by name a file
+// that isn't there isn't an error, since the backup doesn't treat it
+// as one either.
+//
+static int apply_batch(stream_target *t, stream_reader *in, const char *batch, size_t length, bool *done) throw();
+
+static int apply_action(stream_target *t, stream_reader *in, const char *action, size_t length, bool *done) throw() {
+    stream_message a, m;
+    if (!parse_message(action, action + length, &a) || !a.m_has[STREAM_FIELD_ACTION]) {
+        return EPROTO;
+    }
+    const uint64_t type = a.m_uint[STREAM_FIELD_ACTION];
+    if (type == STREAM_END) {
+        *done = true;
+        return 0;
+    }
+    if (type == STREAM_BATCH) {
+        if (in == NULL || !a.m_has[STREAM_FIELD_BATCH]) {
+            return EPROTO; // A batch in a batch.
+        }
+        return apply_batch(t, in, a.m_bytes[STREAM_FIELD_BATCH], a.m_length[STREAM_FIELD_BATCH], done);
+    }
+    // Each type's message is in the field two past its value (CREATE's is in field 2, and so on).
+    const uint64_t field = type + 2;
+    if (field > STREAM_FIELD_FALLOCATE || !a.m_has[field]) {
+        return EPROTO;
+    }
+    const char *body = a.m_bytes[field];
+    const size_t body_len = a.m_length[field];
+    if (!parse_message(body, body + body_len, &m)) {
+        return EPROTO;
+    }
+
+    int r = 0;
+    int fd;
+    char *name = NULL, *new_name = NULL;
+    switch (type) {
+    case STREAM_CREATE:
+        r = get_name(m, 1, &name);
+        if (r == 0) {
+            if (!m.m_has[2] || S_ISDIR(m.m_uint[2])) {
+                r = make_directories(t->m_dir_fd, name);
+            } else {
+                fd = openat(t->m_dir_fd, name, O_WRONLY | O_CREAT, m.m_uint[2] & 07777);
+                r = (fd < 0) ? errno : close(fd);
+            }
+        }
+        break;
+    case STREAM_RENAME:
+    case STREAM_LINK:
+        r = get_name(m, 1, &name);
+        if (r == 0) r = get_name(m, 2, &new_name);
+        if (r == 0) {
+            int rr = (type == STREAM_RENAME) ? renameat(t->m_dir_fd, name, t->m_dir_fd, new_name) : linkat(t->m_dir_fd, name, t->m_dir_fd, new_name, 0);
+            r = (rr == 0 || errno == ENOENT) ? 0 : errno;
+        }
+        break;
+    case STREAM_UNLINK:
+        r = get_name(m, 1, &name);
+        if (r == 0) {
+            r = (unlinkat(t->m_dir_fd, name, 0) == 0 || errno == ENOENT) ? 0 : errno;
+        }
+        break;
+    case STREAM_OPEN:
+        r = apply_open(t, m);
+        break;
+    case STREAM_CLOSE:
+        r = get_fd(t, m, &fd);
+        if (r == 0) {
+            t->m_fds[m.m_uint[1]] = -1;
+            r = (close(fd) == 0) ? 0 : errno;
+        }
+        break;
+    case STREAM_PWRITE:
+        r = get_fd(t, m, &fd);
+        if (r == 0 && (!m.m_has[2] || !m.m_has[3])) r = EPROTO;
+        if (r == 0) r = pwrite_fully(fd, m.m_bytes[2], m.m_length[2], m.m_uint[3]);
+        break;
+    case STREAM_TRUNCATE:
+        if (!m.m_has[2]) {
+            r = EPROTO;
+        } else if (m.m_has[3]) {
+            r = get_name(m, 3, &name);
+            if (r == 0) {
+                fd = openat(t->m_dir_fd, name, O_WRONLY);
+                if (fd < 0) {
+                    r = (errno == ENOENT) ? 0 : errno;
+                } else {
+                    r = (ftruncate(fd, m.m_uint[2]) == 0) ? 0 : errno;
+                    close(fd);
+                }
+            }
+        } else {
+            r = get_fd(t, m, &fd);
+            if (r == 0) r = (ftruncate(fd, m.m_uint[2]) == 0) ? 0 : errno;
+        }
+        break;
+    case STREAM_FALLOCATE:
+        r = get_fd(t, m, &fd);
+        if (r == 0 && (!m.m_has[2] || !m.m_has[3] || !m.m_has[4])) r = EPROTO;
+        if (r == 0) r = fallocate_or_fake_it(fd, (int)m.m_uint[2], m.m_uint[3], m.m_uint[4]);
+        break;
+    default:
+        r = EPROTO;
+    }
+    free(name);
+    free(new_name);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// apply_batch() -
+//
+// Description:
+//
+//     Applies the actions of a batch in order (Batch.action repeats,
+// so it can't go through parse_message()), and takes note of it if
+// it wants to be acknowledged.  The batches must come in order.
+//
+static int apply_batch(stream_target *t, stream_reader *in, const char *batch, size_t length, bool *done) throw() {
+    const char *p = batch;
+    const char *end = batch + length;
+    uint64_t seq = 0;
+    bool want_ack = false;
+    int r = 0;
+    while (r == 0 && p < end) {
+        uint64_t key, v;
+        if (!get_varint(&p, end, &key)) {
+            return EPROTO;
+        }
+        if ((key & 7) == STREAM_WIRE_VARINT) {
+            if (!get_varint(&p, end, &v)) {
+                return EPROTO;
+            }
+            if ((key >> 3) == STREAM_BATCH_SEQ) {
+                seq = v;
+            } else if ((key >> 3) == STREAM_BATCH_WANT_ACK) {
+                want_ack = (v != 0);
+            }
+        } else if ((key & 7) == STREAM_WIRE_LENGTH) {
+            if (!get_varint(&p, end, &v) || v > (uint64_t)(end - p)) {
+                return EPROTO;
+            }
+            if ((key >> 3) == STREAM_BATCH_ACTION) {
+                if (*done) {
+                    return EPROTO; // Nothing comes after the END.
+                }
+                r = apply_action(t, NULL, p, v, done);
+            }
+            p += v;
+        } else {
+            return EPROTO;
+        }
+    }
+    if (r == 0 && seq != t->m_last_seq + 1) {
+        r = EPROTO;
+    }
+    if (r == 0) {
+        t->m_last_seq = seq;
+        if (want_ack) {
+            in->m_ack_seq = seq;
+        }
+    }
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int receive_action_stream(int in_fd, int ack_fd, const char *dir) throw() {
+    stream_target t;
+    t.m_dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (t.m_dir_fd < 0) {
+        return errno;
+    }
+    t.m_fds = NULL;
+    t.m_n_fds = 0;
+    t.m_last_seq = 0;
+    stream_reader *in = (stream_reader *)malloc(sizeof(stream_reader));
+    char *action = (char *)malloc(stream_max_action);
+    int r = (in == NULL || action == NULL) ? ENOMEM : 0;
+    if (r == 0) {
+        in->m_fd = in_fd;
+        in->m_ack_fd = ack_fd;
+        in->m_ack_seq = 0;
+        in->m_begin = in->m_end = 0;
+    }
+    bool done = false;
+    while (r == 0 && !done) {
+        uint64_t length;
+        r = read_frame_length(in, &length);
+        if (r == 0 && length > stream_max_action) {
+            r = EPROTO;
+        }
+        if (r == 0) {
+            r = read_bytes(in, action, length);
+        }
+        if (r == 0) {
+            r = apply_action(&t, in, action, length, &done);
+        }
+    }
+    if (r == 0) {
+        r = send_ack(in); // The END's, which the sender is waiting for.
+    }
+    for (uint32_t i = 0; i < t.m_n_fds; i++) {
+        if (t.m_fds[i] >= 0 && close(t.m_fds[i]) != 0 && r == 0) {
+            r = errno;
+        }
+    }
+    free(t.m_fds);
+    free(action);
+    free(in);
+    close(t.m_dir_fd);
+    return r;
+}
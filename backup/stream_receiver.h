@@ -1,3 +1,5 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
 /*======
 This file is part of Percona TokuBackup.
 
@@ -29,47 +31,20 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
     You should have received a copy of the GNU Affero General Public License
     along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
 ======= */
-
-#include "backup_test_helpers.h"
-#include "raii-malloc.h"
-
-static int my_poll(float progress, const char *progress_string, void *poll_extra) {
-    check(poll_extra==NULL);
-    fprintf(stderr, "progress %2.f%%: %s\n", progress*100, progress_string);
-    return 0;
-}
-
-static void simple_error(int errnum, const char *error_string, void *error_extra) {
-    check(error_extra==NULL);
-    fprintf(stderr, "backup error: errnum=%d (%s)\n", errnum, error_string);
-    abort();
-}
-
-int test_main(int argc __attribute__((unused)), const char *argv[] __attribute__((unused))) {
-    setup_source();
-    setup_destination();
-    with_object_to_free<char *> src(get_src());
-    {
-        long long v = dirsum(src.value);
-        //printf("dirsum empty dir is %lld\n", v);
-        check(v==0);
-    }
-
-    systemf("echo hello > %s/data", src.value);
-    {
-        long long v = dirsum(src.value);
-        //printf("dirsum 1dir is %lld\n", v);
-        check(v==6);
-    }
-    systemf("mkdir %s/dir;echo foo > %s/dir/data", src.value, src.value);
-    {
-        long long v = dirsum(src.value);
-        //printf("dirsum 2dir is %lld\n", v);
-        check(v==10);
-    }
-    pthread_t thread;
-    start_backup_thread_with_funs(&thread, get_src(), get_dst(), my_poll, NULL, simple_error, NULL, 0);
-    finish_backup_thread(thread);
-
-    return 0;
-}
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#ifndef STREAM_RECEIVER_H
+#define STREAM_RECEIVER_H
+
+int receive_action_stream(int in_fd, int ack_fd, const char *dir) throw() __attribute__((warn_unused_result));
+// Effect: Read a streamed backup (see stream_format.h) from IN_FD until it ends, and apply it to DIR,
+//  which should be empty.  Names that are absolute, or that go up a directory, are rejected.
+//  The batches that ask for it are acknowledged on ACK_FD (usually IN_FD, a socket).  If ACK_FD is -1,
+//  nothing is acknowledged, so the sender mustn't be given a window.
+//  Returns 0 once the stream's END has been applied.  Returns EPIPE if the stream stops before its END
+//  (the backup failed, or the sender went away), EPROTO if it isn't a backup stream, and otherwise the
+//  error number of whatever failed.
+//  This is shared with the tokubackup_receive tool, so it doesn't use the backup manager.
+
+#endif // End of header guardian.
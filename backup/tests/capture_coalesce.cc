@@ -0,0 +1,121 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that the flushers coalesce captured writes.  The application
+// makes many small writes, some adjacent and some overwriting earlier
+// ones, while the backup's writes are slowed down so that they pile up.
+// The backup should get far fewer writes than the application made,
+// and still end up identical to the source.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "real_syscalls.h"
+
+static const int N_WRITES = 2000;
+static const int SMALL = 512;
+
+static int source_fd;
+static volatile long n_backup_writes = 0;
+
+static pwrite_fun_t original_pwrite;
+static ssize_t my_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
+    if (fd != source_fd) {
+        __sync_fetch_and_add(&n_backup_writes, 1);
+        usleep(1000);
+    }
+    return original_pwrite(fd, buf, nbyte, offset);
+}
+
+static pwritev_fun_t original_pwritev;
+static ssize_t my_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    __sync_fetch_and_add(&n_backup_writes, 1);
+    usleep(1000);
+    return original_pwritev(fd, iov, iovcnt, offset);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    source_fd = openf(O_RDWR | O_CREAT, 0777, "%s/log", src);
+    check(source_fd >= 0);
+
+    backup_set_keep_capturing(true);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+
+    original_pwrite = register_pwrite(my_pwrite);
+    original_pwritev = register_pwritev(my_pwritev);
+    char buf[SMALL];
+    off_t end = 0;
+    for (int i = 0; i < N_WRITES; i++) {
+        memset(buf, 'a' + i % 26, sizeof(buf));
+        // Mostly append, like a log, but every fifth write rewrites
+        // parts of the last two blocks, like a checkpoint.
+        if (i % 5 == 4) {
+            check(pwrite(source_fd, buf, sizeof(buf), end - SMALL - SMALL / 2) == (ssize_t)sizeof(buf));
+        } else {
+            check(pwrite(source_fd, buf, sizeof(buf), end) == (ssize_t)sizeof(buf));
+            end += SMALL;
+        }
+    }
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(backup_thread);
+    register_pwrite(original_pwrite);
+    register_pwritev(original_pwritev);
+    check(close(source_fd) == 0);
+
+    fprintf(stderr, "%d application writes became %ld backup writes\n", N_WRITES, n_backup_writes);
+    check(n_backup_writes < N_WRITES / 4);
+    int r = systemf("cmp %s/log %s/log", src, dst);
+    check(r == 0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,149 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that captured writes beyond the copier's frontier aren't
+// mirrored into the backup, since the copier reads them anyway.  We
+// stall the copier after its first chunk by throttling it to a byte per
+// second, write both behind and ahead of it (and past the end of the
+// file), and count the backup's writes at the offsets we used.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "real_syscalls.h"
+
+static const size_t MB = 1024 * 1024;
+static const size_t FILE_SIZE = 4 * MB;
+static const off_t MARK = 100; // Our writes start this far into a page, and the copier's never do.
+static const size_t SMALL = 100;
+
+static int source_fd;
+static volatile long n_head_writes = 0;
+static volatile long n_tail_writes = 0;
+
+static void count(int fd, off_t offset) {
+    if (fd == source_fd || offset % 4096 != MARK) {
+        return;
+    }
+    if (offset < (off_t)MB) {
+        __sync_fetch_and_add(&n_head_writes, 1);
+    } else {
+        __sync_fetch_and_add(&n_tail_writes, 1);
+    }
+}
+
+static pwrite_fun_t original_pwrite;
+static ssize_t my_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
+    count(fd, offset);
+    return original_pwrite(fd, buf, nbyte, offset);
+}
+
+static pwritev_fun_t original_pwritev;
+static ssize_t my_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    count(fd, offset);
+    return original_pwritev(fd, iov, iovcnt, offset);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    source_fd = openf(O_RDWR | O_CREAT, 0777, "%s/data", src);
+    check(source_fd >= 0);
+    {
+        char *buf = (char *)malloc(FILE_SIZE);
+        check(buf != NULL);
+        for (size_t i = 0; i < FILE_SIZE; i++) {
+            buf[i] = 'a' + i % 26;
+        }
+        check(write(source_fd, buf, FILE_SIZE) == (ssize_t)FILE_SIZE);
+        free(buf);
+    }
+
+    original_pwrite = register_pwrite(my_pwrite);
+    original_pwritev = register_pwritev(my_pwritev);
+    tokubackup_throttle_backup(1);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+
+    // Wait for the copier to copy its first chunk and stall.
+    char *dst_file;
+    check(asprintf(&dst_file, "%s/data", dst) > 0);
+    while (1) {
+        struct stat sbuf;
+        if (stat(dst_file, &sbuf) == 0 && sbuf.st_size >= (off_t)MB) break;
+        usleep(1000);
+    }
+
+    char buf[SMALL];
+    memset(buf, 'X', sizeof(buf));
+    // Behind the copier: these must be mirrored.
+    for (int i = 0; i < 4; i++) {
+        check(pwrite(source_fd, buf, sizeof(buf), i * 4096 + MARK) == (ssize_t)sizeof(buf));
+    }
+    // Ahead of the copier, and past the end of the file: these needn't be.
+    for (int i = 0; i < 16; i++) {
+        check(pwrite(source_fd, buf, sizeof(buf), 2 * MB + i * 65536 + MARK) == (ssize_t)sizeof(buf));
+    }
+    check(pwrite(source_fd, buf, sizeof(buf), FILE_SIZE + MB + MARK) == (ssize_t)sizeof(buf));
+    check(!backup_done_copying());
+
+    tokubackup_throttle_backup(ULONG_MAX);
+    finish_backup_thread(backup_thread);
+    register_pwrite(original_pwrite);
+    register_pwritev(original_pwritev);
+    check(close(source_fd) == 0);
+
+    fprintf(stderr, "%ld writes behind the copier and %ld ahead of it were mirrored\n", n_head_writes, n_tail_writes);
+    check(n_head_writes > 0);
+    check(n_tail_writes == 0);
+    check(systemf("cmp %s/data %s", src, dst_file) == 0);
+    free(dst_file);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,161 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that a captured write still queued for the backup when the copier
+// starts a file can't land on top of what the copier copies.  The
+// flushers' writes are slowed down.  Just before the copier starts the
+// file, we write an offset in its second chunk, and that write is
+// queued.  As the copier writes its first chunk, we write the same
+// offset again.  That write is ahead of the copier, so it isn't
+// mirrored, and the copier copies it.  The backup must end up with the
+// second write.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "real_syscalls.h"
+
+static const size_t MB = 1024 * 1024;
+static const size_t FILE_SIZE = 2 * MB;
+static const off_t OFFSET = MB + 100; // In the copier's second chunk.
+static const size_t SMALL = 100;
+
+static int source_fd;
+static char *source_path;
+static pthread_t copier_thread;
+static volatile bool copier_started = false;
+static volatile bool rewritten = false;
+
+static void write_small(char c) {
+    char buf[SMALL];
+    memset(buf, c, sizeof(buf));
+    check(pwrite(source_fd, buf, sizeof(buf), OFFSET) == (ssize_t)sizeof(buf));
+}
+
+// Called by the copier just before it copies each file.  (It is also
+// called with the backup's names, while the backup starts.)
+static int before_copy(const char *source_file, void *extra __attribute__((__unused__))) {
+    if (strcmp(source_file, source_path) == 0) {
+        copier_thread = pthread_self();
+        copier_started = true;
+        write_small('1');
+    }
+    return 0;
+}
+
+// The copier's writes go straight through, and the first one (of its
+// first chunk) rewrites the offset.  Everybody else's writes to the
+// backup are slow.
+static void before_backup_write(int fd) {
+    if (fd == source_fd) {
+        return;
+    }
+    if (copier_started && pthread_equal(pthread_self(), copier_thread)) {
+        if (!rewritten) {
+            rewritten = true;
+            write_small('2');
+        }
+    } else {
+        usleep(200000);
+    }
+}
+
+static pwrite_fun_t original_pwrite;
+static ssize_t my_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
+    before_backup_write(fd);
+    return original_pwrite(fd, buf, nbyte, offset);
+}
+
+static pwritev_fun_t original_pwritev;
+static ssize_t my_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    before_backup_write(fd);
+    return original_pwritev(fd, iov, iovcnt, offset);
+}
+
+static copy_file_range_fun_t original_copy_file_range;
+static ssize_t my_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    before_backup_write(fd_out);
+    return original_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    source_fd = openf(O_RDWR | O_CREAT, 0777, "%s/data", src);
+    check(source_fd >= 0);
+    {
+        char *real_src = realpath(src, NULL);
+        check(real_src != NULL);
+        check(asprintf(&source_path, "%s/data", real_src) > 0);
+        free(real_src);
+    }
+    {
+        char *buf = (char *)malloc(FILE_SIZE);
+        check(buf != NULL);
+        memset(buf, 'a', FILE_SIZE);
+        check(write(source_fd, buf, FILE_SIZE) == (ssize_t)FILE_SIZE);
+        free(buf);
+    }
+
+    original_pwrite = register_pwrite(my_pwrite);
+    original_pwritev = register_pwritev(my_pwritev);
+    original_copy_file_range = register_copy_file_range(my_copy_file_range);
+    pthread_t backup_thread;
+    start_backup_thread_with_exclusion_callback(&backup_thread, before_copy, NULL);
+    finish_backup_thread(backup_thread);
+    register_pwrite(original_pwrite);
+    register_pwritev(original_pwritev);
+    register_copy_file_range(original_copy_file_range);
+    check(rewritten);
+    check(close(source_fd) == 0);
+
+    check(systemf("cmp %s/data %s/data", src, dst) == 0);
+    free(source_path);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
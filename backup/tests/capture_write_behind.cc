@@ -0,0 +1,124 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that captured writes mirrored by the write-behind queue reach the
+// backup in order.  Several threads overwrite the same blocks of an open
+// file while the backup is capturing, with a queue small enough that
+// they have to wait for it, and then the file is truncated and written
+// again.  The backup must end up identical to the source.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const int N_THREADS = 4;
+static const int N_WRITES = 500; // per thread
+static const int BLOCK = 4096;
+static const int N_BLOCKS = 256;
+
+static int fd;
+
+static void *overwrite(void *arg) {
+    const long id = (long)arg;
+    unsigned int seed = id + 1;
+    char buf[BLOCK];
+    for (int i = 0; i < N_WRITES; i++) {
+        memset(buf, 'a' + (id * N_WRITES + i) % 26, sizeof(buf));
+        // Straddle block boundaries, so that writes from different threads overlap.
+        const off_t offset = (off_t)(rand_r(&seed) % N_BLOCKS) * BLOCK + (rand_r(&seed) % 2) * BLOCK / 2;
+        check(pwrite(fd, buf, sizeof(buf), offset) == (ssize_t)sizeof(buf));
+    }
+    return arg;
+}
+
+static void run(unsigned long queue_size) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    fd = openf(O_RDWR | O_CREAT, 0777, "%s/data", src);
+    check(fd >= 0);
+    char buf[BLOCK];
+    memset(buf, 'z', sizeof(buf));
+    for (int i = 0; i < N_BLOCKS; i++) {
+        check(write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    }
+
+    tokubackup_set_capture_queue_size(queue_size);
+    backup_set_keep_capturing(true);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+
+    pthread_t threads[N_THREADS];
+    for (long i = 0; i < N_THREADS; i++) {
+        check(pthread_create(&threads[i], NULL, overwrite, (void *)i) == 0);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        check(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // Writes past the new end must not come back after the truncate.
+    check(ftruncate(fd, N_BLOCKS * BLOCK / 3) == 0);
+    memset(buf, 'y', sizeof(buf));
+    check(pwrite(fd, buf, sizeof(buf), BLOCK / 4) == (ssize_t)sizeof(buf));
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(backup_thread);
+    check(close(fd) == 0);
+
+    int r = systemf("cmp %s/data %s/data", src, dst);
+    check(r == 0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    run(3 * BLOCK);      // Smaller than one write per flusher, so writers wait.
+    run(64 * 1024 * 1024);
+    run(0);              // Synchronous.
+    return 0;
+}
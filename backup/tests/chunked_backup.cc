@@ -0,0 +1,226 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+// Check that chunk boundaries survive an insertion, and then two
+// deduplicated backups into one chunk store: the second, of a source
+// changed a little, must store only a few new chunks, and the files of
+// both must restore to their sources, including the writes captured
+// while the second was running (inside the chunks, past the end of the
+// file, and truncating it, by fd and by name).
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "chunk_format.h"
+
+static void fill_random(char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = random();
+    }
+}
+
+static void cut(const char *buf, size_t n, std::vector<chunk_ref> *refs) {
+    size_t at = 0;
+    while (at < n) {
+        size_t c = find_chunk_boundary(buf + at, n - at, 0);
+        if (c == 0) {
+            c = n - at;
+        }
+        check(c <= chunk_max_size);
+        chunk_ref ref;
+        make_chunk_ref(buf + at, c, &ref);
+        refs->push_back(ref);
+        at += c;
+    }
+}
+
+static bool same_chunk(const chunk_ref &a, const chunk_ref &b) {
+    return a.m_hash[0] == b.m_hash[0] && a.m_hash[1] == b.m_hash[1] && a.m_length == b.m_length;
+}
+
+static void test_boundaries(void) {
+    const size_t n = 4 << 20;
+    char *buf = (char *)malloc(n + 100);
+    fill_random(buf, n);
+    std::vector<chunk_ref> before;
+    cut(buf, n, &before);
+    check(before.size() > n / chunk_max_size);
+
+    // Insert 100 bytes near the start: only the chunks around them may change.
+    memmove(buf + 1100, buf + 1000, n - 1000);
+    fill_random(buf + 1000, 100);
+    std::vector<chunk_ref> after;
+    cut(buf, n + 100, &after);
+    size_t shared = 0;
+    for (size_t i = 0; i < after.size(); i++) {
+        for (size_t j = 0; j < before.size(); j++) {
+            if (same_chunk(after[i], before[j])) {
+                shared++;
+                break;
+            }
+        }
+    }
+    check(shared + 2 >= before.size());
+    free(buf);
+}
+
+static void write_file(const char *src, const char *name, const char *buf, size_t n, off_t offset) {
+    int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/%s", src, name);
+    check(fd >= 0);
+    check(pwrite(fd, buf, n, offset) == (ssize_t)n);
+    check(close(fd) == 0);
+}
+
+// Restore the backup of NAME next to it, and compare it with the source.
+static void check_restored(const char *src, const char *dst, const char *store, const char *name) {
+    int store_fd = open(store, O_RDONLY | O_DIRECTORY);
+    check(store_fd >= 0);
+    int in_fd = openf(O_RDONLY, 0, "%s/%s", dst, name);
+    check(in_fd >= 0);
+    check(is_chunk_recipe(in_fd));
+    int out_fd = openf(O_WRONLY | O_CREAT | O_TRUNC, 0777, "%s/%s.restored", dst, name);
+    check(out_fd >= 0);
+    check(restore_chunked_file(store_fd, in_fd, out_fd) == 0);
+    check(close(out_fd) == 0);
+    check(close(in_fd) == 0);
+    check(close(store_fd) == 0);
+    check(systemf("cmp %s/%s %s/%s.restored", src, name, dst, name) == 0);
+}
+
+static int count_chunks(const char *store) {
+    char command[1000];
+    snprintf(command, sizeof(command), "find %s -type f | wc -l", store);
+    FILE *f = popen(command, "r");
+    check(f != NULL);
+    int n = -1;
+    check(fscanf(f, "%d", &n) == 1);
+    check(pclose(f) == 0);
+    return n;
+}
+
+static void test_backup(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    char store[1000], dst2[1000];
+    snprintf(store, sizeof(store), "%s.store", dst);
+    snprintf(dst2, sizeof(dst2), "%s.2", dst);
+    check(systemf("rm -rf %s %s", store, dst2) == 0);
+    setup_directory(dst2);
+
+    const size_t n = 3 << 20;
+    char *data = (char *)malloc(n + 10);
+    char *noise = (char *)malloc(n);
+    fill_random(data, n);
+    fill_random(noise, n);
+    write_file(src, "data", data, n, 0);
+    write_file(src, "sparse", data, 1000, 0);
+    write_file(src, "sparse", noise, 1000, 2000000);
+    write_file(src, "empty", data, 0, 0);
+    write_file(src, "open", noise, n, 0);
+    write_file(src, "closed", noise, n, 0);
+    char closed[1000], open_path[1000];
+    snprintf(closed, sizeof(closed), "%s/closed", src);
+    snprintf(open_path, sizeof(open_path), "%s/open", src);
+
+    check(tokubackup_set_chunk_store(store) == 0);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    const int first = count_chunks(store);
+    check(first > (int)(2 * n / chunk_max_size));
+    check_restored(src, dst, store, "data");
+    check_restored(src, dst, store, "sparse");
+    check_restored(src, dst, store, "empty");
+    check_restored(src, dst, store, "open");
+    check_restored(src, dst, store, "closed");
+
+    // Insert 10 bytes into the middle of data, and write open while the second backup runs.
+    memmove(data + n / 2 + 10, data + n / 2, n / 2);
+    memset(data + n / 2, 'x', 10);
+    write_file(src, "data", data, n + 10, 0);
+    int fd = openf(O_RDWR, 0, "%s/open", src);
+    check(fd >= 0);
+    int fd2 = openf(O_RDWR, 0, "%s/open", src); // So the backup copy is still in use when the backup ends.
+    check(fd2 >= 0);
+    backup_set_keep_capturing(true);
+    start_backup_thread(&thread, strdup(dst2));
+    while (!backup_is_capturing()) sched_yield(); // The first backup left backup_done_copying() true.
+    while (!backup_done_copying()) sched_yield();
+    check(pwrite(fd, data, 100, 1000000) == 100);
+    check(pwrite(fd, data, 5000, n + 300000) == 5000);
+    check(ftruncate(fd, n - 700000) == 0);
+    check(pwrite(fd, data, 70000, 200000) == 70000);
+    // By name, both a file nothing has open and one that is open.
+    check(truncate(closed, 1000000) == 0);
+    check(truncate(open_path, n - 900000) == 0);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    check(tokubackup_set_chunk_store(NULL) == 0);
+
+    // The inserted bytes and the captured writes touch only a few chunks each.
+    check(count_chunks(store) <= first + 12);
+    check_restored(src, dst2, store, "data");
+    check_restored(src, dst2, store, "sparse");
+    check_restored(src, dst2, store, "empty");
+    check_restored(src, dst2, store, "open");
+    check_restored(src, dst2, store, "closed");
+    check(close(fd) == 0);
+    check(close(fd2) == 0);
+
+    check(systemf("rm -rf %s %s", store, dst2) == 0);
+    free(data);
+    free(noise);
+    cleanup_dirs();
+    free(src);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_boundaries();
+    test_backup();
+    return 0;
+}
@@ -0,0 +1,263 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Check the codec and the compression pool, and then a compressed backup: its files must
+// decompress to the sources, including the writes captured while the
+// backup was running (across block boundaries, past the end of the
+// file, and truncating it, by fd and by name), and a file still open
+// (twice) when the backup ends.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "compressed_file.h"
+#include "compressed_format.h"
+#include "lz_codec.h"
+
+static void fill_text(char *buf, size_t n) {
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = words[(i * 7 / 5) % (sizeof(words) - 1)];
+    }
+}
+
+static void fill_random(char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = random();
+    }
+}
+
+static void test_codec(void) {
+    const size_t n = compressed_block_size;
+    char *in = (char *)malloc(n);
+    char *out = (char *)malloc(lz_compress_bound(n));
+    char *back = (char *)malloc(n);
+
+    fill_text(in, n);
+    size_t c = lz_compress(in, n, out, lz_compress_bound(n));
+    check(c > 0 && c < n / 4);
+    check(lz_decompress(out, c, back, n) == 0);
+    check(memcmp(in, back, n) == 0);
+    // A truncated or too-short output must be caught, not overrun.
+    check(lz_decompress(out, c / 2, back, n) == EINVAL);
+    check(lz_decompress(out, c, back, n - 1) == EINVAL);
+
+    // Random data doesn't shrink, so it is stored as it is.
+    fill_random(in, n);
+    check(lz_compress(in, n, out, lz_compress_bound(n)) == 0);
+
+    free(in);
+    free(out);
+    free(back);
+}
+
+static int count_threads(void) {
+    DIR *dir = opendir("/proc/self/task");
+    check(dir != NULL);
+    int n = 0;
+    while (struct dirent *e = readdir(dir)) {
+        if (e->d_name[0] != '.') {
+            n++;
+        }
+    }
+    check(closedir(dir) == 0);
+    return n;
+}
+
+static compression_pool pool;
+static const int n_pool_jobs = 12;
+static char *pool_in;
+
+// Compress a batch with the pool, many times over, and check it against compressing it alone.
+static void *compress_with_pool(void *arg __attribute__((__unused__))) {
+    const size_t bound = lz_compress_bound(compressed_block_size);
+    compression_pool::job jobs[n_pool_jobs], alone[n_pool_jobs];
+    char *out = (char *)malloc(2 * n_pool_jobs * bound);
+    check(out != NULL);
+    for (int j = 0; j < n_pool_jobs; j++) {
+        jobs[j].m_block = alone[j].m_block = j;
+        jobs[j].m_data = alone[j].m_data = pool_in + j * compressed_block_size;
+        jobs[j].m_out = out + j * bound;
+        alone[j].m_out = out + (n_pool_jobs + j) * bound;
+        compression_pool::compress_job(&alone[j]);
+    }
+    for (int i = 0; i < 20; i++) {
+        for (int n = 1; n <= n_pool_jobs; n++) {
+            memset(out, 0, n_pool_jobs * bound);
+            pool.compress(jobs, n);
+            for (int j = 0; j < n; j++) {
+                check(jobs[j].m_kind == alone[j].m_kind && jobs[j].m_length == alone[j].m_length);
+                check(memcmp(jobs[j].m_out, alone[j].m_out, jobs[j].m_length) == 0);
+            }
+        }
+    }
+    free(out);
+    return NULL;
+}
+
+// The pool's helpers are started once, and shared by writers.  Without them a writer does all the work.
+static void test_pool(void) {
+    pool_in = (char *)malloc(n_pool_jobs * compressed_block_size);
+    check(pool_in != NULL);
+    for (int j = 0; j < n_pool_jobs; j++) {
+        char *block = pool_in + j * compressed_block_size;
+        switch (j % 3) {
+        case 0: fill_text(block, compressed_block_size); break;
+        case 1: fill_random(block, compressed_block_size); break;
+        default: memset(block, 0, compressed_block_size); break;
+        }
+    }
+    compress_with_pool(NULL);
+    const int n_threads = count_threads();
+    pool.start();
+    check(count_threads() == n_threads + compression_pool::n_helpers);
+    const int n_writers = 4;
+    pthread_t writers[n_writers];
+    for (int i = 0; i < n_writers; i++) {
+        check(pthread_create(&writers[i], NULL, compress_with_pool, NULL) == 0);
+    }
+    for (int i = 0; i < n_writers; i++) {
+        check(pthread_join(writers[i], NULL) == 0);
+    }
+    check(count_threads() == n_threads + compression_pool::n_helpers);
+    pool.stop();
+    check(count_threads() == n_threads);
+    compress_with_pool(NULL);
+    free(pool_in);
+}
+
+static void write_file(const char *src, const char *name, const char *buf, size_t n, off_t offset) {
+    int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/%s", src, name);
+    check(fd >= 0);
+    check(pwrite(fd, buf, n, offset) == (ssize_t)n);
+    check(close(fd) == 0);
+}
+
+// Decompress the backup of NAME next to it, and compare it with the source.
+static void check_restored(const char *src, const char *dst, const char *name) {
+    int in_fd = openf(O_RDONLY, 0, "%s/%s", dst, name);
+    check(in_fd >= 0);
+    check(is_compressed_file(in_fd));
+    int out_fd = openf(O_WRONLY | O_CREAT | O_TRUNC, 0777, "%s/%s.restored", dst, name);
+    check(out_fd >= 0);
+    check(decompress_file(in_fd, out_fd) == 0);
+    check(close(out_fd) == 0);
+    check(close(in_fd) == 0);
+    check(systemf("cmp %s/%s %s/%s.restored", src, name, dst, name) == 0);
+}
+
+static void test_backup(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    const size_t n = 300000;
+    char *text = (char *)malloc(n);
+    char *noise = (char *)malloc(n);
+    fill_text(text, n);
+    fill_random(noise, n);
+    write_file(src, "text", text, n, 0);
+    write_file(src, "random", noise, n, 0);
+    write_file(src, "sparse", text, 1000, 0);
+    write_file(src, "sparse", noise, 1000, 700000);
+    write_file(src, "empty", text, 0, 0);
+    write_file(src, "closed", text, n, 0);
+    char closed[1000], open_path[1000];
+    snprintf(closed, sizeof(closed), "%s/closed", src);
+    snprintf(open_path, sizeof(open_path), "%s/open", src);
+    int fd = openf(O_RDWR | O_CREAT, 0777, "%s/open", src);
+    check(fd >= 0);
+    check(pwrite(fd, text, n, 0) == (ssize_t)n);
+    int fd2 = openf(O_RDWR, 0, "%s/open", src); // So the backup copy is still in use when the backup ends.
+    check(fd2 >= 0);
+
+    tokubackup_set_compression(1);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_done_copying()) sched_yield();
+    // Across a block boundary, past the end, then shrinking into a block, and writing at the fd's offset.
+    check(pwrite(fd, noise, 100, compressed_block_size - 50) == 100);
+    check(pwrite(fd, noise, 3 * compressed_block_size, 400000) == (ssize_t)(3 * compressed_block_size));
+    check(ftruncate(fd, 350000) == 0);
+    check(lseek(fd, 200000, SEEK_SET) == 200000);
+    check(write(fd, noise, 1000) == 1000);
+    // By name, both a file nothing has open and one that is open.
+    check(truncate(closed, 100000) == 0);
+    check(truncate(open_path, 300000) == 0);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_compression(0);
+
+    check_restored(src, dst, "text");
+    check_restored(src, dst, "random");
+    check_restored(src, dst, "sparse");
+    check_restored(src, dst, "empty");
+    check_restored(src, dst, "open");
+    check_restored(src, dst, "closed");
+    struct stat sbuf;
+    int text_fd = openf(O_RDONLY, 0, "%s/text", dst);
+    check(text_fd >= 0 && fstat(text_fd, &sbuf) == 0);
+    check(sbuf.st_size < (off_t)n / 4);
+    check(close(text_fd) == 0);
+    check(close(fd) == 0);
+    check(close(fd2) == 0);
+
+    free(text);
+    free(noise);
+    cleanup_dirs();
+    free(src);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_codec();
+    test_pool();
+    test_backup();
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Test the locks that application writes take on a file the copier has
+// finished.  They take block locks instead of range locks, so they
+// exclude each other only when they share a block, and the copier's
+// state changes wait for the writers on the other kind of lock.  Then
+// run a backup in which many threads make overlapping writes to a copied
+// file, and check that the backup still matches the source.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "source_file.h"
+
+static const uint64_t MB = 1024 * 1024;
+
+static source_file sf("locks");
+
+// The thread under test says when it's about to take its lock and when
+// it gets past it.  For a lock that should block, we say when we let go
+// of ours, so that the thread can tell us whether it got past before.
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static bool started, released, done, done_after_release;
+
+static void set_state(bool *flag) {
+    check(pthread_mutex_lock(&state_mutex) == 0);
+    *flag = true;
+    if (flag == &done) {
+        done_after_release = released;
+    }
+    check(pthread_cond_broadcast(&state_cond) == 0);
+    check(pthread_mutex_unlock(&state_mutex) == 0);
+}
+
+static void wait_for_state(bool *flag) {
+    check(pthread_mutex_lock(&state_mutex) == 0);
+    while (!*flag) {
+        check(pthread_cond_wait(&state_cond, &state_mutex) == 0);
+    }
+    check(pthread_mutex_unlock(&state_mutex) == 0);
+}
+
+static void *lock_first_block(void *arg __attribute__((__unused__))) {
+    set_state(&started);
+    bool block_locked = sf.lock_for_write(50, 150);
+    check(block_locked);
+    set_state(&done);
+    check(sf.unlock_for_write(50, 150, block_locked) == 0);
+    return NULL;
+}
+
+static void *lock_third_block(void *arg __attribute__((__unused__))) {
+    set_state(&started);
+    bool block_locked = sf.lock_for_write(2 * MB, 2 * MB + 100);
+    check(block_locked);
+    set_state(&done);
+    check(sf.unlock_for_write(2 * MB, 2 * MB + 100, block_locked) == 0);
+    return NULL;
+}
+
+static void *begin_copy(void *arg __attribute__((__unused__))) {
+    set_state(&started);
+    sf.begin_copy();
+    set_state(&done);
+    return NULL;
+}
+
+static void *end_copy(void *arg __attribute__((__unused__))) {
+    set_state(&started);
+    sf.end_copy(true);
+    set_state(&done);
+    return NULL;
+}
+
+// Run FUN in a thread, and check whether it gets done while we hold whatever lock we hold.
+static void check_blocks(void *(*fun)(void *), bool should_block, uint64_t lo, uint64_t hi, bool block_locked) {
+    started = released = done = done_after_release = false;
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, fun, NULL) == 0);
+    wait_for_state(&started);
+    if (should_block) {
+        set_state(&released);
+        check(sf.unlock_for_write(lo, hi, block_locked) == 0);
+        check(pthread_join(thread, NULL) == 0);
+        check(done && done_after_release);
+    } else {
+        wait_for_state(&done);
+        check(!done_after_release);
+        check(sf.unlock_for_write(lo, hi, block_locked) == 0);
+        check(pthread_join(thread, NULL) == 0);
+    }
+}
+
+static void test_locks(void) {
+    // Before the copy, writes take range locks.
+    check(sf.get_copy_state() == source_file::NOT_COPIED);
+    bool block_locked = sf.lock_for_write(0, 100);
+    check(!block_locked);
+    check(sf.lock_range_would_block_unlocked(0, 100));
+    // Marking the file copied waits for them.
+    check_blocks(end_copy, true, 0, 100, block_locked);
+    check(sf.get_copy_state() == source_file::COPIED);
+
+    // Now they take block locks, which the range locks don't see.
+    block_locked = sf.lock_for_write(0, 100);
+    check(block_locked);
+    check(!sf.lock_range_would_block_unlocked(0, 100));
+    // A write to the same block waits, and one to another block doesn't.
+    check_blocks(lock_first_block, true, 0, 100, block_locked);
+    block_locked = sf.lock_for_write(0, 100);
+    check_blocks(lock_third_block, false, 0, 100, block_locked);
+
+    // Copying the file again waits for the block locks too.
+    block_locked = sf.lock_for_write(MB, 3 * MB);
+    check(block_locked);
+    check_blocks(begin_copy, true, MB, 3 * MB, block_locked);
+    check(sf.get_copy_state() == source_file::COPYING);
+    block_locked = sf.lock_for_write(0, 100);
+    check(!block_locked);
+    check(sf.unlock_for_write(0, 100, block_locked) == 0);
+    sf.end_copy(false);
+    check(sf.get_copy_state() == source_file::NOT_COPIED);
+}
+
+static const int N_WRITERS = 4;
+static const int N_WRITES = 1000;
+static const size_t WRITE_SIZE = 3000;
+static int source_fd;
+
+static void *overlapping_writes(void *arg) {
+    const int id = *(int *)arg;
+    char buf[WRITE_SIZE];
+    memset(buf, 'a' + id, sizeof(buf));
+    unsigned int seed = id;
+    for (int i = 0; i < N_WRITES; i++) {
+        // Everyone writes to the same few blocks, so the writes overlap, and some span two blocks.
+        off_t offset = rand_r(&seed) % (2 * MB + MB / 2) + MB - WRITE_SIZE;
+        check(pwrite(source_fd, buf, sizeof(buf), offset) == (ssize_t)sizeof(buf));
+    }
+    return arg;
+}
+
+static void test_backup(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    source_fd = openf(O_RDWR | O_CREAT, 0777, "%s/data", src);
+    check(source_fd >= 0);
+    check(ftruncate(source_fd, 4 * MB) == 0);
+
+    backup_set_keep_capturing(true);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+
+    pthread_t writers[N_WRITERS];
+    int ids[N_WRITERS];
+    for (int i = 0; i < N_WRITERS; i++) {
+        ids[i] = i;
+        check(pthread_create(&writers[i], NULL, overlapping_writes, &ids[i]) == 0);
+    }
+    for (int i = 0; i < N_WRITERS; i++) {
+        check(pthread_join(writers[i], NULL) == 0);
+    }
+    // A truncate takes every block lock.
+    check(ftruncate(source_fd, 3 * MB) == 0);
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(backup_thread);
+    check(close(source_fd) == 0);
+
+    check(systemf("cmp %s/data %s/data", src, dst) == 0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_locks();
+    test_backup();
+    return 0;
+}
@@ -0,0 +1,183 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test the copy orders: largest first, smallest first, and coldest first
+// (where the files the application writes the most are copied last).  The
+// exclusion callback is called as each file is copied, so we use it to
+// see the order.
+//
+// Then copy with several threads, with the largest files at the bottom of a
+// deep directory chain.  No file may be copied until the whole tree has been
+// scanned, however long that takes.  A worker calls the callback for one file
+// before it takes the next, so the first file seen must be one of the N_THREADS
+// largest.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+static const int N_FILES = 12;
+static const int N_LEVELS = 8;
+static const int N_THREADS = 4;
+static const int MAX_COPIED = 100;
+
+static off_t copied_sizes[MAX_COPIED];
+static char *copied_names[MAX_COPIED];
+static int n_copied = 0;
+
+static int record_copy(const char *source_file, void *extra __attribute__((__unused__))) {
+    struct stat sbuf;
+    if (stat(source_file, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        check(n_copied < MAX_COPIED);
+        copied_sizes[n_copied] = sbuf.st_size;
+        copied_names[n_copied] = strdup(source_file);
+        n_copied++;
+    } else if (S_ISDIR(sbuf.st_mode) && strstr(source_file, "/deep") != NULL) {
+        usleep(10000); // Scan the chain slowly, so that the other workers run out of directories.
+    }
+    return 0;
+}
+
+static void write_file(int fd, size_t size) {
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+    while (size > 0) {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        check(write(fd, buf, n) == (ssize_t)n);
+        size -= n;
+    }
+}
+
+static void do_backup(int order, int n_files) {
+    for (int i = 0; i < n_copied; i++) {
+        free(copied_names[i]);
+    }
+    n_copied = 0;
+    setup_destination();
+    tokubackup_set_copy_order(order);
+    pthread_t thread;
+    start_backup_thread_with_exclusion_callback(&thread, record_copy, NULL);
+    finish_backup_thread(thread);
+    char *src = get_src();
+    char *dst = get_dst();
+    check(systemf("diff -r %s %s", src, dst) == 0);
+    free(src);
+    free(dst);
+    check(n_copied == n_files);
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+    size_t len = strlen(s);
+    size_t slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    char *src = get_src();
+    check(systemf("mkdir %s/a %s/b", src, src) == 0);
+    // Sizes that are all different, spread over two directories in no particular order.
+    for (int i = 0; i < N_FILES; i++) {
+        int fd = openf(O_WRONLY|O_CREAT, 0777, "%s/%s/f%d", src, (i % 2) ? "a" : "b", i);
+        check(fd >= 0);
+        write_file(fd, ((i * 7) % N_FILES + 1) * 1000);
+        check(close(fd) == 0);
+    }
+    // Two files the application keeps open and writes to: the "warm" one a little, the "hot" one a lot.
+    // They are small, so the size orders don't put them last.
+    int hot = openf(O_RDWR|O_CREAT, 0777, "%s/a/hot", src);
+    check(hot >= 0);
+    int warm = openf(O_RDWR|O_CREAT, 0777, "%s/warm", src);
+    check(warm >= 0);
+    for (int i = 0; i < 100; i++) {
+        check(pwrite(hot, "hothothot", 9, 0) == 9);
+    }
+    check(pwrite(warm, "warm", 4, 0) == 4);
+
+    do_backup(TOKUBACKUP_COPY_ORDER_LARGEST_FIRST, N_FILES + 2);
+    for (int i = 1; i < n_copied; i++) {
+        check(copied_sizes[i-1] >= copied_sizes[i]);
+    }
+
+    do_backup(TOKUBACKUP_COPY_ORDER_SMALLEST_FIRST, N_FILES + 2);
+    for (int i = 1; i < n_copied; i++) {
+        check(copied_sizes[i-1] <= copied_sizes[i]);
+    }
+
+    do_backup(TOKUBACKUP_COPY_ORDER_COLDEST_FIRST, N_FILES + 2);
+    check(ends_with(copied_names[n_copied-2], "/warm"));
+    check(ends_with(copied_names[n_copied-1], "/a/hot"));
+
+    do_backup(TOKUBACKUP_COPY_ORDER_TREE, N_FILES + 2);
+
+    // Each level of the chain holds a file bigger than any above it.
+    {
+        size_t len = strlen(src) + sizeof("/deep") + N_LEVELS * sizeof("/d0");
+        char *dir = (char *)malloc(len);
+        check(dir != NULL);
+        snprintf(dir, len, "%s/deep", src);
+        check(mkdir(dir, 0777) == 0);
+        for (int level = 0; level < N_LEVELS; level++) {
+            snprintf(dir + strlen(dir), len - strlen(dir), "/d%d", level);
+            check(mkdir(dir, 0777) == 0);
+            int fd = openf(O_WRONLY|O_CREAT, 0777, "%s/f", dir);
+            check(fd >= 0);
+            write_file(fd, (N_FILES + 1 + level) * 1000);
+            check(close(fd) == 0);
+        }
+        free(dir);
+    }
+    tokubackup_set_copy_threads(N_THREADS);
+    do_backup(TOKUBACKUP_COPY_ORDER_LARGEST_FIRST, N_FILES + 2 + N_LEVELS);
+    check(copied_sizes[0] >= (N_FILES + 1 + N_LEVELS - N_THREADS) * 1000);
+    tokubackup_set_copy_threads(1);
+
+    tokubackup_set_copy_order(TOKUBACKUP_COPY_ORDER_TREE);
+    check(close(hot) == 0);
+    check(close(warm) == 0);
+    for (int i = 0; i < n_copied; i++) {
+        free(copied_names[i]);
+    }
+    free(src);
+    cleanup_dirs();
+    return 0;
+}
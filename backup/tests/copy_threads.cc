@@ -0,0 +1,139 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that a backup copied by several copier threads is an exact copy, and
+// that the progress reported to the poll function never overshoots.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const int N_DIRS = 4;
+static const int N_SUBDIRS = 3;
+static const int N_FILES = 5;
+static const int N_THREADS = 4;
+
+static long total_bytes = 0;
+static volatile long max_bytes_reported = 0;
+
+static void write_file(const char *dir, int i, int j) {
+    // Some files are bigger than the copier's 1MB buffer, some are empty.
+    const long size = ((i * N_FILES + j) % 4) * 700 * 1024 + j * 13;
+    char *buf = (char *)malloc(size + 1);
+    check(buf != NULL);
+    for (long k = 0; k < size; k++) {
+        buf[k] = 'a' + (k + i + j) % 26;
+    }
+    int fd = openf(O_RDWR | O_CREAT, 0777, "%s/f%d", dir, j);
+    check(fd >= 0);
+    check(write(fd, buf, size) == size);
+    check(close(fd) == 0);
+    free(buf);
+    total_bytes += size;
+}
+
+static void setup_tree(const char *src) {
+    for (int i = 0; i < N_DIRS; i++) {
+        check(systemf("mkdir %s/d%d", src, i) == 0);
+        for (int s = 0; s < N_SUBDIRS; s++) {
+            char dir[1000];
+            snprintf(dir, sizeof(dir), "%s/d%d/s%d", src, i, s);
+            check(mkdir(dir, 0777) == 0);
+            for (int j = 0; j < N_FILES; j++) {
+                write_file(dir, i + s, j);
+            }
+        }
+    }
+}
+
+static int my_poll(float progress, const char *progress_string, void *extra) {
+    check(progress >= 0);
+    check(extra == NULL);
+    long bytes, files;
+    if (sscanf(progress_string, "Backup progress %ld bytes, %ld files.", &bytes, &files) == 2) {
+        check(bytes <= total_bytes);
+        if (bytes > max_bytes_reported) {
+            max_bytes_reported = bytes;
+        }
+    }
+    return 0;
+}
+
+static void my_error(int error_number, const char *error_string, void *extra __attribute__((unused))) {
+    fprintf(stderr, "Unexpected error #%d: %s\n", error_number, error_string);
+    abort();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    setup_tree(src);
+
+    tokubackup_set_copy_threads(N_THREADS);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread, get_src(), get_dst(), my_poll, NULL, my_error, NULL, 0);
+    while (!backup_is_capturing()) sched_yield();
+
+    // Modify a file while the copiers are running.  The capture must keep the copy exact.
+    int fd = openf(O_RDWR, 0, "%s/d1/s1/f3", src);
+    check(fd >= 0);
+    check(pwrite(fd, "hello", 5, 100) == 5);
+    check(close(fd) == 0);
+
+    while (!backup_done_copying()) sched_yield();
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_copy_threads(1);
+
+    check(max_bytes_reported <= total_bytes);
+    int r = systemf("diff -r %s %s", src, dst);
+    check(r == 0);
+
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Check that the epoch_rwlock excludes readers from writers: readers
+// keep two counters equal, and writers change both, so a reader that
+// got in while a writer was writing would see them differ.  Also check
+// that a reader may take the lock again while it holds it, and that a
+// writer waits for the readers already in, and sleeps while it waits
+// for a reader that stays in.
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup_test_helpers.h"
+#include "epoch_rwlock.h"
+
+static epoch_rwlock lock;
+static long a, b;            // Protected by the lock.
+static volatile bool stop;   // Read and written with atomic operations.
+static volatile bool done;
+static double wait_cpu_seconds; // The CPU time write_once() spent taking the lock.
+
+static const int N_READERS = 8;
+static const int N_WRITERS = 2;
+
+static void *reader(void *arg __attribute__((__unused__))) {
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        with_epoch_rdlocked rl(&lock);
+        check(a == b);
+        {
+            with_epoch_rdlocked again(&lock);
+            check(a == b);
+        }
+    }
+    return NULL;
+}
+
+static void *writer(void *arg __attribute__((__unused__))) {
+    for (int i = 0; i < 1000; i++) {
+        with_epoch_wrlocked wl(&lock);
+        a++;
+        sched_yield();
+        b++;
+    }
+    return NULL;
+}
+
+static void *write_once(void *arg __attribute__((__unused__))) {
+    struct timespec start, end;
+    check(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start) == 0);
+    lock.wrlock();
+    check(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end) == 0);
+    wait_cpu_seconds = tdiff(start, end);
+    __atomic_store_n(&done, true, __ATOMIC_SEQ_CST);
+    lock.wrunlock();
+    return NULL;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    // A writer waits for a reader.
+    lock.rdlock();
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, write_once, NULL) == 0);
+    usleep(500000);
+    check(!done);
+    lock.rdunlock();
+    check(pthread_join(thread, NULL) == 0);
+    check(done);
+    check(wait_cpu_seconds < 0.1);
+
+    pthread_t readers[N_READERS], writers[N_WRITERS];
+    for (int i = 0; i < N_READERS; i++) {
+        check(pthread_create(&readers[i], NULL, reader, NULL) == 0);
+    }
+    for (int i = 0; i < N_WRITERS; i++) {
+        check(pthread_create(&writers[i], NULL, writer, NULL) == 0);
+    }
+    for (int i = 0; i < N_WRITERS; i++) {
+        check(pthread_join(writers[i], NULL) == 0);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < N_READERS; i++) {
+        check(pthread_join(readers[i], NULL) == 0);
+    }
+    check(a == N_WRITERS * 1000 && b == a);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test fallocate() and posix_fallocate() capture: preallocating,
+// punching holes and zeroing ranges in a source file does the same to
+// the backup, even when the backup's filesystem can't (so that we have
+// to write zeros instead).  Also test that the copier preallocates the
+// destination of a dense file, and not of a sparse one.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "real_syscalls.h"
+
+static const off_t KB = 1024;
+static const off_t MB = 1024 * KB;
+
+static int source_fd = -1;
+static volatile bool dest_cannot_fallocate = false;
+static volatile long n_preallocations = 0;
+static volatile off_t preallocated_len = 0;
+
+static fallocate_fun_t original_fallocate;
+static int my_fallocate(int fd, int mode, off_t offset, off_t len) {
+    if (fd != source_fd) {
+        if (dest_cannot_fallocate) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        if (mode == FALLOC_FL_KEEP_SIZE && offset == 0) {
+            __sync_fetch_and_add(&n_preallocations, 1);
+            preallocated_len = len;
+        }
+    }
+    return original_fallocate(fd, mode, offset, len);
+}
+
+static off_t size_of(const char *dir, const char *file) {
+    struct stat sbuf;
+    char path[1000];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    check(stat(path, &sbuf) == 0);
+    return sbuf.st_size;
+}
+
+static void test_preallocation(char *src, char *dst) {
+    char buf[4096];
+    memset(buf, 'a', sizeof(buf));
+    int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/dense", src);
+    check(fd >= 0);
+    for (off_t i = 0; i < MB; i += sizeof(buf)) {
+        check(write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    }
+    check(close(fd) == 0);
+    fd = openf(O_WRONLY | O_CREAT, 0777, "%s/sparse", src);
+    check(fd >= 0);
+    check(pwrite(fd, buf, sizeof(buf), 4 * MB - sizeof(buf)) == (ssize_t)sizeof(buf));
+    check(close(fd) == 0);
+
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    finish_backup_thread(backup_thread);
+
+    check(n_preallocations == 1);
+    check(preallocated_len == MB);
+    check(size_of(dst, "dense") == MB);
+    check(size_of(dst, "sparse") == 4 * MB);
+    check(systemf("diff -r %s %s", src, dst) == 0);
+    check(systemf("rm %s/dense %s/sparse", src, src) == 0);
+}
+
+static void test_capture(char *src, char *dst, bool emulate) {
+    setup_destination();
+    source_fd = openf(O_RDWR | O_CREAT | O_TRUNC, 0777, "%s/log", src);
+    check(source_fd >= 0);
+
+    backup_set_keep_capturing(true);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+    dest_cannot_fallocate = emulate;
+
+    check(posix_fallocate(source_fd, 0, 256 * KB) == 0);
+    check(size_of(dst, "log") == 256 * KB);
+    char *buf = (char *)malloc(256 * KB);
+    check(buf != NULL);
+    memset(buf, 'b', 256 * KB);
+    check(pwrite(source_fd, buf, 256 * KB, 0) == 256 * KB);
+    free(buf);
+    check(fallocate(source_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 64 * KB, 64 * KB) == 0);
+    check(fallocate(source_fd, FALLOC_FL_ZERO_RANGE, 192 * KB, 128 * KB) == 0);
+    check(size_of(dst, "log") == 320 * KB);
+    check(fallocate(source_fd, FALLOC_FL_KEEP_SIZE, 0, MB) == 0);
+    check(size_of(dst, "log") == 320 * KB);
+    check(fallocate(source_fd, 0, 0, 512 * KB) == 0);
+    check(size_of(dst, "log") == 512 * KB);
+
+    dest_cannot_fallocate = false;
+    backup_set_keep_capturing(false);
+    finish_backup_thread(backup_thread);
+    check(close(source_fd) == 0);
+    source_fd = -1;
+
+    check(systemf("cmp %s/log %s/log", src, dst) == 0);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    original_fallocate = register_fallocate(my_fallocate);
+
+    test_preallocation(src, dst);
+    test_capture(src, dst, false);
+    test_capture(src, dst, true);
+
+    register_fallocate(original_fallocate);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
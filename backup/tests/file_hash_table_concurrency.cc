@@ -0,0 +1,101 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Have several threads create, look up and remove source files in
+// one file_hash_table at once, with enough names that the segments have
+// to grow while the others are in use.  At the end the table must be
+// empty, and every lookup along the way must have found the right file.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backup_test_helpers.h"
+#include "file_hash_table.h"
+#include "source_file.h"
+
+static const int N_THREADS = 8;
+static const int N_NAMES = 2000; // per thread
+static const int N_ROUNDS = 3;
+
+static file_hash_table table;
+
+static void *churn(void *arg) {
+    const long id = (long)arg;
+    source_file **files = new source_file*[N_NAMES];
+    for (int round = 0; round < N_ROUNDS; round++) {
+        for (int i = 0; i < N_NAMES; i++) {
+            char name[100];
+            snprintf(name, sizeof(name), "/src/t%ld/f%d", id, i);
+            table.get_or_create_locked(name, &files[i]);
+            check(strcmp(files[i]->name(), name) == 0);
+        }
+        for (int i = 0; i < N_NAMES; i++) {
+            char name[100];
+            snprintf(name, sizeof(name), "/src/t%ld/f%d", id, i);
+            with_file_hash_table_mutex mtl(&table, name);
+            check(table.get(name) == files[i]);
+        }
+        for (int i = 0; i < N_NAMES; i++) {
+            // Take the file out and put it back, holding its segment by
+            // file, the way close() does.
+            with_file_hash_table_mutex mtl(&table, files[i]);
+            table.remove(files[i]);
+            check(table.get(files[i]->name()) == NULL);
+            table.put(files[i]);
+            check(table.get(files[i]->name()) == files[i]);
+        }
+        for (int i = 0; i < N_NAMES; i++) {
+            table.try_to_remove_locked(files[i]);
+        }
+    }
+    delete[] files;
+    return arg;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    pthread_t threads[N_THREADS];
+    for (long i = 0; i < N_THREADS; i++) {
+        check(pthread_create(&threads[i], NULL, churn, (void *)i) == 0);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        void *result;
+        check(pthread_join(threads[i], &result) == 0);
+        check(result == (void *)(long)i);
+    }
+    check(table.size() == 0);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Measure how interposed calls scale with the number of threads.  Every
+// interposed lseek() looks its fd up in the fd map, so if the lookups
+// serialized, the calls per second would stay flat as threads are added.
+// Each thread seeks on its own fd, so nothing else is shared.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const int MAX_THREADS = 16;
+static const double SECONDS_PER_RUN = 0.25;
+
+static bool stop_running; // Read and written with atomic operations.
+
+struct seeker {
+    pthread_t m_thread;
+    int m_fd;
+    long m_n_calls;
+};
+
+static double now(void) {
+    struct timeval tv;
+    check(gettimeofday(&tv, NULL) == 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void *seek_until_stopped(void *arg) {
+    seeker *s = (seeker *)arg;
+    long n = 0;
+    while (!__atomic_load_n(&stop_running, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < 1000; i++) {
+            check(lseek(s->m_fd, 0, SEEK_CUR) == 0);
+        }
+        n += 1000;
+    }
+    s->m_n_calls = n;
+    return arg;
+}
+
+static double run(seeker *seekers, int n_threads) {
+    __atomic_store_n(&stop_running, false, __ATOMIC_RELAXED);
+    const double start = now();
+    for (int i = 0; i < n_threads; i++) {
+        check(pthread_create(&seekers[i].m_thread, NULL, seek_until_stopped, &seekers[i]) == 0);
+    }
+    usleep(SECONDS_PER_RUN * 1e6);
+    __atomic_store_n(&stop_running, true, __ATOMIC_RELAXED);
+    long total = 0;
+    for (int i = 0; i < n_threads; i++) {
+        check(pthread_join(seekers[i].m_thread, NULL) == 0);
+        check(seekers[i].m_n_calls > 0);
+        total += seekers[i].m_n_calls;
+    }
+    return total / (now() - start);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    char *src = get_src();
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1) n_cpus = 1;
+    if (n_cpus > MAX_THREADS) n_cpus = MAX_THREADS;
+
+    seeker seekers[MAX_THREADS];
+    for (int i = 0; i < n_cpus; i++) {
+        seekers[i].m_fd = openf(O_RDWR | O_CREAT, 0777, "%s/f%d", src, i);
+        check(seekers[i].m_fd >= 0);
+    }
+
+    double one_thread = 0;
+    for (int n_threads = 1; n_threads <= n_cpus; n_threads *= 2) {
+        const double rate = run(seekers, n_threads);
+        if (n_threads == 1) one_thread = rate;
+        printf("%2d threads: %12.0f lseeks/s  (%.2fx one thread)\n", n_threads, rate, rate / one_thread);
+    }
+
+    for (int i = 0; i < n_cpus; i++) {
+        check(close(seekers[i].m_fd) == 0);
+    }
+    free(src);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test incremental backups.  A full backup writes a manifest.  Then a
+// backup based on it must come out the same as the source: unchanged
+// files are hard links to the base, changed and new files are copied,
+// and deleted files are left out.  Finally, a write the application
+// makes to a hard-linked file while a third backup is capturing must
+// reach that backup, but not the base it is linked to.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static void write_file(const char *src, const char *name, size_t size, char c) {
+    int fd = openf(O_WRONLY|O_CREAT|O_TRUNC, 0777, "%s/%s", src, name);
+    check(fd >= 0);
+    char buf[1000];
+    for (size_t i = 0; i < size; i += sizeof(buf)) {
+        memset(buf, c + (i / 65536) % 7, sizeof(buf));
+        size_t n = (size - i < sizeof(buf)) ? size - i : sizeof(buf);
+        check(write(fd, buf, n) == (ssize_t)n);
+    }
+    check(close(fd) == 0);
+}
+
+static ino_t inode_of(const char *dir, const char *name) {
+    struct stat sbuf;
+    char path[1000];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    check(stat(path, &sbuf) == 0);
+    return sbuf.st_ino;
+}
+
+static void check_same(const char *src, const char *dst) {
+    check(systemf("diff -r -x %s %s %s", ".tokubackup_manifest", src, dst) == 0);
+    check(systemf("test -f %s/.tokubackup_manifest", dst) == 0);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    size_t len = strlen(dst) + 10;
+    char dst2[len], dst3[len];
+    snprintf(dst2, len, "%s.2", dst);
+    snprintf(dst3, len, "%s.3", dst);
+    setup_directory(dst2);
+    setup_directory(dst3);
+
+    check(systemf("mkdir %s/sub", src) == 0);
+    write_file(src, "big", 3500000, 'a');
+    write_file(src, "small", 100, 'b');
+    write_file(src, "sub/mid", 2000000, 'c');
+    write_file(src, "sub/other", 5000, 'd');
+
+    // A full backup, with a manifest.
+    tokubackup_set_manifest(1);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+    check_same(src, dst);
+
+    // Change some files.  The sizes change too, so the changes show even if the mtimes don't.
+    {
+        int fd = openf(O_RDWR, 0777, "%s/big", src);
+        check(fd >= 0);
+        check(pwrite(fd, "changed", 7, 2000005) == 7);
+        check(pwrite(fd, "!", 1, 3500000) == 1);
+        check(close(fd) == 0);
+    }
+    check(systemf("rm %s/small", src) == 0);
+    write_file(src, "sub/other", 6000, 'e');
+    write_file(src, "new", 1500000, 'f');
+
+    // An incremental backup.
+    const char *base_dirs[1] = {dst};
+    check(tokubackup_set_incremental_base(base_dirs, 1) == 0);
+    start_backup_thread(&thread, strdup(dst2));
+    finish_backup_thread(thread);
+    check_same(src, dst2);
+    check(inode_of(dst, "sub/mid") == inode_of(dst2, "sub/mid"));
+    check(inode_of(dst, "big") != inode_of(dst2, "big"));
+    check(inode_of(dst, "sub/other") != inode_of(dst2, "sub/other"));
+
+    // Another one, based on that.  Write to a linked file while the backup is capturing.
+    base_dirs[0] = dst2;
+    check(tokubackup_set_incremental_base(base_dirs, 1) == 0);
+    backup_set_keep_capturing(true);
+    start_backup_thread(&thread, strdup(dst3));
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+    check(inode_of(dst2, "sub/mid") == inode_of(dst3, "sub/mid"));
+    {
+        int fd = openf(O_RDWR, 0777, "%s/sub/mid", src);
+        check(fd >= 0);
+        check(pwrite(fd, "captured", 8, 1000000) == 8);
+        check(close(fd) == 0);
+    }
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    check_same(src, dst3);
+    check(inode_of(dst2, "sub/mid") != inode_of(dst3, "sub/mid"));
+    check(systemf("cmp -s %s/sub/mid %s/sub/mid", dst, dst2) == 0);
+    check(systemf("cmp -s %s/sub/mid %s/sub/mid", src, dst2) != 0);
+
+    // A base without a manifest fails the backup.
+    base_dirs[0] = src;
+    check(tokubackup_set_incremental_base(base_dirs, 1) == 0);
+    setup_directory(dst3);
+    start_backup_thread_with_funs(&thread, get_src(), strdup(dst3), simple_poll_fun, NULL, dummy_error, NULL, ENOENT);
+    finish_backup_thread(thread);
+
+    check(tokubackup_set_incremental_base(NULL, 0) == 0);
+    tokubackup_set_manifest(0);
+    check(systemf("rm -rf %s %s", dst2, dst3) == 0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test copying with a nonzero io queue depth, so that (where io_uring
+// works) many chunks of a file are in flight at once.  Writes made while
+// the file is being copied, both to chunks that may be in flight and to
+// chunks not yet started, must reach the backup, and the backup must keep
+// the source's holes.  If io_uring can't be used here, the copier copies
+// synchronously and the test still checks the backup.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const off_t MB = 1024 * 1024;
+
+static void write_at(int fd, off_t offset, size_t size, char c) {
+    char *buf = (char *)malloc(size);
+    check(buf != NULL);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = c + i % 11;
+    }
+    check(pwrite(fd, buf, size, offset) == (ssize_t)size);
+    free(buf);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    tokubackup_set_io_queue_depth(8);
+
+    // A 20MB file of data, with a short last chunk.
+    int fd = openf(O_RDWR|O_CREAT, 0777, "%s/full.data", src);
+    check(fd >= 0);
+    write_at(fd, 0, 20 * MB + 1234, 'a');
+
+    // A sparse file that ends with a hole.
+    int sfd = openf(O_RDWR|O_CREAT, 0777, "%s/sparse.data", src);
+    check(sfd >= 0);
+    write_at(sfd, 0, 4096, 'b');
+    write_at(sfd, 8 * MB, 3 * MB, 'c');
+    check(ftruncate(sfd, 16 * MB) == 0);
+
+    // Some small files.
+    for (int i = 0; i < 5; i++) {
+        int tfd = openf(O_RDWR|O_CREAT, 0777, "%s/small%d", src, i);
+        check(tfd >= 0);
+        write_at(tfd, 0, 100 * (i + 1), 'd');
+        check(close(tfd) == 0);
+    }
+
+    // Stop the copier after its first chunk.
+    HotBackup::toggle_pause_point(HotBackup::COPIER_AFTER_WRITE);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) sched_yield();
+    sleep(1);
+
+    // Write near the start (which may be in flight), in the middle, and past the end of both files.
+    write_at(fd, 1 * MB - 10, 20, 'e');
+    write_at(fd, 9 * MB + 7, 2 * MB, 'f');
+    write_at(fd, 20 * MB + 1000, 1000, 'g');
+    write_at(sfd, 4 * MB, 100, 'h');
+    write_at(sfd, 15 * MB, 100, 'i');
+
+    HotBackup::toggle_pause_point(HotBackup::COPIER_AFTER_WRITE);
+    finish_backup_thread(thread);
+    check(close(fd) == 0);
+    check(close(sfd) == 0);
+
+    check(systemf("diff -r %s %s", src, dst) == 0);
+    {
+        int dfd = openf(O_RDONLY, 0, "%s/sparse.data", dst);
+        check(dfd >= 0);
+        struct stat sbuf;
+        check(fstat(dfd, &sbuf) == 0);
+        check(close(dfd) == 0);
+        check(sbuf.st_size == 16 * MB);
+        check(sbuf.st_blocks * 512 < 8 * MB);
+    }
+
+    tokubackup_set_io_queue_depth(0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
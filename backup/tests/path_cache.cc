@@ -0,0 +1,176 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Check that the path cache resolves paths as realpath() does, that it
+// remembers directories it has resolved, and that it notices when they
+// are moved, replaced or forgotten.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup_test_helpers.h"
+#include "path_cache.h"
+#include "real_syscalls.h"
+
+static path_cache cache;
+
+static realpath_fun_t original_realpath = NULL;
+static int n_realpaths = 0;
+static char *counting_realpath(const char *path, char *result) {
+    n_realpaths++;
+    return original_realpath(path, result);
+}
+
+// Check that the cache resolves PATH as realpath() does, into a malloc'd string and into a buffer,
+// and return how many times the first of those called realpath().
+static int check_resolves(const char *path) {
+    char *expect = original_realpath(path, NULL);
+    check(expect != NULL);
+    n_realpaths = 0;
+    char *got = cache.realpath(path);
+    check(got != NULL);
+    const int result = n_realpaths;
+    if (strcmp(expect, got) != 0) {
+        fprintf(stderr, "%s resolved to %s, expected %s\n", path, got, expect);
+        fail();
+    }
+    char buf[PATH_MAX];
+    check(cache.realpath(path, buf) == buf);
+    check(strcmp(expect, buf) == 0);
+    free(expect);
+    free(got);
+    return result;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    original_realpath = register_realpath(counting_realpath);
+    setup_source();
+    char *src = get_src();
+    check(systemf("mkdir -p %s/a/b/c && touch %s/a/b/c/f %s/a/b/c/g %s/a/f", src, src, src, src) == 0);
+    check(systemf("ln -s a/b %s/link && ln -s c/f %s/a/b/flink", src, src) == 0);
+    const size_t len = strlen(src) + 100;
+    char path[len];
+
+    // The first file in a directory resolves the directory, and the rest of the files there don't.
+    snprintf(path, len, "%s/a/b/c/f", src);
+    check(check_resolves(path) == 1);
+    check(check_resolves(path) == 0);
+    snprintf(path, len, "%s/a/b/c/g", src);
+    check(check_resolves(path) == 0);
+    // Another path to the same directory finds it too.
+    snprintf(path, len, "%s/link/c/../c/g", src);
+    check(check_resolves(path) == 0);
+    // A symlink at the end of the path goes to realpath().
+    snprintf(path, len, "%s/a/b/flink", src);
+    check(check_resolves(path) == 1);
+    // So do paths that end in "." or "..".
+    snprintf(path, len, "%s/a/b/c/..", src);
+    check(check_resolves(path) == 1);
+
+    // Relative paths.
+    char cwd[PATH_MAX];
+    check(getcwd(cwd, sizeof(cwd)) != NULL);
+    snprintf(path, len, "%s/a", src);
+    check(chdir(path) == 0);
+    check(check_resolves("f") == 1);
+    check(check_resolves("b/c/f") == 0);
+    check(chdir(cwd) == 0);
+
+    // A file that isn't there fails as realpath() does.
+    snprintf(path, len, "%s/a/b/c/nothere", src);
+    errno = 0;
+    check(cache.realpath(path) == NULL);
+    check(errno == ENOENT);
+
+    // We're told whether a path might be a directory.
+    bool maybe_directory = false;
+    snprintf(path, len, "%s/a/b", src);
+    char *got = cache.realpath(path, &maybe_directory);
+    check(got != NULL && maybe_directory);
+    free(got);
+    snprintf(path, len, "%s/a/b/c/f", src);
+    got = cache.realpath(path, &maybe_directory);
+    check(got != NULL && !maybe_directory);
+    free(got);
+    // A symlink might lead to one.
+    snprintf(path, len, "%s/a/link", src);
+    check(symlink("b", path) == 0);
+    got = cache.realpath(path, &maybe_directory);
+    check(got != NULL && maybe_directory);
+    free(got);
+    check(unlink(path) == 0);
+    snprintf(path, len, "%s/a/b/c/f", src);
+
+    // Forgetting a tree above a directory makes us resolve it again.
+    check(check_resolves(path) == 0);
+    char *a = original_realpath(src, NULL);
+    check(a != NULL);
+    cache.forget_tree(a);
+    check(check_resolves(path) == 1);
+    check(check_resolves(path) == 0);
+
+    // A directory moved behind our back has a new ctime, so it is
+    // noticed when we look it up.
+    snprintf(path, len, "%s/a/b/c", src);
+    char new_path[len];
+    snprintf(new_path, len, "%s/a/b/moved", src);
+    check(call_real_rename(path, new_path) == 0);
+    snprintf(path, len, "%s/a/b/moved/f", src);
+    check(check_resolves(path) == 1);
+
+    // So is a new directory that reuses a remembered one's inode (and
+    // its slot, if it gets the same inode number).
+    snprintf(path, len, "%s/a/b/moved/f", src);
+    check(unlink(path) == 0);
+    snprintf(path, len, "%s/a/b/moved/g", src);
+    check(unlink(path) == 0);
+    check(rmdir(new_path) == 0);
+    check(systemf("mkdir %s/a/b/moved && touch %s/a/b/moved/f", src, src) == 0);
+    snprintf(path, len, "%s/a/b/moved/f", src);
+    check(check_resolves(path) == 1);
+
+    cache.clear();
+    check(check_resolves(path) == 1);
+
+    free(a);
+    free(src);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Measure range lock throughput when many threads lock small ranges of
+// one file, as the application's writers and the copier do during a
+// backup.  Each run is repeated with many other ranges held elsewhere
+// in the file, which would slow down a lock that scans every locked
+// range.  The test also checks that no two threads ever hold the same
+// block.
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "backup_helgrind.h"
+#include "backup_test_helpers.h"
+#include "source_file.h"
+
+static const int N_BLOCKS = 64;         // The blocks the threads fight over.
+static const uint64_t BLOCK_SIZE = 4096;
+static const int MAX_THREADS = 16;
+static const int N_HELD = 1000;         // The ranges held beyond the blocks in the second set of runs.
+static const double SECONDS_PER_RUN = 0.2;
+
+static source_file sf("speed");
+static int owners[N_BLOCKS]; // Protected by the range locks.
+static bool stop_running;    // Read and written with atomic operations.
+
+struct locker {
+    pthread_t m_thread;
+    int m_id;
+    long m_n_locks;
+};
+
+static double now(void) {
+    struct timeval tv;
+    check(gettimeofday(&tv, NULL) == 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void *lock_until_stopped(void *arg) {
+    locker *l = (locker *)arg;
+    unsigned int seed = l->m_id + 1;
+    long n = 0;
+    while (!__atomic_load_n(&stop_running, __ATOMIC_RELAXED)) {
+        // Lock one or two blocks, so that the threads also wait for each other.
+        const int block = rand_r(&seed) % N_BLOCKS;
+        const int n_blocks = (block + 1 < N_BLOCKS && rand_r(&seed) % 2) ? 2 : 1;
+        sf.lock_range(block * BLOCK_SIZE, (block + n_blocks) * BLOCK_SIZE);
+        for (int i = block; i < block + n_blocks; i++) {
+            check(owners[i] == 0);
+            owners[i] = l->m_id;
+        }
+        for (int i = block; i < block + n_blocks; i++) {
+            check(owners[i] == l->m_id);
+            owners[i] = 0;
+        }
+        int r = sf.unlock_range(block * BLOCK_SIZE, (block + n_blocks) * BLOCK_SIZE);
+        check(r == 0);
+        n++;
+    }
+    l->m_n_locks = n;
+    return arg;
+}
+
+static double run(int n_threads) {
+    locker lockers[MAX_THREADS];
+    __atomic_store_n(&stop_running, false, __ATOMIC_RELAXED);
+    const double start = now();
+    for (int i = 0; i < n_threads; i++) {
+        lockers[i].m_id = i + 1;
+        check(pthread_create(&lockers[i].m_thread, NULL, lock_until_stopped, &lockers[i]) == 0);
+    }
+    usleep(SECONDS_PER_RUN * 1e6);
+    __atomic_store_n(&stop_running, true, __ATOMIC_RELAXED);
+    long total = 0;
+    for (int i = 0; i < n_threads; i++) {
+        check(pthread_join(lockers[i].m_thread, NULL) == 0);
+        total += lockers[i].m_n_locks;
+    }
+    return total / (now() - start);
+}
+
+static void run_all(const char *label) {
+    for (int n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+        printf("%s, %2d threads: %10.0f locks/s\n", label, n_threads, run(n_threads));
+    }
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(owners, sizeof(owners));
+    run_all("no other ranges");
+
+    const uint64_t held_start = N_BLOCKS * BLOCK_SIZE;
+    for (int i = 0; i < N_HELD; i++) {
+        sf.lock_range(held_start + i * BLOCK_SIZE, held_start + (i + 1) * BLOCK_SIZE);
+    }
+    check(!sf.lock_range_would_block_unlocked(0, held_start));
+    check(sf.lock_range_would_block_unlocked(held_start - 1, LLONG_MAX));
+    run_all("1000 other ranges");
+    for (int i = 0; i < N_HELD; i++) {
+        int r = sf.unlock_range(held_start + i * BLOCK_SIZE, held_start + (i + 1) * BLOCK_SIZE);
+        check(r == 0);
+    }
+    check(!sf.lock_range_would_block_unlocked(0, LLONG_MAX));
+    TOKUBACKUP_VALGRIND_HG_ENABLE_CHECKING(owners, sizeof(owners));
+    return 0;
+}
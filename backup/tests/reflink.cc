@@ -0,0 +1,94 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test backups with reflinks turned on.  On a filesystem that can clone
+// (XFS, btrfs) the files are cloned, and elsewhere the copier must fall
+// back to copying.  Either way the backup must be exact, including
+// writes captured while the backup runs.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const long FILE_SIZE = 3 * 1024 * 1024 + 100; // Not a multiple of any block size.
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    setup_dirs();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    int fd = openf(O_RDWR|O_CREAT, 0777, "%s/big.data", src);
+    check(fd>=0);
+    {
+        char buf[4096];
+        for (long off = 0; off < FILE_SIZE; off += sizeof(buf)) {
+            for (size_t i = 0; i < sizeof(buf); i++) {
+                buf[i] = (char)((off + i) % 251);
+            }
+            size_t n = (FILE_SIZE - off < (long)sizeof(buf)) ? FILE_SIZE - off : sizeof(buf);
+            check(write(fd, buf, n) == (ssize_t)n);
+        }
+    }
+
+    tokubackup_set_reflink(1);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_done_copying()) sched_yield();
+
+    // These must reach the backup even though its blocks may be shared with the source.
+    check(pwrite(fd, "hello", 5, 10) == 5);
+    check(pwrite(fd, "world", 5, FILE_SIZE) == 5);
+    check(close(fd) == 0);
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_reflink(0);
+
+    check(systemf("diff -r %s %s", src, dst) == 0);
+
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
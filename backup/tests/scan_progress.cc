@@ -0,0 +1,118 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that the copier scans the source tree only once, while it copies:
+// the whole tree (including symlinked files and an empty directory) must
+// reach the backup, and the progress reported, whose denominator grows as
+// the scan finds files, must never pass 1 and must end up near 1.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+static const int N_DIRS = 4;
+static const int N_SUBDIRS = 3;
+static const int N_FILES = 4;
+static const size_t FILE_SIZE = 64 * 1024;
+
+static float max_progress = 0;
+
+static int check_progress(float progress, const char *progress_string, void *poll_extra __attribute__((__unused__))) {
+    check(progress_string != NULL);
+    check(progress >= 0);
+    check(progress <= 1.0001);
+    if (progress > max_progress) {
+        max_progress = progress;
+    }
+    return 0;
+}
+
+static void create_file(const char *dir, int i) {
+    int fd = openf(O_RDWR|O_CREAT, 0777, "%s/file%d", dir, i);
+    check(fd >= 0);
+    char buf[FILE_SIZE];
+    for (size_t j = 0; j < FILE_SIZE; j++) {
+        buf[j] = 'a' + (i + j) % 26;
+    }
+    check(write(fd, buf, FILE_SIZE) == (ssize_t)FILE_SIZE);
+    check(close(fd) == 0);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    tokubackup_set_copy_threads(3);
+
+    for (int d = 0; d < N_DIRS; d++) {
+        check(systemf("mkdir %s/d%d", src, d) == 0);
+        for (int s = 0; s < N_SUBDIRS; s++) {
+            char dir[1000];
+            snprintf(dir, sizeof(dir), "%s/d%d/s%d", src, d, s);
+            check(systemf("mkdir %s", dir) == 0);
+            for (int f = 0; f < N_FILES; f++) {
+                create_file(dir, f);
+            }
+        }
+    }
+    check(systemf("mkdir %s/empty", src) == 0);
+    check(systemf("ln -s d0/s0/file0 %s/link_to_file", src) == 0);
+
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread,
+                                  strdup(src), strdup(dst), // free's src and dst
+                                  check_progress, NULL,
+                                  dummy_error, NULL,
+                                  0);
+    finish_backup_thread(thread);
+
+    // The copier follows symlinks, so the backup has a copy of the file instead of the link.
+    check(systemf("diff -r %s %s", src, dst) == 0);
+    printf("max progress %f\n", max_progress);
+    check(max_progress > 0.9);
+
+    tokubackup_set_copy_threads(1);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that the copier copies only the data of a sparse file, so the
+// backup stays sparse, and that writes which fill holes while the file is
+// being copied (including the hole at the end) still reach the backup.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_debug.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+
+static const off_t MB = 1024 * 1024;
+
+static void write_at(int fd, off_t offset, size_t size, char c) {
+    char *buf = (char *)malloc(size);
+    check(buf != NULL);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = c + i % 7;
+    }
+    check(pwrite(fd, buf, size, offset) == (ssize_t)size);
+    free(buf);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    // Data, a 10MB hole, data, a 20MB hole, one byte, and then a 10MB hole at the end.
+    int fd = openf(O_RDWR|O_CREAT, 0777, "%s/sparse.data", src);
+    check(fd >= 0);
+    write_at(fd, 0, 64 * 1024, 'a');
+    write_at(fd, 10 * MB, 64 * 1024, 'b');
+    write_at(fd, 30 * MB, 1, 'c');
+    check(ftruncate(fd, 40 * MB) == 0);
+
+    // Stop the copier after its first chunk.
+    HotBackup::toggle_pause_point(HotBackup::COPIER_AFTER_WRITE);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) sched_yield();
+    sleep(1);
+
+    // Fill in some holes: one the copier will look at later, one at the end, and one it has passed.
+    write_at(fd, 20 * MB, 4096, 'd');
+    write_at(fd, 35 * MB + 10, 100, 'e');
+    write_at(fd, 5 * MB, 100, 'f');
+
+    HotBackup::toggle_pause_point(HotBackup::COPIER_AFTER_WRITE);
+    finish_backup_thread(thread);
+    check(close(fd) == 0);
+
+    check(systemf("cmp %s/sparse.data %s/sparse.data", src, dst) == 0);
+    {
+        int dfd = openf(O_RDONLY, 0, "%s/sparse.data", dst);
+        check(dfd >= 0);
+        struct stat sbuf;
+        check(fstat(dfd, &sbuf) == 0);
+        check(close(dfd) == 0);
+        check(sbuf.st_size == 40 * MB);
+        // Copying the holes would have taken 40MB.
+        printf("backup uses %ld bytes\n", (long)sbuf.st_blocks * 512);
+        check(sbuf.st_blocks * 512 < 4 * MB);
+    }
+
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,193 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Stream a backup over a socket to a receiver (in a child process),
+// while the application writes, truncates, renames, unlinks and makes
+// directories, and check that what the receiver applied matches the
+// source.  Then check that the receiver refuses a stream that ends
+// before the backup finishes.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "stream_format.h"
+#include "stream_receiver.h"
+
+// Fork a receiver that applies one connection's stream to DIR, and
+// return a socket connected to it.
+static int start_receiver(const char *dir, pid_t *pid) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    check(lfd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    check(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    check(getsockname(lfd, (struct sockaddr *)&addr, &len) == 0);
+    check(listen(lfd, 1) == 0);
+
+    *pid = fork();
+    check(*pid >= 0);
+    if (*pid == 0) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) _exit(100);
+        _exit(receive_action_stream(fd, -1, dir));
+    }
+    check(close(lfd) == 0);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    check(fd >= 0);
+    check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+// Return what the receiver returned.
+static int wait_for_receiver(pid_t pid) {
+    int status;
+    check(waitpid(pid, &status, 0) == pid);
+    check(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+static void write_file(const char *src, const char *name, size_t n) {
+    char buf[n + 1];
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = 'a' + (i * 13) % 26;
+    }
+    int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/%s", src, name);
+    check(fd >= 0);
+    check(write(fd, buf, n) == (ssize_t)n);
+    check(close(fd) == 0);
+}
+
+static char *pathf(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = (char *)malloc(len);
+    check(path != NULL);
+    check(snprintf(path, len, "%s/%s", dir, name) == (int)len - 1);
+    return path;
+}
+
+static void test_stream(void) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    write_file(src, "big", 3 << 20);
+    write_file(src, "small", 100);
+    write_file(src, "doomed", 100);
+    write_file(src, "moved", 100);
+    check(systemf("mkdir %s/sub && mkdir %s/sub/deeper", src, src) == 0);
+    write_file(src, "sub/deeper/leaf", 5000);
+    write_file(src, "shrunk", 70000);
+    int fd = openf(O_RDWR, 0, "%s/small", src);
+    check(fd >= 0);
+
+    pid_t pid;
+    int sock = start_receiver(dst, &pid);
+    tokubackup_set_stream_fd(sock);
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread, strdup("streamed")); // The thread frees it.
+    while (!backup_done_copying()) sched_yield();
+    check(pwrite(fd, "hello", 5, 1000) == 5);
+    check(ftruncate(fd, 500) == 0);
+    check(pwrite(fd, "world", 5, 20) == 5);
+    char *shrunk = pathf(src, "shrunk");
+    char *doomed = pathf(src, "doomed");
+    char *moved = pathf(src, "moved");
+    char *renamed = pathf(src, "sub/renamed");
+    char *late = pathf(src, "late");
+    check(truncate(shrunk, 1234) == 0);
+    check(unlink(doomed) == 0);
+    check(rename(moved, renamed) == 0);
+    check(mkdir(late, 0777) == 0);
+    write_file(src, "late/new", 300);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    tokubackup_set_stream_fd(-1);
+    check(close(sock) == 0);
+    check(wait_for_receiver(pid) == 0);
+    check(close(fd) == 0);
+
+    check(systemf("diff -r %s %s/streamed", src, dst) == 0);
+
+    free(shrunk);
+    free(doomed);
+    free(moved);
+    free(renamed);
+    free(late);
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+}
+
+// A receiver given only part of a stream must say so, not succeed.
+static void test_cut_short(void) {
+    setup_destination();
+    char *dst = get_dst();
+    int fds[2];
+    check(pipe(fds) == 0);
+    // A length, then fewer bytes than it promised.
+    const unsigned char partial[] = { 10, (STREAM_FIELD_ACTION << 3) | STREAM_WIRE_VARINT, STREAM_CREATE };
+    check(write(fds[1], partial, sizeof(partial)) == (ssize_t)sizeof(partial));
+    check(close(fds[1]) == 0);
+    check(receive_action_stream(fds[0], -1, dst) == EPIPE);
+    check(close(fds[0]) == 0);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_stream();
+    test_cut_short();
+    return 0;
+}
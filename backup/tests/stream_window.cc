@@ -0,0 +1,262 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// Stream a backup with a window, through a shim that delays
+// everything by a one-way latency, to a receiver that acknowledges
+// the batches.  The copier has to wait for the window (so the backup
+// takes a few round trips), but the application's many small writes
+// during the backup must not each wait for a round trip.  When the
+// backup finishes, the receiver must already have applied all of it.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "stream_receiver.h"
+
+static const int latency_ms = 25;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    check(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Listen on a loopback port, and return its socket.
+static int listen_on_loopback(struct sockaddr_in *addr) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    check(lfd >= 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    check(bind(lfd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+    socklen_t len = sizeof(*addr);
+    check(getsockname(lfd, (struct sockaddr *)addr, &len) == 0);
+    check(listen(lfd, 1) == 0);
+    return lfd;
+}
+
+static int connect_to(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    check(fd >= 0);
+    check(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0);
+    return fd;
+}
+
+// The shim: each direction is a thread that reads what arrives, and
+// writes it on latency_ms later.
+struct chunk {
+    double m_due;
+    size_t m_len;
+    chunk *m_next;
+    char m_data[1<<16];
+};
+
+struct direction {
+    int m_from, m_to;
+};
+
+static void *delay_direction(void *arg) {
+    const direction *d = (const direction *)arg;
+    chunk *head = NULL, *tail = NULL;
+    bool open = true;
+    while (open || head != NULL) {
+        int timeout = -1;
+        if (head != NULL) {
+            timeout = (int)((head->m_due - now_seconds()) * 1000) + 1;
+            if (timeout < 0) timeout = 0;
+        }
+        struct pollfd pfd = {d->m_from, POLLIN, 0};
+        int n = poll(&pfd, open ? 1 : 0, timeout);
+        check(n >= 0 || errno == EINTR);
+        if (n > 0) {
+            chunk *c = (chunk *)malloc(sizeof(chunk));
+            check(c != NULL);
+            ssize_t r = read(d->m_from, c->m_data, sizeof(c->m_data));
+            if (r <= 0) {
+                free(c);
+                open = false;
+            } else {
+                c->m_due = now_seconds() + latency_ms / 1000.0;
+                c->m_len = r;
+                c->m_next = NULL;
+                if (tail != NULL) tail->m_next = c; else head = c;
+                tail = c;
+            }
+        }
+        while (head != NULL && head->m_due <= now_seconds()) {
+            for (size_t done = 0; done < head->m_len; ) {
+                ssize_t r = send(d->m_to, head->m_data + done, head->m_len - done, MSG_NOSIGNAL);
+                if (r < 0) {
+                    // The other end is gone.  Drop the rest.
+                    open = false;
+                    break;
+                }
+                done += r;
+            }
+            chunk *c = head;
+            head = head->m_next;
+            if (head == NULL) tail = NULL;
+            free(c);
+        }
+    }
+    shutdown(d->m_to, SHUT_WR);
+    return NULL;
+}
+
+// Fork a receiver applying one connection's stream to DIR (and
+// acknowledging on it), and a shim in front of it.  Return a socket
+// connected to the shim.
+static int start_receiver_behind_shim(const char *dir, pid_t *receiver, pid_t *shim) {
+    struct sockaddr_in receiver_addr, shim_addr;
+    int receiver_lfd = listen_on_loopback(&receiver_addr);
+    *receiver = fork();
+    check(*receiver >= 0);
+    if (*receiver == 0) {
+        int fd = accept(receiver_lfd, NULL, NULL);
+        if (fd < 0) _exit(100);
+        _exit(receive_action_stream(fd, fd, dir));
+    }
+
+    int shim_lfd = listen_on_loopback(&shim_addr);
+    *shim = fork();
+    check(*shim >= 0);
+    if (*shim == 0) {
+        int in = accept(shim_lfd, NULL, NULL);
+        if (in < 0) _exit(100);
+        int out = connect_to(&receiver_addr);
+        direction there = {in, out}, back = {out, in};
+        pthread_t t1, t2;
+        if (pthread_create(&t1, NULL, delay_direction, &there) != 0) _exit(101);
+        if (pthread_create(&t2, NULL, delay_direction, &back) != 0) _exit(101);
+        pthread_join(t1, NULL);
+        pthread_join(t2, NULL);
+        _exit(0);
+    }
+    check(close(receiver_lfd) == 0);
+    check(close(shim_lfd) == 0);
+    return connect_to(&shim_addr);
+}
+
+static int wait_for(pid_t pid) {
+    int status;
+    check(waitpid(pid, &status, 0) == pid);
+    check(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+static void write_file(const char *src, const char *name, size_t n) {
+    char *buf = (char *)malloc(n);
+    check(buf != NULL);
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = 'a' + (i * 7) % 26;
+    }
+    int fd = openf(O_WRONLY | O_CREAT, 0777, "%s/%s", src, name);
+    check(fd >= 0);
+    check(write(fd, buf, n) == (ssize_t)n);
+    check(close(fd) == 0);
+    free(buf);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+
+    // The copier sends 1MiB at a time, each in a batch of its own, so
+    // with a window of 2 this takes at least 3 round trips.
+    const int window = 2;
+    write_file(src, "big", 8 << 20);
+    write_file(src, "busy", 100000);
+    int fd = openf(O_RDWR, 0, "%s/busy", src);
+    check(fd >= 0);
+
+    pid_t receiver, shim;
+    int sock = start_receiver_behind_shim(dst, &receiver, &shim);
+    tokubackup_set_stream_fd(sock);
+    tokubackup_set_stream_window(window);
+    backup_set_keep_capturing(true);
+    const double start = now_seconds();
+    pthread_t thread;
+    start_backup_thread(&thread, strdup("streamed")); // The thread frees it.
+    while (!backup_done_copying()) sched_yield();
+    const double copied = now_seconds();
+
+    // Each of these costs a round trip if writes aren't batched and pipelined.
+    const int n_writes = 2000;
+    const double writes_start = now_seconds();
+    for (int i = 0; i < n_writes; i++) {
+        char buf[64];
+        memset(buf, 'A' + i % 26, sizeof(buf));
+        check(pwrite(fd, buf, sizeof(buf), (i * 4099) % 99000) == (ssize_t)sizeof(buf));
+    }
+    const double writes_took = now_seconds() - writes_start;
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    printf("copy %.3fs, %d writes %.3fs\n", copied - start, n_writes, writes_took);
+    check(copied - start >= 3 * 2 * latency_ms / 1000.0);
+    check(writes_took < n_writes * 2 * latency_ms / 1000.0 / 50);
+
+    // The END was acknowledged, so all of it has been applied already.
+    check(systemf("diff -r %s %s/streamed", src, dst) == 0);
+
+    tokubackup_set_stream_fd(-1);
+    tokubackup_set_stream_window(0);
+    check(close(sock) == 0);
+    check(wait_for(receiver) == 0);
+    check(wait_for(shim) == 0);
+    check(close(fd) == 0);
+
+    cleanup_dirs();
+    free(src);
+    free(dst);
+    return 0;
+}
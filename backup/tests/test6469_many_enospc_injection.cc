@@ -145,6 +145,7 @@ int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribu
     src = get_src();
     original_pwrite = register_pwrite(my_pwrite);
     original_write  = register_write(my_write);
+    backup_set_zero_copy(false); // The copier must call write() for the injection to hit it.
 
     injection_pattern.push_back(0);
     testit();
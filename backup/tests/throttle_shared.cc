@@ -0,0 +1,120 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that the throttle is shared by all the copier threads, and by all
+// the files (so many small files can't get around it), and that raising
+// the throttle in the middle of a backup takes effect right away.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_test_helpers.h"
+
+static const int N_FILES = 64;
+static const size_t FILE_SIZE = 16 * 1024;
+
+static void* raise_throttle(void *arg __attribute__((__unused__))) {
+    sleep(1);
+    tokubackup_throttle_backup(ULONG_MAX);
+    return arg;
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    tokubackup_set_copy_threads(2);
+
+    char buf[FILE_SIZE];
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+    for (int i = 0; i < N_FILES; i++) {
+        int fd = openf(O_WRONLY|O_CREAT, 0777, "%s/f%d", src, i);
+        check(fd >= 0);
+        check(write(fd, buf, FILE_SIZE) == (ssize_t)FILE_SIZE);
+        check(close(fd) == 0);
+    }
+
+    // 1MiB in 16KiB files, at half a MiB per second for both threads together.
+    {
+        const unsigned long throttle = 1L<<19;
+        double expected_n_seconds = (N_FILES * FILE_SIZE) / (double)throttle;
+        tokubackup_throttle_backup(throttle);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_t thread;
+        start_backup_thread(&thread);
+        finish_backup_thread(thread);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double td = tdiff(start, end);
+        printf("time used     == %6.3fs\n", td);
+        printf("time expected >= %6.3fs\n", expected_n_seconds);
+        check(td >= expected_n_seconds * 0.95);
+        check(systemf("diff -r %s %s", src, dst) == 0);
+    }
+
+    // At a byte per second the backup would take days, but we raise the throttle after a second.
+    {
+        setup_destination();
+        tokubackup_throttle_backup(1);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_t thread, raiser;
+        check(pthread_create(&raiser, NULL, raise_throttle, NULL) == 0);
+        start_backup_thread(&thread);
+        finish_backup_thread(thread);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        check(pthread_join(raiser, NULL) == 0);
+        double td = tdiff(start, end);
+        printf("time used     == %6.3fs\n", td);
+        check(td >= 0.9);
+        check(td < 10);
+        check(systemf("diff -r %s %s", src, dst) == 0);
+    }
+
+    tokubackup_set_copy_threads(1);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// truncate() a file by its path while a backup is running, both one the
+// application has open and one nothing has open.  The backup copies must
+// come out at the truncated lengths.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup_test_helpers.h"
+#include "backup_internal.h"
+
+static void check_backup_size(const char *dst, const char *name, off_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dst, name);
+    struct stat sbuf;
+    check(stat(path, &sbuf) == 0);
+    check(sbuf.st_size == size);
+}
+
+static void test_truncate_by_name(void) {
+    setup_source();
+    setup_dirs();
+    setup_destination();
+
+    char *src = get_src();
+    char open_path[PATH_MAX], closed_path[PATH_MAX];
+    snprintf(open_path, sizeof(open_path), "%s/open.data", src);
+    snprintf(closed_path, sizeof(closed_path), "%s/closed.data", src);
+    free(src);
+
+    const char text[] = "Hello World, Hello World";
+    int closed_fd = open(closed_path, O_CREAT | O_RDWR, 0777);
+    check(closed_fd >= 0);
+    check(write(closed_fd, text, sizeof(text)) == (ssize_t)sizeof(text));
+    check(close(closed_fd) == 0);
+
+    backup_set_keep_capturing(true);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    while (!backup_done_copying()) {
+        usleep(1000);
+    }
+
+    int fd = open(open_path, O_CREAT | O_RDWR, 0777);
+    check(fd >= 0);
+    check(write(fd, text, sizeof(text)) == (ssize_t)sizeof(text));
+
+    check(truncate(open_path, 5) == 0);
+    check(truncate(closed_path, 11) == 0);
+
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+    check(close(fd) == 0);
+
+    char *dst = get_dst();
+    check_backup_size(dst, "open.data", 5);
+    check_backup_size(dst, "closed.data", 11);
+    free(dst);
+    cleanup_dirs();
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_truncate_by_name();
+    return 0;
+}
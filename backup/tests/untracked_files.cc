@@ -0,0 +1,138 @@
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#ident "$Id$"
+
+// Check the filter that decides which files to track, and then that a
+// file opened outside every directory backed up so far, which isn't
+// tracked, is tracked when a later backup covers it.  Its writes during
+// that backup must reach the backup, at the offsets the fd had reached
+// while it was untracked.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "prefix_filter.h"
+
+static void test_filter(void) {
+    prefix_filter filter;
+    check(!filter.is_active());
+    check(filter.may_contain("/anything"));
+    filter.add("/a/b");
+    check(filter.is_active());
+    check(filter.may_contain("/a/b"));
+    check(filter.may_contain("/a/b/c"));
+    check(!filter.may_contain("/a/c"));
+    check(!filter.may_contain("/a"));
+    filter.add("/a/b/c"); // Already covered.
+    filter.add("/x");
+    check(filter.may_contain("/x/y"));
+    check(!filter.may_contain("/y"));
+}
+
+static void write_string(int fd, const char *s) {
+    const size_t len = strlen(s);
+    check(write(fd, s, len) == (ssize_t)len);
+}
+
+static void test_backup(void) {
+    set_dir_count(2);
+    char *src0 = get_src(0);
+    char *src1 = get_src(1);
+    char *dst0 = get_dst(0);
+    char *dst1 = get_dst(1);
+    for (int i = 0; i < 2; i++) {
+        char *src = get_src(i);
+        char *dst = get_dst(i);
+        check(systemf("rm -rf %s %s && mkdir %s %s", src, dst, src, dst) == 0);
+        free(src);
+        free(dst);
+    }
+
+    // Back up only the first directory, which turns the filter on.
+    set_dir_count(1);
+    pthread_t thread;
+    start_backup_thread(&thread);
+    finish_backup_thread(thread);
+
+    // So a file opened in the second directory isn't tracked.
+    int fd = openf(O_RDWR | O_CREAT, 0777, "%s/untracked", src1);
+    check(fd >= 0);
+    write_string(fd, "0123456789");
+    check(lseek(fd, 2, SEEK_SET) == 2);
+    char buf[3];
+    check(read(fd, buf, 3) == 3);
+
+    // Now back up both.
+    check(systemf("rm -rf %s && mkdir %s", dst0, dst0) == 0);
+    set_dir_count(2);
+    backup_set_keep_capturing(true);
+    start_backup_thread(&thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+    // The fd must write at offset 5, where the read left it.
+    write_string(fd, "abc");
+    check(pwrite(fd, "XY", 2, 8) == 2);
+    write_string(fd, "def");
+    check(ftruncate(fd, 12) == 0);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(thread);
+
+    check(systemf("cmp %s/untracked %s/untracked", src1, dst1) == 0);
+    check(systemf("printf '01234abcdef\\0' | cmp - %s/untracked", dst1) == 0);
+    check(close(fd) == 0);
+
+    free(src0);
+    free(src1);
+    free(dst0);
+    free(dst1);
+    for (int i = 0; i < 2; i++) {
+        char *src = get_src(i);
+        char *dst = get_dst(i);
+        check(systemf("rm -rf %s %s", src, dst) == 0);
+        free(src);
+        free(dst);
+    }
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    test_filter();
+    test_backup();
+    return 0;
+}
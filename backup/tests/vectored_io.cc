@@ -0,0 +1,154 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that writev(), pwritev() and pwritev2() are captured, that each
+// is mirrored into the backup with a single write, and that writev()
+// and readv() move the file offset that later writes use.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "backup.h"
+#include "backup_internal.h"
+#include "backup_test_helpers.h"
+#include "real_syscalls.h"
+
+static const int N_BUFS = 8;
+static const size_t BUF_SIZE = 1000;
+
+static int source_fd;
+static volatile long n_backup_writes = 0;
+
+static pwrite_fun_t original_pwrite;
+static ssize_t my_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) {
+    if (fd != source_fd) {
+        __sync_fetch_and_add(&n_backup_writes, 1);
+    }
+    return original_pwrite(fd, buf, nbyte, offset);
+}
+
+static pwritev_fun_t original_pwritev;
+static ssize_t my_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (fd != source_fd) {
+        __sync_fetch_and_add(&n_backup_writes, 1);
+    }
+    return original_pwritev(fd, iov, iovcnt, offset);
+}
+
+static char bufs[N_BUFS][BUF_SIZE];
+static struct iovec iov[N_BUFS];
+
+static void fill(char c) {
+    for (int i = 0; i < N_BUFS; i++) {
+        memset(bufs[i], c + i, BUF_SIZE);
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = BUF_SIZE;
+    }
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    setup_source();
+    setup_destination();
+    char *src = get_src();
+    char *dst = get_dst();
+    const ssize_t total = N_BUFS * BUF_SIZE;
+
+    source_fd = openf(O_RDWR | O_CREAT, 0777, "%s/data", src);
+    check(source_fd >= 0);
+
+    // Mirror synchronously, so we can count the backup's writes as they happen.
+    tokubackup_set_capture_queue_size(0);
+    backup_set_keep_capturing(true);
+    pthread_t backup_thread;
+    start_backup_thread(&backup_thread);
+    while (!backup_is_capturing()) sched_yield();
+    while (!backup_done_copying()) sched_yield();
+
+    original_pwrite = register_pwrite(my_pwrite);
+    original_pwritev = register_pwritev(my_pwritev);
+
+    fill('a');
+    check(writev(source_fd, iov, N_BUFS) == total);
+    check(n_backup_writes == 1);
+    fill('A');
+    check(writev(source_fd, iov, N_BUFS) == total);
+    check(n_backup_writes == 2);
+    check(lseek(source_fd, 0, SEEK_CUR) == 2 * total);
+
+    fill('k');
+    check(pwritev(source_fd, iov, N_BUFS, total / 2) == total);
+    check(n_backup_writes == 3);
+    check(lseek(source_fd, 0, SEEK_CUR) == 2 * total);
+
+    fill('K');
+    check(pwritev2(source_fd, iov, N_BUFS, 3 * total, 0) == total);
+    check(n_backup_writes == 4);
+    // At the file offset, which then moves.
+    check(lseek(source_fd, total, SEEK_SET) == total);
+    fill('q');
+    check(pwritev2(source_fd, iov, N_BUFS, -1, 0) == total);
+    check(n_backup_writes == 5);
+    // At the end of the file, wherever the offset is.
+    fill('Q');
+    check(pwritev2(source_fd, iov, N_BUFS, 0, RWF_APPEND) == total);
+    check(n_backup_writes == 6);
+    check(lseek(source_fd, 0, SEEK_END) == 5 * total);
+
+    // readv() moves the offset, so the write lands after what we read.
+    check(lseek(source_fd, 0, SEEK_SET) == 0);
+    check(readv(source_fd, iov, 2) == (ssize_t)(2 * BUF_SIZE));
+    fill('x');
+    check(writev(source_fd, iov, 1) == (ssize_t)BUF_SIZE);
+    check(n_backup_writes == 7);
+    check(lseek(source_fd, 0, SEEK_CUR) == (off_t)(3 * BUF_SIZE));
+
+    register_pwrite(original_pwrite);
+    register_pwritev(original_pwritev);
+    backup_set_keep_capturing(false);
+    finish_backup_thread(backup_thread);
+    tokubackup_set_capture_queue_size(64 << 20);
+    check(close(source_fd) == 0);
+
+    check(systemf("cmp %s/data %s/data", src, dst) == 0);
+    free(src);
+    free(dst);
+    cleanup_dirs();
+    return 0;
+}
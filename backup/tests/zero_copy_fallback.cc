@@ -0,0 +1,149 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+// Test that the copier steps down from copy_file_range() to splice() to
+// read()/write() when a method isn't supported, even in the middle of a
+// file, and that a real error from copy_file_range() fails the backup.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "backup_test_helpers.h"
+#include "backup_internal.h"
+#include "real_syscalls.h"
+
+static const long FILE_SIZE = 5 * 1024 * 1024 + 1234; // Several of the copier's 1MB chunks.
+
+static copy_file_range_fun_t original_copy_file_range;
+static splice_fun_t original_splice;
+
+static int copy_file_range_calls, splice_calls;
+static int copy_file_range_successes; // Succeed this many times, then fail with copy_file_range_errno.
+static int splice_successes;          // Succeed this many times, then fail with EINVAL.
+static int copy_file_range_errno;
+
+static ssize_t my_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    if (copy_file_range_calls++ >= copy_file_range_successes) {
+        errno = copy_file_range_errno;
+        return -1;
+    }
+    return original_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static ssize_t my_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    // Only count the splices into the pipe, which is where the copier notices that splice() doesn't work.
+    if (off_in != NULL && splice_calls++ >= splice_successes) {
+        errno = EINVAL;
+        return -1;
+    }
+    return original_splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static int ercount = 0;
+static void my_error_fun(int e, const char *s, void *ignore) {
+    check(ignore==NULL);
+    ercount++;
+    fprintf(stderr, "Got error %d (%s)\n", e, s);
+}
+
+static void testit(int cfr_successes, int cfr_errno, int sp_successes, int expect_result) {
+    copy_file_range_calls = splice_calls = 0;
+    copy_file_range_successes = cfr_successes;
+    copy_file_range_errno = cfr_errno;
+    splice_successes = sp_successes;
+    ercount = 0;
+
+    setup_source();
+    setup_destination();
+    setup_dirs();
+    char *src = get_src();
+    char *dst = get_dst();
+    {
+        int fd = openf(O_RDWR|O_CREAT, 0777, "%s/big.data", src);
+        check(fd>=0);
+        char buf[4096];
+        for (long off = 0; off < FILE_SIZE; off += sizeof(buf)) {
+            for (size_t i = 0; i < sizeof(buf); i++) {
+                buf[i] = (char)((off + i) * 7 / 3);
+            }
+            size_t n = (FILE_SIZE - off < (long)sizeof(buf)) ? FILE_SIZE - off : sizeof(buf);
+            check(write(fd, buf, n) == (ssize_t)n);
+        }
+        check(close(fd) == 0);
+    }
+
+    pthread_t thread;
+    start_backup_thread_with_funs(&thread, get_src(), get_dst(), simple_poll_fun, NULL, my_error_fun, NULL, expect_result);
+    finish_backup_thread(thread);
+
+    fprintf(stderr, "copy_file_range calls=%d splice calls=%d\n", copy_file_range_calls, splice_calls);
+    check(copy_file_range_calls > 0);
+    if (expect_result == 0) {
+        check(ercount == 0);
+        check(systemf("cmp %s/big.data %s/big.data", src, dst) == 0);
+        check(systemf("diff -r %s %s", src, dst) == 0);
+    } else {
+        check(ercount > 0);
+    }
+    free(src);
+    free(dst);
+}
+
+int test_main(int argc __attribute__((__unused__)), const char *argv[] __attribute__((__unused__))) {
+    original_copy_file_range = register_copy_file_range(my_copy_file_range);
+    original_splice = register_splice(my_splice);
+
+    // copy_file_range() works.
+    testit(1000, 0, 1000, 0);
+    check(splice_calls == 0);
+
+    // copy_file_range() isn't supported at all, splice() is.
+    testit(0, EXDEV, 1000, 0);
+    check(splice_calls > 0);
+
+    // Each method copies a little, and then stops working.
+    testit(1, ENOSYS, 3, 0);
+    check(splice_calls > 3);
+
+    // A real error.
+    testit(1, ENOSPC, 1000, ENOSPC);
+
+    cleanup_dirs();
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "backup_helgrind.h"
+#include "check.h"
+#include "mutex.h"
+#include "token_bucket.h"
+
+#include <limits.h>
+#include <math.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+token_bucket::token_bucket(uint64_t burst) throw()
+    : m_burst(burst),
+      m_tokens(burst)
+{
+    int r = pthread_mutex_init(&m_mutex, NULL);
+    check(r==0);
+    r = clock_gettime(CLOCK_MONOTONIC, &m_last_fill);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+token_bucket::~token_bucket(void) throw() {
+    int r = pthread_mutex_destroy(&m_mutex);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void token_bucket::set_burst(uint64_t burst) throw() {
+    TOKUBACKUP_VALGRIND_HG_DISABLE_CHECKING(&m_burst, sizeof(m_burst));
+    m_burst = burst;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+uint64_t token_bucket::get_burst(void) const throw() {
+    return m_burst;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void token_bucket::empty(void) throw() {
+    struct timespec now;
+    int r = clock_gettime(CLOCK_MONOTONIC, &now);
+    check(r==0);
+    with_mutex_locked ml(&m_mutex);
+    m_tokens = 0;
+    m_last_fill = now;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+double token_bucket::take(uint64_t n_bytes, unsigned long rate) throw() {
+    struct timespec now;
+    int r = clock_gettime(CLOCK_MONOTONIC, &now);
+    check(r==0);
+    with_mutex_locked ml(&m_mutex);
+    const double burst = m_burst;
+    if (rate == ULONG_MAX) {
+        m_tokens = burst;
+        m_last_fill = now;
+        return 0;
+    }
+    const double elapsed = (now.tv_sec - m_last_fill.tv_sec) + 1e-9*(now.tv_nsec - m_last_fill.tv_nsec);
+    m_last_fill = now;
+    if (elapsed > 0) {
+        m_tokens += elapsed * rate;
+    }
+    if (m_tokens > burst) {
+        m_tokens = burst;
+    }
+    m_tokens -= n_bytes;
+    if (m_tokens >= 0) {
+        return 0;
+    }
+    if (rate == 0) {
+        return HUGE_VAL;
+    }
+    return -m_tokens / rate;
+}
@@ -0,0 +1,87 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// token_bucket:
+//
+// Description:
+//
+//     The rate limiter behind tokubackup_throttle_backup().  There is
+// one for the whole process, shared by every copier thread.  The bucket
+// fills at the throttle rate, measured in nanoseconds, and holds at
+// most the burst size.  Copying takes bytes out of it.  A copier may
+// take more than there is, putting the bucket into debt, and then
+// waits until the debt is paid off, so a whole chunk can be copied at
+// once even when the burst is smaller than a chunk.
+//
+//     The rate is passed in on every call rather than stored, so a
+// change to the throttle applies to the very next call.
+//
+class token_bucket {
+  public:
+    token_bucket(uint64_t burst) throw();
+    ~token_bucket(void) throw();
+
+    void set_burst(uint64_t burst) throw();  // This is thread-safe.
+    uint64_t get_burst(void) const throw(); // This is thread-safe.
+
+    void empty(void) throw();
+    // Effect: Take everything out of the bucket (and forgive any debt).
+
+    double take(uint64_t n_bytes, unsigned long rate) throw();
+    // Effect: Add what RATE (bytes per second) has earned since the last call, up to the burst size,
+    //  and then take N_BYTES out, going into debt if need be.  Pass zero bytes to see how things stand.
+    //  Returns how many seconds it will take, at RATE, to pay off the debt: 0 if the bucket isn't in
+    //  debt, or HUGE_VAL if the rate is zero.
+    //  A rate of ULONG_MAX means no throttling: the bucket stays full and this returns 0.
+
+  private:
+    pthread_mutex_t m_mutex;
+    volatile uint64_t m_burst;
+    double m_tokens;            // Negative when the bucket is in debt.  Protected by m_mutex.
+    struct timespec m_last_fill; // Protected by m_mutex.
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,141 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// tokubackup_receive DIR [PORT]
+//
+//     Applies a backup streamed by tokubackup_set_stream_fd() to DIR,
+// which is created if it doesn't exist.  The stream is read from
+// standard input, or, given a PORT, from the first connection
+// accepted on that TCP port (which is where the acknowledgements of
+// tokubackup_set_stream_window() go).  Exits with 0 only if the whole
+// backup arrived.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream_receiver.h"
+
+static const char *progname = "tokubackup_receive";
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int report(int r, const char *what, const char *arg) {
+    fprintf(stderr, "%s: %s %s: %s\n", progname, what, arg, strerror(r));
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// accept_one() -
+//
+// Description:
+//
+//     Listens on PORT, on every address, and returns the first
+// connection made, or -1 (having said why).
+//
+static int accept_one(const char *port) {
+    char *end;
+    long p = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || p <= 0 || p > 65535) {
+        report(EINVAL, "Bad port", port);
+        return -1;
+    }
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        report(errno, "Could not create a socket for port", port);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)p);
+    int fd = -1;
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        report(errno, "Could not bind port", port);
+    } else if (listen(lfd, 1) != 0) {
+        report(errno, "Could not listen on port", port);
+    } else {
+        do {
+            fd = accept(lfd, NULL, NULL);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0) {
+            report(errno, "Could not accept a connection on port", port);
+        }
+    }
+    close(lfd);
+    return fd;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s DIR [PORT]\n", progname);
+        fprintf(stderr, "  Receives a streamed backup into DIR, from standard input or from one connection to PORT.\n");
+        return 2;
+    }
+    if (mkdir(argv[1], 0777) != 0 && errno != EEXIST) {
+        report(errno, "Could not create", argv[1]);
+        return 1;
+    }
+    int fd = 0;
+    if (argc == 3) {
+        fd = accept_one(argv[2]);
+        if (fd < 0) {
+            return 1;
+        }
+    }
+    // Acknowledge on the connection, but not to whatever stdin came from.
+    int r = receive_action_stream(fd, (fd != 0) ? fd : -1, argv[1]);
+    if (r == EPIPE) {
+        fprintf(stderr, "%s: The stream ended before the backup finished.\n", progname);
+    } else if (r != 0) {
+        report(r, "Could not receive the backup into", argv[1]);
+    }
+    if (fd != 0) {
+        close(fd);
+    }
+    return (r == 0) ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+// tokubackup_restore [-c CHUNK_STORE] SOURCE DEST
+//
+//     Copies the backup in SOURCE to DEST, which must not exist,
+// decompressing the files that tokubackup_set_compression() wrote
+// compressed, putting back together (from CHUNK_STORE) the files that
+// tokubackup_set_chunk_store() wrote as recipes, and copying everything
+// else as it is.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk_format.h"
+#include "compressed_format.h"
+
+static const char *progname = "tokubackup_restore";
+static int store_fd = -1; // The chunk store, if one was given.
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int report(int r, const char *what, const char *path) {
+    fprintf(stderr, "%s: %s %s: %s\n", progname, what, path, strerror(r));
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int copy_plain_file(int in_fd, int out_fd) {
+    static char buf[1<<20];
+    while (true) {
+        ssize_t n = read(in_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(out_fd, buf + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            done += w;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int restore_file(const char *source, const char *dest, mode_t mode) {
+    int in_fd = open(source, O_RDONLY);
+    if (in_fd < 0) {
+        return report(errno, "Could not open", source);
+    }
+    int out_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL, mode & 07777);
+    if (out_fd < 0) {
+        int r = report(errno, "Could not create", dest);
+        close(in_fd);
+        return r;
+    }
+    int r;
+    if (is_compressed_file(in_fd)) {
+        r = decompress_file(in_fd, out_fd);
+    } else if (is_chunk_recipe(in_fd)) {
+        if (store_fd < 0) {
+            fprintf(stderr, "%s: %s was deduplicated, so the chunk store must be given with -c\n", progname, source);
+        }
+        r = (store_fd < 0) ? EINVAL : restore_chunked_file(store_fd, in_fd, out_fd);
+    } else {
+        r = copy_plain_file(in_fd, out_fd);
+    }
+    if (r != 0) {
+        report(r, "Could not restore", source);
+    }
+    if (close(out_fd) != 0 && r == 0) {
+        r = report(errno, "Could not close", dest);
+    }
+    close(in_fd);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static int restore_directory(const char *source, const char *dest, mode_t mode) {
+    if (mkdir(dest, mode & 07777) != 0) {
+        return report(errno, "Could not create", dest);
+    }
+    DIR *dir = opendir(source);
+    if (dir == NULL) {
+        return report(errno, "Could not open", source);
+    }
+    int r = 0;
+    struct dirent *e;
+    while (r == 0 && (e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        size_t n = strlen(e->d_name);
+        char *from = (char *)malloc(strlen(source) + n + 2);
+        char *to = (char *)malloc(strlen(dest) + n + 2);
+        sprintf(from, "%s/%s", source, e->d_name);
+        sprintf(to, "%s/%s", dest, e->d_name);
+        struct stat sbuf;
+        if (lstat(from, &sbuf) != 0) {
+            r = report(errno, "Could not stat", from);
+        } else if (S_ISDIR(sbuf.st_mode)) {
+            r = restore_directory(from, to, sbuf.st_mode);
+        } else if (S_ISREG(sbuf.st_mode)) {
+            r = restore_file(from, to, sbuf.st_mode);
+        } else {
+            fprintf(stderr, "%s: Skipping %s, which is not a file or directory\n", progname, from);
+        }
+        free(from);
+        free(to);
+    }
+    closedir(dir);
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, const char *argv[]) {
+    if (argc == 5 && strcmp(argv[1], "-c") == 0) {
+        store_fd = open(argv[2], O_RDONLY | O_DIRECTORY);
+        if (store_fd < 0) {
+            report(errno, "Could not open", argv[2]);
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s [-c CHUNK_STORE] SOURCE DEST\n", progname);
+        fprintf(stderr, "  Restores the backup in SOURCE into the new directory DEST, decompressing its files,\n");
+        fprintf(stderr, "  and reading the chunks of a deduplicated one from CHUNK_STORE.\n");
+        return 2;
+    }
+    struct stat sbuf;
+    if (stat(argv[1], &sbuf) != 0) {
+        report(errno, "Could not stat", argv[1]);
+        return 1;
+    }
+    if (!S_ISDIR(sbuf.st_mode)) {
+        report(ENOTDIR, "Could not restore", argv[1]);
+        return 1;
+    }
+    return (restore_directory(argv[1], argv[2], sbuf.st_mode) == 0) ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include "uring_engine.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if BACKUP_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Older C libraries don't know the numbers, but they are the same on every architecture.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+static const size_t uring_buffer_alignment = 4096; // Good enough for O_DIRECT sources.
+
+uring_engine::uring_engine(void) throw()
+    : m_ring_fd(-1),
+      m_depth(0),
+      m_buffer_size(0),
+      m_buffers(NULL),
+      m_sq_ring(NULL),
+      m_sq_ring_size(0),
+      m_cq_ring(NULL),
+      m_cq_ring_size(0),
+      m_sqes(NULL),
+      m_sqes_size(0),
+      m_sq_tail(NULL),
+      m_sq_mask(0),
+      m_sq_array(NULL),
+      m_cq_head(NULL),
+      m_cq_tail(NULL),
+      m_cq_mask(0),
+      m_cqes(NULL),
+      m_to_submit(0),
+      m_broken(false) {
+}
+
+uring_engine::~uring_engine(void) throw() {
+    this->destroy();
+}
+
+unsigned int uring_engine::queue_depth(void) const throw() {
+    return m_depth;
+}
+
+char *uring_engine::buffer(unsigned int slot) const throw() {
+    return m_buffers + (size_t)slot * m_buffer_size;
+}
+
+#if BACKUP_USE_IO_URING
+
+void uring_engine::destroy(void) throw() {
+    if (m_sqes != NULL) {
+        munmap(m_sqes, m_sqes_size);
+        m_sqes = NULL;
+    }
+    if (m_cq_ring != NULL && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    m_cq_ring = NULL;
+    if (m_sq_ring != NULL) {
+        munmap(m_sq_ring, m_sq_ring_size);
+        m_sq_ring = NULL;
+    }
+    if (m_ring_fd >= 0) {
+        // Closing the ring waits for anything still in flight, except when the ring has failed.
+        close(m_ring_fd);
+        m_ring_fd = -1;
+    }
+    if (!m_broken) {
+        free(m_buffers);
+    }
+    m_buffers = NULL;
+    m_depth = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// init() -
+//
+// Description:
+//
+//     Creates the ring, maps its submission and completion queues,
+// and registers the buffers so the kernel doesn't have to pin and
+// unpin the pages on every operation.  Registration counts against
+// RLIMIT_MEMLOCK, so it is the step most likely to fail.
+//
+int uring_engine::init(unsigned int queue_depth, size_t buffer_size) throw() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+    if (fd < 0) {
+        return errno;
+    }
+    m_ring_fd = fd;
+    m_depth = queue_depth;
+    m_buffer_size = buffer_size;
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_ring_size > m_sq_ring_size) {
+            m_sq_ring_size = m_cq_ring_size;
+        }
+        m_cq_ring_size = m_sq_ring_size;
+    }
+    void *sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        int e = errno;
+        this->destroy();
+        return e;
+    }
+    m_sq_ring = sq_ring;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        void *cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            int e = errno;
+            this->destroy();
+            return e;
+        }
+        m_cq_ring = cq_ring;
+    }
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        int e = errno;
+        this->destroy();
+        return e;
+    }
+    m_sqes = sqes;
+
+    char *sq = (char *)m_sq_ring;
+    char *cq = (char *)m_cq_ring;
+    m_sq_tail  = (volatile unsigned int *)(sq + p.sq_off.tail);
+    m_sq_mask  = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned int *)(sq + p.sq_off.array);
+    m_cq_head  = (volatile unsigned int *)(cq + p.cq_off.head);
+    m_cq_tail  = (volatile unsigned int *)(cq + p.cq_off.tail);
+    m_cq_mask  = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    m_cqes     = cq + p.cq_off.cqes;
+
+    void *buffers;
+    int r = posix_memalign(&buffers, uring_buffer_alignment, (size_t)queue_depth * buffer_size);
+    if (r != 0) {
+        this->destroy();
+        return r;
+    }
+    m_buffers = (char *)buffers;
+    struct iovec *iov = (struct iovec *)calloc(queue_depth, sizeof(struct iovec));
+    if (iov == NULL) {
+        this->destroy();
+        return ENOMEM;
+    }
+    for (unsigned int i = 0; i < queue_depth; i++) {
+        iov[i].iov_base = this->buffer(i);
+        iov[i].iov_len = buffer_size;
+    }
+    r = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, queue_depth);
+    int e = errno;
+    free(iov);
+    if (r < 0) {
+        this->destroy();
+        return e;
+    }
+    return 0;
+}
+
+static void prepare_fixed(struct io_uring_sqe *sqe, unsigned char opcode, int fd, char *addr, unsigned int slot, size_t length, uint64_t offset) throw() {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = length;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+}
+
+void uring_engine::prepare_read(unsigned int slot, int fd, size_t length, uint64_t offset) throw() {
+    unsigned int tail = *m_sq_tail;
+    unsigned int index = tail & m_sq_mask;
+    prepare_fixed(&((struct io_uring_sqe *)m_sqes)[index], IORING_OP_READ_FIXED, fd, this->buffer(slot), slot, length, offset);
+    m_sq_array[index] = index;
+    __sync_synchronize(); // The kernel must see the entry before it sees the new tail.
+    *m_sq_tail = tail + 1;
+    m_to_submit++;
+}
+
+void uring_engine::prepare_write(unsigned int slot, int fd, size_t buffer_offset, size_t length, uint64_t offset) throw() {
+    unsigned int tail = *m_sq_tail;
+    unsigned int index = tail & m_sq_mask;
+    prepare_fixed(&((struct io_uring_sqe *)m_sqes)[index], IORING_OP_WRITE_FIXED, fd, this->buffer(slot) + buffer_offset, slot, length, offset);
+    m_sq_array[index] = index;
+    __sync_synchronize();
+    *m_sq_tail = tail + 1;
+    m_to_submit++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// wait() -
+//
+// Description:
+//
+//     Hands anything queued to the kernel first, so the device stays
+// busy while we look at completions, then reaps one completion,
+// blocking only if none is ready.
+//
+int uring_engine::wait(unsigned int *slot, int *result) throw() {
+    while (1) {
+        unsigned int flags = 0;
+        unsigned int min_complete = 0;
+        unsigned int head = *m_cq_head;
+        unsigned int tail = *m_cq_tail;
+        __sync_synchronize(); // Read the tail before the entry it covers.
+        if (head != tail && m_to_submit == 0) {
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *)m_cqes)[head & m_cq_mask];
+            *slot = (unsigned int)cqe->user_data;
+            *result = cqe->res;
+            __sync_synchronize(); // Finish with the entry before giving it back.
+            *m_cq_head = head + 1;
+            return 0;
+        }
+        if (head == tail) {
+            flags = IORING_ENTER_GETEVENTS;
+            min_complete = 1;
+        }
+        int n = syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit, min_complete, flags, NULL, 0);
+        if (n < 0) {
+            int e = errno;
+            if (e == EINTR || e == EAGAIN || e == EBUSY) {
+                continue;
+            }
+            m_broken = true;
+            return e;
+        }
+        m_to_submit -= n;
+    }
+}
+
+#else // BACKUP_USE_IO_URING
+
+void uring_engine::destroy(void) throw() {
+    m_depth = 0;
+}
+
+int uring_engine::init(unsigned int queue_depth __attribute__((__unused__)), size_t buffer_size __attribute__((__unused__))) throw() {
+    return ENOSYS;
+}
+
+void uring_engine::prepare_read(unsigned int slot __attribute__((__unused__)),
+                                int fd __attribute__((__unused__)),
+                                size_t length __attribute__((__unused__)),
+                                uint64_t offset __attribute__((__unused__))) throw() {
+}
+
+void uring_engine::prepare_write(unsigned int slot __attribute__((__unused__)),
+                                 int fd __attribute__((__unused__)),
+                                 size_t buffer_offset __attribute__((__unused__)),
+                                 size_t length __attribute__((__unused__)),
+                                 uint64_t offset __attribute__((__unused__))) throw() {
+}
+
+int uring_engine::wait(unsigned int *slot __attribute__((__unused__)), int *result __attribute__((__unused__))) throw() {
+    return ENOSYS;
+}
+
+#endif // BACKUP_USE_IO_URING
@@ -0,0 +1,108 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// uring_engine:
+//
+// Description:
+//
+//     A thin wrapper around an io_uring instance (set up with the raw
+// system calls, so we don't need liburing) and a set of registered,
+// O_DIRECT-aligned buffers, one per queue slot.  The copier keeps up to
+// queue_depth() reads and writes in flight with it.  Each slot has at
+// most one operation in flight, so the submission queue can never
+// overflow.
+//
+//     If the library is built without BACKUP_USE_IO_URING, init()
+// always fails with ENOSYS and the copier copies synchronously.
+//
+class uring_engine {
+  public:
+    uring_engine(void) throw();
+    ~uring_engine(void) throw();
+
+    int init(unsigned int queue_depth, size_t buffer_size) throw() __attribute__((warn_unused_result));
+    // Effect: Set up a ring and queue_depth buffers of buffer_size bytes.
+    //  Returns 0, or an error number if io_uring can't be used here (too old a kernel, not enough locked
+    //  memory, or not built in).  Nothing is reported: the caller just falls back to copying synchronously.
+
+    unsigned int queue_depth(void) const throw(); // Zero if init() failed.
+    char *buffer(unsigned int slot) const throw();
+
+    void prepare_read(unsigned int slot, int fd, size_t length, uint64_t offset) throw();
+    // Effect: Queue a read of length bytes at offset into the start of slot's buffer.
+
+    void prepare_write(unsigned int slot, int fd, size_t buffer_offset, size_t length, uint64_t offset) throw();
+    // Effect: Queue a write of length bytes from slot's buffer (starting buffer_offset bytes in) to offset.
+
+    int wait(unsigned int *slot, int *result) throw() __attribute__((warn_unused_result));
+    // Effect: Submit everything queued, then wait until some operation finishes.  Set *slot to its slot
+    //  and *result to what read(2) or write(2) would have returned, except that errors are -errno.
+    //  Returns 0, or an error number if the ring itself failed (in which case the engine can't be used any more).
+
+  private:
+    void destroy(void) throw();
+
+    int m_ring_fd;
+    unsigned int m_depth;
+    size_t m_buffer_size;
+    char *m_buffers;
+    void *m_sq_ring;
+    size_t m_sq_ring_size;
+    void *m_cq_ring;
+    size_t m_cq_ring_size;
+    void *m_sqes;
+    size_t m_sqes_size;
+    volatile unsigned int *m_sq_tail;
+    unsigned int m_sq_mask;
+    unsigned int *m_sq_array;
+    volatile unsigned int *m_cq_head;
+    volatile unsigned int *m_cq_tail;
+    unsigned int m_cq_mask;
+    void *m_cqes;
+    unsigned int m_to_submit;  // Entries queued but not yet handed to the kernel.
+    bool m_broken;             // Operations may still be in flight after the ring failed, so we must never free the buffers.
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,355 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "check.h"
+#include "instantiate_vector.h"
+#include "mutex.h"
+#include "work_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+INSTANTIATE_VECTOR(todo_item)
+INSTANTIATE_VECTOR(prioritized_todo_item)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+work_queue::work_queue(int n_workers) throw()
+    : m_n_workers(n_workers < 1 ? 1 : n_workers),
+      m_deques(new worker_deque[m_n_workers]),
+      m_pending(0),
+      m_scans(0),
+      m_pushes(0),
+      m_aborted(false),
+      m_priority_fun(NULL),
+      m_priority_extra(NULL)
+{
+    for (int i = 0; i < m_n_workers; ++i) {
+        int r = pthread_mutex_init(&m_deques[i].m_mutex, NULL);
+        check(r==0);
+        m_deques[i].m_head = 0;
+        m_deques[i].m_holds_scan = false;
+    }
+    {
+        int r = pthread_mutex_init(&m_mutex, NULL);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_init(&m_cond, NULL);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+work_queue::~work_queue(void) throw() {
+    for (int i = 0; i < m_n_workers; ++i) {
+        worker_deque *d = &m_deques[i];
+        for (size_t j = d->m_head; j < d->m_items.size(); ++j) {
+            free(d->m_items[j].m_name);
+        }
+        int r = pthread_mutex_destroy(&d->m_mutex);
+        check(r==0);
+    }
+    delete[] m_deques;
+    for (size_t i = 0; i < m_files.size(); ++i) {
+        free(m_files[i].m_item.m_name);
+    }
+    {
+        int r = pthread_mutex_destroy(&m_mutex);
+        check(r==0);
+    }
+    {
+        int r = pthread_cond_destroy(&m_cond);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int work_queue::worker_count(void) const throw() {
+    return m_n_workers;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::set_priority_function(priority_fun_t fun, void *extra) throw() {
+    with_mutex_locked ml(&m_mutex);
+    check(m_files.empty());
+    m_priority_fun = fun;
+    m_priority_extra = extra;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::push(int worker, const char *name, mode_t mode, off_t size) throw() {
+    todo_item item;
+    item.m_name = strdup(name);
+    check(item.m_name != NULL);
+    item.m_mode = mode;
+    item.m_size = size;
+    priority_fun_t fun = m_priority_fun;
+    if (fun != NULL && S_ISREG(mode)) {
+        prioritized_todo_item entry;
+        entry.m_priority = fun(item, m_priority_extra);
+        entry.m_item = item;
+        with_mutex_locked ml(&m_mutex);
+        this->push_file(entry);
+        m_pending++;
+        m_pushes++;
+        int r = pthread_cond_signal(&m_cond);
+        check(r==0);
+        return;
+    }
+    // Count the item as pending before anyone can steal it, so that a
+    // thief finishing it can never see the pending count hit zero early.
+    with_mutex_locked ml(&m_mutex);
+    {
+        worker_deque *d = &m_deques[worker];
+        with_mutex_locked dl(&d->m_mutex);
+        d->m_items.push_back(item);
+    }
+    m_pending++;
+    m_scans++;
+    m_pushes++;
+    int r = pthread_cond_signal(&m_cond);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// take_from() -
+//
+// Description:
+//
+//     Take an item off the given deque.  The owner takes the newest
+// item, thieves take the oldest.
+//
+bool work_queue::take_from(int victim, bool own, todo_item *item) throw() {
+    worker_deque *d = &m_deques[victim];
+    with_mutex_locked dl(&d->m_mutex);
+    if (d->m_head == d->m_items.size()) {
+        return false;
+    }
+    if (own) {
+        *item = d->m_items.back();
+        d->m_items.pop_back();
+    } else {
+        *item = d->m_items[d->m_head++];
+    }
+    if (d->m_head == d->m_items.size()) {
+        d->m_items.clear();
+        d->m_head = 0;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// push_file() -
+//
+// Description:
+//
+//     Adds an entry to the file heap, sifting it up past the entries
+// with lower priorities.
+//
+void work_queue::push_file(const prioritized_todo_item &entry) throw() {
+    m_files.push_back(entry);
+    size_t i = m_files.size() - 1;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (m_files[parent].m_priority >= entry.m_priority) {
+            break;
+        }
+        m_files[i] = m_files[parent];
+        i = parent;
+    }
+    m_files[i] = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// take_file() -
+//
+// Description:
+//
+//     Takes the highest priority file off the heap, unless a directory
+// is still waiting to be scanned, or being scanned.  We check its
+// priority again (without holding the mutex, since the priority
+// function may need other locks), and if it has dropped we put it back
+// and try again.
+//
+bool work_queue::take_file(todo_item *item) throw() {
+    while (1) {
+        prioritized_todo_item top;
+        {
+            with_mutex_locked ml(&m_mutex);
+            if (m_files.empty() || m_scans != 0) {
+                return false;
+            }
+            top = m_files[0];
+            prioritized_todo_item last = m_files.back();
+            m_files.pop_back();
+            const size_t n = m_files.size();
+            size_t i = 0;
+            while (n > 0) {
+                size_t child = 2 * i + 1;
+                if (child >= n) {
+                    break;
+                }
+                if (child + 1 < n && m_files[child + 1].m_priority > m_files[child].m_priority) {
+                    child++;
+                }
+                if (last.m_priority >= m_files[child].m_priority) {
+                    break;
+                }
+                m_files[i] = m_files[child];
+                i = child;
+            }
+            if (n > 0) {
+                m_files[i] = last;
+            }
+        }
+        priority_fun_t fun = m_priority_fun;
+        const int64_t priority = (fun == NULL) ? top.m_priority : fun(top.m_item, m_priority_extra);
+        if (priority >= top.m_priority) {
+            *item = top.m_item;
+            return true;
+        }
+        top.m_priority = priority;
+        with_mutex_locked ml(&m_mutex);
+        this->push_file(top);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+bool work_queue::pop(int worker, todo_item *item) throw() {
+    while (1) {
+        unsigned long pushes;
+        {
+            with_mutex_locked ml(&m_mutex);
+            if (m_aborted || m_pending == 0) {
+                return false;
+            }
+            pushes = m_pushes;
+        }
+
+        worker_deque *own = &m_deques[worker];
+        if (this->take_from(worker, true, item)) {
+            own->m_holds_scan = true;
+            return true;
+        }
+        for (int i = 1; i < m_n_workers; ++i) {
+            if (this->take_from((worker + i) % m_n_workers, false, item)) {
+                own->m_holds_scan = true;
+                return true;
+            }
+        }
+        if (this->take_file(item)) {
+            own->m_holds_scan = false;
+            return true;
+        }
+
+        // Everything that is pending is being worked on by someone
+        // else.  Wait for them to push more, to finish scanning, or to
+        // finish.
+        with_mutex_locked ml(&m_mutex);
+        while (!m_aborted && m_pending != 0 && m_pushes == pushes && (m_scans != 0 || m_files.empty())) {
+            int r = pthread_cond_wait(&m_cond, &m_mutex);
+            check(r==0);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::finish(int worker) throw() {
+    with_mutex_locked ml(&m_mutex);
+    check(m_pending > 0);
+    m_pending--;
+    bool wake = (m_pending == 0);
+    if (m_deques[worker].m_holds_scan) {
+        check(m_scans > 0);
+        m_scans--;
+        // The files in the heap can be taken now.
+        wake = wake || (m_scans == 0 && !m_files.empty());
+    }
+    if (wake) {
+        int r = pthread_cond_broadcast(&m_cond);
+        check(r==0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::abort(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    m_aborted = true;
+    int r = pthread_cond_broadcast(&m_cond);
+    check(r==0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+void work_queue::clear(void) throw() {
+    with_mutex_locked ml(&m_mutex);
+    for (int i = 0; i < m_n_workers; ++i) {
+        worker_deque *d = &m_deques[i];
+        with_mutex_locked dl(&d->m_mutex);
+        for (size_t j = d->m_head; j < d->m_items.size(); ++j) {
+            free(d->m_items[j].m_name);
+            m_pending--;
+            m_scans--;
+        }
+        d->m_items.clear();
+        d->m_head = 0;
+    }
+    for (size_t i = 0; i < m_files.size(); ++i) {
+        free(m_files[i].m_item.m_name);
+        m_pending--;
+    }
+    m_files.clear();
+    m_aborted = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+size_t work_queue::pending(void) const throw() {
+    return m_pending;
+}
@@ -0,0 +1,150 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// todo_item:
+//
+// Description:
+//
+//     One entry of the copier's manifest: a path relative to the source
+// directory, and what the scanner learned about it when it read the
+// parent directory, so the copier doesn't have to stat it again.
+//
+struct todo_item {
+    char *m_name;  // malloc'd.
+    mode_t m_mode; // The file's type and permissions, or 0 if nobody has stat'd it yet.
+    off_t m_size;  // The file's size when it was stat'd.
+};
+
+// A regular file waiting in the work_queue's priority heap.
+struct prioritized_todo_item {
+    int64_t m_priority;
+    todo_item m_item;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// work_queue:
+//
+// Description:
+//
+//     The copier's todo list.  Each copier worker owns a deque of
+// todo_items.  A worker pushes and pops at the back
+// of its own deque (so a directory tree is walked depth first, like the
+// old single todo vector), and when its own deque is empty it steals
+// from the front of somebody else's deque (which tends to hand out
+// whole subtrees).  A worker that finds nothing to do waits until
+// either more work shows up or every queued item has been finished.
+//
+//     If a priority function is set, the regular files that the scan
+// finds go into a single heap instead.  The workers only take from it
+// once every directory has been scanned, so the order covers the whole
+// tree.  Until then, a worker that has no directory to scan waits.
+//
+class work_queue {
+  public:
+    work_queue(int n_workers) throw();
+    ~work_queue(void) throw(); // frees any items that are still queued.
+
+    int worker_count(void) const throw();
+
+    typedef int64_t (*priority_fun_t)(const todo_item &item, void *extra);
+    void set_priority_function(priority_fun_t fun, void *extra) throw();
+    // Effect: From now on, pop regular files (items whose mode says so) in order of FUN, highest first.
+    //  FUN is called without any of the queue's locks held, both when an item is pushed and again when it
+    //  is about to be popped.  If an item's priority has dropped since it was pushed, it goes back into the
+    //  heap, so FUN may lower priorities over time (but if it raises them, files can come out late).
+    //  Pass NULL to go back to keeping everything in the deques.
+    //  Requires that the queue is empty.
+
+    void push(int worker, const char *name, mode_t mode = 0, off_t size = 0) throw();
+    // Effect: Add an item for a copy of NAME (with the given mode and size, if known) to the back of WORKER's deque.
+    //  Can be called by any thread.  Threads that are not copier workers should use worker 0.
+
+    bool pop(int worker, todo_item *item) throw() __attribute__((warn_unused_result));
+    // Effect: Take an item for WORKER, first from its own deque, then by stealing from the others.
+    //  Blocks while there is nothing to take but some other worker is still busy (and so might push more).
+    //  Returns true and sets *ITEM (whose name the caller must free, and then call finish()) if an item was taken.
+    //  Returns false once every pushed item has been finished, or after abort() has been called.
+
+    void finish(int worker) throw();
+    // Effect: Tell the queue that the item WORKER got from pop() has been completely handled (including pushing any children).
+
+    void abort(void) throw();
+    // Effect: Make every current and future pop() return false.
+
+    void clear(void) throw();
+    // Effect: Free every queued item and undo abort(), so that the queue can be used for another directory.
+    //  Requires that no worker is between pop() and finish().
+
+    size_t pending(void) const throw(); // Return the number of items that have been pushed but not yet finished.
+
+  private:
+    struct worker_deque {
+        pthread_mutex_t m_mutex;
+        std::vector<todo_item> m_items;
+        size_t m_head; // Items before m_head have been stolen.
+        bool m_holds_scan; // Set while the worker holds an item it took from a deque.  Only the worker uses it.
+    };
+    bool take_from(int victim, bool own, todo_item *item) throw();
+    void push_file(const prioritized_todo_item &entry) throw(); // Requires m_mutex.
+    bool take_file(todo_item *item) throw();
+
+    const int m_n_workers;
+    worker_deque *m_deques;
+    pthread_mutex_t m_mutex;   // Protects m_pending, m_scans, m_pushes, and m_aborted, and is the mutex for m_cond.
+    pthread_cond_t  m_cond;    // Signalled when something is pushed, when the last scan is finished, or when the last item is finished.
+    volatile size_t m_pending;
+    size_t m_scans;            // The number of items pushed to the deques but not yet finished.
+    unsigned long m_pushes;    // Lets an idle worker notice a push that happened while it was looking.
+    bool m_aborted;
+    priority_fun_t m_priority_fun;
+    void *m_priority_extra;
+    std::vector<prioritized_todo_item> m_files; // A binary heap, highest priority first.  Protected by m_mutex.
+};
+
+#endif // End of header guardian.
@@ -0,0 +1,366 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ident "$Id$"
+
+#include "backup_internal.h"
+#include "check.h"
+#include "destination_file.h"
+#include "mutex.h"
+#include "write_behind.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+write_behind::write_behind(size_t capacity) throw()
+  : m_capacity(capacity), m_flusher_capacity(0), m_n_running(0) {
+    for (int i = 0; i < n_flushers; i++) {
+        flusher *f = &m_flushers[i];
+        int r = pthread_mutex_init(&f->m_mutex, NULL);
+        check(r==0);
+        r = pthread_cond_init(&f->m_work, NULL);
+        check(r==0);
+        r = pthread_cond_init(&f->m_space, NULL);
+        check(r==0);
+        r = pthread_cond_init(&f->m_flushed, NULL);
+        check(r==0);
+        f->m_head = f->m_tail = NULL;
+        f->m_bytes = 0;
+        f->m_stopping = false;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+write_behind::~write_behind(void) throw() {
+    for (int i = 0; i < n_flushers; i++) {
+        flusher *f = &m_flushers[i];
+        int r = pthread_mutex_destroy(&f->m_mutex);
+        check(r==0);
+        r = pthread_cond_destroy(&f->m_work);
+        check(r==0);
+        r = pthread_cond_destroy(&f->m_space);
+        check(r==0);
+        r = pthread_cond_destroy(&f->m_flushed);
+        check(r==0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void write_behind::set_capacity(size_t capacity) throw() {
+    m_capacity = capacity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+size_t write_behind::get_capacity(void) const throw() {
+    return m_capacity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void write_behind::start(void) throw() {
+    const size_t capacity = m_capacity;
+    if (capacity == 0) {
+        return;
+    }
+    m_flusher_capacity = capacity / n_flushers;
+    if (m_flusher_capacity == 0) {
+        m_flusher_capacity = 1;
+    }
+    for (int i = 0; i < n_flushers; i++) {
+        flusher *f = &m_flushers[i];
+        f->m_stopping = false;
+        int r = pthread_create(&f->m_thread, NULL, flush_loop, f);
+        if (r != 0) {
+            // Stop the ones we started, and capture synchronously.
+            this->stop();
+            return;
+        }
+        m_n_running = i + 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void write_behind::stop(void) throw() {
+    for (int i = 0; i < m_n_running; i++) {
+        flusher *f = &m_flushers[i];
+        {
+            with_mutex_locked ml(&f->m_mutex);
+            f->m_stopping = true;
+            int r = pthread_cond_signal(&f->m_work);
+            check(r==0);
+        }
+        int r = pthread_join(f->m_thread, NULL);
+        check(r==0);
+        check(f->m_head == NULL);
+    }
+    m_n_running = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+bool write_behind::is_running(void) const throw() {
+    return m_n_running == n_flushers;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// flusher_of() -
+//
+// Description:
+//
+//     Every write to a destination has to go to the same flusher.
+// Destinations are heap objects, so mix the low bits of the pointer.
+//
+write_behind::flusher *write_behind::flusher_of(destination_file *dest) throw() {
+    const uint64_t h = (uint64_t)(uintptr_t)dest * 0x9E3779B97F4A7C15ULL;
+    return &m_flushers[(h >> 32) % n_flushers];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void write_behind::enqueue(destination_file *dest, const struct iovec *iov, int iovcnt, size_t nbyte, off_t offset) throw() {
+    item *it = (item *)malloc(sizeof(item) + nbyte);
+    if (it == NULL) {
+        // Do it ourselves, after the writes that are ahead of us.
+        this->drain(dest);
+        ignore(dest->pwritev(iov, iovcnt, offset)); // It's been reported.
+        return;
+    }
+    it->m_dest = dest;
+    it->m_offset = offset;
+    it->m_nbyte = nbyte;
+    it->m_next = NULL;
+    char *data = (char *)(it + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+
+    flusher *f = flusher_of(dest);
+    with_mutex_locked ml(&f->m_mutex);
+    // A write bigger than the whole share only has to wait for the queue to empty.
+    while (f->m_bytes > 0 && f->m_bytes + nbyte > m_flusher_capacity) {
+        int r = pthread_cond_wait(&f->m_space, &f->m_mutex);
+        check(r==0);
+    }
+    if (f->m_tail != NULL) {
+        f->m_tail->m_next = it;
+    } else {
+        f->m_head = it;
+    }
+    f->m_tail = it;
+    f->m_bytes += nbyte;
+    dest->m_n_queued++;
+    int r = pthread_cond_signal(&f->m_work);
+    check(r==0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void write_behind::drain(destination_file *dest) throw() {
+    if (m_n_running == 0) {
+        return;
+    }
+    flusher *f = flusher_of(dest);
+    with_mutex_locked ml(&f->m_mutex);
+    const uint64_t target = dest->m_n_queued;
+    while (dest->m_n_written < target) {
+        int r = pthread_cond_wait(&f->m_flushed, &f->m_mutex);
+        check(r==0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// write_run() -
+//
+// Description:
+//
+//     Write RUN[0..n), which are items for one destination, sorted by
+// offset, that together cover one contiguous extent.  If none of them
+// overlap, they go out in one pwritev() straight from the items.
+// Otherwise they're merged into a staging buffer, in the order they
+// were queued, so that later writes win.  N is at most max_batch.
+//
+void write_behind::write_run(const queued *run, int n, bool overlapping) throw() {
+    destination_file *dest = run[0].m_item->m_dest;
+    const off_t lo = run[0].m_item->m_offset;
+    if (!overlapping) {
+        struct iovec iov[max_batch];
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = run[i].m_item + 1;
+            iov[i].iov_len = run[i].m_item->m_nbyte;
+        }
+        ignore(dest->pwritev(iov, n, lo)); // It's been reported.
+        return;
+    }
+    off_t hi = lo;
+    for (int i = 0; i < n; i++) {
+        const off_t end = run[i].m_item->m_offset + run[i].m_item->m_nbyte;
+        if (end > hi) hi = end;
+    }
+    // Apply them in queue order.
+    queued by_seq[max_batch];
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        while (j > 0 && by_seq[j-1].m_seq > run[i].m_seq) {
+            by_seq[j] = by_seq[j-1];
+            j--;
+        }
+        by_seq[j] = run[i];
+    }
+    char *buf = (char *)malloc(hi - lo);
+    if (buf == NULL) {
+        for (int i = 0; i < n; i++) {
+            const item *it = by_seq[i].m_item;
+            ignore(dest->pwrite(it + 1, it->m_nbyte, it->m_offset)); // It's been reported.
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        const item *it = by_seq[i].m_item;
+        memcpy(buf + (it->m_offset - lo), it + 1, it->m_nbyte);
+    }
+    ignore(dest->pwrite(buf, hi - lo, lo)); // It's been reported.
+    free(buf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// write_batch() -
+//
+// Description:
+//
+//     Write BATCH[0..n), the items at the head of a flusher's queue,
+// coalescing the ones for the same destination: sort them by offset
+// (stably, so equal offsets stay in queue order), and write each
+// contiguous extent with one call.  Items for different destinations
+// don't affect each other, so their order doesn't matter.  N is at
+// most max_batch.
+//
+void write_behind::write_batch(item **batch, int n) throw() {
+    check(n <= max_batch);
+    bool done[max_batch];
+    for (int i = 0; i < n; i++) done[i] = false;
+    queued group[max_batch];
+    for (int i = 0; i < n; i++) {
+        if (done[i]) continue;
+        destination_file *dest = batch[i]->m_dest;
+        int n_group = 0;
+        for (int j = i; j < n; j++) {
+            if (done[j] || batch[j]->m_dest != dest) continue;
+            done[j] = true;
+            queued q = {batch[j], j};
+            int k = n_group++;
+            while (k > 0 && group[k-1].m_item->m_offset > q.m_item->m_offset) {
+                group[k] = group[k-1];
+                k--;
+            }
+            group[k] = q;
+        }
+        int start = 0;
+        off_t run_hi = group[0].m_item->m_offset + group[0].m_item->m_nbyte;
+        bool overlapping = false;
+        for (int k = 1; k <= n_group; k++) {
+            if (k < n_group && group[k].m_item->m_offset <= run_hi) {
+                const off_t end = group[k].m_item->m_offset + group[k].m_item->m_nbyte;
+                if (group[k].m_item->m_offset < run_hi) overlapping = true;
+                if (end > run_hi) run_hi = end;
+                continue;
+            }
+            write_run(group + start, k - start, overlapping);
+            if (k < n_group) {
+                start = k;
+                run_hi = group[k].m_item->m_offset + group[k].m_item->m_nbyte;
+                overlapping = false;
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// flush_loop() -
+//
+// Description:
+//
+//     The body of each flusher: write out the queued items, a batch at
+// a time, until stop() is called and the queue is empty.  Whatever
+// piled up while the last batch was being written is the next batch,
+// so the busier the destination, the more gets coalesced.  The items
+// stay in the queue while they're written, so that they still count
+// against the cap.
+//
+void *write_behind::flush_loop(void *arg) throw() {
+    flusher *f = static_cast<flusher *>(arg);
+    pmutex_lock(&f->m_mutex);
+    while (true) {
+        if (f->m_head == NULL) {
+            if (f->m_stopping) break;
+            int r = pthread_cond_wait(&f->m_work, &f->m_mutex);
+            check(r==0);
+            continue;
+        }
+        item *batch[max_batch];
+        int n = 0;
+        for (item *it = f->m_head; it != NULL && n < max_batch; it = it->m_next) {
+            batch[n++] = it;
+        }
+        pmutex_unlock(&f->m_mutex);
+        write_batch(batch, n);
+        pmutex_lock(&f->m_mutex);
+        f->m_head = batch[n-1]->m_next;
+        if (f->m_head == NULL) {
+            f->m_tail = NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            f->m_bytes -= batch[i]->m_nbyte;
+            batch[i]->m_dest->m_n_written++;
+            free(batch[i]);
+        }
+        int r = pthread_cond_broadcast(&f->m_space);
+        check(r==0);
+        r = pthread_cond_broadcast(&f->m_flushed);
+        check(r==0);
+    }
+    pmutex_unlock(&f->m_mutex);
+    return arg;
+}
@@ -0,0 +1,135 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+/*======
+This file is part of Percona TokuBackup.
+
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License, version 2,
+    as published by the Free Software Foundation.
+
+     Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+
+----------------------------------------
+
+    Percona TokuBackup is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License, version 3,
+    as published by the Free Software Foundation.
+
+    Percona TokuBackup is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with Percona TokuBackup.  If not, see <http://www.gnu.org/licenses/>.
+======= */
+
+#ifndef WRITE_BEHIND_H
+#define WRITE_BEHIND_H
+
+#ident "Copyright (c) 2012-2013 Tokutek Inc.  All rights reserved."
+#ident "$Id$"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class destination_file;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// write_behind:
+//
+// Description:
+//
+//     Mirrors the application's captured writes into the backup in the
+// background, so that a write during a backup costs the application
+// a memcpy instead of a second disk write.
+//
+//     There are n_flushers flusher threads, each with its own queue.
+// All the writes for one destination go to the same flusher, which
+// does them in the order they were queued, so later writes to an
+// offset always land after earlier ones.  The queued data is capped:
+// a write that would go over its flusher's share of the cap waits for
+// the flusher to catch up.
+//
+//     A flusher takes everything that's queued (up to max_batch items)
+// at once, and merges the items for each destination into as few
+// writes as it can: adjacent extents go out together with pwritev(),
+// and overlapping ones are combined in a staging buffer, with the
+// later write winning.
+//
+//     Anything that changes a destination other than by a queued write
+// (truncating it, closing it, or the copier calling it done) has to
+// drain() it first.
+//
+class write_behind {
+  public:
+    static const int n_flushers = 4;
+
+    write_behind(size_t capacity) throw();
+    ~write_behind(void) throw(); // Requires that the flushers are stopped.
+
+    void set_capacity(size_t capacity) throw(); // This is thread-safe.  Takes effect at the next start().
+    size_t get_capacity(void) const throw();    // This is thread-safe.
+
+    void start(void) throw();
+    // Effect: Start the flushers, unless the capacity is zero.  If a flusher thread can't be
+    //  started, the writes are done synchronously instead.
+    void stop(void) throw();
+    // Effect: Wait for everything queued to be written, and stop the flushers.
+    //  Requires that no thread calls enqueue() while this runs.
+    bool is_running(void) const throw();
+
+    void enqueue(destination_file *dest, const struct iovec *iov, int iovcnt, size_t nbyte, off_t offset) throw();
+    // Effect: Queue a copy of IOV (whose buffers hold NBYTE bytes in all) to be written to DEST at OFFSET, as one write.
+    //  Errors are reported to the manager by the flusher.
+    //  Requires is_running().
+    void drain(destination_file *dest) throw();
+    // Effect: Wait until every write queued so far for DEST has been done.  Returns at once if nothing is running.
+
+  private:
+    struct item {
+        destination_file *m_dest;
+        off_t m_offset;
+        size_t m_nbyte;
+        item *m_next;
+        // The data follows.
+    };
+    struct flusher {
+        pthread_mutex_t m_mutex;   // Protects everything here, and the queue counters of the destinations that hash here.
+        pthread_cond_t m_work;     // Signalled when an item is queued, or when it's time to stop.
+        pthread_cond_t m_space;    // Signalled when the flusher frees some space.
+        pthread_cond_t m_flushed;  // Signalled when the flusher finishes an item.
+        item *m_head, *m_tail;
+        size_t m_bytes;            // The bytes queued.
+        bool m_stopping;
+        pthread_t m_thread;
+    };
+    struct queued {
+        item *m_item;
+        int m_seq; // The item's place in its batch.
+    };
+    static const int max_batch = 64; // The most items a flusher takes at once.
+    flusher *flusher_of(destination_file *dest) throw();
+    static void *flush_loop(void *arg) throw();
+    static void write_batch(item **batch, int n) throw();
+    static void write_run(const queued *run, int n, bool overlapping) throw();
+
+    volatile size_t m_capacity;
+    size_t m_flusher_capacity; // Each flusher's share of m_capacity, as of start().
+    int m_n_running;           // How many flushers start() made.
+    flusher m_flushers[n_flushers];
+};
+
+#endif // End of header guardian.